@@ -0,0 +1,660 @@
+/* ata.c - IDE/ATA disk driver with bus-master DMA
+ */
+
+#include "ata.h"
+#include "lib.h"
+#include "pci.h"
+
+#include "task/task.h"
+#include "task/task_sched.h"
+
+// Task file registers, offset from the I/O base of the channel
+#define ATA_REG_DATA        0
+#define ATA_REG_SECCOUNT    2
+#define ATA_REG_LBA0        3
+#define ATA_REG_LBA1        4
+#define ATA_REG_LBA2        5
+#define ATA_REG_DRIVE       6
+#define ATA_REG_STATUS      7  // read
+#define ATA_REG_COMMAND     7  // write
+
+#define ATA_STATUS_ERR      0x01
+#define ATA_STATUS_DRQ      0x08
+#define ATA_STATUS_DF       0x20
+#define ATA_STATUS_BSY      0x80
+
+#define ATA_CTRL_NIEN       0x02  // in device control register, disable interrupt of the channel
+
+#define ATA_CMD_READ_PIO    0x20
+#define ATA_CMD_WRITE_PIO   0x30
+#define ATA_CMD_READ_DMA    0xC8
+#define ATA_CMD_WRITE_DMA   0xCA
+#define ATA_CMD_FLUSH       0xE7
+#define ATA_CMD_IDENTIFY    0xEC
+
+#define ATA_DRIVE_LBA       0xE0  // in drive register, select LBA addressing
+#define ATA_LBA28_MAX       (1U << 28)
+
+// Bus master registers, offset from the bus master base of the channel
+#define BM_REG_COMMAND      0
+#define BM_REG_STATUS       2
+#define BM_REG_PRDT         4
+#define BM_CHANNEL_OFFSET   8  // the secondary channel follows the primary one
+
+#define BM_CMD_START        0x01
+#define BM_CMD_READ         0x08  // device to memory
+#define BM_STATUS_ERROR     0x02  // write 1 to clear
+#define BM_STATUS_IRQ       0x04  // write 1 to clear
+
+#define PRD_EOT             0x8000  // last entry of the table
+
+#define PCI_CLASS_IDE       0x0101  // mass storage controller, IDE
+#define ATA_POLL_LIMIT      1000000
+
+// Physical region descriptor, an entry of the scatter/gather table of bus-master DMA
+typedef struct ata_prd_t {
+    uint32_t addr;
+    uint16_t byte_count;
+    uint16_t flags;
+} ata_prd_t;
+
+/*
+ * I/O scheduler. Each channel keeps pending requests sorted by drive and LBA. When the channel is idle, the next
+ * transfer is picked in one-way elevator order (C-SCAN): the first request at or after the position of the last
+ * transfer, wrapping around to the lowest. A request whose deadline has passed is picked first instead, so requests
+ * far from a busy area are not starved, and reads (which tasks wait for) expire earlier than writes. Requests that
+ * follow the picked one on the disk, in the same direction, are merged into the same transfer, up to
+ * ATA_MAX_REQUEST_BUFS buffers. On completion (IRQ 14/15, or polling before the scheduler runs), tasks waiting for
+ * each request of the transfer are woken up, and the next transfer is started. A write transfer is followed by FLUSH
+ * CACHE, and its requests are finished when the flush completes, so a finished write is on the disk.
+ */
+typedef struct ata_channel_t {
+    uint16_t io_base;
+    uint16_t ctrl_base;
+    uint16_t bm_base;       // 0 if there is no bus master, then PIO is used
+    uint8_t irq;
+    ata_prd_t *prd;
+    ata_request_t *queue;   // pending, sorted by drive and LBA
+    ata_request_t *active;  // in transfer, in LBA order, or NULL if idle
+    uint32_t depth;         // number of requests in queue and active
+    int32_t last_drive;     // position after the last transfer, for the elevator
+    uint32_t last_lba;
+    int32_t flushing;       // 1 if FLUSH CACHE is running for the active write transfer
+} ata_channel_t;
+
+static ata_prd_t ata_prd[2][ATA_MAX_REQUEST_BUFS] __attribute__((aligned(256)));  // never cross 64KB
+
+static ata_channel_t ata_channel[2] = {
+        {0x1F0, 0x3F6, 0, ATA_PRIMARY_IRQ, ata_prd[0], NULL, NULL, 0, 0, 0, 0},
+        {0x170, 0x376, 0, ATA_SECONDARY_IRQ, ata_prd[1], NULL, NULL, 0, 0, 0, 0}
+};
+
+static uint32_t ata_sectors[ATA_DRIVE_COUNT];  // 0 if there is no ATA drive
+
+static ata_stat_t ata_stat;
+
+// Helper functions
+static void ata_dispatch_unsafe(ata_channel_t *ch);
+static int32_t ata_finish_unsafe(ata_channel_t *ch, int32_t status);
+static int32_t ata_complete_unsafe(ata_channel_t *ch);
+
+/**
+ * Read words from a port
+ * @param port     The port
+ * @param buf      Output buffer
+ * @param count    Number of words
+ */
+static inline void ata_insw(uint16_t port, void *buf, uint32_t count) {
+    asm volatile ("cld; rep insw"
+    : "+D"(buf), "+c"(count)
+    : "d"(port)
+    : "memory"
+    );
+}
+
+/**
+ * Write words to a port
+ * @param port     The port
+ * @param buf      Input buffer
+ * @param count    Number of words
+ */
+static inline void ata_outsw(uint16_t port, const void *buf, uint32_t count) {
+    asm volatile ("cld; rep outsw"
+    : "+S"(buf), "+c"(count)
+    : "d"(port)
+    : "memory"
+    );
+}
+
+/**
+ * Wait 400ns for the drive to present its status after selection
+ * @param ch    The channel
+ */
+static void ata_delay(ata_channel_t *ch) {
+    int i;
+    for (i = 0; i < 4; i++) inb(ch->ctrl_base);  // each read of alternate status takes ~100ns
+}
+
+/**
+ * Wait until the channel is not busy
+ * @param ch    The channel
+ * @return Status register, or -1 for timeout
+ */
+static int32_t ata_wait_not_busy(ata_channel_t *ch) {
+    int i;
+    uint32_t status;
+    for (i = 0; i < ATA_POLL_LIMIT; i++) {
+        status = inb(ch->io_base + ATA_REG_STATUS);
+        if (!(status & ATA_STATUS_BSY)) return status;
+    }
+    return -1;
+}
+
+/**
+ * Wait until the drive is ready to transfer data in PIO
+ * @param ch    The channel
+ * @return 0 for ready, -1 for error or timeout
+ */
+static int32_t ata_wait_drq(ata_channel_t *ch) {
+    int32_t status = ata_wait_not_busy(ch);
+    if (status == -1 || (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) || !(status & ATA_STATUS_DRQ)) return -1;
+    return 0;
+}
+
+/**
+ * Find the bus master of the IDE controller on PCI bus 0, and enable it
+ * @return I/O base of the bus master of the primary channel, or 0 if not found
+ */
+static uint16_t ata_find_bus_master() {
+    uint32_t dev, func, bar, command;
+
+    for (dev = 0; dev < 32; dev++) {
+        for (func = 0; func < 8; func++) {
+            if ((pci_config_read(0, dev, func, PCI_REG_VENDOR) & 0xFFFF) == PCI_VENDOR_NONE) {
+                if (func == 0) break;
+                continue;
+            }
+            if ((pci_config_read(0, dev, func, PCI_REG_CLASS) >> 16) != PCI_CLASS_IDE) continue;
+
+            bar = pci_config_read(0, dev, func, PCI_REG_BAR4);
+            if (!(bar & 0x1)) continue;  // must be I/O space
+
+            // Status in the high 16 bits is write-1-to-clear, so only write the command
+            command = pci_config_read(0, dev, func, PCI_REG_COMMAND) & 0xFFFF;
+            pci_config_write(0, dev, func, PCI_REG_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+            return bar & 0xFFFC;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Identify a drive
+ * @param ch       The channel
+ * @param slave    0 for master, 1 for slave
+ * @return Number of LBA28 sectors, or 0 if there is no ATA drive
+ */
+static uint32_t ata_identify(ata_channel_t *ch, int slave) {
+    uint16_t data[ATA_SECTOR_SIZE / 2];
+    int32_t status;
+
+    outb(0xA0 | (slave << 4), ch->io_base + ATA_REG_DRIVE);
+    ata_delay(ch);
+    outb(0, ch->io_base + ATA_REG_SECCOUNT);
+    outb(0, ch->io_base + ATA_REG_LBA0);
+    outb(0, ch->io_base + ATA_REG_LBA1);
+    outb(0, ch->io_base + ATA_REG_LBA2);
+    outb(ATA_CMD_IDENTIFY, ch->io_base + ATA_REG_COMMAND);
+
+    if (inb(ch->io_base + ATA_REG_STATUS) == 0) return 0;  // no drive
+    if (ata_wait_not_busy(ch) == -1) return 0;
+
+    // ATAPI and SATA devices set the signature in LBA1/LBA2 and abort IDENTIFY
+    if (inb(ch->io_base + ATA_REG_LBA1) != 0 || inb(ch->io_base + ATA_REG_LBA2) != 0) return 0;
+    if (ata_wait_drq(ch) == -1) return 0;
+
+    ata_insw(ch->io_base + ATA_REG_DATA, data, ATA_SECTOR_SIZE / 2);
+
+    if (!(data[49] & (1 << 9))) return 0;  // LBA not supported
+    status = data[60] | ((uint32_t) data[61] << 16);
+    return status;
+}
+
+/**
+ * Find the drives and enable interrupts of channels that use DMA
+ * @return Number of ATA drives found
+ * @note Interrupts (IRQ 14 and 15) should be enabled on PIC after this function
+ */
+int32_t ata_init() {
+    uint16_t bm_base = ata_find_bus_master();
+    int32_t i, count = 0;
+    ata_channel_t *ch;
+
+    for (i = 0; i < 2; i++) {
+        ch = &ata_channel[i];
+        ch->bm_base = (bm_base ? bm_base + i * BM_CHANNEL_OFFSET : 0);
+        ch->queue = ch->active = NULL;
+        ch->depth = 0;
+
+        // Floating bus, no drive on the channel
+        if (inb(ch->io_base + ATA_REG_STATUS) == 0xFF) {
+            ata_sectors[i * 2] = ata_sectors[i * 2 + 1] = 0;
+            continue;
+        }
+
+        // PIO transfers are polled, so interrupt is only used with DMA
+        outb(ch->bm_base ? 0 : ATA_CTRL_NIEN, ch->ctrl_base);
+    }
+
+    for (i = 0; i < ATA_DRIVE_COUNT; i++) {
+        ch = &ata_channel[i / 2];
+        if (inb(ch->io_base + ATA_REG_STATUS) == 0xFF) continue;
+        ata_sectors[i] = ata_identify(ch, i % 2);
+        if (ata_sectors[i] != 0) {
+            printf("ATA drive %d: %u sectors (%uKB), %s\n", i, ata_sectors[i], ata_sectors[i] / 2,
+                   ch->bm_base ? "DMA" : "PIO");
+            count++;
+        }
+    }
+
+    // IDENTIFY raises an interrupt as well, acknowledge it
+    inb(ata_channel[0].io_base + ATA_REG_STATUS);
+    inb(ata_channel[1].io_base + ATA_REG_STATUS);
+
+    return count;
+}
+
+/**
+ * Get the size of a drive
+ * @param drive    The drive
+ * @return Number of sectors, or 0 if there is no such drive
+ */
+uint32_t ata_drive_sectors(int32_t drive) {
+    if (drive < 0 || drive >= ATA_DRIVE_COUNT) return 0;
+    return ata_sectors[drive];
+}
+
+/**
+ * Select the drive and issue a read/write command
+ * @param ch         The channel
+ * @param drive      The drive
+ * @param lba        First sector
+ * @param sectors    Number of sectors, 1 to 256 (0 means 256 in the register)
+ * @param cmd        The ATA command
+ * @return 0 for success, -1 if the drive stays busy
+ */
+static int32_t ata_issue_unsafe(ata_channel_t *ch, int32_t drive, uint32_t lba, uint32_t sectors, uint8_t cmd) {
+    outb(ATA_DRIVE_LBA | ((drive % 2) << 4) | ((lba >> 24) & 0x0F), ch->io_base + ATA_REG_DRIVE);
+    ata_delay(ch);
+    if (ata_wait_not_busy(ch) == -1) return -1;
+
+    outb(sectors & 0xFF, ch->io_base + ATA_REG_SECCOUNT);
+    outb(lba & 0xFF, ch->io_base + ATA_REG_LBA0);
+    outb((lba >> 8) & 0xFF, ch->io_base + ATA_REG_LBA1);
+    outb((lba >> 16) & 0xFF, ch->io_base + ATA_REG_LBA2);
+    outb(cmd, ch->io_base + ATA_REG_COMMAND);
+    return 0;
+}
+
+/**
+ * Transfer a request with polled PIO
+ * @param ch     The channel
+ * @param req    The request
+ * @return ATA_REQ_DONE or ATA_REQ_ERROR
+ */
+static int32_t ata_pio_transfer_unsafe(ata_channel_t *ch, ata_request_t *req) {
+    uint32_t i, j;
+    uint8_t *sector;
+
+    if (ata_issue_unsafe(ch, req->drive, req->lba, req->buf_count * ATA_BUF_SECTORS,
+                         req->write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO) == -1) {
+        return ATA_REQ_ERROR;
+    }
+
+    for (i = 0; i < req->buf_count; i++) {
+        for (j = 0; j < ATA_BUF_SECTORS; j++) {
+            if (ata_wait_drq(ch) == -1) return ATA_REQ_ERROR;
+            sector = req->bufs[i] + j * ATA_SECTOR_SIZE;
+            if (req->write) {
+                ata_outsw(ch->io_base + ATA_REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+            } else {
+                ata_insw(ch->io_base + ATA_REG_DATA, sector, ATA_SECTOR_SIZE / 2);
+            }
+        }
+    }
+
+    if (req->write) {
+        outb(ATA_CMD_FLUSH, ch->io_base + ATA_REG_COMMAND);
+        if (ata_wait_not_busy(ch) == -1) return ATA_REQ_ERROR;
+    }
+    return ATA_REQ_DONE;
+}
+
+/**
+ * Compare the position of a request with a position on the disks of a channel
+ * @param req      The request
+ * @param drive    The drive of the position
+ * @param lba      The LBA of the position
+ * @return Negative, 0 or positive if the request is before, at or after the position
+ */
+static int32_t ata_position_cmp(const ata_request_t *req, int32_t drive, uint32_t lba) {
+    if (req->drive != drive) return req->drive - drive;
+    if (req->lba != lba) return (req->lba < lba ? -1 : 1);
+    return 0;
+}
+
+/**
+ * Pick the next transfer from the queue of an idle channel and start it, see the I/O scheduler above
+ * @param ch    The channel
+ * @note Use this function in a lock
+ */
+static void ata_dispatch_unsafe(ata_channel_t *ch) {
+    ata_request_t *first, *expired, *last, *req;
+    ata_request_t **link;
+    uint32_t now = sched_get_time();
+    uint32_t buf_count, i, j;
+
+    while (ch->active == NULL && ch->queue != NULL) {
+        first = expired = NULL;
+
+        // The earliest expired deadline goes first, otherwise continue the elevator from the last position
+        for (req = ch->queue; req != NULL; req = req->next) {
+            if ((int32_t) (now - req->deadline) >= 0 &&
+                (expired == NULL || (int32_t) (req->deadline - expired->deadline) < 0)) {
+                expired = req;
+            }
+            if (first == NULL && ata_position_cmp(req, ch->last_drive, ch->last_lba) >= 0) first = req;
+        }
+        if (expired != NULL) {
+            first = expired;
+            ata_stat.deadline_count++;
+        } else if (first == NULL) {
+            first = ch->queue;  // wrap around
+        }
+
+        // Merge the following requests that continue on the disk
+        buf_count = first->buf_count;
+        for (last = first; last->next != NULL; last = last->next) {
+            req = last->next;
+            if (req->drive != first->drive || req->write != first->write ||
+                req->lba != last->lba + last->buf_count * ATA_BUF_SECTORS ||
+                buf_count + req->buf_count > ATA_MAX_REQUEST_BUFS) {
+                break;
+            }
+            buf_count += req->buf_count;
+            ata_stat.merge_count++;
+        }
+
+        // Move them from the queue to the transfer
+        for (link = &ch->queue; *link != first; link = &(*link)->next) {}
+        *link = last->next;
+        last->next = NULL;
+        ch->active = first;
+        ch->last_drive = first->drive;
+        ch->last_lba = last->lba + last->buf_count * ATA_BUF_SECTORS;
+        ata_stat.transfer_count++;
+
+        // Scatter/gather table, one entry per buffer
+        j = 0;
+        for (req = first; req != NULL; req = req->next) {
+            for (i = 0; i < req->buf_count; i++, j++) {
+                ch->prd[j].addr = (uint32_t) req->bufs[i];  // kernel memory is identity mapped
+                ch->prd[j].byte_count = ATA_BUF_SIZE;
+                ch->prd[j].flags = 0;
+            }
+        }
+        ch->prd[j - 1].flags = PRD_EOT;
+
+        outb(0, ch->bm_base + BM_REG_COMMAND);
+        outl((uint32_t) ch->prd, ch->bm_base + BM_REG_PRDT);
+        outb(inb(ch->bm_base + BM_REG_STATUS) | BM_STATUS_ERROR | BM_STATUS_IRQ, ch->bm_base + BM_REG_STATUS);
+
+        if (ata_issue_unsafe(ch, first->drive, first->lba, buf_count * ATA_BUF_SECTORS,
+                             first->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA) == -1) {
+            // Fail it now, the bus master is not started, and try the next one
+            DEBUG_ERR("ata_dispatch_unsafe(): drive %d is busy", first->drive);
+            ata_finish_unsafe(ch, ATA_REQ_ERROR);
+            continue;
+        }
+
+        outb(BM_CMD_START | (first->write ? 0 : BM_CMD_READ), ch->bm_base + BM_REG_COMMAND);
+    }
+}
+
+/**
+ * Finish all requests of the transfer of a channel, and wake up tasks waiting for them
+ * @param ch        The channel
+ * @param status    ATA_REQ_DONE or ATA_REQ_ERROR
+ * @return Number of tasks woken up
+ * @note Use this function in a lock
+ */
+static int32_t ata_finish_unsafe(ata_channel_t *ch, int32_t status) {
+    ata_request_t *req = ch->active;
+    ata_request_t *next;
+    task_list_node_t *node;
+    task_list_node_t *temp;
+    uint32_t latency;
+    int32_t wake_count = 0;
+
+    ch->active = NULL;
+
+    for (; req != NULL; req = next) {
+        next = req->next;  // the request may be reused once it's finished
+
+        latency = (rdtsc() - req->submit_tsc) / 1000;
+        ata_stat.latency_sum += latency;
+        if (latency > ata_stat.latency_max) ata_stat.latency_max = latency;
+        ch->depth--;
+
+        task_list_for_each_safe(node, &req->wait_list, temp) {
+            // Already in lock
+            sched_insert_to_head_unsafe(task_from_node(node));
+            wake_count++;
+        }
+        req->status = status;
+    }
+
+    return wake_count;
+}
+
+/**
+ * Finish the transfer of a channel if it's done, and start the next one. A write transfer is finished after the
+ * FLUSH CACHE that follows it
+ * @param ch    The channel
+ * @return Number of tasks woken up, or -1 if the transfer is not done
+ * @note Use this function in a lock
+ */
+static int32_t ata_complete_unsafe(ata_channel_t *ch) {
+    uint32_t bm_status, status;
+    int32_t wake_count;
+
+    if (ch->active == NULL) return -1;
+
+    if (ch->flushing) {
+        // FLUSH CACHE is not a DMA command, so only the drive tells whether it's done
+        status = inb(ch->io_base + ATA_REG_STATUS);      // also acknowledge the interrupt of the drive
+        if (status & ATA_STATUS_BSY) return -1;
+        ch->flushing = 0;
+    } else {
+        bm_status = inb(ch->bm_base + BM_REG_STATUS);
+        if (!(bm_status & BM_STATUS_IRQ)) return -1;
+
+        outb(0, ch->bm_base + BM_REG_COMMAND);           // stop the bus master
+        status = inb(ch->io_base + ATA_REG_STATUS);      // also acknowledge the interrupt of the drive
+        outb(bm_status | BM_STATUS_ERROR | BM_STATUS_IRQ, ch->bm_base + BM_REG_STATUS);
+        if (bm_status & BM_STATUS_ERROR) status |= ATA_STATUS_ERR;
+
+        // The drive may still hold the data in its write cache, flush it before the requests are finished
+        if (ch->active->write && !(status & (ATA_STATUS_ERR | ATA_STATUS_DF))) {
+            outb(ATA_CMD_FLUSH, ch->io_base + ATA_REG_COMMAND);  // the drive of the transfer is still selected
+            ch->flushing = 1;
+            return -1;
+        }
+    }
+
+    if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        DEBUG_ERR("ata_complete_unsafe(): drive %d error at LBA %u, status %#x", ch->active->drive,
+                  ch->active->lba, status);
+        wake_count = ata_finish_unsafe(ch, ATA_REQ_ERROR);
+    } else {
+        wake_count = ata_finish_unsafe(ch, ATA_REQ_DONE);
+    }
+
+    ata_dispatch_unsafe(ch);
+    return wake_count;
+}
+
+/**
+ * Check whether a request is within its drive
+ * @param req    The request
+ * @return 1 for yes, 0 for no
+ */
+static int ata_request_valid(const ata_request_t *req) {
+    return req->buf_count != 0 && req->buf_count <= ATA_MAX_REQUEST_BUFS && ata_drive_sectors(req->drive) != 0 &&
+           req->lba < ata_sectors[req->drive] && req->buf_count * ATA_BUF_SECTORS <= ata_sectors[req->drive] - req->lba;
+}
+
+/**
+ * Queue requests to the I/O scheduler together, so that they can be ordered and merged before any of them starts.
+ * An idle channel starts at once
+ * @param reqs     Array of requests, which must stay valid until they are finished
+ * @param count    Number of requests
+ * @return 0 for success, -1 for bad request, in which case none is queued
+ * @note With PIO the requests are finished before return
+ */
+int32_t ata_submit_batch(ata_request_t *reqs, uint32_t count) {
+    ata_channel_t *ch;
+    ata_request_t *req;
+    ata_request_t **link;
+    uint32_t flags, i;
+
+    if (reqs == NULL) return -1;
+    for (i = 0; i < count; i++) {
+        if (!ata_request_valid(&reqs[i])) {
+            DEBUG_ERR("ata_submit_batch(): bad request");
+            return -1;
+        }
+    }
+
+    cli_and_save(flags);
+    {
+        for (i = 0; i < count; i++) {
+            req = &reqs[i];
+            ch = &ata_channel[req->drive / 2];
+            req->status = ATA_REQ_PENDING;
+            req->wait_list.next = req->wait_list.prev = &req->wait_list;
+
+            if (ch->bm_base == 0) {
+                req->status = ata_pio_transfer_unsafe(ch, req);
+                continue;
+            }
+
+            req->deadline = sched_get_time() + (req->write ? ATA_WRITE_DEADLINE : ATA_READ_DEADLINE);
+            req->submit_tsc = rdtsc();
+
+            // Insert in order of position, after requests at the same position
+            for (link = &ch->queue; *link != NULL && ata_position_cmp(*link, req->drive, req->lba) <= 0;
+                 link = &(*link)->next) {}
+            req->next = *link;
+            *link = req;
+
+            ch->depth++;
+            ata_stat.request_count++;
+            ata_stat.depth_sum += ch->depth;
+            if (ch->depth > ata_stat.depth_max) ata_stat.depth_max = ch->depth;
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (ata_channel[i].bm_base != 0) ata_dispatch_unsafe(&ata_channel[i]);
+        }
+    }
+    restore_flags(flags);
+
+    return 0;
+}
+
+/**
+ * Queue a request to the I/O scheduler, see ata_submit_batch()
+ * @param req    The request, which must stay valid until it's finished
+ * @return 0 for success, -1 for bad request
+ */
+int32_t ata_submit(ata_request_t *req) {
+    return ata_submit_batch(req, 1);
+}
+
+/**
+ * Wait for a request to finish. The running task sleeps until the request completes, or the channel is polled if
+ * the scheduler is not running
+ * @param req    The request submitted
+ * @return 0 for success, -1 for transfer error
+ */
+int32_t ata_wait(ata_request_t *req) {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    {
+        while (req->status == ATA_REQ_PENDING) {
+            if (task_count == 0 || (running_task()->flags & TASK_IDLE_TASK)) {
+                ata_complete_unsafe(&ata_channel[req->drive / 2]);
+            } else {
+                // Woken up by ata_finish_unsafe()
+                sched_move_running_after_node_unsafe(&req->wait_list);
+                sched_launch_to_current_head();
+            }
+        }
+    }
+    restore_flags(flags);
+
+    return (req->status == ATA_REQ_DONE ? 0 : -1);
+}
+
+/**
+ * Transfer between buffers and consecutive sectors of a drive, and wait for it
+ * @param drive        The drive
+ * @param lba          First sector
+ * @param bufs         Buffers, each ATA_BUF_SIZE bytes, see ata_request_t
+ * @param buf_count    Number of buffers, 1 to ATA_MAX_REQUEST_BUFS
+ * @param write        1 for memory to disk, 0 for disk to memory
+ * @return 0 for success, -1 for fail
+ */
+int32_t ata_rw(int32_t drive, uint32_t lba, uint8_t **bufs, uint32_t buf_count, int32_t write) {
+    ata_request_t req;
+    uint32_t i;
+
+    if (bufs == NULL || buf_count > ATA_MAX_REQUEST_BUFS) return -1;
+
+    req.drive = drive;
+    req.lba = lba;
+    req.buf_count = buf_count;
+    for (i = 0; i < buf_count; i++) req.bufs[i] = bufs[i];
+    req.write = write;
+
+    if (ata_submit(&req) == -1) return -1;
+    return ata_wait(&req);
+}
+
+/**
+ * Get statistics of the I/O scheduler
+ * @param stat    Output statistics
+ */
+void ata_get_stat(ata_stat_t *stat) {
+    if (stat != NULL) *stat = ata_stat;
+}
+
+/**
+ * Handle IRQ 14 and 15. Finish the transfer of the channel and wake up waiting tasks
+ */
+asmlinkage void ata_interrupt_handler(hw_context_t hw_context) {
+
+    // We are using interrupt gate now, so we don't need a lock
+
+    ata_channel_t *ch = &ata_channel[hw_context.irq_exp_num == ATA_PRIMARY_IRQ ? 0 : 1];
+    int32_t wake_count = -1;
+
+    if (ch->bm_base != 0) wake_count = ata_complete_unsafe(ch);
+    if (wake_count == -1) inb(ch->io_base + ATA_REG_STATUS);  // not a DMA completion, e.g. IDENTIFY, just acknowledge
+
+    idt_send_eoi(hw_context.irq_exp_num);
+
+    if (wake_count > 0) sched_launch_to_current_head();
+}
@@ -0,0 +1,74 @@
+/* ata.h - IDE/ATA disk driver with bus-master DMA
+ */
+
+#ifndef _ATA_H
+#define _ATA_H
+
+#include "types.h"
+#include "idt.h"
+#include "linkage.h"
+#include "task/task.h"
+
+#define ATA_PRIMARY_IRQ         14
+#define ATA_SECONDARY_IRQ       15
+
+#define ATA_DRIVE_COUNT         4     // primary master, primary slave, secondary master, secondary slave
+
+#define ATA_SECTOR_SIZE         512
+#define ATA_BUF_SIZE            4096  // size of each buffer of a request, which is one PRD entry
+#define ATA_BUF_SECTORS         (ATA_BUF_SIZE / ATA_SECTOR_SIZE)
+#define ATA_MAX_REQUEST_BUFS    16    // 64KB, within the 8-bit sector count of LBA28 commands
+
+#define ATA_REQ_PENDING         0
+#define ATA_REQ_DONE            1
+#define ATA_REQ_ERROR           (-1)
+
+// Deadlines of the I/O scheduler, after which a request is served before the elevator order [ms]
+#define ATA_READ_DEADLINE       50
+#define ATA_WRITE_DEADLINE      500
+
+/**
+ * A transfer of whole buffers between memory and consecutive sectors. Buffers MUST be ATA_BUF_SIZE bytes in the
+ * kernel image (identity mapped), and not cross a 64KB boundary, e.g. 4KB-aligned.
+ * @note Only the first six fields are set by the caller, the rest are used by the driver
+ */
+typedef struct ata_request_t ata_request_t;
+struct ata_request_t {
+    int32_t drive;          // 0 to ATA_DRIVE_COUNT - 1
+    uint32_t lba;           // first sector
+    uint32_t buf_count;     // 1 to ATA_MAX_REQUEST_BUFS
+    uint8_t *bufs[ATA_MAX_REQUEST_BUFS];
+    int32_t write;          // 1 for memory to disk, 0 for disk to memory
+    volatile int32_t status;  // ATA_REQ_*, updated on completion
+
+    uint32_t deadline;      // see ATA_READ_DEADLINE [ms]
+    uint32_t submit_tsc;    // for latency statistics
+    task_list_node_t wait_list;  // tasks waiting for completion
+    ata_request_t *next;    // next in the queue of the channel, or in the same transfer
+};
+
+// Statistics of the I/O scheduler, since boot
+typedef struct ata_stat_t {
+    uint32_t request_count;    // requests submitted
+    uint32_t transfer_count;   // transfers started, each with one or more requests
+    uint32_t merge_count;      // requests merged into the transfer of an adjacent request
+    uint32_t deadline_count;   // transfers started for an expired deadline, out of elevator order
+    uint32_t depth_sum;        // sum of queue depth seen by each submitted request, including itself
+    uint32_t depth_max;
+    uint32_t latency_sum;      // sum of latency from submit to completion over requests [1K cycles]
+    uint32_t latency_max;      // [1K cycles]
+} ata_stat_t;
+
+int32_t ata_init();
+uint32_t ata_drive_sectors(int32_t drive);
+
+int32_t ata_submit(ata_request_t *req);
+int32_t ata_submit_batch(ata_request_t *reqs, uint32_t count);
+int32_t ata_wait(ata_request_t *req);
+int32_t ata_rw(int32_t drive, uint32_t lba, uint8_t **bufs, uint32_t buf_count, int32_t write);
+
+void ata_get_stat(ata_stat_t *stat);
+
+asmlinkage void ata_interrupt_handler(hw_context_t hw_context);
+
+#endif // _ATA_H
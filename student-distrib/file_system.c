@@ -2,9 +2,13 @@
 #include "file_system.h"
 #include "lib.h"
 
+#include "ata.h"
+#include "fs_cache.h"
 #include "terminal.h"
 #include "rtc.h"
 #include "task/task.h"
+#include "task/task_paging.h"
+#include "task/task_sched.h"
 
 // Global variables for file system
 static module_t file_system;       // the module for file system
@@ -19,10 +23,82 @@ static operation_table_t file_op_table;
 // file_array array
 // static file_array_t file_array;
 
-// Blocks for file system
+// Boot block of the file system. Inodes and data blocks are accessed through fs_cache.c, see get_inode()
 static boot_block_t boot_block;
-static inode_t *inodes = NULL;
-static data_block_t *data_blocks = NULL;
+
+// Block numbers in the image, as used by fs_cache.c
+#define BOOT_BLOCK              0
+#define INODE_BLOCK(inode)      (1 + (inode))
+#define DATA_BLOCK(block_num)   (1 + boot_block.inode_num + (block_num))
+
+#define INODE_MAX_BLOCK_COUNT   ((FILE_BLOCK_SIZE_IN_BYTES / DATA_BLOCK_NUM_SIZE_IN_BYTE) - 1)
+#define FILE_MAX_SIZE           (INODE_MAX_BLOCK_COUNT * FILE_BLOCK_SIZE_IN_BYTES)
+
+/*
+ * Usage of inodes and data blocks, rebuilt from the directory entries and inodes at init, so the format of the image
+ * stays the same as createfs makes. Data blocks and inodes beyond the maximal counts are never allocated.
+ */
+#define FS_MAX_DATA_BLOCK_COUNT  8192  // 32MB of data
+#define FS_MAX_INODE_COUNT       1024
+
+#define INODE_FREE               0
+#define INODE_FILE               1     // used by a regular file
+#define INODE_RESERVED           2     // used by other types of dentry, or beyond FS_MAX_INODE_COUNT
+
+static uint32_t data_block_bitmap[FS_MAX_DATA_BLOCK_COUNT / 32];  // 1 for used
+static uint32_t free_data_block_count = 0;
+static uint8_t inode_state[FS_MAX_INODE_COUNT];
+
+/*
+ * The file system, including fs_cache.c and task_paging_invalidate_img(), is protected by a sleeping lock instead of
+ * cli, since disk I/O sleeps until the interrupt of the drive. The lock is recursive, because a page fault inside it
+ * (executable image loaded on demand) reads the file system again. The owner is marked TASK_IN_FILE_SYSTEM so that
+ * it's not torn down while holding the lock. Before the scheduler starts there is a single flow of control, and the
+ * lock does nothing.
+ */
+static task_t *fs_lock_owner = NULL;
+static uint32_t fs_lock_depth = 0;
+static task_list_node_t fs_lock_wait_list = TASK_LIST_SENTINEL(fs_lock_wait_list);
+
+static int32_t fs_disk = -1;  // ATA drive of the file system, or -1 for the module
+static ata_request_t fs_disk_req[FS_CACHE_SIZE];  // one for each block of a batch, protected by the lock
+
+#define FS_READ_BATCH    16  // data blocks that read_data() loads from the disk together
+
+/*
+ * Read-ahead of file_read(). A reader that keeps reading from where it stopped gets a growing window of blocks after
+ * its position loaded into the cache by the read-ahead task, while it processes what it has read. Requests are
+ * queued in a ring, and dropped if it's full since read-ahead is only a hint. The ring is protected by cli.
+ */
+#define FS_READAHEAD_RING_SIZE    16  // power of 2
+
+typedef struct readahead_req_t {
+    uint32_t inode;
+    uint32_t first;  // index of the first block in the file
+    uint32_t end;    // index after the last block
+} readahead_req_t;
+
+static readahead_req_t readahead_ring[FS_READAHEAD_RING_SIZE];
+static uint32_t readahead_head = 0;  // next to serve
+static uint32_t readahead_tail = 0;  // next to fill
+static task_t *readahead_task = NULL;
+static int readahead_waiting = 0;    // whether read-ahead task is in readahead_wait_list
+static task_list_node_t readahead_wait_list = TASK_LIST_SENTINEL(readahead_wait_list);
+
+// Helper functions
+static int32_t file_system_mount(uint32_t block_count);
+static int32_t fs_lock();
+static void fs_unlock();
+static int32_t read_data_unsafe(uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t length);
+static int32_t read_data_direct_unsafe(uint32_t inode, uint32_t offset, const uint8_t **ptr);
+
+// Hash index of directory entries, built at init. Open addressing with linear probing.
+#define DENTRY_HASH_SIZE     128   // power of 2, at least twice of the max count of dentries
+#define DENTRY_HASH_MASK     (DENTRY_HASH_SIZE - 1)
+#define DENTRY_HASH_EMPTY    0xFF  // empty slot
+#define DENTRY_MAX_COUNT     (sizeof(boot_block.dir_entries) / sizeof(dentry_t))
+static uint8_t dentry_name_hash[DENTRY_HASH_SIZE];   // file name -> index in boot_block.dir_entries
+static uint8_t dentry_inode_hash[DENTRY_HASH_SIZE];  // inode number -> index in boot_block.dir_entries
 
 
 
@@ -135,6 +211,12 @@ int32_t system_read(int32_t fd, void *buf, int32_t nbytes) {
         return -1;
     }
 
+    // Read-only pages (text, mappings of files) would be written without a fault
+    if (nbytes > 0 && task_paging_touch_user_output(buf, nbytes) == -1) {
+        DEBUG_ERR("system_read(): the buf is not writable");
+        return -1;
+    }
+
     return running_task()->file_array.opened_files[fd].file_op_table_p->read(fd, buf, nbytes);
 }
 
@@ -143,8 +225,8 @@ int32_t system_read(int32_t fd, void *buf, int32_t nbytes) {
  * @param fd        The file descriptor
  * @param buf       The things to write
  * @param nbytes    The number of bytes to write
- * @return 0 for success, -1 for fail
- * @note This is a read only file system, if file type is dir/regular file, return -1
+ * @return The number of bytes written, or -1 for fail
+ * @note Regular files are written at the file position, see file_write(). Directory can't be written
  */
 int32_t system_write(int32_t fd, const void *buf, int32_t nbytes) {
 
@@ -169,8 +251,218 @@ int32_t system_write(int32_t fd, const void *buf, int32_t nbytes) {
     return running_task()->file_array.opened_files[fd].file_op_table_p->write(fd, buf, nbytes);
 }
 
+/**
+ * Support system call: create(). Create an empty regular file
+ * @param filename    Name of the file, at most FILE_NAME_LENGTH characters
+ * @return 0 for success, -1 for fail (file exists, bad name, or no space)
+ */
+int32_t system_create(const uint8_t *filename) {
+    dentry_t dentry;
+
+    if (filename == NULL) {
+        DEBUG_ERR("system_create(): NULL filename");
+        return -1;
+    }
+
+    return (create_file(filename, &dentry) == -1 ? -1 : 0);
+}
+
+/**
+ * Support system call: truncate(). Set the length of a regular file, zero-filling if it grows
+ * @param fd        The file descriptor
+ * @param length    New length of the file
+ * @return 0 for success, -1 for fail
+ * @note The file position is not changed
+ */
+int32_t system_truncate(int32_t fd, int32_t length) {
+
+    // Check for invalid fd
+    if (fd < 0 || fd >= MAX_OPEN_FILE) {
+        DEBUG_ERR("system_truncate(): invalid fd %d", fd);
+        return -1;
+    }
+
+    // Only regular files that are opened can be truncated
+    if (running_task()->file_array.opened_files[fd].flags == FD_NOT_IN_USE ||
+        running_task()->file_array.opened_files[fd].file_op_table_p != &file_op_table) {
+        DEBUG_ERR("system_truncate(): fd %d is not an opened regular file", fd);
+        return -1;
+    }
+
+    if (length < 0) {
+        DEBUG_ERR("system_truncate(): bad length %d", length);
+        return -1;
+    }
+
+    return truncate_data(running_task()->file_array.opened_files[fd].inode, length);
+}
+
 /***************************** Public Functions *********************************/
 
+/**
+ * Hash a file name. Stop at '\0' or FILE_NAME_LENGTH characters, same as the comparison in read_dentry_by_name()
+ * @param fname    The file name
+ * @return Slot in the hash table
+ */
+static uint32_t dentry_name_hash_of(const uint8_t *fname) {
+    uint32_t hash = 2166136261U;  // FNV-1a
+    int i;
+    for (i = 0; i < FILE_NAME_LENGTH && fname[i] != '\0'; i++) {
+        hash = (hash ^ fname[i]) * 16777619U;
+    }
+    return (hash ^ (hash >> 16)) & DENTRY_HASH_MASK;
+}
+
+/**
+ * Add boot_block.dir_entries[index] to the name and inode hash index
+ * @param index    Index of the dentry
+ * @note For dentries sharing the same inode (such as "." and "rtc"), the first one is indexed, same as the linear
+ *       scan in read_dentry_by_index()
+ * @note Lookups don't take the lock, so new slots are only ever filled in, never moved
+ */
+static void dentry_hash_insert(uint32_t index) {
+    uint32_t slot;
+
+    // Name index, duplicated names are skipped
+    slot = dentry_name_hash_of(boot_block.dir_entries[index].file_name);
+    while (dentry_name_hash[slot] != DENTRY_HASH_EMPTY &&
+           strncmp((int8_t *) boot_block.dir_entries[dentry_name_hash[slot]].file_name,
+                   (int8_t *) boot_block.dir_entries[index].file_name, FILE_NAME_LENGTH) != 0) {
+        slot = (slot + 1) & DENTRY_HASH_MASK;
+    }
+    if (dentry_name_hash[slot] == DENTRY_HASH_EMPTY) dentry_name_hash[slot] = index;
+
+    // Inode index
+    slot = boot_block.dir_entries[index].inode_num & DENTRY_HASH_MASK;
+    while (dentry_inode_hash[slot] != DENTRY_HASH_EMPTY &&
+           boot_block.dir_entries[dentry_inode_hash[slot]].inode_num != boot_block.dir_entries[index].inode_num) {
+        slot = (slot + 1) & DENTRY_HASH_MASK;
+    }
+    if (dentry_inode_hash[slot] == DENTRY_HASH_EMPTY) dentry_inode_hash[slot] = index;
+}
+
+/**
+ * Build the name and inode hash index of boot_block.dir_entries
+ */
+static void build_dentry_hash() {
+    uint32_t i;
+
+    memset(dentry_name_hash, DENTRY_HASH_EMPTY, sizeof(dentry_name_hash));
+    memset(dentry_inode_hash, DENTRY_HASH_EMPTY, sizeof(dentry_inode_hash));
+
+    for (i = 0; i < boot_block.dir_num; i++) {
+        dentry_hash_insert(i);
+    }
+}
+
+/**
+ * Mark a data block as used or free in the bitmap
+ * @param block_num    The data block number, must be less than FS_MAX_DATA_BLOCK_COUNT
+ * @param used         1 for used, 0 for free
+ */
+static void set_data_block_used(uint32_t block_num, int used) {
+    uint32_t mask = 1U << (block_num % 32);
+    if (((data_block_bitmap[block_num / 32] & mask) != 0) == (used != 0)) return;
+    if (used) {
+        data_block_bitmap[block_num / 32] |= mask;
+        free_data_block_count--;
+    } else {
+        data_block_bitmap[block_num / 32] &= ~mask;
+        free_data_block_count++;
+    }
+}
+
+/**
+ * Build the inode state and the data block bitmap from directory entries and inodes of regular files
+ * @note Inodes that no dentry refers to are free, and so are data blocks that no such inode uses
+ */
+static void build_usage_map() {
+    uint32_t i, j, inode, block_count;
+    const inode_t *node;
+
+    // Everything beyond the image is used, so that it's never allocated
+    memset(data_block_bitmap, 0xFF, sizeof(data_block_bitmap));
+    free_data_block_count = 0;
+    for (i = 0; i < boot_block.data_block_num && i < FS_MAX_DATA_BLOCK_COUNT; i++) set_data_block_used(i, 0);
+
+    memset(inode_state, INODE_RESERVED, sizeof(inode_state));
+    for (i = 0; i < boot_block.inode_num && i < FS_MAX_INODE_COUNT; i++) inode_state[i] = INODE_FREE;
+
+    for (i = 0; i < boot_block.dir_num; i++) {
+        inode = boot_block.dir_entries[i].inode_num;
+        if (inode >= boot_block.inode_num || inode >= FS_MAX_INODE_COUNT) continue;
+
+        if (boot_block.dir_entries[i].file_type != 2) {
+            inode_state[inode] = INODE_RESERVED;
+            continue;
+        }
+        if ((node = (const inode_t *) fs_cache_read_unsafe(INODE_BLOCK(inode))) == NULL) continue;
+        inode_state[inode] = INODE_FILE;
+        block_count = (node->length_in_bytes + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+        if (block_count > INODE_MAX_BLOCK_COUNT) block_count = INODE_MAX_BLOCK_COUNT;
+        for (j = 0; j < block_count; j++) {
+            if (node->data_block_num[j] < FS_MAX_DATA_BLOCK_COUNT) set_data_block_used(node->data_block_num[j], 1);
+        }
+    }
+}
+
+/**
+ * Acquire the lock of the file system, sleeping while another task holds it
+ * @return 1 if it has slept, 0 otherwise
+ * @note Recursive. It may sleep, so don't call it in an interrupt handler
+ */
+static int32_t fs_lock() {
+    uint32_t flags;
+    task_t *task;
+    int32_t slept = 0;
+
+    if (task_count == 0) return 0;
+
+    cli_and_save(flags);
+    {
+        task = running_task();
+        while (fs_lock_owner != NULL && fs_lock_owner != task) {
+            // Woken up by fs_unlock()
+            sched_move_running_after_node_unsafe(&fs_lock_wait_list);
+            sched_launch_to_current_head();
+            slept = 1;
+        }
+        fs_lock_owner = task;
+        fs_lock_depth++;
+        task->flags |= TASK_IN_FILE_SYSTEM;
+    }
+    restore_flags(flags);
+
+    return slept;
+}
+
+/**
+ * Release the lock of the file system, and wake up all waiting tasks
+ * @note If the task is killed while holding the lock, it halts here, see task_halt_terminal()
+ */
+static void fs_unlock() {
+    uint32_t flags;
+    task_t *task;
+    task_list_node_t *node;
+    task_list_node_t *temp;
+
+    cli_and_save(flags);
+    {
+        if ((task = fs_lock_owner) != NULL && --fs_lock_depth == 0) {
+            fs_lock_owner = NULL;
+            task->flags &= ~TASK_IN_FILE_SYSTEM;
+
+            task_list_for_each_safe(node, &fs_lock_wait_list, temp) {
+                // Already in lock
+                sched_insert_to_head_unsafe(task_from_node(node));
+            }
+
+            if (task->flags & TASK_HALT_PENDING) system_halt(255);
+        }
+    }
+    restore_flags(flags);
+}
+
 /**
  * Initialize the whole file system, usually called by kernel when init
  * will check whether the system already inited, if not, init the file
@@ -179,6 +471,8 @@ int32_t system_write(int32_t fd, const void *buf, int32_t nbytes) {
  * @return    0 for success, -1 for the file system already inited
  */
 int32_t file_system_init(module_t *fs) {
+    uint32_t image_block_count;
+
     // Check if already inited
     if (file_system_inited == 1) {
         DEBUG_ERR("file_system_init(): file system already inited");
@@ -189,10 +483,107 @@ int32_t file_system_init(module_t *fs) {
     file_system_inited = 1;
     file_system = *fs;
 
-    // Store the blocks as global variable
-    boot_block = *((boot_block_t *) fs->mod_start);
-    inodes = ((inode_t *) fs->mod_start) + 1;
-    data_blocks = ((data_block_t *) fs->mod_start) + boot_block.inode_num + 1;
+    image_block_count = (fs->mod_end - fs->mod_start) / FILE_BLOCK_SIZE_IN_BYTES;
+    fs_cache_init((uint8_t *) fs->mod_start, image_block_count);
+
+    return file_system_mount(image_block_count);
+}
+
+/**
+ * Transfer blocks of the file system between the cache and the disk, see fs_cache_io_t. Each block is a request,
+ * and the I/O scheduler merges adjacent ones
+ */
+static int32_t fs_disk_io(const uint32_t *blocks, uint8_t **bufs, uint32_t count, int32_t write) {
+    uint32_t i;
+    int32_t ret = 0;
+
+    for (i = 0; i < count; i++) {
+        fs_disk_req[i].drive = fs_disk;
+        fs_disk_req[i].lba = blocks[i] * (FILE_BLOCK_SIZE_IN_BYTES / ATA_SECTOR_SIZE);
+        fs_disk_req[i].buf_count = 1;
+        fs_disk_req[i].bufs[0] = bufs[i];
+        fs_disk_req[i].write = write;
+    }
+    if (ata_submit_batch(fs_disk_req, count) == -1) return -1;
+
+    for (i = 0; i < count; i++) {
+        if (ata_wait(&fs_disk_req[i]) == -1) ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * Check whether a block looks like the boot block of a file system made by createfs
+ * @param block          The block
+ * @param block_count    Number of blocks of the disk
+ * @return 1 for yes, 0 for no
+ */
+static int is_boot_block(const boot_block_t *block, uint32_t block_count) {
+    return block != NULL && block->dir_num >= 1 && block->dir_num <= DENTRY_MAX_COUNT && block->inode_num != 0 &&
+           1 + block->inode_num + block->data_block_num <= block_count &&
+           strncmp((const int8_t *) block->dir_entries[0].file_name, ".", FILE_NAME_LENGTH) == 0 &&
+           block->dir_entries[0].file_type == 1;
+}
+
+/**
+ * Initialize the file system from the first ATA drive that holds one, such as filesys_img attached as a disk. Only
+ * blocks in use are read, through the cache, so memory and time don't grow with the size of the file system
+ * @return 0 for success, -1 for no such drive or the file system already inited
+ * @note ata_init() must be called first. Before the scheduler starts, the drive is polled
+ */
+int32_t file_system_init_disk() {
+    uint32_t block_count;
+
+    // Check if already inited
+    if (file_system_inited == 1) {
+        DEBUG_ERR("file_system_init_disk(): file system already inited");
+        return -1;
+    }
+
+    for (fs_disk = 0; fs_disk < ATA_DRIVE_COUNT; fs_disk++) {
+        block_count = ata_drive_sectors(fs_disk) / (FILE_BLOCK_SIZE_IN_BYTES / ATA_SECTOR_SIZE);
+        if (block_count == 0) continue;
+
+        fs_cache_init_dev(fs_disk_io, block_count);
+        if (is_boot_block((const boot_block_t *) fs_cache_read_unsafe(BOOT_BLOCK), block_count)) {
+            file_system_inited = 1;
+            printf("File system on ATA drive %d\n", fs_disk);
+            return file_system_mount(block_count);
+        }
+    }
+
+    fs_disk = -1;
+    return -1;
+}
+
+/**
+ * Set up the file system over the cache, which has been initialized with the backing store
+ * @param block_count    Number of blocks in the backing store
+ * @return 0 for success, -1 for unreadable boot block
+ */
+static int32_t file_system_mount(uint32_t block_count) {
+    const boot_block_t *block;
+
+    // Store the boot block as global variable, and access the rest through the cache
+    if ((block = (const boot_block_t *) fs_cache_read_unsafe(BOOT_BLOCK)) == NULL) {
+        DEBUG_ERR("file_system_mount(): fail to read boot block");
+        return -1;
+    }
+    boot_block = *block;
+    if (DATA_BLOCK(boot_block.data_block_num) > block_count) {
+        DEBUG_WARN("file_system_mount(): image is smaller than %u data blocks", boot_block.data_block_num);
+        boot_block.data_block_num = (block_count > DATA_BLOCK(0) ? block_count - DATA_BLOCK(0) : 0);
+    }
+
+    // Build hash index of directory entries
+    if (boot_block.dir_num > DENTRY_MAX_COUNT) {
+        DEBUG_WARN("file_system_mount(): bad dir_num %u, only first %u are used", boot_block.dir_num, DENTRY_MAX_COUNT);
+        boot_block.dir_num = DENTRY_MAX_COUNT;
+    }
+    build_dentry_hash();
+
+    // Find out free inodes and data blocks
+    build_usage_map();
 
     // Init operation table for terminal
     terminal_op_table.open = system_terminal_open;
@@ -308,14 +699,16 @@ int32_t set_file_array(file_array_t *cur_file_array) {
  */
 int32_t read_dentry_by_name(const uint8_t *fname, dentry_t *dentry) {
 
-    int i;  // loop counter
+    uint32_t slot;  // slot in hash index
+    uint8_t i;      // index of dentry
 
     // Check if the file name is too long
     if (strlen((int8_t *) fname) > FILE_NAME_LENGTH)
         return -1;
 
-    // Loop though all the file names
-    for (i = 0; i < boot_block.dir_num; i++) {
+    // Probe the hash index until an empty slot
+    for (slot = dentry_name_hash_of(fname);
+         (i = dentry_name_hash[slot]) != DENTRY_HASH_EMPTY; slot = (slot + 1) & DENTRY_HASH_MASK) {
         // Test whether current file match
         if (!strncmp((int8_t *) fname, (int8_t *) boot_block.dir_entries[i].file_name, FILE_NAME_LENGTH)) {
             // If yes, set dentry and return
@@ -324,7 +717,7 @@ int32_t read_dentry_by_name(const uint8_t *fname, dentry_t *dentry) {
         }
     }
 
-    // After looping though all dentries and not found, meaning not exist
+    // Reach empty slot and not found, meaning not exist
     return -1;
 }
 
@@ -336,10 +729,12 @@ int32_t read_dentry_by_name(const uint8_t *fname, dentry_t *dentry) {
  */
 int32_t read_dentry_by_index(uint32_t index, dentry_t *dentry) {
 
-    int i;  // loop counter
+    uint32_t slot;  // slot in hash index
+    uint8_t i;      // index of dentry
 
-    // Loop though all the file names
-    for (i = 0; i < boot_block.dir_num; i++) {
+    // Probe the hash index until an empty slot
+    for (slot = index & DENTRY_HASH_MASK;
+         (i = dentry_inode_hash[slot]) != DENTRY_HASH_EMPTY; slot = (slot + 1) & DENTRY_HASH_MASK) {
         // test whether current file match
         if (index == boot_block.dir_entries[i].inode_num) {
             // if yes, set dentry and return
@@ -348,10 +743,39 @@ int32_t read_dentry_by_index(uint32_t index, dentry_t *dentry) {
         }
     }
 
-    // After looping though all dentries and not found, meaning not exist
+    // Reach empty slot and not found, meaning not exist
     return -1;
 }
 
+/**
+ * Get the current content of an inode
+ * @param inode    The inode number, must be valid
+ * @return Pointer to the inode, or NULL if it's beyond the image
+ * @note Use this function in a lock, see fs_cache_read_unsafe()
+ */
+static const inode_t *get_inode(uint32_t inode) {
+    return (const inode_t *) fs_cache_read_unsafe(INODE_BLOCK(inode));
+}
+
+/**
+ * Get the data block that holds the given block index of a file
+ * @param inode          The inode number of the file, must be valid
+ * @param block_index    The index of the block inside the file
+ * @return Pointer to the current content of the data block, or NULL for bad data block
+ * @note Use this function in a lock, see fs_cache_read_unsafe()
+ */
+static const data_block_t *get_data_block(uint32_t inode, uint32_t block_index) {
+    uint32_t block_num;
+    const inode_t *node;
+
+    if (block_index >= INODE_MAX_BLOCK_COUNT || (node = get_inode(inode)) == NULL) return NULL;
+
+    block_num = node->data_block_num[block_index];
+    if (block_num >= boot_block.data_block_num) return NULL;
+
+    return (const data_block_t *) fs_cache_read_unsafe(DATA_BLOCK(block_num));
+}
+
 /**
  * Read length of bytes starting from the position offset of the given file
  * @param inode     The inode number of the file to be read
@@ -361,56 +785,651 @@ int32_t read_dentry_by_index(uint32_t index, dentry_t *dentry) {
  * @return The number of Bytes read and placed into buffer, or
  *         -1 for the bad inode / inode point to bad data block, 0 if offset reach the end of the file
  * @note The caller is responsible for produce enough space for the buffer
+ * @note Data is copied span by span, each span is the part of the request that lies in one data block
  */
 int32_t read_data(uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t length) {
+    int32_t ret;
 
     // Check whether inode is valid
     if (inode >= boot_block.inode_num)
         return -1;
 
-    uint32_t file_length = inodes[inode].length_in_bytes; // the max length of the file
+    // Blocks may be moved in the cache by a writer
+    fs_lock();
+    {
+        ret = read_data_unsafe(inode, offset, buf, length);
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Load data blocks of a file into the cache together, so that the disk gets them as one batch of requests
+ * @param inode    The inode number of the file, must be valid
+ * @param first    Index of the first block in the file
+ * @param end      Index after the last block to load
+ * @return Index after the last block requested, at most FS_READ_BATCH after first
+ * @note Use this function in a lock. Errors are left to the following reads
+ */
+static uint32_t load_file_blocks(uint32_t inode, uint32_t first, uint32_t end) {
+    uint32_t blocks[FS_READ_BATCH];
+    const inode_t *node;
+    uint32_t i;
+
+    if (end - first > FS_READ_BATCH) end = first + FS_READ_BATCH;
+    if (fs_cache_in_memory() || (node = get_inode(inode)) == NULL) return end;
+
+    // Blocks beyond the end of the file are left from a truncate
+    i = (node->length_in_bytes + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+    if (end > i) end = (first < i ? i : first);
+
+    for (i = first; i < end && i < INODE_MAX_BLOCK_COUNT; i++) {
+        if (node->data_block_num[i] >= boot_block.data_block_num) break;
+        blocks[i - first] = DATA_BLOCK(node->data_block_num[i]);
+    }
+    fs_cache_prefetch_unsafe(blocks, i - first);
 
-    // Counters, all of them, including offset needed to be updated in the loop
-    uint32_t bytes_read = 0; // a counter for how many Bytes have been read
+    return end;
+}
 
-    // Data block
-    uint32_t current_data_block_index = offset / FILE_BLOCK_SIZE_IN_BYTES;
-    uint32_t current_data_block_num = inodes[inode].data_block_num[current_data_block_index];
-    uint32_t current_data_block_offset = offset - (current_data_block_index * FILE_BLOCK_SIZE_IN_BYTES);
+/**
+ * Read data of a file, see read_data()
+ * @note Use this function in a lock
+ */
+static int32_t read_data_unsafe(uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t length) {
+    const inode_t *node;
+    const data_block_t *block;
+    uint32_t loaded_end = 0;  // index after the blocks loaded by load_file_blocks()
 
-    // Check if the data block is valid
-    if (current_data_block_num >= boot_block.data_block_num)
+    if ((node = get_inode(inode)) == NULL)
         return -1;
 
-    while (bytes_read < length) {
+    uint32_t file_length = node->length_in_bytes; // the max length of the file
 
-        // Check if reach the end of the file
-        if (offset >= file_length)
-            break;
+    // Check if reach the end of the file, and cut length at the end of the file
+    if (offset >= file_length)
+        return 0;
+    if (length > file_length - offset)
+        length = file_length - offset;
 
-        // Copy the current Byte
-        buf[bytes_read] = data_blocks[current_data_block_num].data[current_data_block_offset];
+    uint32_t bytes_read = 0;  // a counter for how many Bytes have been read
+    uint32_t block_offset;    // offset inside current data block
+    uint32_t span;            // bytes to copy from current data block
 
-        // Update the counters
-        bytes_read++;
-        offset++;
-        current_data_block_offset++;
+    while (bytes_read < length) {
 
-        // Check if need to update block_num
-        if (current_data_block_offset >= FILE_BLOCK_SIZE_IN_BYTES) {
-            current_data_block_offset -= FILE_BLOCK_SIZE_IN_BYTES;
-            current_data_block_index++;
-            current_data_block_num = inodes[inode].data_block_num[current_data_block_index];
+        if (offset / FILE_BLOCK_SIZE_IN_BYTES >= loaded_end) {
+            loaded_end = load_file_blocks(inode, offset / FILE_BLOCK_SIZE_IN_BYTES,
+                                          (offset + length - bytes_read - 1) / FILE_BLOCK_SIZE_IN_BYTES + 1);
+        }
 
-            // Check if the data block is valid
-            if (current_data_block_num >= boot_block.data_block_num)
-                return bytes_read;
+        block = get_data_block(inode, offset / FILE_BLOCK_SIZE_IN_BYTES);
+        if (block == NULL) {
+            // Bad data block at the very beginning is an error, otherwise return what have been read
+            return (bytes_read == 0 ? -1 : bytes_read);
         }
+
+        block_offset = offset % FILE_BLOCK_SIZE_IN_BYTES;
+        span = FILE_BLOCK_SIZE_IN_BYTES - block_offset;
+        if (span > length - bytes_read) span = length - bytes_read;
+
+        memcpy(buf + bytes_read, &block->data[block_offset], span);
+
+        bytes_read += span;
+        offset += span;
     }
 
     return bytes_read;
 }
 
+/**
+ * Get a pointer directly into the file system module for data starting at offset of the given file, without copying
+ * @param inode     The inode number of the file to be read
+ * @param offset    The position begin to be read in the file
+ * @param ptr       Output pointer to the data in the module
+ * @return The number of contiguous Bytes available at *ptr, or
+ *         -1 for the bad inode / inode point to bad data block, 0 if offset reach the end of the file
+ * @note The span extends across data blocks as long as they are adjacent in the module, so a file that is stored
+ *       continuously can be accessed as a whole. Call again with offset + returned value for the rest of the file.
+ *       With the file system on a disk, the span is at most one block.
+ * @note Only for in-kernel callers. Data in the module MUST NOT be modified. The pointer may point to a block in the
+ *       write-back cache, so it's only valid until the file system is written.
+ */
+int32_t read_data_direct(uint32_t inode, uint32_t offset, const uint8_t **ptr) {
+    int32_t ret;
+
+    // Check whether inode and output pointer are valid
+    if (inode >= boot_block.inode_num || ptr == NULL)
+        return -1;
+
+    fs_lock();
+    {
+        ret = read_data_direct_unsafe(inode, offset, ptr);
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Get a pointer to data of a file, see read_data_direct()
+ * @note Use this function in a lock
+ */
+static int32_t read_data_direct_unsafe(uint32_t inode, uint32_t offset, const uint8_t **ptr) {
+    const inode_t *node;
+
+    if ((node = get_inode(inode)) == NULL)
+        return -1;
+
+    uint32_t file_length = node->length_in_bytes; // the max length of the file
+
+    // Check if reach the end of the file
+    if (offset >= file_length)
+        return 0;
+
+    uint32_t block_index = offset / FILE_BLOCK_SIZE_IN_BYTES;
+    const data_block_t *block = get_data_block(inode, block_index);
+    const data_block_t *next_block;
+    if (block == NULL)
+        return -1;
+
+    *ptr = &block->data[offset % FILE_BLOCK_SIZE_IN_BYTES];
+
+    // Extend the span while the next data block of the file is right after current one in the module
+    uint32_t span_end = (block_index + 1) * FILE_BLOCK_SIZE_IN_BYTES;  // end of the span, as offset in the file
+    while (fs_cache_in_memory() && span_end < file_length) {
+        next_block = get_data_block(inode, block_index + 1);
+        if (next_block != block + 1) break;
+        block = next_block;
+        block_index++;
+        span_end += FILE_BLOCK_SIZE_IN_BYTES;
+    }
+    if (span_end > file_length) span_end = file_length;
+
+    return span_end - offset;
+}
+
+/**
+ * Find a free data block in [start, end) and mark it as used
+ * @param start    The first block to check
+ * @param end      One past the last block to check
+ * @return The data block number, or -1 if all blocks in the range are used
+ */
+static int32_t alloc_data_block_in_range(uint32_t start, uint32_t end) {
+    uint32_t block_num = start;
+
+    while (block_num < end) {
+        if (data_block_bitmap[block_num / 32] == 0xFFFFFFFF) {
+            block_num = (block_num / 32 + 1) * 32;  // skip to the next word
+            continue;
+        }
+        if (!(data_block_bitmap[block_num / 32] & (1U << (block_num % 32)))) {
+            set_data_block_used(block_num, 1);
+            return block_num;
+        }
+        block_num++;
+    }
+
+    return -1;
+}
+
+/**
+ * Find a free data block and mark it as used
+ * @param hint    The block to try first, usually the one after the previous block of the file, so that the file
+ *                stays contiguous for read_data_direct()
+ * @return The data block number, or -1 if the file system is full
+ */
+static int32_t alloc_data_block(uint32_t hint) {
+    uint32_t limit = boot_block.data_block_num;
+    int32_t block_num;
+
+    if (free_data_block_count == 0) return -1;
+    if (limit > FS_MAX_DATA_BLOCK_COUNT) limit = FS_MAX_DATA_BLOCK_COUNT;
+    if (hint >= limit) hint = 0;
+
+    // Scan from the hint to the end, then wrap around to the blocks before the hint
+    block_num = alloc_data_block_in_range(hint, limit);
+    if (block_num == -1) block_num = alloc_data_block_in_range(0, hint);
+    return block_num;
+}
+
+/**
+ * Write data to a file, growing it as needed
+ * @param inode     The inode number of a regular file
+ * @param offset    The position to start writing. The gap beyond the end of the file is zero-filled
+ * @param buf       The data to write, or NULL to write zeros
+ * @param length    The length to write
+ * @return The number of bytes written, which is less than length if the file system is full or the file reaches
+ *         FILE_MAX_SIZE, or -1 if nothing can be written
+ * @note Use this function in a lock
+ */
+static int32_t write_data_unsafe(uint32_t inode, uint32_t offset, const uint8_t *buf, uint32_t length) {
+    const inode_t *node = get_inode(inode);
+    uint32_t file_length, block_count;
+    uint32_t bytes_written = 0;
+    uint32_t block_index, block_offset, span;
+    int32_t block_num;
+    uint8_t *data;
+    inode_t *inode_buf;
+
+    if (node == NULL) return -1;
+    file_length = node->length_in_bytes;
+    block_count = (file_length + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;  // allocated
+
+    if (length == 0) return 0;
+    if (offset >= FILE_MAX_SIZE) return -1;
+    if (length > FILE_MAX_SIZE - offset) length = FILE_MAX_SIZE - offset;
+
+    // Fill the gap first, so that the file has no hole
+    if (offset > file_length) {
+        if (write_data_unsafe(inode, file_length, NULL, offset - file_length) != offset - file_length) return -1;
+        file_length = offset;
+        block_count = (file_length + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+    }
+
+    while (bytes_written < length) {
+        block_index = offset / FILE_BLOCK_SIZE_IN_BYTES;
+        block_offset = offset % FILE_BLOCK_SIZE_IN_BYTES;
+        span = FILE_BLOCK_SIZE_IN_BYTES - block_offset;
+        if (span > length - bytes_written) span = length - bytes_written;
+
+        if (block_index < block_count) {
+            // Existing block, load it unless it's overwritten as a whole
+            if ((node = get_inode(inode)) == NULL) break;
+            block_num = node->data_block_num[block_index];
+            if (block_num >= boot_block.data_block_num) break;
+            data = fs_cache_write_unsafe(DATA_BLOCK(block_num), span != FILE_BLOCK_SIZE_IN_BYTES);
+            if (data == NULL) break;
+        } else {
+            // New block at the end of the file, which always starts at block_offset 0
+            if ((inode_buf = (inode_t *) fs_cache_write_unsafe(INODE_BLOCK(inode), 1)) == NULL) break;
+            block_num = alloc_data_block(block_index == 0 ? 0 : inode_buf->data_block_num[block_index - 1] + 1);
+            if (block_num == -1) break;
+            inode_buf->data_block_num[block_index] = block_num;
+            // Fails only if the cache is all dirty and can't be written back. The length doesn't cover the block
+            // then, so it's not part of the file
+            if ((data = fs_cache_write_unsafe(DATA_BLOCK(block_num), 0)) == NULL) {
+                set_data_block_used(block_num, 0);
+                break;
+            }
+            block_count++;
+            if (span != FILE_BLOCK_SIZE_IN_BYTES) memset(&data[span], 0, FILE_BLOCK_SIZE_IN_BYTES - span);
+        }
+
+        if (buf == NULL) {
+            memset(&data[block_offset], 0, span);
+        } else {
+            memcpy(&data[block_offset], buf + bytes_written, span);
+        }
+
+        bytes_written += span;
+        offset += span;
+    }
+
+    // Update the length once for the whole write
+    if (offset > file_length) {
+        if ((inode_buf = (inode_t *) fs_cache_write_unsafe(INODE_BLOCK(inode), 1)) == NULL) return -1;
+        inode_buf->length_in_bytes = offset;
+    }
+
+    return (bytes_written == 0 ? -1 : bytes_written);
+}
+
+/**
+ * Check whether an inode is a regular file that can be written
+ * @param inode    The inode number
+ * @return 1 for yes, 0 for no
+ */
+static int is_file_inode(uint32_t inode) {
+    return inode < boot_block.inode_num && inode < FS_MAX_INODE_COUNT && inode_state[inode] == INODE_FILE;
+}
+
+/**
+ * Write length of bytes starting from the position offset of the given file
+ * @param inode     The inode number of the file to be written
+ * @param offset    The position begin to be written in the file. If it's beyond the end, the gap is zero-filled
+ * @param buf       The data to write
+ * @param length    The length to write
+ * @return The number of bytes written, which is less than length if the file system is full, or -1 for bad inode
+ *         or nothing can be written
+ * @note Data goes to the write-back cache, see fs_cache.c. Cached executable image of the file is dropped
+ */
+int32_t write_data(uint32_t inode, uint32_t offset, const uint8_t *buf, uint32_t length) {
+    int32_t ret;
+
+    if (!is_file_inode(inode) || (length != 0 && buf == NULL)) {
+        DEBUG_ERR("write_data(): bad inode %u or buffer", inode);
+        return -1;
+    }
+
+    fs_lock();
+    {
+        ret = write_data_unsafe(inode, offset, buf, length);
+        task_paging_invalidate_img(inode);
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Append data to the end of a file
+ * @param inode     The inode number of the file
+ * @param buf       The data to write
+ * @param length    The length to write
+ * @return The number of bytes written, see write_data()
+ */
+int32_t append_data(uint32_t inode, const uint8_t *buf, uint32_t length) {
+    const inode_t *node;
+    int32_t ret = -1;
+
+    if (!is_file_inode(inode) || (length != 0 && buf == NULL)) {
+        DEBUG_ERR("append_data(): bad inode %u or buffer", inode);
+        return -1;
+    }
+
+    fs_lock();
+    {
+        if ((node = get_inode(inode)) != NULL) ret = write_data_unsafe(inode, node->length_in_bytes, buf, length);
+        task_paging_invalidate_img(inode);
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Set the length of a file. Data blocks beyond the new length are freed, and a growing file is zero-filled
+ * @param inode     The inode number of the file
+ * @param length    The new length
+ * @return 0 for success, -1 for bad inode, or no space to grow the file
+ */
+int32_t truncate_data(uint32_t inode, uint32_t length) {
+    const inode_t *node;
+    inode_t *inode_buf;
+    uint32_t file_length, i, block_count;
+    int32_t ret = 0;
+
+    if (!is_file_inode(inode) || length > FILE_MAX_SIZE) {
+        DEBUG_ERR("truncate_data(): bad inode %u or length %u", inode, length);
+        return -1;
+    }
+
+    fs_lock();
+    {
+        file_length = ((node = get_inode(inode)) != NULL ? node->length_in_bytes : length);  // nothing to do if NULL
+
+        if (length > file_length) {
+            if (write_data_unsafe(inode, file_length, NULL, length - file_length) != length - file_length) ret = -1;
+        } else if (length < file_length) {
+            // Free the blocks that are no longer used, without writing them back
+            block_count = (file_length + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+            if ((inode_buf = (inode_t *) fs_cache_write_unsafe(INODE_BLOCK(inode), 1)) == NULL) {
+                ret = -1;
+            } else {
+                inode_buf->length_in_bytes = length;
+                for (i = (length + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES; i < block_count; i++) {
+                    if ((node = get_inode(inode)) == NULL) break;
+                    uint32_t block_num = node->data_block_num[i];
+                    if (block_num >= boot_block.data_block_num) continue;
+                    fs_cache_discard_unsafe(DATA_BLOCK(block_num));
+                    if (block_num < FS_MAX_DATA_BLOCK_COUNT) set_data_block_used(block_num, 0);
+                }
+            }
+        }
+
+        task_paging_invalidate_img(inode);
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Create an empty regular file
+ * @param fname     The file name, at most FILE_NAME_LENGTH characters
+ * @param dentry    Output dentry of the new file
+ * @return 0 for success, -1 if the file exists, the name is bad, or no dentry/inode is available
+ */
+int32_t create_file(const uint8_t *fname, dentry_t *dentry) {
+    uint32_t inode;
+    uint32_t name_length = strlen((const int8_t *) fname);
+    int32_t ret = -1;
+    uint32_t flags;
+    uint8_t *inode_buf, *boot_buf;
+
+    if (name_length == 0 || name_length > FILE_NAME_LENGTH || dentry == NULL) {
+        DEBUG_ERR("create_file(): bad file name or dentry");
+        return -1;
+    }
+
+    fs_lock();
+    {
+        if (read_dentry_by_name(fname, dentry) == 0) {
+            DEBUG_WARN("create_file(): %s already exists", fname);
+        } else if (boot_block.dir_num >= DENTRY_MAX_COUNT) {
+            DEBUG_WARN("create_file(): no dentry available");
+        } else {
+            for (inode = 0; inode < boot_block.inode_num && inode < FS_MAX_INODE_COUNT; inode++) {
+                if (inode_state[inode] == INODE_FREE) break;
+            }
+            if (inode == boot_block.inode_num || inode == FS_MAX_INODE_COUNT) {
+                DEBUG_WARN("create_file(): no inode available");
+            } else if ((inode_buf = fs_cache_write_unsafe(INODE_BLOCK(inode), 0)) == NULL) {
+                DEBUG_WARN("create_file(): no cache buffer, dirty blocks can't be written back");
+            } else {
+                // Empty inode. It's still free if the boot block can't be written, as no dentry refers to it
+                memset(inode_buf, 0, FILE_BLOCK_SIZE_IN_BYTES);
+                if ((boot_buf = fs_cache_write_unsafe(BOOT_BLOCK, 0)) == NULL) {
+                    DEBUG_WARN("create_file(): no cache buffer, dirty blocks can't be written back");
+                } else {
+                    inode_state[inode] = INODE_FILE;
+
+                    // Directory entry, in both the boot block and its cache
+                    memset(dentry, 0, sizeof(dentry_t));
+                    strncpy((int8_t *) dentry->file_name, (const int8_t *) fname, FILE_NAME_LENGTH);
+                    dentry->file_type = 2;
+                    dentry->inode_num = inode;
+                    // read_dentry_by_name() and read_dentry_by_index() don't take fs_lock(), so publish the entry and
+                    // its hash slots at once instead of rebuilding the index
+                    cli_and_save(flags);
+                    {
+                        boot_block.dir_entries[boot_block.dir_num] = *dentry;
+                        dentry_hash_insert(boot_block.dir_num);
+                        boot_block.dir_num++;
+                    }
+                    restore_flags(flags);
+                    memcpy(boot_buf, &boot_block, sizeof(boot_block));
+
+                    ret = 0;
+                }
+            }
+        }
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Write back all dirty blocks of the file system
+ * @return Number of blocks written back, or -1 for disk error (the blocks stay dirty and are written by the next sync)
+ */
+int32_t file_system_sync() {
+    int32_t ret;
+
+    fs_lock();
+    {
+        ret = fs_cache_sync_unsafe();
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Write back dirty blocks and drop all blocks from the cache, so that following reads go to the disk
+ * @return Number of blocks dropped, or -1 if dirty blocks can't be written back
+ * @note For measurement with a cold cache. It does nothing to the image of the module, which is read in place
+ */
+int32_t file_system_drop_cache() {
+    int32_t ret;
+
+    fs_lock();
+    {
+        ret = fs_cache_drop_unsafe();
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Queue blocks of a file for the read-ahead task, and wake it up
+ * @param inode    The inode number of the file
+ * @param first    Index of the first block in the file
+ * @param end      Index after the last block
+ * @return 0 for success, -1 if there is no read-ahead task or the ring is full
+ * @note Use this function in a lock
+ */
+static int32_t readahead_queue_unsafe(uint32_t inode, uint32_t first, uint32_t end) {
+    readahead_req_t *req;
+
+    if (readahead_task == NULL || readahead_tail - readahead_head == FS_READAHEAD_RING_SIZE) return -1;
+
+    req = &readahead_ring[readahead_tail++ & (FS_READAHEAD_RING_SIZE - 1)];
+    req->inode = inode;
+    req->first = first;
+    req->end = end;
+
+    if (readahead_waiting) {
+        readahead_waiting = 0;
+        sched_insert_to_head_unsafe(readahead_task);
+    }
+    return 0;
+}
+
+/**
+ * Main function of read-ahead task. Load blocks queued by file_read() into the cache, with interrupts on
+ * @usage Kernel task EIP, started by init_task_main()
+ * @note It holds the lock of the file system while waiting for the disk, so a reader that catches up with it waits
+ *       for the lock instead of reading the same blocks again
+ */
+void file_readahead_main() {
+    uint32_t flags;
+    readahead_req_t req;
+
+    cli_and_save(flags);
+    {
+        readahead_task = running_task();
+    }
+    restore_flags(flags);
+
+    while (1) {
+        cli_and_save(flags);
+        {
+            while (readahead_head == readahead_tail) {
+                readahead_waiting = 1;
+                sched_move_running_after_node_unsafe(&readahead_wait_list);
+                sched_launch_to_current_head();
+                // Return after this task is woken up
+            }
+            req = readahead_ring[readahead_head++ & (FS_READAHEAD_RING_SIZE - 1)];
+        }
+        restore_flags(flags);
+
+        fs_lock();
+        {
+            // The file may have been truncated since, see load_file_blocks()
+            if (is_file_inode(req.inode)) load_file_blocks(req.inode, req.first, req.end);
+        }
+        fs_unlock();
+    }
+}
+
+/**
+ * Update read-ahead state of a file after a read, and queue the blocks after the reader if it's sequential
+ * @param ra             Read-ahead state of the file
+ * @param inode          The inode number of the file
+ * @param offset         Where the read starts
+ * @param length         Bytes read, not 0
+ * @param file_length    Length of the file
+ * @return 1 if blocks are queued, 0 otherwise
+ * @note Use this function in a lock
+ */
+static int32_t readahead_update_unsafe(file_readahead_t *ra, uint32_t inode, uint32_t offset, uint32_t length,
+                                       uint32_t file_length) {
+    uint32_t next_block;   // the first block that the reader hasn't touched
+    uint32_t file_blocks;  // number of blocks of the file
+    uint32_t first, end;
+
+    if (offset != ra->next_offset) {
+        // Random access, start over from the next read
+        ra->next_offset = offset + length;
+        ra->window = ra->end_block = 0;
+        return 0;
+    }
+    ra->next_offset = offset + length;
+    if (ra->window == 0) ra->window = FS_READAHEAD_MIN;
+    if (fs_cache_in_memory()) return 0;  // nothing to load
+
+    next_block = (ra->next_offset + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+    file_blocks = (file_length + FILE_BLOCK_SIZE_IN_BYTES - 1) / FILE_BLOCK_SIZE_IN_BYTES;
+
+    // Refill when the reader is half a window from the end of what's requested
+    if (ra->end_block >= next_block + ra->window / 2 || ra->end_block >= file_blocks) return 0;
+
+    first = (ra->end_block > next_block ? ra->end_block : next_block);
+    end = next_block + ra->window;
+    if (end > file_blocks) end = file_blocks;
+    if (first >= end || readahead_queue_unsafe(inode, first, end) == -1) return 0;
+
+    ra->block_count += end - first;
+    ra->end_block = end;
+    ra->window *= 2;
+    if (ra->window > FS_READAHEAD_MAX) ra->window = FS_READAHEAD_MAX;
+    return 1;
+}
+
+/**
+ * Get read-ahead statistics of an opened file of the running task
+ * @param fd      The file descriptor, must be a regular file
+ * @param stat    Output state and statistics
+ * @return 0 for success, -1 for bad fd
+ */
+int32_t file_get_readahead_stat(int32_t fd, file_readahead_t *stat) {
+    file_array_entry_t *file;
+
+    if (fd < 0 || fd >= MAX_OPEN_FILE || stat == NULL) {
+        DEBUG_ERR("file_get_readahead_stat(): invalid fd %d or NULL stat", fd);
+        return -1;
+    }
+    file = &running_task()->file_array.opened_files[fd];
+    if (file->flags == FD_NOT_IN_USE || file->file_op_table_p != &file_op_table) {
+        DEBUG_ERR("file_get_readahead_stat(): fd %d is not an opened file", fd);
+        return -1;
+    }
+
+    *stat = file->readahead;
+    return 0;
+}
+
+/**
+ * Get the inode of an opened regular file of the running task
+ * @param fd    The file descriptor
+ * @return The inode number, or -1 if fd is not an opened regular file
+ */
+int32_t file_get_inode(int32_t fd) {
+    file_array_entry_t *file;
+
+    if (fd < 0 || fd >= MAX_OPEN_FILE) return -1;
+    file = &running_task()->file_array.opened_files[fd];
+    if (file->flags == FD_NOT_IN_USE || file->file_op_table_p != &file_op_table) return -1;
+
+    return file->inode;
+}
+
 /**************************** File Operations ****************************/
 
 /**
@@ -435,6 +1454,7 @@ int32_t file_open(const uint8_t *filename) {
     running_task()->file_array.opened_files[fd].inode = current_dentry.inode_num;
     running_task()->file_array.opened_files[fd].file_position = 0; // the beginning of the file
     running_task()->file_array.opened_files[fd].flags = FD_IN_USE;
+    memset(&running_task()->file_array.opened_files[fd].readahead, 0, sizeof(file_readahead_t));
 
     return fd;
 }
@@ -456,35 +1476,91 @@ int32_t file_close(int32_t fd) {
  * @param nbytes    The size of the buffer
  * @return the number of Bytes read and placed into buffer, or
  *         -1 for the bad inode / inode point to bad data block, 0 if offset reach the end of the file
+ * @note A sequential reader gets blocks after it loaded by the read-ahead task, see readahead_update_unsafe(). A
+ *       read that waits for the disk, either loading by itself or waiting for the read-ahead task, is a stall
  */
 int32_t file_read(int32_t fd, void *buf, int32_t nbytes) {
 
     int32_t ret = 0;                                  // the return value
-    uint32_t offset = running_task()->file_array.opened_files[fd].file_position; // current offset of the file
+    file_array_entry_t *file = &running_task()->file_array.opened_files[fd];
+    uint32_t offset = file->file_position;            // current offset of the file
+    uint32_t file_length = 0;
+    uint32_t read_miss;
+    fs_cache_stat_t stat;
+    const inode_t *node;
+    int32_t stalled, queued = 0;
+    uint32_t flags;
+
+    if (nbytes > 0) task_paging_touch_user_buffer(buf, nbytes);
+
+    // Check whether inode is valid
+    if (file->inode >= boot_block.inode_num)
+        return -1;
+
+    stalled = fs_lock();
+    {
+        fs_cache_get_stat(&stat);
+        read_miss = stat.read_miss;
+
+        // Place the data into buffer
+        ret = read_data_unsafe(file->inode, offset, buf, nbytes);
+
+        fs_cache_get_stat(&stat);
+        if (stat.read_miss != read_miss) stalled = 1;
+        if ((node = get_inode(file->inode)) != NULL) file_length = node->length_in_bytes;
+    }
+    fs_unlock();
 
-    // Place the data into buffer
-    ret = read_data(running_task()->file_array.opened_files[fd].inode, offset, buf, nbytes);
     // Check if success
     if (ret == -1)
         return -1;
 
     // Update the file position
-    running_task()->file_array.opened_files[fd].file_position += ret;
+    file->file_position += ret;
+
+    if (ret > 0) {
+        if (stalled) file->readahead.stall_count++;
+        else file->readahead.hit_count++;
+
+        cli_and_save(flags);
+        {
+            queued = readahead_update_unsafe(&file->readahead, file->inode, offset, ret, file_length);
+            // Let the read-ahead task start the transfer, it sleeps soon for the disk
+            if (queued) sched_launch_to_current_head();
+        }
+        restore_flags(flags);
+    }
 
     return ret;
 }
 
 /**
- * The file system is read only, always return -1 and report error
+ * Write to the file at the file position, growing the file as needed
+ * @param fd        The file to write
+ * @param buf       The data to write
+ * @param nBytes    The number of bytes to write
+ * @return The number of bytes written, or -1 for fail
+ * @note Reading to the end of the file and then writing appends to it
  */
 int32_t file_write(int32_t fd, const void *buf, int32_t nBytes) {
-    // Params will not be used, avoid warning
-    (void) fd;
-    (void) buf;
-    (void) nBytes;
 
-    DEBUG_ERR("file_write(): the file system is read only");
-    return -1;
+    int32_t ret;
+    uint32_t offset = running_task()->file_array.opened_files[fd].file_position; // current offset of the file
+
+    if (nBytes < 0) {
+        DEBUG_ERR("file_write(): bad nBytes %d", nBytes);
+        return -1;
+    }
+    task_paging_touch_user_buffer(buf, nBytes);
+
+    ret = write_data(running_task()->file_array.opened_files[fd].inode, offset, buf, nBytes);
+    if (ret == -1)
+        return -1;
+
+    // Update the file position
+    running_task()->file_array.opened_files[fd].file_position += ret;
+
+    return ret;
 }
 
 /**************************** directory operatoins ****************************/
@@ -561,7 +1637,7 @@ int32_t dir_read(int32_t fd, void *buf, int32_t nbytes) {
 }
 
 /**
- * The file system is read only, always return -1 and report error
+ * The directory can't be written directly, always return -1 and report error. Use create_file() to add a file
  * @param fd
  * @param buf
  * @param nBytes
@@ -574,7 +1650,7 @@ int32_t dir_write(int32_t fd, const void *buf, int32_t nBytes) {
     (void) buf;
     (void) nBytes;
 
-    DEBUG_ERR("dir_write(): the file system is read only");
+    DEBUG_ERR("dir_write(): the directory is read only");
     return -1;
 }
 
@@ -641,11 +1717,29 @@ int32_t local_rtc_write(int32_t fd, const void *buf, int32_t nbytes) {
  * @return Length in bytes
  */
 int32_t get_file_size(uint32_t inode) {
+    const inode_t *node;
+    int32_t ret = -1;
+
     if (inode >= boot_block.inode_num) {
         DEBUG_ERR("get_file_size(): no such inode");
         return -1;
     }
-    return inodes[inode].length_in_bytes;
+
+    fs_lock();
+    {
+        if ((node = get_inode(inode)) != NULL) ret = node->length_in_bytes;
+    }
+    fs_unlock();
+
+    return ret;
+}
+
+/**
+ * Get number of free data blocks
+ * @return The count
+ */
+int32_t get_free_block_count() {
+    return free_data_block_count;
 }
 
 /**
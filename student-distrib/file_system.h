@@ -18,6 +18,21 @@
  * 
  * Version 3.1 Tingkai Liu 2019.11.3
  * support task 
+ *
+ * Version 3.2
+ * block-granular read_data() and read_data_direct() for zero-copy access to the module
+ *
+ * Version 4.0
+ * writable: free-block bitmap, file create/append/truncate, and a write-back buffer cache (fs_cache.c)
+ *
+ * Version 4.1
+ * mount from an ATA disk (ata.c) through the cache, with a sleeping lock instead of cli for disk I/O
+ *
+ * Version 4.2
+ * sequential read-ahead of file_read() by a kernel task
+ *
+ * Version 4.3
+ * blocks of the module can be mapped to user space by mmap(), see task_paging.c
  */
 
 #define     MAX_OPEN_FILE   8
@@ -32,6 +47,10 @@
 
 #define     FILE_NAME_LENGTH    32
 
+#define     FS_READAHEAD_TASK       1   // 1 to start the read-ahead task, see file_readahead_main()
+#define     FS_READAHEAD_MIN        4   // blocks read ahead when a reader is found sequential
+#define     FS_READAHEAD_MAX        16  // the window doubles up to this while the reader stays sequential
+
 /************************* File System (Abstraction) Structs *********************/
 
 // Function pointers for system calls
@@ -48,12 +67,23 @@ typedef struct operation_table_t {
     func_write   write;
 } operation_table_t;
 
+// Read-ahead state and statistics of an opened regular file, see file_read()
+typedef struct file_readahead_t {
+    uint32_t    next_offset;        // where the next read starts if the reader is sequential
+    uint32_t    end_block;          // blocks before it have been requested for read-ahead
+    uint32_t    window;             // number of blocks to read ahead, 0 if the reader is not sequential
+    uint32_t    hit_count;          // reads that went through without waiting for the disk
+    uint32_t    stall_count;        // reads that waited for the disk
+    uint32_t    block_count;        // blocks requested for read-ahead
+} file_readahead_t;
+
 // The struct for process control block, see mp3 document 8.2
 typedef struct file_array_entry_t {
     operation_table_t*    file_op_table_p;    // 4 Bytes: file operatoin table pointer
     uint32_t    inode;              // 4 Bytes: the inode number, only valid for data file
     uint32_t    file_position;      // 4 Bytes: where is currently reading, updated by sys read
     uint32_t    flags;              // 4 Bytes: making this file descriptor as "in use"
+    file_readahead_t    readahead;  // only valid for data file
 } file_array_entry_t;
 
 typedef struct file_array_t{
@@ -102,12 +132,15 @@ int32_t system_open(const uint8_t* filename);
 int32_t system_close(int32_t fd);
 int32_t system_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t system_write(int32_t fd, const void* buf, int32_t nbytes);
+int32_t system_create(const uint8_t* filename);
+int32_t system_truncate(int32_t fd, int32_t length);
 
 
 /***************************** Public Functions *********************************/
 
 
 int32_t file_system_init(module_t * fs);
+int32_t file_system_init_disk();
 
 int32_t init_file_array(file_array_t* cur_file_array);
 int32_t clear_file_array(file_array_t* cur_file_array);
@@ -116,6 +149,18 @@ int32_t set_file_array(file_array_t* cur_file_array);
 int32_t read_dentry_by_name(const uint8_t* fname, dentry_t* dentry);
 int32_t read_dentry_by_index(uint32_t index, dentry_t* dentry);
 int32_t read_data(uint32_t inode, uint32_t offset, uint8_t* buf, uint32_t length);
+int32_t read_data_direct(uint32_t inode, uint32_t offset, const uint8_t** ptr);
+
+int32_t create_file(const uint8_t* fname, dentry_t* dentry);
+int32_t write_data(uint32_t inode, uint32_t offset, const uint8_t* buf, uint32_t length);
+int32_t append_data(uint32_t inode, const uint8_t* buf, uint32_t length);
+int32_t truncate_data(uint32_t inode, uint32_t length);
+int32_t file_system_sync();
+int32_t file_system_drop_cache();
+
+void file_readahead_main();
+int32_t file_get_readahead_stat(int32_t fd, file_readahead_t* stat);
+int32_t file_get_inode(int32_t fd);
 
 
 /**************************** File Operations ****************************/
@@ -142,6 +187,7 @@ int32_t local_rtc_read(int32_t fd, void* buf, int32_t nbytes);
 int32_t local_rtc_write(int32_t fd, const void* buf, int32_t nbytes);
 
 int32_t get_file_size(uint32_t inode);
+int32_t get_free_block_count();
 int32_t get_free_fd();
 
 
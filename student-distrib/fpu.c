@@ -0,0 +1,197 @@
+/* fpu.c - Detection and setup of x87 FPU and SIMD extensions
+*/
+
+#include "fpu.h"
+#include "lib.h"
+#include "task/task.h"
+
+#define EFLAGS_ID    (1U << 21)  // CPUID is supported if this flag can be toggled
+
+uint32_t cpu_features_edx = 0;
+
+/*
+ * FPU registers are switched lazily. They hold the state of fpu_owner until another task executes an x87/SSE
+ * instruction. sched_switch_to_unsafe() sets CR0.TS when switching to any other task, so that its first x87/SSE
+ * instruction raises #NM, and fpu_handle_nm() saves the state of fpu_owner to its task_t and loads the state of the
+ * running task. Tasks that never use the FPU pay nothing but the CR0 update on context switch.
+ */
+static task_t *fpu_owner = NULL;
+static uint32_t fpu_switch_count = 0;  // number of times the FPU changed hands
+
+// FPU state of a task when it first uses the FPU, captured by fpu_init()
+static uint8_t fpu_initial_state[TASK_FPU_STATE_SIZE] __attribute__((aligned(16)));
+
+/**
+ * Save FPU state to a buffer
+ * @param buf    TASK_FPU_STATE_SIZE bytes, 16-byte aligned
+ * @note FNSAVE also reinitializes the FPU, which is fine since the state is always reloaded before use
+ */
+static inline void fpu_save(uint8_t *buf) {
+    if (cpu_features_edx & CPUID_FEAT_EDX_FXSR) {
+        asm volatile ("fxsave (%0)" : : "r"(buf) : "memory");
+    } else {
+        asm volatile ("fnsave (%0)" : : "r"(buf) : "memory");
+    }
+}
+
+/**
+ * Load FPU state from a buffer
+ * @param buf    TASK_FPU_STATE_SIZE bytes, 16-byte aligned, written by fpu_save()
+ */
+static inline void fpu_restore(const uint8_t *buf) {
+    if (cpu_features_edx & CPUID_FEAT_EDX_FXSR) {
+        asm volatile ("fxrstor (%0)" : : "r"(buf) : "memory");
+    } else {
+        asm volatile ("frstor (%0)" : : "r"(buf) : "memory");
+    }
+}
+
+/**
+ * Set or clear CR0.TS, skipping the write if it's unchanged
+ * @param ts    1 to set, 0 to clear
+ */
+static inline void fpu_set_ts(int ts) {
+    uint32_t cr0;
+    asm volatile ("movl %%cr0, %0" : "=r"(cr0));
+    if (((cr0 & CR0_TS) != 0) == (ts != 0)) return;
+    if (ts) {
+        asm volatile ("movl %0, %%cr0" : : "r"(cr0 | CR0_TS));
+    } else {
+        asm volatile ("clts");
+    }
+}
+
+/**
+ * Check whether CPUID is supported by toggling the ID flag in EFLAGS
+ * @return 1 if supported, 0 if not
+ */
+static int cpuid_supported() {
+    uint32_t before, after;
+    asm volatile ("                 \n\
+            pushfl                  \n\
+            popl    %0              \n\
+            movl    %0, %1          \n\
+            xorl    %2, %1          \n\
+            pushl   %1              \n\
+            popfl                   \n\
+            pushfl                  \n\
+            popl    %1              \n\
+            pushl   %0              \n\
+            popfl                   \n\
+            "
+    : "=&r"(before), "=&r"(after)
+    : "i"(EFLAGS_ID)
+    : "cc"
+    );
+    return ((before ^ after) & EFLAGS_ID) != 0;
+}
+
+/**
+ * Detect the FPU and SIMD extensions, enable them in CR0/CR4, and select the SIMD level used by memcpy() family
+ * @return 0 on success, -1 if there is no x87 FPU
+ * @note Must be called before any task runs. Kernel code only uses SIMD inside the memcpy() family, which saves
+ *       and restores the XMM registers it touches with interrupts off, so it doesn't disturb the state of the task
+ *       owning the FPU. Small copies of a task not owning the FPU stay on rep movsl, so they don't raise #NM
+ */
+int fpu_init() {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t cr0, cr4;
+
+    mem_simd_level = MEM_SIMD_NONE;
+
+    if (!cpuid_supported()) {
+        DEBUG_WARN("fpu_init(): CPUID is not supported");
+        return -1;
+    }
+
+    asm volatile ("cpuid"
+    : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+    : "a"(1)
+    );
+    cpu_features_edx = edx;
+
+    if (!(edx & CPUID_FEAT_EDX_FPU)) {
+        DEBUG_WARN("fpu_init(): no x87 FPU");
+        return -1;
+    }
+
+    asm volatile ("movl %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    asm volatile ("movl %0, %%cr0" : : "r"(cr0));
+    asm volatile ("fninit");
+
+    if ((edx & CPUID_FEAT_EDX_FXSR) && (edx & CPUID_FEAT_EDX_SSE)) {
+        asm volatile ("movl %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+        asm volatile ("movl %0, %%cr4" : : "r"(cr4));
+
+        mem_simd_level = (edx & CPUID_FEAT_EDX_SSE2) ? MEM_SIMD_SSE2 : MEM_SIMD_SSE;
+    }
+
+    // Capture the clean state for tasks. FNSAVE reinitializes the FPU, which is what we want here anyway
+    if (mem_simd_level != MEM_SIMD_NONE) {
+        eax = MXCSR_DEFAULT;
+        asm volatile ("ldmxcsr %0" : : "m"(eax));
+    }
+    fpu_save(fpu_initial_state);
+
+    return 0;
+}
+
+/**
+ * Prepare FPU for a context switch. Called right before switching to another task
+ * @param to_run    The task to run
+ * @note Use this function in a lock
+ */
+void fpu_switch_unsafe(task_t *to_run) {
+    if (!(cpu_features_edx & CPUID_FEAT_EDX_FPU)) return;
+    fpu_set_ts(to_run != fpu_owner);
+}
+
+/**
+ * Drop the FPU state of a task that is being deallocated, so it's not saved into a reused PKM
+ * @param task    The task
+ * @note Use this function in a lock
+ */
+void fpu_release_unsafe(task_t *task) {
+    if (fpu_owner == task) fpu_owner = NULL;
+    task->fpu_used = 0;
+}
+
+/**
+ * Handle device-not-available exception (#NM) by giving the FPU to the running task
+ * @return 0 if handled and the instruction can be restarted, -1 if it's not caused by lazy switching
+ * @note Also raised by kernel code (memcpy() family) running on behalf of a task or in an interrupt handler. In
+ *       both cases the running task gets the FPU, and the kernel code preserves the registers it uses
+ */
+int fpu_handle_nm() {
+    uint32_t flags;
+    task_t *task;
+
+    if (!(cpu_features_edx & CPUID_FEAT_EDX_FPU) || task_count == 0) return -1;
+
+    cli_and_save(flags);
+    {
+        asm volatile ("clts");  // must be first, or saving and loading state raise #NM again
+        task = running_task();
+        if (fpu_owner != task) {
+            if (fpu_owner != NULL) fpu_save(fpu_owner->fpu_state);
+            fpu_restore(task->fpu_used ? task->fpu_state : fpu_initial_state);
+            task->fpu_used = 1;
+            fpu_owner = task;
+            fpu_switch_count++;
+        }
+    }
+    restore_flags(flags);
+
+    return 0;
+}
+
+/**
+ * Get number of times the FPU state changed hands in fpu_handle_nm()
+ * @return Switch count
+ */
+uint32_t fpu_get_switch_count() {
+    return fpu_switch_count;
+}
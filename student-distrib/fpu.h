@@ -0,0 +1,37 @@
+/* fpu.h - Detection and setup of x87 FPU and SIMD extensions
+*/
+
+#ifndef _FPU_H
+#define _FPU_H
+
+#include "types.h"
+
+/* CPUID leaf 1, EDX feature flags */
+#define CPUID_FEAT_EDX_FPU     (1U << 0)
+#define CPUID_FEAT_EDX_SEP     (1U << 11)  // SYSENTER/SYSEXIT
+#define CPUID_FEAT_EDX_MMX     (1U << 23)
+#define CPUID_FEAT_EDX_FXSR    (1U << 24)
+#define CPUID_FEAT_EDX_SSE     (1U << 25)
+#define CPUID_FEAT_EDX_SSE2    (1U << 26)
+
+#define CR0_MP    (1U << 1)   // monitor coprocessor, WAIT/FWAIT honor TS
+#define CR0_EM    (1U << 2)   // emulation, x87 and SIMD instructions raise #UD when set
+#define CR0_TS    (1U << 3)   // task switched, x87 and SIMD instructions raise #NM when set
+#define CR0_NE    (1U << 5)   // report x87 errors with #MF instead of IRQ 13
+
+#define CR4_OSFXSR        (1U << 9)   // OS supports FXSAVE/FXRSTOR, enables SSE instructions
+#define CR4_OSXMMEXCPT    (1U << 10)  // OS handles #XM for unmasked SIMD floating-point exceptions
+
+#define MXCSR_DEFAULT     0x1F80  // all SIMD floating-point exceptions masked, round to nearest
+
+extern uint32_t cpu_features_edx;  // CPUID leaf 1 EDX, 0 if CPUID is not supported
+
+int fpu_init();
+
+struct task_t;
+void fpu_switch_unsafe(struct task_t *to_run);
+void fpu_release_unsafe(struct task_t *task);
+int fpu_handle_nm();
+uint32_t fpu_get_switch_count();
+
+#endif // _FPU_H
@@ -0,0 +1,395 @@
+/* fs_cache.c - Write-back buffer cache of file system blocks
+ */
+
+#include "fs_cache.h"
+#include "lib.h"
+
+#define FS_CACHE_HASH_SIZE    128  // power of 2, at least twice of FS_CACHE_SIZE
+#define FS_CACHE_HASH_MASK    (FS_CACHE_HASH_SIZE - 1)
+#define FS_CACHE_NULL         0xFFFF
+
+/*
+ * Blocks are numbered as in the image: 0 for the boot block, then inodes, then data blocks. Writes go to a buffer
+ * and mark it dirty. Dirty buffers are written back together in block order by fs_cache_sync_unsafe(), either
+ * explicitly or when all buffers are dirty and a new one is needed, so that adjacent blocks are written back in one
+ * transfer. The backing store is either an image in memory, whose uncached blocks are read in place without taking
+ * a buffer, or a device (see fs_cache_io_t), whose blocks are loaded into buffers on read.
+ */
+typedef struct fs_cache_entry_t {
+    uint32_t block;      // block number, only meaningful if in_use
+    uint32_t last_use;   // for LRU replacement
+    uint16_t hash_next;  // next entry in the same hash chain, or FS_CACHE_NULL
+    uint8_t  in_use;
+    uint8_t  dirty;
+    uint8_t  loading;    // claimed by fs_cache_prefetch_unsafe() and not loaded yet, never evicted
+} fs_cache_entry_t;
+
+static uint8_t *fs_image = NULL;     // backing store in memory, or NULL for device
+static fs_cache_io_t fs_io = NULL;   // backing device, if fs_image is NULL
+static uint32_t fs_block_count = 0;  // number of blocks in the backing store
+
+static uint8_t fs_cache_buf[FS_CACHE_SIZE][FS_CACHE_BLOCK_SIZE] __attribute__((aligned(FS_CACHE_BLOCK_SIZE)));
+static fs_cache_entry_t fs_cache_entry[FS_CACHE_SIZE];
+static uint16_t fs_cache_hash[FS_CACHE_HASH_SIZE];  // block number -> first entry in the chain
+static uint32_t fs_cache_used = 0;    // number of entries in use
+static uint32_t fs_cache_dirty = 0;   // number of dirty entries
+static uint32_t fs_cache_clock = 0;   // increase on each access of a buffer, for LRU
+static fs_cache_stat_t fs_cache_stat;
+
+// Helper functions
+static void fs_cache_reset(uint32_t block_count);
+
+/**
+ * Initialize the cache over a file system image in memory
+ * @param image          The image, used as the backing store
+ * @param block_count    Number of blocks in the image
+ * @return 0 for success, -1 for bad input
+ */
+int32_t fs_cache_init(uint8_t *image, uint32_t block_count) {
+    if (image == NULL) {
+        DEBUG_ERR("fs_cache_init(): NULL image");
+        return -1;
+    }
+
+    fs_image = image;
+    fs_io = NULL;
+    fs_cache_reset(block_count);
+    return 0;
+}
+
+/**
+ * Initialize the cache over a block device
+ * @param io             Transfer function of the device
+ * @param block_count    Number of blocks of the device
+ * @return 0 for success, -1 for bad input
+ */
+int32_t fs_cache_init_dev(fs_cache_io_t io, uint32_t block_count) {
+    if (io == NULL) {
+        DEBUG_ERR("fs_cache_init_dev(): NULL io");
+        return -1;
+    }
+
+    fs_image = NULL;
+    fs_io = io;
+    fs_cache_reset(block_count);
+    return 0;
+}
+
+/**
+ * Check whether the backing store is an image in memory
+ * @return 1 for memory, 0 for device
+ * @note Only with an image in memory, blocks that are adjacent in the image are also adjacent in memory
+ */
+int32_t fs_cache_in_memory() {
+    return fs_image != NULL;
+}
+
+/**
+ * Drop all buffers without writing back, and clear the statistics
+ * @param block_count    Number of blocks in the backing store
+ */
+static void fs_cache_reset(uint32_t block_count) {
+    int i;
+
+    fs_block_count = block_count;
+
+    for (i = 0; i < FS_CACHE_SIZE; i++) {
+        fs_cache_entry[i].in_use = fs_cache_entry[i].dirty = 0;
+    }
+    for (i = 0; i < FS_CACHE_HASH_SIZE; i++) {
+        fs_cache_hash[i] = FS_CACHE_NULL;
+    }
+    fs_cache_used = fs_cache_dirty = fs_cache_clock = 0;
+    memset(&fs_cache_stat, 0, sizeof(fs_cache_stat));
+}
+
+/**
+ * Find the entry that caches a block
+ * @param block    The block number
+ * @return Index of the entry, or FS_CACHE_NULL if not cached
+ */
+static uint16_t fs_cache_lookup(uint32_t block) {
+    uint16_t i;
+    for (i = fs_cache_hash[block & FS_CACHE_HASH_MASK]; i != FS_CACHE_NULL; i = fs_cache_entry[i].hash_next) {
+        if (fs_cache_entry[i].block == block) return i;
+    }
+    return FS_CACHE_NULL;
+}
+
+/**
+ * Remove an entry from its hash chain and mark it unused
+ * @param index    Index of the entry, must be in use
+ */
+static void fs_cache_remove(uint16_t index) {
+    uint16_t *link = &fs_cache_hash[fs_cache_entry[index].block & FS_CACHE_HASH_MASK];
+    while (*link != index) link = &fs_cache_entry[*link].hash_next;
+    *link = fs_cache_entry[index].hash_next;
+
+    if (fs_cache_entry[index].dirty) fs_cache_dirty--;
+    fs_cache_entry[index].in_use = fs_cache_entry[index].dirty = 0;
+    fs_cache_used--;
+}
+
+/**
+ * Add an unused entry to the hash chain of a block
+ * @param index    Index of the entry
+ * @param block    The block number
+ */
+static void fs_cache_insert(uint16_t index, uint32_t block) {
+    fs_cache_entry[index].block = block;
+    fs_cache_entry[index].in_use = 1;
+    fs_cache_entry[index].dirty = 0;
+    fs_cache_entry[index].loading = 0;
+    fs_cache_entry[index].hash_next = fs_cache_hash[block & FS_CACHE_HASH_MASK];
+    fs_cache_hash[block & FS_CACHE_HASH_MASK] = index;
+    fs_cache_used++;
+}
+
+/**
+ * Load a block from the backing store into the buffer of an entry
+ * @param index    Index of the entry
+ * @param block    The block number
+ * @return 0 for success, -1 for device error
+ */
+static int32_t fs_cache_load(uint16_t index, uint32_t block) {
+    uint8_t *buf = fs_cache_buf[index];
+
+    if (fs_image != NULL) {
+        memcpy(buf, &fs_image[block * FS_CACHE_BLOCK_SIZE], FS_CACHE_BLOCK_SIZE);
+        return 0;
+    }
+    if (fs_io(&block, &buf, 1, 0) == -1) {
+        DEBUG_ERR("fs_cache_load(): fail to read block %u", block);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Get an unused entry, evicting the least recently used clean one if all are in use
+ * @return Index of the entry, or FS_CACHE_NULL if all entries are dirty and can't be written back
+ * @note If no entry can be evicted, dirty ones are written back first
+ */
+static uint16_t fs_cache_get_free_entry() {
+    uint16_t i, victim = FS_CACHE_NULL;
+    int pass;
+
+    if (fs_cache_used < FS_CACHE_SIZE) {
+        for (i = 0; i < FS_CACHE_SIZE; i++) {
+            if (!fs_cache_entry[i].in_use) return i;
+        }
+    }
+
+    for (pass = 0; pass < 2 && victim == FS_CACHE_NULL; pass++) {
+        if (pass == 1) fs_cache_sync_unsafe();
+        for (i = 0; i < FS_CACHE_SIZE; i++) {
+            if (!fs_cache_entry[i].dirty && !fs_cache_entry[i].loading &&
+                (victim == FS_CACHE_NULL || fs_cache_entry[i].last_use < fs_cache_entry[victim].last_use)) {
+                victim = i;
+            }
+        }
+    }
+    if (victim != FS_CACHE_NULL) fs_cache_remove(victim);
+    return victim;
+}
+
+/**
+ * Get the current content of a block
+ * @param block    The block number
+ * @return Pointer to the block, or NULL for bad block number or device error
+ * @note Use this function in a lock. The content MUST NOT be modified, and the pointer is only valid until the next
+ *       call to the cache, since the buffer may be reused
+ */
+const uint8_t *fs_cache_read_unsafe(uint32_t block) {
+    uint16_t i;
+
+    if (block >= fs_block_count) return NULL;
+
+    if (fs_cache_used != 0 && (i = fs_cache_lookup(block)) != FS_CACHE_NULL) {
+        fs_cache_stat.read_hit++;
+        fs_cache_entry[i].last_use = ++fs_cache_clock;
+        return fs_cache_buf[i];
+    }
+    if (fs_image != NULL) return &fs_image[block * FS_CACHE_BLOCK_SIZE];
+
+    // Load from the device into a clean buffer
+    fs_cache_stat.read_miss++;
+    if ((i = fs_cache_get_free_entry()) == FS_CACHE_NULL || fs_cache_load(i, block) == -1) return NULL;
+    fs_cache_insert(i, block);
+    fs_cache_entry[i].last_use = ++fs_cache_clock;
+
+    return fs_cache_buf[i];
+}
+
+/**
+ * Load blocks that are not cached with one call to the device, so that it can schedule and merge the transfers
+ * @param blocks    Block numbers, in any order
+ * @param count     Number of blocks, at most FS_CACHE_MAX_PREFETCH are used
+ * @return Number of blocks loaded, or -1 for device error
+ * @note Use this function in a lock. It does nothing for an image in memory, whose blocks are read in place
+ */
+int32_t fs_cache_prefetch_unsafe(const uint32_t *blocks, uint32_t count) {
+    uint32_t load_blocks[FS_CACHE_MAX_PREFETCH];
+    uint8_t *bufs[FS_CACHE_MAX_PREFETCH];
+    uint16_t index[FS_CACHE_MAX_PREFETCH];
+    uint32_t load_count = 0;
+    uint32_t i;
+
+    if (fs_image != NULL) return 0;
+    if (count > FS_CACHE_MAX_PREFETCH) count = FS_CACHE_MAX_PREFETCH;
+
+    // Claim buffers first, which may write back dirty blocks. Duplicated blocks are found in the cache then
+    for (i = 0; i < count; i++) {
+        if (blocks[i] >= fs_block_count || fs_cache_lookup(blocks[i]) != FS_CACHE_NULL) continue;
+        if ((index[load_count] = fs_cache_get_free_entry()) == FS_CACHE_NULL) break;
+        fs_cache_insert(index[load_count], blocks[i]);
+        fs_cache_entry[index[load_count]].loading = 1;
+        fs_cache_entry[index[load_count]].last_use = ++fs_cache_clock;
+        load_blocks[load_count] = blocks[i];
+        bufs[load_count] = fs_cache_buf[index[load_count]];
+        load_count++;
+    }
+    if (load_count == 0) return (i < count ? -1 : 0);  // stopped early if no buffer could be claimed
+
+    fs_cache_stat.read_miss += load_count;
+    if (fs_io(load_blocks, bufs, load_count, 0) == -1) {
+        DEBUG_ERR("fs_cache_prefetch_unsafe(): fail to read %u blocks", load_count);
+        for (i = 0; i < load_count; i++) fs_cache_remove(index[i]);
+        return -1;
+    }
+
+    for (i = 0; i < load_count; i++) fs_cache_entry[index[i]].loading = 0;
+    return load_count;
+}
+
+/**
+ * Get a buffer of a block to modify, and mark it dirty
+ * @param block    The block number
+ * @param load     1 to load the current content if the block is not cached, 0 if the caller overwrites the whole
+ *                 block (content of the buffer is undefined then)
+ * @return Pointer to the buffer, or NULL for bad block number or device error
+ * @note Use this function in a lock. The pointer is only valid until the next call to the cache, since the buffer
+ *       may be reused
+ */
+uint8_t *fs_cache_write_unsafe(uint32_t block, int32_t load) {
+    uint16_t i;
+
+    if (block >= fs_block_count) return NULL;
+
+    if ((i = fs_cache_lookup(block)) != FS_CACHE_NULL) {
+        fs_cache_stat.write_hit++;
+    } else {
+        fs_cache_stat.write_miss++;
+        if ((i = fs_cache_get_free_entry()) == FS_CACHE_NULL) return NULL;
+        if (load && fs_cache_load(i, block) == -1) return NULL;
+        fs_cache_insert(i, block);
+    }
+
+    if (!fs_cache_entry[i].dirty) {
+        fs_cache_entry[i].dirty = 1;
+        fs_cache_dirty++;
+    }
+    fs_cache_entry[i].last_use = ++fs_cache_clock;
+
+    return fs_cache_buf[i];
+}
+
+/**
+ * Drop a block from the cache without writing it back, for a block that is freed
+ * @param block    The block number
+ * @note Use this function in a lock
+ */
+void fs_cache_discard_unsafe(uint32_t block) {
+    uint16_t i;
+    if (fs_cache_used != 0 && (i = fs_cache_lookup(block)) != FS_CACHE_NULL) fs_cache_remove(i);
+}
+
+/**
+ * Write back all dirty blocks in the order of block number. Blocks stay in the cache as clean
+ * @return Number of blocks written back, or -1 for device error, in which case all of them stay dirty
+ * @note Use this function in a lock. It may sleep with a device, see fs_cache_io_t
+ */
+int32_t fs_cache_sync_unsafe() {
+    uint16_t order[FS_CACHE_SIZE];  // dirty entries, sorted by block number
+    uint32_t blocks[FS_CACHE_SIZE];
+    uint8_t *bufs[FS_CACHE_SIZE];
+    uint32_t count = 0, runs = 0;
+    uint32_t i, j;
+    uint16_t index;
+
+    if (fs_cache_dirty == 0) return 0;
+
+    // Insertion sort, the cache is small
+    for (i = 0; i < FS_CACHE_SIZE; i++) {
+        if (!fs_cache_entry[i].dirty) continue;
+        for (j = count; j > 0 && fs_cache_entry[order[j - 1]].block > fs_cache_entry[i].block; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        count++;
+    }
+
+    for (i = 0; i < count; i++) {
+        index = order[i];
+        // A block that doesn't follow the previous one starts a new run
+        if (i == 0 || fs_cache_entry[index].block != fs_cache_entry[order[i - 1]].block + 1) {
+            runs++;
+        }
+        if (fs_image != NULL) {
+            memcpy(&fs_image[fs_cache_entry[index].block * FS_CACHE_BLOCK_SIZE], fs_cache_buf[index],
+                   FS_CACHE_BLOCK_SIZE);
+        }
+        blocks[i] = fs_cache_entry[index].block;
+        bufs[i] = fs_cache_buf[index];
+    }
+
+    // The whole batch goes to the device at once, which merges adjacent blocks. The device doesn't report which
+    // blocks made it, so keep all of them dirty to be written again by the next sync
+    if (fs_image == NULL && fs_io(blocks, bufs, count, 1) == -1) {
+        DEBUG_ERR("fs_cache_sync_unsafe(): fail to write back %u blocks", count);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) fs_cache_entry[order[i]].dirty = 0;
+    fs_cache_dirty = 0;
+    fs_cache_stat.sync_count++;
+    fs_cache_stat.block_written += count;
+    fs_cache_stat.batch_written += runs;
+
+    return count;
+}
+
+/**
+ * Write back all dirty blocks and drop every block from the cache, so that following reads go to the backing store
+ * @return Number of blocks dropped, or -1 if dirty blocks can't be written back (clean ones are still dropped)
+ * @note Use this function in a lock. It may sleep with a device. For measurement with a cold cache
+ */
+int32_t fs_cache_drop_unsafe() {
+    int32_t count = 0;
+    uint16_t i;
+    int32_t synced = fs_cache_sync_unsafe();
+
+    for (i = 0; i < FS_CACHE_SIZE; i++) {
+        if (fs_cache_entry[i].in_use && !fs_cache_entry[i].loading && !fs_cache_entry[i].dirty) {
+            fs_cache_remove(i);
+            count++;
+        }
+    }
+    return (synced == -1 ? -1 : count);
+}
+
+/**
+ * Get number of dirty blocks in the cache
+ * @return The count
+ */
+uint32_t fs_cache_dirty_count() {
+    return fs_cache_dirty;
+}
+
+/**
+ * Get statistics of the cache
+ * @param stat    Output statistics
+ */
+void fs_cache_get_stat(fs_cache_stat_t *stat) {
+    if (stat != NULL) *stat = fs_cache_stat;
+}
@@ -0,0 +1,50 @@
+/* fs_cache.h - Write-back buffer cache of file system blocks
+ */
+
+#ifndef _FS_CACHE_H
+#define _FS_CACHE_H
+
+#include "types.h"
+
+#define FS_CACHE_BLOCK_SIZE    4096
+#define FS_CACHE_SIZE          64      // number of block buffers
+#define FS_CACHE_MAX_PREFETCH  (FS_CACHE_SIZE / 2)  // max number of blocks loaded by one fs_cache_prefetch_unsafe()
+
+/**
+ * Transfer a batch of blocks between buffers and a device. The blocks are in any order and may not be adjacent, and
+ * the device is free to reorder and merge the transfers
+ * @param blocks    Block numbers
+ * @param bufs      Buffers, one for each block
+ * @param count     Number of blocks, 1 to FS_CACHE_SIZE
+ * @param write     1 for buffers to device, 0 for device to buffers
+ * @return 0 for success, -1 if any block fails
+ * @note It may sleep, so the cache must be protected by a lock that allows it, see fs_lock() in file_system.c
+ */
+typedef int32_t (*fs_cache_io_t)(const uint32_t *blocks, uint8_t **bufs, uint32_t count, int32_t write);
+
+// Statistics of the cache, since init
+typedef struct fs_cache_stat_t {
+    uint32_t read_hit;       // reads of a block that is already cached
+    uint32_t read_miss;      // blocks loaded from the device, on read or prefetch
+    uint32_t write_hit;      // writes to a block that is already cached
+    uint32_t write_miss;     // writes that take a new buffer
+    uint32_t sync_count;     // times dirty blocks are written back
+    uint32_t block_written;  // blocks written back
+    uint32_t batch_written;  // runs of adjacent blocks written back, which a device can transfer together
+} fs_cache_stat_t;
+
+int32_t fs_cache_init(uint8_t *image, uint32_t block_count);
+int32_t fs_cache_init_dev(fs_cache_io_t io, uint32_t block_count);
+int32_t fs_cache_in_memory();
+
+const uint8_t *fs_cache_read_unsafe(uint32_t block);
+int32_t fs_cache_prefetch_unsafe(const uint32_t *blocks, uint32_t count);
+uint8_t *fs_cache_write_unsafe(uint32_t block, int32_t load);
+void fs_cache_discard_unsafe(uint32_t block);
+int32_t fs_cache_sync_unsafe();
+int32_t fs_cache_drop_unsafe();
+
+uint32_t fs_cache_dirty_count();
+void fs_cache_get_stat(fs_cache_stat_t *stat);
+
+#endif // _FS_CACHE_H
@@ -60,11 +60,16 @@ void ca_draw_pixel(unsigned char *canvas, int x, int y, vga_argb argb) {
 int load_png(const char *fname, int expected_width, int expected_height, vga_argb *png_data) {
     dentry_t test_png;
     int32_t readin_size;
+    const uint8_t *file_data;
 
-    // Open the png file and read it into buffer
+    // Open the png file. If it is stored continuously in the module, decode in place. Otherwise read it into buffer
     int32_t read_png = read_dentry_by_name((const uint8_t *) fname, &test_png);
     if (0 == read_png) {
-        readin_size = read_data(test_png.inode_num, 0, (unsigned char *) _png_data, sizeof(_png_data));
+        readin_size = read_data_direct(test_png.inode_num, 0, &file_data);
+        if (readin_size != get_file_size(test_png.inode_num)) {
+            readin_size = read_data(test_png.inode_num, 0, (unsigned char *) _png_data, sizeof(_png_data));
+            file_data = (const uint8_t *) _png_data;
+        }
         if (readin_size == sizeof(_png_data)) {
             DEBUG_ERR("draw_png(): PNG BUFFER NOT ENOUGH!");
             return -1;
@@ -81,7 +86,7 @@ int load_png(const char *fname, int expected_width, int expected_height, vga_arg
     const unsigned char *buffer;
     unsigned int idx;
 
-    upng = upng_new_from_file((unsigned char *) _png_data, (long) readin_size);
+    upng = upng_new_from_file((unsigned char *) file_data, (long) readin_size);
     upng.buffer = (unsigned char *) &_png_buf;
     upng_decode(&upng);
     if (upng_get_error(&upng) != UPNG_EOK) {
@@ -198,41 +203,6 @@ int draw_png_to_screen(vga_argb *png_data, unsigned width, unsigned height, int
     return 0;
 }
 
-/**
- * Initialize font objects
- * @param fg    RGB foreground color of characters
- * @param bg    RGB background color of characters
- */
-static void init_font_obj(vga_rgb fg, vga_rgb bg) {
-    int ch;
-    int i, j;
-    int x, y;
-
-    for (ch = 0; ch < 256; ch++) {
-
-        x = (ch & 0x7F) * FONT_WIDTH;
-        y = VGA_HEIGHT * 2 + (ch / 128) * FONT_HEIGHT;
-
-        for (i = 0; i < FONT_WIDTH; i++) {
-            for (j = 0; j < FONT_HEIGHT; j++) {
-                vga_set_color_argb((font_data[ch][j] & (1 << (7 - i)) ? fg : bg));
-                vga_draw_pixel(x + i, y + j);
-            }
-        }
-    }
-}
-
-/**
- * Get the GUI object of the given character
- * @param ch    The character
- * @return The GUI object
- */
-gui_object_t gui_get_obj_font(char ch) {
-    return (gui_object_t) {NULL,
-                           (ch & 0x7F) * FONT_WIDTH, VGA_HEIGHT * 2 + (ch / 128) * FONT_HEIGHT,
-                           FONT_WIDTH, FONT_HEIGHT, GUI_FONT_BACKCOLOR_ARGB};
-}
-
 /**
  * Initialize the desktop object
  */
@@ -433,6 +403,5 @@ static void init_window_obj() {
  */
 void gui_obj_load() {
     init_desktop_obj();
-    init_font_obj(GUI_FONT_FORECOLOR_ARGB, GUI_FONT_BACKCOLOR_ARGB);
     init_window_obj();
 }
@@ -36,7 +36,13 @@ struct gui_object_t {
 
 void gui_obj_load();
 
-gui_object_t gui_get_obj_font(char ch);
+/*
+ * Text is drawn by color-expand BitBLT from the 1bpp font_data. Glyph bits of the characters to draw are staged in
+ * the first lines of invisible video memory (the first 64K page after the two screen buffers), just before window
+ * objects.
+ */
+#define GUI_TEXT_STAGE_ADDR    (VGA_HEIGHT * 2 * VGA_BYTES_PER_LINE)
+#define GUI_TEXT_STAGE_SIZE    (FONT_HEIGHT * 2 * VGA_BYTES_PER_LINE)
 
 extern gui_object_t gui_obj_desktop;
 
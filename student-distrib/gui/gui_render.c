@@ -10,47 +10,207 @@
 #include "gui.h"
 #include "gui_font_data.h"
 #include "gui_window.h"
-#include "qsort.h"
 #include "gui_objs.h"
 #include "../vidmem.h"
 #include "../rtc.h"
+#include "../task/task_sched.h"
 
 static int curr_y = 0;  // double buffering y coordinate
 int gui_term_button_pressed = 0;
+static volatile int gui_render_requested = 1;  // whether anything on screen has changed since last frame
+
+// Damage tracking. A frame only redraws damaged rectangles. Since the back buffer was last drawn two frames ago, a
+// frame redraws damage of its own together with damage of the previous frame (stale area of the back buffer).
+static gui_rect_t damage[GUI_DAMAGE_MAX] = {{0, 0, VGA_WIDTH, VGA_HEIGHT}};  // damage reported since last frame
+static int damage_count = 1;  // the first frame draws the whole screen
+static gui_rect_t frame_damage[GUI_DAMAGE_MAX * 2];  // damage to be drawn in this frame
+static int frame_damage_count = 0;
+static gui_rect_t stale_damage[GUI_DAMAGE_MAX];  // damage drawn in last frame, which the back buffer lacks
+static int stale_damage_count = 0;
+static gui_rect_t clip;  // all drawing is clipped by it
+
+// Snapshot of windows taken at the beginning of a frame
+static gui_window_t frame_windows[GUI_MAX_WINDOW_NUM];
+static gui_window_t *frame_stack[GUI_MAX_WINDOW_NUM];  // index 0 is on the top
+static gui_rect_t frame_visible[GUI_WIN_VISIBLE_MAX];  // visible parts of window bodies, see window_visible
+static int frame_visible_end[GUI_MAX_WINDOW_NUM];
+static uint32_t frame_layout_version = 0;
+
+// Text of windows, copied from terminal buffers when damage is collected, so that drawing with interrupts on shows the
+// text the damage was collected for. A slot is kept by a window as long as it exists, and only changed rows are copied
+static const gui_window_t *text_owner[GUI_MAX_WINDOW_NUM];
+static const char *text_source[GUI_MAX_WINDOW_NUM];  // screen_char of the owner when last copied
+static char frame_text[GUI_MAX_WINDOW_NUM][TERMINAL_TEXT_ROWS * TERMINAL_TEXT_COLS];
+
+// Keypress-to-screen latency, see gui_render_input()
+static uint32_t input_tsc;  // TSC at IRQ of the oldest keypress not taken by a frame yet
+static int input_pending = 0;
+static uint32_t frame_input_tsc;  // TSC at IRQ of the keypress shown by the frame being rendered
+static uint32_t frame_input_consumed;
+static int frame_has_input = 0;
+static uint32_t input_consumed[GUI_INPUT_LATENCY_SAMPLES];  // cycles from IRQ to the frame taking its snapshot
+static uint32_t input_shown[GUI_INPUT_LATENCY_SAMPLES];  // cycles from IRQ to the frame being switched to the screen
+static int input_sample_count = 0;
+
+static int render_busy = 0;  // whether a frame is being rendered, see gui_compositor_set_enabled()
+
+// Compositor task
+static task_t *compositor_task = NULL;
+static int compositor_waiting = 0;  // whether compositor task is in compositor_wait_list
+static int compositor_frame_due = 0;  // whether a frame is requested by the timer
+static task_list_node_t compositor_wait_list = TASK_LIST_SENTINEL(compositor_wait_list);
+static int compositor_enabled = GUI_COMPOSITOR_TASK;  // whether frames are rendered by the compositor task
+
+static int drawn_term_button = -1;  // state of terminal button on screen, -1 for never drawn
+static int drawn_clock = -1;  // time of clock on screen, -1 for never drawn
+
+static gui_render_stat_t render_stat;
 
-// Drawing optimization related
-int grid_count;
-int grid_x[GUI_MAX_WINDOW_NUM * 2 + 2];
-int grid_y[GUI_MAX_WINDOW_NUM * 2 + 2];
-gui_window_t *grid[GUI_MAX_WINDOW_NUM * 2 + 1][GUI_MAX_WINDOW_NUM * 2 + 1];  // [x index][y index]
+/**
+ * Add a rectangle to a rectangle list. If the list is full, all rectangles are merged into their bounding box.
+ * @param list     The rectangle list
+ * @param count    Number of rectangles in the list, updated
+ * @param max      Capacity of the list
+ * @param r        The rectangle to add, clipped to the screen
+ */
+static void rect_list_add(gui_rect_t *list, int *count, int max, gui_rect_t r) {
+    int i;
+
+    if (r.x1 < 0) r.x1 = 0;
+    if (r.y1 < 0) r.y1 = 0;
+    if (r.x2 > VGA_WIDTH) r.x2 = VGA_WIDTH;
+    if (r.y2 > VGA_HEIGHT) r.y2 = VGA_HEIGHT;
+    if (r.x1 >= r.x2 || r.y1 >= r.y2) return;
+
+    for (i = 0; i < *count; i++) {
+        if (list[i].x1 <= r.x1 && list[i].y1 <= r.y1 && list[i].x2 >= r.x2 && list[i].y2 >= r.y2) return;
+    }
+
+    if (*count == max) {
+        for (i = 0; i < *count; i++) {
+            if (list[i].x1 < r.x1) r.x1 = list[i].x1;
+            if (list[i].y1 < r.y1) r.y1 = list[i].y1;
+            if (list[i].x2 > r.x2) r.x2 = list[i].x2;
+            if (list[i].y2 > r.y2) r.y2 = list[i].y2;
+        }
+        *count = 0;
+    }
+
+    list[(*count)++] = r;
+}
+
+static inline gui_rect_t make_rect(int x, int y, int width, int height) {
+    gui_rect_t r = {x, y, x + width, y + height};
+    return r;
+}
+
+static inline int rect_intersect(const gui_rect_t *a, const gui_rect_t *b) {
+    return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/**
+ * Get the whole area of a window, including borders
+ * @param win    The window
+ * @return Rectangle of the window
+ */
+static inline gui_rect_t window_rect(const gui_window_t *win) {
+    return make_rect(win->term_x - GUI_WIN_LEFT_RIGHT_MARGIN, win->term_y - GUI_WIN_TITLE_BAR_HEIGHT,
+                     TERMINAL_WIDTH_PIXEL + GUI_WIN_LEFT_RIGHT_MARGIN * 2,
+                     GUI_WIN_TITLE_BAR_HEIGHT + TERMINAL_HEIGHT_PIXEL + GUI_WIN_DOWN_MARGIN);
+}
+
+#define ceil_div(x, y)     (((x) + (y) - 1) / (y))
+#define floor_div(x, y)    ((x) / (y))
 
 static void inline draw_object(gui_object_t *obj, int x, int y) {
-    y += curr_y;  // double buffering
+    // Clip the object
+    int x1 = (x > clip.x1 ? x : clip.x1);
+    int y1 = (y > clip.y1 ? y : clip.y1);
+    int x2 = (x + (int) obj->width < clip.x2 ? x + (int) obj->width : clip.x2);
+    int y2 = (y + (int) obj->height < clip.y2 ? y + (int) obj->height : clip.y2);
+    if (x1 >= x2 || y1 >= y2) return;
+
+    if (obj->transparent_color) {
+        vga_set_transparent(ENABLE_TRANSPARENCY_COLOR, color_convert(obj->transparent_color));
+    } else {
+        vga_set_transparent(DISABLE_TRANSPARENCY_COLOR, 0);
+    }
     if (obj->canvas == NULL) {
-        if (obj->transparent_color) {
-            vga_set_transparent(ENABLE_TRANSPARENCY_COLOR, color_convert(obj->transparent_color));
-        } else {
-            vga_set_transparent(DISABLE_TRANSPARENCY_COLOR, 0);
-        }
-        vga_screen_copy(obj->x, obj->y, x, y, obj->width, obj->height);
+        vga_screen_copy(obj->x + (x1 - x), obj->y + (y1 - y), x1, y1 + curr_y /* double buffering */,
+                        x2 - x1, y2 - y1);
     } else {
-        DEBUG_ERR("draw_object(): system-to-screen BitBLT is still broken.");
-//        vga_buf_copy((unsigned int *) obj->canvas, x, y, obj->width, obj->height);
+        // Canvas has the same layout as the screen
+#if GUI_CANVAS_BITBLT
+        vga_buf_copy(obj->canvas + (obj->y + (y1 - y)) * VGA_BYTES_PER_LINE + (obj->x + (x1 - x)) * VGA_BYTES_PER_PIXEL,
+                     VGA_BYTES_PER_LINE, x1, y1 + curr_y /* double buffering */, x2 - x1, y2 - y1);
+#else
+        // Transparency is not applied, which only the blitter does. The only canvas object (desktop) is opaque
+        int line;
+        vga_accel_sync();  // blits queued for earlier rectangles may overlap
+        for (line = y1; line < y2; line++) {
+            // A line never crosses 64K pages, in case there is no linear framebuffer
+            memcpy(vga_vram((line + curr_y /* double buffering */) * VGA_BYTES_PER_LINE + x1 * VGA_BYTES_PER_PIXEL),
+                   obj->canvas + (obj->y + (line - y)) * VGA_BYTES_PER_LINE + (obj->x + (x1 - x)) * VGA_BYTES_PER_PIXEL,
+                   (x2 - x1) * VGA_BYTES_PER_PIXEL);
+        }
+#endif
     }
 }
 
-static void inline print_char(char ch, int x, int y) {
-    gui_object_t c = gui_get_obj_font(ch);
-    draw_object(&c, x, y);
+static unsigned char text_stage[TERMINAL_TEXT_COLS * TERMINAL_HEIGHT_PIXEL];  // glyph bits before going to VRAM
+
+/**
+ * Draw a block of characters with one color-expand BitBLT, clipped by the clipping rectangle
+ * @param buf      Characters, row by row
+ * @param pitch    Characters between two rows in buf
+ * @param cols     Number of columns to draw
+ * @param rows     Number of rows to draw
+ * @param x        X coordinate of the first character
+ * @param y        Y coordinate of the first character
+ * @param fg       RGB color of characters
+ * @param bg       RGB color of background
+ * @note Glyph rows are one byte each, so the bitmap of a block is gathered from font_data by CPU, copied to the
+ *       staging area in video memory, and expanded to the screen in a single operation
+ */
+static void draw_text(const char *buf, int pitch, int cols, int rows, int x, int y, vga_rgb fg, vga_rgb bg) {
+    // Clip the block
+    int x1 = (x > clip.x1 ? x : clip.x1);
+    int y1 = (y > clip.y1 ? y : clip.y1);
+    int x2 = (x + cols * FONT_WIDTH < clip.x2 ? x + cols * FONT_WIDTH : clip.x2);
+    int y2 = (y + rows * FONT_HEIGHT < clip.y2 ? y + rows * FONT_HEIGHT : clip.y2);
+    if (x1 >= x2 || y1 >= y2) return;
+
+    // Columns of characters that are (partially) visible, and scanlines of the block
+    int col_start = (x1 - x) / FONT_WIDTH;
+    int col_end = ceil_div(x2 - x, FONT_WIDTH);
+    int line;
+    int col;
+    const char *row;
+    unsigned char *p = text_stage;
+
+    if ((col_end - col_start) * (y2 - y1) > sizeof(text_stage)) {
+        DEBUG_ERR("draw_text(): block is too large to stage.");
+        return;
+    }
+
+    for (line = y1 - y; line < y2 - y; line++) {
+        row = buf + (line / FONT_HEIGHT) * pitch;
+        for (col = col_start; col < col_end; col++) {
+            *p++ = font_data[(unsigned char) row[col]][line % FONT_HEIGHT];
+        }
+    }
+
+    vga_accel_sync();  // the previous block may still be read by the blitter
+    memcpy(vga_vram(GUI_TEXT_STAGE_ADDR), text_stage, p - text_stage);
+
+    // The part of the first column on the left of the clipping rectangle is skipped by the blitter
+    vga_mono_expand(GUI_TEXT_STAGE_ADDR, (x1 - x) % FONT_WIDTH,
+                    x + col_start * FONT_WIDTH, y1 + curr_y /* double buffering */,
+                    x2 - (x + col_start * FONT_WIDTH), y2 - y1, color_convert(fg), color_convert(bg));
 }
 
 static void render_desktop() {
-//    draw_object(&gui_obj_desktop, 0, 0);
-    int page;
-    for (page = 0; page < VGA_SCREEN_BYTES / VGA_PAGE_SIZE; page++) {
-        vga_set_page(page + curr_y / 32);
-        memcpy((void *) VIDEO, gui_obj_desktop.canvas + page * VGA_PAGE_SIZE, VGA_PAGE_SIZE);
-    }
+    draw_object(&gui_obj_desktop, 0, 0);
 }
 
 /**
@@ -110,135 +270,338 @@ static void draw_window_border(int terminal_x, int terminal_y, int r, int y, int
 #endif
 }
 
-static inline void draw_terminal_content(const char *buf, int buf_start_x, int buf_start_y, int buf_cols, int buf_rows,
-                                  int term_x, int term_y) {
-    int x, y;
-    for (y = 0; y < buf_rows; y++) {
-        for (x = 0; x < buf_cols; x++) {
-            print_char(buf[(y + buf_start_y) * TERMINAL_TEXT_COLS + (x + buf_start_x)],
-                       x * FONT_WIDTH + term_x, y * FONT_HEIGHT + term_y);
+static inline void draw_terminal_content(const gui_window_t *win) {
+    draw_text(win->screen_char, TERMINAL_TEXT_COLS, TERMINAL_TEXT_COLS, TERMINAL_TEXT_ROWS, win->term_x, win->term_y,
+              GUI_FONT_FORECOLOR_ARGB, GUI_FONT_BACKCOLOR_ARGB);
+}
+
+/**
+ * Draw windows inside the clipping rectangle
+ */
+static void render_windows() {
+    gui_window_t *win;
+    gui_rect_t win_rect;
+    gui_rect_t frame_clip = clip;
+    gui_rect_t *r;
+    int i, j;
+
+    // Draw windows from bottom to top. Only the visible part of window body is drawn, but borders are drawn fully so
+    // that windows above can cover them.
+    for (i = GUI_MAX_WINDOW_NUM - 1; i >= 0; i--) {
+        win = frame_stack[i];
+        if (win == NULL) continue;
+        win_rect = window_rect(win);
+        if (!rect_intersect(&win_rect, &frame_clip)) continue;
+        for (j = (i == 0 ? 0 : frame_visible_end[i - 1]); j < frame_visible_end[i]; j++) {
+            r = &frame_visible[j];
+            if (!rect_intersect(r, &frame_clip)) continue;
+            clip.x1 = (r->x1 > frame_clip.x1 ? r->x1 : frame_clip.x1);
+            clip.y1 = (r->y1 > frame_clip.y1 ? r->y1 : frame_clip.y1);
+            clip.x2 = (r->x2 < frame_clip.x2 ? r->x2 : frame_clip.x2);
+            clip.y2 = (r->y2 < frame_clip.y2 ? r->y2 : frame_clip.y2);
+            draw_terminal_content(win);
         }
+        clip = frame_clip;
+        draw_window_border(win->term_x, win->term_y, (i == 0 ? 0 : -1), -1, -1);  // only the top window is active
     }
 }
 
+static void render_clock() {
+    int hour = drawn_clock / 3600;
+    int minute = drawn_clock / 60 % 60;
+    int second = drawn_clock % 60;
+    char str[8] = {'0' + (hour / 10), '0' + (hour % 10), ':', '0' + (minute / 10), '0' + (minute % 10), ':',
+                   '0' + (second / 10), '0' + (second % 10)};
+    draw_text(str, sizeof(str), sizeof(str), 1, CLOCK_START_X, CLOCK_START_Y,
+              GUI_FONT_FORECOLOR_ARGB, GUI_FONT_BACKCOLOR_ARGB);
+}
+
+static void render_term_button() {
+    draw_object(&gui_obj_terminal[drawn_term_button], TERMINAL_B_X, TERMINAL_B_Y);
+}
+
 /**
- * Find the window that has (part of) its body (terminal) visible on the given point
- * @param x
- * @param y
- * @return
+ * Copy changed text rows of a window to its snapshot
+ * @param win     The window
+ * @param rows    Changed rows, see SCREEN_ROW()
+ * @return The snapshot of text of the window
+ * @note A window without a slot yet gets a free one (there are as many as windows) and is copied in full
+ * @note Use this function in a lock
  */
-static inline gui_window_t *find_visible_win_on(int x, int y) {
-    // From top to bottom
-    int i;
-    for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) {
-        if (check_inside_window(x, y, window_stack[i]) == IN_BODY) return window_stack[i];
+static char *snapshot_text_unsafe(const gui_window_t *win, uint32_t rows) {
+    int slot;
+    int free_slot = -1;
+    int row;
+
+    for (slot = 0; slot < GUI_MAX_WINDOW_NUM; slot++) {
+        if (text_owner[slot] == win) break;
+        if (text_owner[slot] == NULL && free_slot == -1) free_slot = slot;
+    }
+    if (slot == GUI_MAX_WINDOW_NUM) {
+        slot = free_slot;
+        text_owner[slot] = win;
+        text_source[slot] = NULL;
+    }
+    if (text_source[slot] != win->screen_char) {
+        text_source[slot] = win->screen_char;
+        rows = SCREEN_ALL_ROWS;
     }
-    return NULL;
-}
 
-#define ceil_div(x, y)     (((x) + (y) - 1) / (y))
-#define floor_div(x, y)    ((x) / (y))
+    if (rows == SCREEN_ALL_ROWS) {
+        memcpy(frame_text[slot], win->screen_char, sizeof(frame_text[slot]));
+    } else {
+        for (row = 0; rows >> row; row++) {
+            if (rows & SCREEN_ROW(row)) {
+                memcpy(&frame_text[slot][row * TERMINAL_TEXT_COLS], &win->screen_char[row * TERMINAL_TEXT_COLS],
+                       TERMINAL_TEXT_COLS);
+            }
+        }
+    }
+    return frame_text[slot];
+}
 
-static void render_windows() {
+/**
+ * Take a snapshot of windows and their text, and collect damage of this frame: reported damage, changed rows of
+ * terminals, clock and terminal button
+ * @note Use this function in a lock
+ */
+static void collect_damage_unsafe() {
+    int i, j;
+    int row, row_end;
+    uint32_t rows;
     gui_window_t *win;
+    int clock;
 
-    // Generate grids
-    grid_count = 1;
-    grid_x[0] = 0;
-    grid_y[0] = 0;
-    grid_x[1] = VGA_WIDTH;
-    grid_y[1] = VGA_HEIGHT;
-    int i;
+    // Snapshot windows, since they may change while the frame is rendered with interrupts on
     for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) {
-        win = window_stack[i];
-        if (win != NULL) {
-            grid_x[grid_count + 1] = win->term_x;
-            grid_y[grid_count + 1] = win->term_y;
-            grid_x[grid_count + 2] = win->term_x + TERMINAL_WIDTH_PIXEL;
-            grid_y[grid_count + 2] = win->term_y + TERMINAL_HEIGHT_PIXEL;
-            grid_count += 2;
+        if (window_stack[i] == NULL) {
+            frame_stack[i] = NULL;
+        } else {
+            frame_windows[i] = *window_stack[i];
+            frame_stack[i] = &frame_windows[i];
         }
     }
-    quick_sort(grid_x, 0, grid_count);
-    quick_sort(grid_y, 0, grid_count);
-
-    // Fill grids
-    int idx, idy;
-    for (idx = 0; idx < grid_count; idx++) {
-        for (idy = 0; idy < grid_count; idy++) {
-            win = find_visible_win_on(grid_x[idx], grid_y[idy]);
-            grid[idx][idy] = win;
-            if (win != NULL) {
-                int buf_start_x = (grid_x[idx] - win->term_x) / FONT_WIDTH;
-                int buf_cols = ceil_div(grid_x[idx + 1] - grid_x[idx],  FONT_WIDTH);
-                int buf_start_y = (grid_y[idy] - win->term_y) / FONT_HEIGHT;
-                int buf_rows = ceil_div(grid_y[idy + 1] - grid_y[idy], FONT_HEIGHT);
-                draw_terminal_content((const char *) win->screen_char, buf_start_x, buf_start_y,
-                                      buf_cols, buf_rows,
-                                      win->term_x + buf_start_x * FONT_WIDTH,
-                                      win->term_y + buf_start_y * FONT_HEIGHT);
-            }
-        }
+    if (frame_layout_version != window_layout_version) {
+        frame_layout_version = window_layout_version;
+        memcpy(frame_visible_end, window_visible_end, sizeof(frame_visible_end));
+        memcpy(frame_visible, window_visible, window_visible_end[GUI_MAX_WINDOW_NUM - 1] * sizeof(gui_rect_t));
+    }
+
+    frame_damage_count = 0;
+    for (i = 0; i < damage_count; i++) {
+        rect_list_add(frame_damage, &frame_damage_count, GUI_DAMAGE_MAX, damage[i]);
     }
+    damage_count = 0;
 
-    // Draw the inactive window, from bottom to top, except the top window
-    for (i = GUI_MAX_WINDOW_NUM - 1; i >= 1; i--) {
-        win = window_stack[i];
-        if (win != NULL) {
-            for (idx = 0; idx < grid_count; idx++) {
-                for (idy = 0; idy < grid_count; idy++) {
-                    if (grid[idx][idy] == win) {
-                        int buf_start_x = (grid_x[idx] - win->term_x) / FONT_WIDTH;
-                        int buf_cols = ceil_div(grid_x[idx + 1] - grid_x[idx],  FONT_WIDTH);
-                        int buf_start_y = (grid_y[idy] - win->term_y) / FONT_HEIGHT;
-                        int buf_rows = ceil_div(grid_y[idy + 1] - grid_y[idy], FONT_HEIGHT);
-                        draw_terminal_content((const char *) win->screen_char, buf_start_x, buf_start_y,
-                                              buf_cols, buf_rows,
-                                              win->term_x + buf_start_x * FONT_WIDTH,
-                                              win->term_y + buf_start_y * FONT_HEIGHT);
-                    }
-                }
+    // Release text snapshots of windows that are gone
+    for (j = 0; j < GUI_MAX_WINDOW_NUM; j++) {
+        if (text_owner[j] == NULL) continue;
+        for (i = 0; i < GUI_MAX_WINDOW_NUM && window_stack[i] != text_owner[j]; i++);
+        if (i == GUI_MAX_WINDOW_NUM) text_owner[j] = NULL;
+    }
+
+    // Changed text rows, merged into runs of adjacent rows. The frame draws from the text snapshot
+    for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) {
+        win = frame_stack[i];
+        if (win == NULL) continue;
+        rows = terminal_fetch_dirty_rows(win->terminal_id);
+        win->screen_char = snapshot_text_unsafe(window_stack[i], rows);
+        row = 0;
+        while (rows >> row) {
+            if ((rows & SCREEN_ROW(row)) == 0) {
+                row++;
+                continue;
             }
-            draw_window_border(win->term_x, win->term_y, -1, -1, -1);
+            for (row_end = row; row_end < TERMINAL_TEXT_ROWS && (rows & SCREEN_ROW(row_end)); row_end++);
+            rect_list_add(frame_damage, &frame_damage_count, GUI_DAMAGE_MAX,
+                          make_rect(win->term_x, win->term_y + row * FONT_HEIGHT,
+                                    TERMINAL_WIDTH_PIXEL, (row_end - row) * FONT_HEIGHT));
+            row = row_end;
         }
     }
 
-    // Draw the top window, which can't be covered by any window
-    if (window_stack[0] != NULL) {
-        win = window_stack[0];
-        draw_terminal_content((const char *) win->screen_char, 0, 0,
-                              TERMINAL_TEXT_COLS, TERMINAL_TEXT_ROWS, win->term_x, win->term_y);
-        draw_window_border(win->term_x, win->term_y, 0, -1, -1);
+    clock = (rtc_hour * 60 + rtc_minute) * 60 + rtc_second;
+    if (clock != drawn_clock) {
+        drawn_clock = clock;
+        rect_list_add(frame_damage, &frame_damage_count, GUI_DAMAGE_MAX,
+                      make_rect(CLOCK_START_X, CLOCK_START_Y, FONT_WIDTH * 8, FONT_HEIGHT));
+    }
+
+    if (gui_term_button_pressed != drawn_term_button) {
+        drawn_term_button = gui_term_button_pressed;
+        rect_list_add(frame_damage, &frame_damage_count, GUI_DAMAGE_MAX,
+                      make_rect(TERMINAL_B_X, TERMINAL_B_Y, WIN_TERMINAL_B_WIDTH, WIN_TERMINAL_B_HEIGHT));
     }
 }
 
-static void render_clock() {
-    print_char('0' + (rtc_hour / 10), CLOCK_START_X, CLOCK_START_Y);
-    print_char('0' + (rtc_hour % 10), CLOCK_START_X + FONT_WIDTH, CLOCK_START_Y);
-    print_char(':', CLOCK_START_X + FONT_WIDTH * 2, CLOCK_START_Y);
-    print_char('0' + (rtc_minute / 10), CLOCK_START_X + FONT_WIDTH * 3, CLOCK_START_Y);
-    print_char('0' + (rtc_minute % 10), CLOCK_START_X + FONT_WIDTH * 4, CLOCK_START_Y);
-    print_char(':', CLOCK_START_X + FONT_WIDTH * 5, CLOCK_START_Y);
-    print_char('0' + (rtc_second / 10), CLOCK_START_X + FONT_WIDTH * 6, CLOCK_START_Y);
-    print_char('0' + (rtc_second % 10), CLOCK_START_X + FONT_WIDTH * 7, CLOCK_START_Y);
+/**
+ * Report a damaged area of the screen, which will be redrawn in next frame, and request a frame
+ * @param x         X coordinate of upper-left corner
+ * @param y         Y coordinate of upper-left corner
+ * @param width     Width of the area
+ * @param height    Height of the area
+ * @note Changes of terminal text, clock and terminal button are tracked by the renderer itself
+ */
+void gui_render_damage(int x, int y, int width, int height) {
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        rect_list_add(damage, &damage_count, GUI_DAMAGE_MAX, make_rect(x, y, width, height));
+    }
+    restore_flags(flags);
+    gui_render_request();
 }
 
-static void render_term_button() {
-    draw_object(&gui_obj_terminal[gui_term_button_pressed], TERMINAL_B_X, TERMINAL_B_Y);
+/**
+ * Report the whole area of a window (including borders) as damaged
+ * @param win    The window
+ */
+void gui_render_damage_window(const gui_window_t *win) {
+    gui_rect_t r = window_rect(win);
+    gui_render_damage(r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1);
+}
+
+/**
+ * Get statistics of rendering, and reset them
+ * @param stat    Output of statistics
+ */
+void gui_render_get_stat(gui_render_stat_t *stat) {
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        *stat = render_stat;
+        memset(&render_stat, 0, sizeof(render_stat));
+    }
+    restore_flags(flags);
+}
+
+/**
+ * Note a keypress that changed the screen, so that its latency until shown is measured
+ * @param irq_tsc    TSC at the start of the keyboard interrupt
+ * @note Only the oldest keypress not taken by a frame is measured, the ones after it are shown by the same frame
+ * @note Use this function in a lock
+ */
+void gui_render_input(uint32_t irq_tsc) {
+    if (!input_pending) {
+        input_pending = 1;
+        input_tsc = irq_tsc;
+    }
+}
+
+/**
+ * Get keypress latency samples recorded since last call, and reset them
+ * @param consumed    Output of cycles from keyboard interrupt to the frame taking its snapshot
+ * @param shown       Output of cycles from keyboard interrupt to the frame being switched to the screen
+ * @param max         Capacity of the outputs
+ * @return Number of samples
+ */
+int gui_render_get_input_latency(uint32_t *consumed, uint32_t *shown, int max) {
+    uint32_t flags;
+    int n;
+
+    cli_and_save(flags);
+    {
+        n = (input_sample_count < max ? input_sample_count : max);
+        memcpy(consumed, input_consumed, n * sizeof(uint32_t));
+        memcpy(shown, input_shown, n * sizeof(uint32_t));
+        input_sample_count = 0;
+    }
+    restore_flags(flags);
+
+    return n;
+}
+
+/**
+ * Request a new frame since something on screen has changed
+ * @note In tickless mode, frames are only rendered on request. Call it after writing to terminal buffers, changing
+ *       windows, etc. It's cheap to call it repeatedly.
+ */
+void gui_render_request() {
+    if (!gui_render_requested) {
+        gui_render_requested = 1;
+        sched_timer_update();  // frame deadline may be earlier than the armed PIT
+    }
+}
+
+/**
+ * Check whether a frame is requested
+ * @return 1 if GUI is ready and a frame is requested, 0 otherwise
+ */
+int gui_render_pending() {
+    return gui_inited && gui_render_requested;
 }
 
+/**
+ * Render a frame for damaged area
+ * @note Only short critical sections are placed in lock, while drawing is done with interrupts on. Changes made during
+ *       drawing are reported as damage and drawn in the next frame.
+ * @note Only the compositor task (or the PIT handler if the compositor is off) calls this function. If a frame is
+ *       still in progress when the other one calls it, such as right after gui_compositor_set_enabled(), the call
+ *       returns and the frame stays requested.
+ */
 void gui_render() {
 
     if (!gui_inited) return;
 
     uint32_t flags;
+    uint32_t start = rdtsc();
+    uint32_t cli_start;
+    uint32_t cli_cycles;
+    int i;
+    int new_damage_count;
+
     cli_and_save(flags);
     {
-        // Switch place to draw (double buffering)
-        curr_y = VGA_HEIGHT - curr_y;
+        if (render_busy) {
+            restore_flags(flags);
+            return;
+        }
+
+        cli_start = rdtsc();
+
+        gui_render_requested = 0;
 
-        // Open all buffer
-        terminal_vidmem_set(NULL_TERMINAL_ID);
+        collect_damage_unsafe();
+        if (frame_damage_count == 0) {
+            // Nothing changed, and the front buffer is up to date
+            render_stat.skipped++;
+            restore_flags(flags);
+            return;
+        }
+        render_busy = 1;
+
+        // The keypress is in the text snapshot just taken
+        if (input_pending) {
+            input_pending = 0;
+            frame_has_input = 1;
+            frame_input_tsc = input_tsc;
+            frame_input_consumed = rdtsc() - input_tsc;
+        }
+
+        cli_cycles = rdtsc() - cli_start;
+        render_stat.cli_cycles += cli_cycles;
+        if (cli_cycles > render_stat.max_cli_cycles) render_stat.max_cli_cycles = cli_cycles;
+    }
+    restore_flags(flags);
+
+    // Back buffer also lacks damage drawn to the front buffer in last frame. After this frame, the new back buffer
+    // lacks damage of this frame only.
+    new_damage_count = frame_damage_count;
+    for (i = 0; i < stale_damage_count; i++) {
+        rect_list_add(frame_damage, &frame_damage_count, GUI_DAMAGE_MAX * 2, stale_damage[i]);
+    }
+    memcpy(stale_damage, frame_damage, new_damage_count * sizeof(gui_rect_t));
+    stale_damage_count = new_damage_count;
+
+    // Switch place to draw (double buffering)
+    curr_y = VGA_HEIGHT - curr_y;
+
+    // Physical video memory is mapped for the compositor task, whose terminal is the null terminal. If rendering in
+    // PIT handler, open all buffer.
+    if (running_task() != compositor_task) terminal_vidmem_set(NULL_TERMINAL_ID);
+
+    for (i = 0; i < frame_damage_count; i++) {
+        clip = frame_damage[i];
 
         // Render desktop and status bar
         render_desktop();
@@ -251,16 +614,105 @@ void gui_render() {
 
         // Render Window
         render_windows();
+    }
 
-        // Wait for BitBLT engine to complete
-        vga_accel_sync();
+    // Wait for BitBLT engine to complete
+    vga_accel_sync();
+
+    cli_and_save(flags);
+    {
+        cli_start = rdtsc();
 
         // Switch view
         vga_set_start_addr(curr_y * VGA_BYTES_PER_LINE);
+        render_busy = 0;
+
+        if (frame_has_input) {
+            frame_has_input = 0;
+            // The new start address is latched by the card at next vertical retrace, which is not waited for
+            if (input_sample_count < GUI_INPUT_LATENCY_SAMPLES) {
+                input_consumed[input_sample_count] = frame_input_consumed;
+                input_shown[input_sample_count] = rdtsc() - frame_input_tsc;
+                input_sample_count++;
+            }
+        }
 
         // Restore terminal mapping
-        terminal_vidmem_set(running_term()->terminal_id);
+        if (running_task() != compositor_task) terminal_vidmem_set(running_term()->terminal_id);
+
+        cli_cycles = rdtsc() - cli_start;
+        render_stat.cli_cycles += cli_cycles;
+        if (cli_cycles > render_stat.max_cli_cycles) render_stat.max_cli_cycles = cli_cycles;
+
+        cli_cycles = rdtsc() - start;  // now the cycles of the whole frame
+        render_stat.frames++;
+        render_stat.rects += frame_damage_count;
+        render_stat.cycles += cli_cycles;
+        if (cli_cycles > render_stat.max_cycles) render_stat.max_cycles = cli_cycles;
+        if (running_task() != compositor_task) {  // in PIT handler, the whole frame is rendered with interrupts off
+            if (cli_cycles > render_stat.max_cli_cycles) render_stat.max_cli_cycles = cli_cycles;
+        }
     }
     restore_flags(flags);
 }
 
+/**
+ * Main function of compositor task. Render a frame each time it's woken up by gui_compositor_wake_unsafe(), with
+ * interrupts on.
+ * @usage Kernel task EIP, started by init_task_main()
+ */
+void gui_compositor_main() {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    {
+        compositor_task = running_task();
+    }
+    restore_flags(flags);
+
+    while (1) {
+        cli_and_save(flags);
+        {
+            while (!compositor_frame_due) {
+                compositor_waiting = 1;
+                sched_move_running_after_node_unsafe(&compositor_wait_list);
+                sched_launch_to_current_head();
+                // Return after this task is woken up
+            }
+            compositor_frame_due = 0;
+        }
+        restore_flags(flags);
+
+        gui_render();
+    }
+}
+
+/**
+ * Ask the compositor task to render a frame
+ * @return 0 on success, -1 if there is no compositor task or it's switched off, in which case the caller should render
+ *         by itself
+ * @note Use this function in a lock
+ */
+int gui_compositor_wake_unsafe() {
+    if (compositor_task == NULL || !compositor_enabled) return -1;
+    compositor_frame_due = 1;
+    if (compositor_waiting) {
+        compositor_waiting = 0;
+        sched_insert_to_head_unsafe(compositor_task);
+    }
+    return 0;
+}
+
+/**
+ * Switch between rendering frames in the compositor task and in the PIT handler
+ * @param enabled    1 to render in the compositor task, 0 to render in the PIT handler
+ */
+void gui_compositor_set_enabled(int enabled) {
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        compositor_enabled = enabled;
+    }
+    restore_flags(flags);
+    gui_render_request();
+}
@@ -9,7 +9,44 @@
 // which allow alpha blending, but it's proven to be too slow on QEMU
 #define GUI_WINDOW_PNG_RENDER    0
 
+#include "../types.h"
+#include "gui_window.h"
+
+// If enabled, canvas objects (the desktop) are drawn with system-to-screen BitBLT. Otherwise the CPU copies them line
+// by line to video memory, the path used before BitBLT was fixed, kept to fall back to if the blitter misbehaves
+#define GUI_CANVAS_BITBLT    1
+
+// If enabled, frames are rendered by a kernel task with interrupts on, rather than in PIT interrupt handler. This is
+// the setting at boot. It can be switched at run time by gui_compositor_set_enabled()
+#define GUI_COMPOSITOR_TASK    1
+
+#define GUI_DAMAGE_MAX    16  // max damaged rectangles tracked for a frame, more are merged into their bounding box
+
+#define GUI_INPUT_LATENCY_SAMPLES    64  // keypress latency samples kept until fetched, more are dropped
+
+typedef struct gui_render_stat_t gui_render_stat_t;
+struct gui_render_stat_t {
+    uint32_t frames;          // frames rendered
+    uint32_t skipped;         // frames requested but skipped since nothing is damaged
+    uint32_t rects;           // damaged rectangles drawn
+    uint32_t cycles;          // total TSC cycles spent in rendering
+    uint32_t max_cycles;      // max TSC cycles of a frame
+    uint32_t cli_cycles;      // total TSC cycles with interrupts off during rendering
+    uint32_t max_cli_cycles;  // max TSC cycles of a single period with interrupts off
+};
+
 void gui_render();
+void gui_render_request();
+int gui_render_pending();
+void gui_render_damage(int x, int y, int width, int height);
+void gui_render_damage_window(const gui_window_t *win);
+void gui_render_get_stat(gui_render_stat_t *stat);
+void gui_render_input(uint32_t irq_tsc);
+int gui_render_get_input_latency(uint32_t *consumed, uint32_t *shown, int max);
+
+void gui_compositor_main();
+int gui_compositor_wake_unsafe();
+void gui_compositor_set_enabled(int enabled);
 
 #define WIN_UP_BORDER_LEFT_MARGIN       6
 #define WIN_UP_BORDER_UP_MARGIN         21
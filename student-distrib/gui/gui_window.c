@@ -11,10 +11,19 @@
 #include "gui_render.h"
 #include "gui_objs.h"
 #include "../task/task.h"
+#include "qsort.h"
 
 gui_window_t *window_stack[GUI_MAX_WINDOW_NUM];
 static int mouse_pressed_on_title = 0;
 
+// Occlusion map, only updated when windows are created, destroyed, activated or moved
+gui_rect_t window_visible[GUI_WIN_VISIBLE_MAX];
+int window_visible_end[GUI_MAX_WINDOW_NUM];
+uint32_t window_layout_version = 0;
+static int grid_x[GUI_MAX_WINDOW_NUM * 2 + 2];  // grid lines, sorted and unique
+static int grid_y[GUI_MAX_WINDOW_NUM * 2 + 2];
+static signed char grid_owner[GUI_MAX_WINDOW_NUM * 2 + 1][GUI_MAX_WINDOW_NUM * 2 + 1];  // [y index][x index]
+
 /**
  * Initialize GUI window control
  */
@@ -38,6 +47,107 @@ static int find_window_idx(const gui_window_t *win) {
     return -1;
 }
 
+/**
+ * Sort grid lines and remove duplicates
+ * @param lines    Grid lines
+ * @param n        Number of grid lines
+ * @return Number of unique grid lines
+ */
+static int unique_grid_lines(int *lines, int n) {
+    int i, m = 1;
+    quick_sort(lines, 0, n - 1);
+    for (i = 1; i < n; i++) {
+        if (lines[i] != lines[m - 1]) lines[m++] = lines[i];
+    }
+    return m;
+}
+
+/**
+ * Find the index of a grid line
+ * @param lines    Sorted unique grid lines
+ * @param n        Number of grid lines
+ * @param v        Coordinate of the grid line, which must exist
+ * @return Index of the grid line
+ */
+static int find_grid_line(const int *lines, int n, int v) {
+    int low = 0, high = n - 1, mid;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (lines[mid] < v) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static inline int clamp(int v, int low, int high) {
+    return (v < low ? low : (v > high ? high : v));
+}
+
+/**
+ * Recompute visible parts of window bodies. Edges of window bodies divide the screen into grid cells, whose owners are
+ * painted from the bottom window to the top one. Then cells of the same window in a row are merged into rectangles.
+ * @note Use this function in a lock, together with the change of windows
+ */
+static void update_visible_unsafe() {
+    int nx = 0, ny = 0;
+    int i, ix, iy, ix_end, iy_end;
+    int next[GUI_MAX_WINDOW_NUM];  // next free slot in window_visible for each window
+    gui_window_t *win;
+
+    grid_x[nx++] = 0;
+    grid_x[nx++] = VGA_WIDTH;
+    grid_y[ny++] = 0;
+    grid_y[ny++] = VGA_HEIGHT;
+    for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) {
+        if ((win = window_stack[i]) == NULL) continue;
+        grid_x[nx++] = clamp(win->term_x, 0, VGA_WIDTH);
+        grid_x[nx++] = clamp(win->term_x + TERMINAL_WIDTH_PIXEL, 0, VGA_WIDTH);
+        grid_y[ny++] = clamp(win->term_y, 0, VGA_HEIGHT);
+        grid_y[ny++] = clamp(win->term_y + TERMINAL_HEIGHT_PIXEL, 0, VGA_HEIGHT);
+    }
+    nx = unique_grid_lines(grid_x, nx);
+    ny = unique_grid_lines(grid_y, ny);
+
+    // Paint owners of cells, from bottom to top
+    for (iy = 0; iy < ny - 1; iy++) {
+        for (ix = 0; ix < nx - 1; ix++) grid_owner[iy][ix] = -1;
+    }
+    for (i = GUI_MAX_WINDOW_NUM - 1; i >= 0; i--) {
+        if ((win = window_stack[i]) == NULL) continue;
+        ix_end = find_grid_line(grid_x, nx, clamp(win->term_x + TERMINAL_WIDTH_PIXEL, 0, VGA_WIDTH));
+        iy_end = find_grid_line(grid_y, ny, clamp(win->term_y + TERMINAL_HEIGHT_PIXEL, 0, VGA_HEIGHT));
+        for (iy = find_grid_line(grid_y, ny, clamp(win->term_y, 0, VGA_HEIGHT)); iy < iy_end; iy++) {
+            for (ix = find_grid_line(grid_x, nx, clamp(win->term_x, 0, VGA_WIDTH)); ix < ix_end; ix++) {
+                grid_owner[iy][ix] = (signed char) i;
+            }
+        }
+    }
+
+    // Count runs of each window to group them, then fill them in
+    for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) next[i] = 0;
+    for (iy = 0; iy < ny - 1; iy++) {
+        for (ix = 0; ix < nx - 1; ix++) {
+            if (grid_owner[iy][ix] >= 0 && (ix == 0 || grid_owner[iy][ix - 1] != grid_owner[iy][ix])) {
+                next[(int) grid_owner[iy][ix]]++;
+            }
+        }
+    }
+    for (i = 0; i < GUI_MAX_WINDOW_NUM; i++) {
+        window_visible_end[i] = (i == 0 ? 0 : window_visible_end[i - 1]) + next[i];
+        next[i] = window_visible_end[i] - next[i];
+    }
+    for (iy = 0; iy < ny - 1; iy++) {
+        for (ix = 0; ix < nx - 1; ix = ix_end) {
+            for (ix_end = ix + 1; ix_end < nx - 1 && grid_owner[iy][ix_end] == grid_owner[iy][ix]; ix_end++);
+            if (grid_owner[iy][ix] < 0) continue;
+            window_visible[next[(int) grid_owner[iy][ix]]++] =
+                    (gui_rect_t) {grid_x[ix], grid_y[iy], grid_x[ix_end], grid_y[iy + 1]};
+        }
+    }
+
+    window_layout_version++;
+}
+
 /**
  * Initialize a new window
  * @param win           The window to be initialized
@@ -59,12 +169,19 @@ int gui_new_window(gui_window_t *win, char *screen_buf, int terminal_id) {
         return -1;
     }
 
-    win->term_x = GUI_WIN_INITIAL_TERM_X + GUI_WIN_INITIAL_OFFSET_X * idx;
-    win->term_y = GUI_WIN_INITIAL_TERM_Y + GUI_WIN_INITIAL_OFFSET_Y * idx;
-    win->screen_char = screen_buf;
-    win->terminal_id = terminal_id;
-
-    window_stack[idx] = win;
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        win->term_x = GUI_WIN_INITIAL_TERM_X + GUI_WIN_INITIAL_OFFSET_X * idx;
+        win->term_y = GUI_WIN_INITIAL_TERM_Y + GUI_WIN_INITIAL_OFFSET_Y * idx;
+        win->screen_char = screen_buf;
+        win->terminal_id = terminal_id;
+
+        window_stack[idx] = win;
+        update_visible_unsafe();
+        gui_render_damage_window(win);
+    }
+    restore_flags(flags);
 
     return 0;
 }
@@ -87,12 +204,26 @@ int gui_activate_window(gui_window_t *win) {
     DEBUG_PRINT("GUI window %d gets activated", idx);
 #endif
 
-    // Put the window to the top of the stack
-    int i;
-    for (i = idx; i >= 1; i--) {
-        window_stack[i] = window_stack[i - 1];
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        // Title bar of the old top window turns inactive, and the new top window becomes fully visible
+        if (window_stack[0] != NULL) {
+            gui_render_damage(window_stack[0]->term_x - GUI_WIN_LEFT_RIGHT_MARGIN,
+                              window_stack[0]->term_y - GUI_WIN_TITLE_BAR_HEIGHT,
+                              TERMINAL_WIDTH_PIXEL + GUI_WIN_LEFT_RIGHT_MARGIN * 2, GUI_WIN_TITLE_BAR_HEIGHT);
+        }
+        gui_render_damage_window(win);
+
+        // Put the window to the top of the stack
+        int i;
+        for (i = idx; i >= 1; i--) {
+            window_stack[i] = window_stack[i - 1];
+        }
+        window_stack[0] = win;
+        update_visible_unsafe();
     }
-    window_stack[0] = win;
+    restore_flags(flags);
 
     task_change_focus(win->terminal_id);
 
@@ -111,12 +242,19 @@ int gui_destroy_window(gui_window_t *win) {
         return -1;
     }
 
-    // Move all windows forward
-    int i;
-    for (i = idx; i < GUI_MAX_WINDOW_NUM - 1; i++) {
-        window_stack[i] = window_stack[i + 1];
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        // Move all windows forward
+        int i;
+        for (i = idx; i < GUI_MAX_WINDOW_NUM - 1; i++) {
+            window_stack[i] = window_stack[i + 1];
+        }
+        window_stack[GUI_MAX_WINDOW_NUM - 1] = NULL;
+        update_visible_unsafe();
+        gui_render_damage_window(win);
     }
-    window_stack[GUI_MAX_WINDOW_NUM - 1] = NULL;
+    restore_flags(flags);
 
     return 0;
 }
@@ -231,6 +369,35 @@ int is_valid_position(int term_x, int term_y) {
     return 1;
 }
 
+/**
+ * Move a window
+ * @param win        The window to be moved
+ * @param delta_x    Movement in x
+ * @param delta_y    Movement in y
+ * @return 0 on success, -1 if the window doesn't exist or the new position is out of screen
+ */
+int gui_move_window(gui_window_t *win, int delta_x, int delta_y) {
+    if (find_window_idx(win) == -1) {
+        DEBUG_ERR("gui_move_window(): no such window");
+        return -1;
+    }
+
+    if (!is_valid_position(win->term_x + delta_x, win->term_y + delta_y)) return -1;
+
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        gui_render_damage_window(win);  // old position
+        win->term_x += delta_x;
+        win->term_y += delta_y;
+        update_visible_unsafe();
+        gui_render_damage_window(win);  // new position
+    }
+    restore_flags(flags);
+
+    return 0;
+}
+
 /**
  * Handle mouse move event
  * @param delta_x
@@ -247,10 +414,5 @@ int gui_handle_mouse_move(int delta_x, int delta_y) {
         return 0;
     }
 
-    if (is_valid_position(win->term_x + delta_x, win->term_y + delta_y)) {
-        win->term_x += delta_x;
-        win->term_y += delta_y;
-        return 0;
-    }
-    return -1;
+    return gui_move_window(win, delta_x, delta_y);
 }
@@ -9,8 +9,16 @@
 #ifndef _GUI_WINDOW_H
 #define _GUI_WINDOW_H
 
+#include "../types.h"
+
 #define GUI_WIN_ENABLE_LOG    0
 
+typedef struct gui_rect_t gui_rect_t;
+struct gui_rect_t {
+    int x1, y1;  // inclusive
+    int x2, y2;  // exclusive
+};
+
 // Data structure of a window
 typedef struct gui_window_t gui_window_t;
 struct gui_window_t {
@@ -20,7 +28,13 @@ struct gui_window_t {
     int terminal_id;    // ID of terminal
 };
 
-#define GUI_MAX_WINDOW_NUM    5
+// Max windows in the window stack, no more than 127 (see grid_owner in gui_window.c). Each terminal takes one, and the
+// rest are left for gui_window_bench() to stress the window manager. Work per frame or layout change scales with
+// windows present, not with this limit
+#define GUI_MAX_WINDOW_NUM    32
+
+// Window bodies divide the screen into at most (2N + 1) * (2N + 1) cells, each showing at most one body
+#define GUI_WIN_VISIBLE_MAX    ((GUI_MAX_WINDOW_NUM * 2 + 1) * (GUI_MAX_WINDOW_NUM * 2 + 1))
 
 #define GUI_WIN_INITIAL_TERM_X  50
 #define GUI_WIN_INITIAL_TERM_Y  50
@@ -33,11 +47,17 @@ struct gui_window_t {
 
 extern gui_window_t* window_stack[GUI_MAX_WINDOW_NUM];  // index 0 is on the top
 
+// Visible parts of window bodies, grouped by window in the order of window_stack
+extern gui_rect_t window_visible[GUI_WIN_VISIBLE_MAX];
+extern int window_visible_end[GUI_MAX_WINDOW_NUM];  // rectangles of window_stack[i] end before window_visible_end[i]
+extern uint32_t window_layout_version;  // incremented every time window_visible changes
+
 void gui_window_init();
 
 int gui_new_window(gui_window_t *win, char *screen_buf, int terminal_id);
 int gui_activate_window(gui_window_t* win);
 int gui_destroy_window(gui_window_t* win);
+int gui_move_window(gui_window_t* win, int delta_x, int delta_y);
 
 void gui_handle_mouse_press(int x, int y);
 int gui_handle_mouse_move(int delta_x, int delta_y);
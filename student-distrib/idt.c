@@ -10,9 +10,11 @@
 #include "file_system.h"
 #include "task/task.h"
 #include "task/task_paging.h"
+#include "task/task_sched.h"
 #include "vidmem.h"
 #include "signal.h"
 #include "beep.h"
+#include "fpu.h"
 
 /**
  * This function is used to initialize IDT table and called in kernel.c. Uses subroutine provided in x86_desc.h.
@@ -105,6 +107,12 @@ void idt_init() {
     SET_IDT_ENTRY(idt[IDT_ENTRY_MOUSE], interrupt_entry_12);
     idt[IDT_ENTRY_MOUSE].present = 1;
 
+    // Set ATA handlers (defined in idt_asm.S)
+    SET_IDT_ENTRY(idt[IDT_ENTRY_ATA_PRIMARY], interrupt_entry_14);
+    idt[IDT_ENTRY_ATA_PRIMARY].present = 1;
+    SET_IDT_ENTRY(idt[IDT_ENTRY_ATA_SECONDARY], interrupt_entry_15);
+    idt[IDT_ENTRY_ATA_SECONDARY].present = 1;
+
     // Set system calls handler (defined in idt_asm.S)
     SET_IDT_ENTRY(idt[IDT_ENTRY_SYSTEM_CALL], system_call_entry);
     idt[IDT_ENTRY_SYSTEM_CALL].dpl = 3;
@@ -118,12 +126,61 @@ void idt_send_eoi(uint32_t irq_num) {
     send_eoi(irq_num);
 }
 
+/**
+ * Set up MSRs for SYSENTER, if the CPU supports it. User programs check CPUID themselves to choose between SYSENTER
+ * and int $0x80, see syscalls/ece391syscall.S
+ * @note Must be called after fpu_init(), which reads CPUID
+ */
+void sysenter_init() {
+    if (!(cpu_features_edx & CPUID_FEAT_EDX_SEP)) {
+        DEBUG_WARN("sysenter_init(): SYSENTER is not supported, only int $0x80 is available");
+        return;
+    }
+    wrmsr(MSR_SYSENTER_CS, KERNEL_CS);  // SS = CS + 8, user CS = CS + 16, user SS = CS + 24, matching the GDT
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t) &tss.esp0);  // not used as a stack, sysenter_entry loads tss.esp0 instead
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
+/**
+ * Halt the running task that enters SYSENTER with EBP not pointing to the user stack, since there is nowhere to return
+ * @usage sysenter_entry in idt_asm.S
+ */
+asmlinkage void sysenter_invalid_stack() {
+    uint32_t flags;
+    DEBUG_WARN("SYSENTER with invalid user EBP, halt user program");
+    cli_and_save(flags);
+    {
+        system_halt(256);
+    }
+    restore_flags(flags);
+}
+
 /**
  * This function is used to print out the given interrupt number in the interrupt descriptor table.
  * @param vec_num    vector number of the interrupt/exception
  */
 void unified_exception_handler(hw_context_t hw_context) {
 
+    uint32_t fault_addr;
+    int fault_handled;
+
+    // FPU is switched lazily, see fpu.c
+    if (hw_context.irq_exp_num == IDT_ENTRY_DEVICE_NA) {
+        if (fpu_handle_nm() == 0) return;  // restart the instruction
+    }
+
+    // Page fault in the image area of running task may be resolved by loading the page in
+    if (hw_context.irq_exp_num == IDT_ENTRY_PAGE_FAULT) {
+        asm volatile ("movl %%cr2, %0" : "=r"(fault_addr));  // before interrupts are on, a nested fault changes CR2
+        // Loading may read the disk and sleep. Turn interrupts back on if the faulting code had them on, so that the
+        // handler runs like the system call that would read the page. A fault inside a lock keeps them off
+        if (hw_context.eflags & EFLAGS_IF) sti();
+        fault_handled = task_paging_handle_fault(fault_addr, hw_context.err_code);
+        cli();  // the exception return path expects interrupts off
+        if (fault_handled == 0) return;  // restart the instruction
+        DEBUG_WARN("Page fault at 0x%x, error code %u", fault_addr, hw_context.err_code);
+    }
+
     if (task_count == 0) {
         clear();
         reset_cursor();
@@ -303,3 +360,23 @@ asmlinkage int32_t lowlevel_sys_play_sound(uint32_t nFrequence){
 asmlinkage int32_t lowlevel_sys_nosound(){
     return system_nosound();
 }
+
+asmlinkage int32_t lowlevel_sys_nice(int32_t inc) {
+    return system_nice(inc);
+}
+
+asmlinkage int32_t lowlevel_sys_create(const uint8_t* filename) {
+    return system_create(filename);
+}
+
+asmlinkage int32_t lowlevel_sys_truncate(int32_t fd, int32_t length) {
+    return system_truncate(fd, length);
+}
+
+asmlinkage int32_t lowlevel_sys_mmap(int32_t fd, int32_t length, uint8_t **start) {
+    return system_mmap(fd, length, start);
+}
+
+asmlinkage int32_t lowlevel_sys_munmap(uint8_t *start) {
+    return system_munmap(start);
+}
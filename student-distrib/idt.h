@@ -4,7 +4,11 @@
 #ifndef _IDT_HANDLER_H
 #define _IDT_HANDLER_H
 
-#define SYSTEM_CALL_TABLE_SIZE   13
+#define SYSTEM_CALL_TABLE_SIZE   18
+
+// User EBP at SYSENTER, pointing to the return address, must lie in the user image (128MB - 132MB)
+#define SYSENTER_USER_START    0x08000000
+#define SYSENTER_USER_END      0x08400000
 
 #ifndef ASM
 
@@ -14,12 +18,22 @@
 #define EXCEPTION_HANDLING_TYPE    2  // 0 for simply loop, 1 for halting user program, 2 for sending signals
 
 #define IDT_ENTRY_INTEL            0x20  // number of vectors used by intel
+#define IDT_ENTRY_DEVICE_NA        0x07  // the vector number of device-not-available (#NM)
+#define IDT_ENTRY_PAGE_FAULT       0x0E  // the vector number of page fault
 #define IDT_ENTRY_PIT              0x20  // the vector number of PIT
 #define IDT_ENTRY_KEYBOARD         0x21  // the vector number of keyboard
 #define IDT_ENTRY_RTC              0x28  // the vector number of RTC
 #define IDT_ENTRY_MOUSE          0x2C  // the vector number of mouse
+#define IDT_ENTRY_ATA_PRIMARY      0x2E  // the vector number of primary ATA channel
+#define IDT_ENTRY_ATA_SECONDARY    0x2F  // the vector number of secondary ATA channel
 #define IDT_ENTRY_SYSTEM_CALL      0x80  // the vector number of system calls
 
+#define EFLAGS_IF                  0x200  // interrupt enable flag in EFLAGS
+
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
 typedef struct hw_context_t hw_context_t;
 struct hw_context_t {
     int32_t ebx;
@@ -71,11 +85,15 @@ extern void interrupt_entry_0();
 extern void interrupt_entry_1();
 extern void interrupt_entry_8();
 extern void interrupt_entry_12();
+extern void interrupt_entry_14();
+extern void interrupt_entry_15();
 
 // Defined in idt_asm.S
 extern void system_call_entry();
+extern void sysenter_entry();
 
 void idt_init();
+void sysenter_init();
 void idt_send_eoi(uint32_t irq_num);
 
 #endif // ASM
@@ -8,11 +8,14 @@
 #include "i8259.h"
 #include "tests.h"
 #include "idt.h"
+#include "fpu.h"
+#include "ata.h"
 #include "file_system.h"
 #include "rtc.h"
 #include "terminal.h"
 #include "task/task.h"
 #include "vidmem.h"
+#include "page_frame.h"
 #include "signal.h"
 #include "mouse.h"
 #include "vga/vga.h"
@@ -27,11 +30,35 @@
 
 extern void enable_paging();  // in boot.S
 
+#define CMDLINE_MAX_TASKS    "max_tasks="
+
+/**
+ * Find "max_tasks=N" in kernel command line
+ * @param cmdline    Kernel command line
+ * @return N, or 0 if not found
+ */
+static uint32_t parse_max_tasks(const int8_t *cmdline) {
+    uint32_t len = strlen(CMDLINE_MAX_TASKS);
+    uint32_t ret = 0;
+
+    for (; *cmdline != '\0'; cmdline++) {
+        if (strncmp(cmdline, CMDLINE_MAX_TASKS, len) == 0) {
+            for (cmdline += len; *cmdline >= '0' && *cmdline <= '9'; cmdline++) {
+                ret = ret * 10 + (*cmdline - '0');
+            }
+            return ret;
+        }
+    }
+    return 0;
+}
+
 /* Check if MAGIC is valid and print the Multiboot information structure
    pointed by ADDR. */
 void entry(unsigned long magic, unsigned long addr) {
 
     multiboot_info_t *mbi;
+    uint32_t max_tasks = 0;
+    uint32_t mods_end = 0;  // end of modules below the PKM arena, see task_init()
 
     /* Am I booted by a Multiboot-compliant boot loader? */
     if (magic != MULTIBOOT_BOOTLOADER_MAGIC) {
@@ -54,8 +81,10 @@ void entry(unsigned long magic, unsigned long addr) {
         printf("boot_device = 0x%#x\n", (unsigned) mbi->boot_device);
 
     /* Is the command line passed? */
-    if (CHECK_FLAG(mbi->flags, 2))
+    if (CHECK_FLAG(mbi->flags, 2)) {
         printf("cmdline = %s\n", (char *) mbi->cmdline);
+        max_tasks = parse_max_tasks((const int8_t *) mbi->cmdline);  // must read before paging
+    }
 
     if (CHECK_FLAG(mbi->flags, 3)) {
         int mod_count = 0;
@@ -64,6 +93,7 @@ void entry(unsigned long magic, unsigned long addr) {
         while (mod_count < mbi->mods_count) {
             printf("Module %d loaded at address: 0x%#x\n", mod_count, (unsigned int) mod->mod_start);
             printf("Module %d ends at address: 0x%#x\n", mod_count, (unsigned int) mod->mod_end);
+            if (mod->mod_start < PKM_STARTING_ADDR && mod->mod_end > mods_end) mods_end = mod->mod_end;
             printf("First few bytes of module:\n");
             for (i = 0; i < 16; i++) {
                 printf("0x%x ", *((char *) (mod->mod_start + i)));
@@ -154,6 +184,12 @@ void entry(unsigned long magic, unsigned long addr) {
     /* Setup IDT table */
     idt_init();
 
+    /* Enable the FPU and SIMD extensions, which memcpy() family uses for large copies */
+    fpu_init();
+
+    /* Enable SYSENTER as a faster alternative of int $0x80 for system calls */
+    sysenter_init();
+
     /* Init the PIT for scheduler */
     enable_irq(0);
 
@@ -166,13 +202,24 @@ void entry(unsigned long magic, unsigned long addr) {
     enable_irq(RTC_IRQ_NUM);  // enable IRQ after setting up RTC
     rtc_restart_interrupt();  // in case that an interrupt happens after rtc_init() and before enable_irq
 
-    /* Init the file system */
-    if (mbi->mods_count == 0) {
-        printf("WARNING: no file system loaded\n");
-    } else {
-        file_system_init((module_t *) mbi->mods_addr);
+    /* Init the disks. Before the scheduler starts, transfers are polled */
+    ata_init();
+    enable_irq(ATA_PRIMARY_IRQ);
+    enable_irq(ATA_SECONDARY_IRQ);
+
+    /* Init the file system, from a disk if there is one, otherwise from the module */
+    if (file_system_init_disk() == -1) {
+        if (mbi->mods_count == 0) {
+            printf("WARNING: no file system loaded\n");
+        } else {
+            file_system_init((module_t *) mbi->mods_addr);
+        }
     }
 
+    /* Init physical frames for user programs. Must before paging since multiboot info is in low memory */
+    page_frame_init(mbi);
+    printf("Page frames: %u free (%uKB)\n", page_frame_free_count(), page_frame_free_count() * (PAGE_FRAME_SIZE / 1024));
+
     /* Enable paging */
     enable_paging();
 
@@ -180,7 +227,9 @@ void entry(unsigned long magic, unsigned long addr) {
     vidmem_init();
 
     /* Init the process system */
-    task_init();
+    task_init(mods_end);
+    if (max_tasks != 0) task_set_max_count(max_tasks);
+    printf("Task limit: %u\n", task_max_count);
 
     /* Init signals */
     signal_init();
@@ -2,6 +2,8 @@
  * vim:ts=4 noexpandtab */
 
 #include "lib.h"
+#include "fpu.h"
+#include "gui/gui_render.h"
 
 /*
  * macro used to target a specific video plane or planes when writing
@@ -19,6 +21,7 @@ do {                                                                    \
 
 int screen_x;
 int screen_y;
+uint32_t screen_dirty_rows = SCREEN_ALL_ROWS;
 static char *video_mem = (char *) VIDEO;
 
 // Always keep the screen_char buffer its largest size (takes 2.4kB)
@@ -41,11 +44,13 @@ void reset_cursor() {
  * Function: Clears video memory */
 void clear(void) {
     int x, y;
+    gui_render_request();
     for (y = 0; y < TERMINAL_TEXT_ROWS; y++) {
         for (x = 0; x < TERMINAL_TEXT_COLS; x++) {
             screen_char[y * TERMINAL_TEXT_COLS + x] = ' ';
         }
     }
+    screen_dirty_rows = SCREEN_ALL_ROWS;
 }
 
 /* Standard printf().
@@ -188,12 +193,14 @@ int32_t puts(int8_t *s) {
  * Return Value: void
  *  Function: Output a character to the console */
 void putc(uint8_t c) {
+    gui_render_request();
     if (c == '\n' || c == '\r') {
         if (screen_x < TERMINAL_TEXT_COLS - 1) {
             int i;
             for (i = screen_x; i < TERMINAL_TEXT_COLS; i++) {
                 screen_char[screen_y * TERMINAL_TEXT_COLS + i] = 0;
             }
+            screen_dirty_rows |= SCREEN_ROW(screen_y);  // mark after writing, since the renderer may run in between
         }
         screen_x = 0;
         screen_y++;
@@ -215,12 +222,14 @@ void putc(uint8_t c) {
 
 
         screen_char[screen_y * TERMINAL_TEXT_COLS + screen_x] = 0;
+        screen_dirty_rows |= SCREEN_ROW(screen_y);
 
         // Don't increase screen_x since next time we need to start from the same location for a new character
     } else {
         // Normal cases for a character
 
         screen_char[screen_y * TERMINAL_TEXT_COLS + screen_x] = c;
+        screen_dirty_rows |= SCREEN_ROW(screen_y);
         screen_x++;
         if (TERMINAL_TEXT_COLS == screen_x) {
             // We need a new line
@@ -233,6 +242,99 @@ void putc(uint8_t c) {
     }
 }
 
+/**
+ * Output a buffer to the console. Equivalent to calling putc() on each character, but text is copied by spans and
+ * the screen is scrolled at most once for the whole buffer, instead of once per new line.
+ * @param buf    Characters to print
+ * @param n      Number of characters
+ * @note Lines that scroll off the screen within the same buffer are never written
+ * @note Backspace is rare in bulk output, so it's handed to putc() and splits the buffer into runs
+ */
+void putbuf(const uint8_t *buf, uint32_t n) {
+    uint32_t i = 0;
+    uint32_t end;  // end of current run, which contains no backspace
+    uint32_t k;
+    int x, y;
+    int first_row;  // row where the run starts
+    int lines;  // number of line advances in current run
+    int scroll;
+
+    if (n == 0) return;
+    gui_render_request();
+
+    while (i < n) {
+        if ('\b' == buf[i]) {
+            putc('\b');
+            i++;
+            continue;
+        }
+
+        // Pass 1: count line advances of the run, with the same wrapping rule as putc()
+        x = screen_x;
+        lines = 0;
+        for (end = i; end < n && buf[end] != '\b'; end++) {
+            if (buf[end] == '\n' || buf[end] == '\r' || ++x == TERMINAL_TEXT_COLS) {
+                x = 0;
+                lines++;
+            }
+        }
+
+        // Scroll once for all lines that go beyond the bottom. Rows end up above the screen (y < 0) are skipped.
+        scroll = screen_y + lines - (TERMINAL_TEXT_ROWS - 1);
+        if (scroll > 0) {
+            scroll_up_lines(scroll);
+        } else {
+            scroll = 0;
+        }
+        x = screen_x;
+        y = screen_y - scroll;
+        first_row = y;
+
+        // Pass 2: copy spans, each within a row and without new line
+        while (i < end) {
+            if (buf[i] == '\n' || buf[i] == '\r') {
+                if (y >= 0 && x < TERMINAL_TEXT_COLS - 1) {
+                    memset(&screen_char[y * TERMINAL_TEXT_COLS + x], 0, TERMINAL_TEXT_COLS - x);
+                }
+                x = 0;
+                y++;
+                i++;
+            } else {
+                for (k = i; k < end && k - i < TERMINAL_TEXT_COLS - x && buf[k] != '\n' && buf[k] != '\r'; k++);
+                if (y >= 0) memcpy(&screen_char[y * TERMINAL_TEXT_COLS + x], &buf[i], k - i);
+                x += k - i;
+                i = k;
+                if (TERMINAL_TEXT_COLS == x) {
+                    x = 0;
+                    y++;
+                }
+            }
+        }
+
+        // Mark after writing, since the renderer may run in between
+        if (scroll > 0) {
+            screen_dirty_rows = SCREEN_ALL_ROWS;
+        } else {
+            screen_dirty_rows |= ((SCREEN_ROW(lines) << 1) - 1) << first_row;  // rows from first_row to the last one
+        }
+
+        screen_x = x;
+        screen_y = y;
+    }
+}
+
+/**
+ * Move the screen n lines up and clear the bottom n lines
+ * @param n    Number of lines to scroll, can be larger than TERMINAL_TEXT_ROWS
+ * @note Cursor is not changed
+ */
+void scroll_up_lines(int n) {
+    if (n > TERMINAL_TEXT_ROWS) n = TERMINAL_TEXT_ROWS;
+    memmove(screen_char, screen_char + n * TERMINAL_TEXT_COLS, (TERMINAL_TEXT_ROWS - n) * TERMINAL_TEXT_COLS);
+    memset(screen_char + (TERMINAL_TEXT_ROWS - n) * TERMINAL_TEXT_COLS, 0, n * TERMINAL_TEXT_COLS);
+    screen_dirty_rows = SCREEN_ALL_ROWS;
+}
+
 /**
  * scroll_up
  * This function is called whenever the cursor moves to TERMINAL_TEXT_ROWS row (which should not happen).
@@ -240,18 +342,7 @@ void putc(uint8_t c) {
  * Side Effect: Discard the top most line of the screen.
  */
 void scroll_up() {
-    int x, y;
-    for (y = 1; y < TERMINAL_TEXT_ROWS; y++) {
-        for (x = 0; x < TERMINAL_TEXT_COLS; x++) {
-            screen_char[(y - 1) * TERMINAL_TEXT_COLS + x] = screen_char[y * TERMINAL_TEXT_COLS + x];
-        }
-    }
-
-    // Clean up the last line
-    y = TERMINAL_TEXT_ROWS - 1;
-    for (x = 0; x < TERMINAL_TEXT_COLS; x++) {
-        screen_char[y * TERMINAL_TEXT_COLS + x] = 0x0;
-    }
+    scroll_up_lines(1);
     // Reset the cursor to the column 0, row (TERMINAL_TEXT_ROWS - 1)
     screen_y = TERMINAL_TEXT_ROWS - 1;
     screen_x = 0;
@@ -325,14 +416,148 @@ uint32_t strlen(const int8_t *s) {
     return len;
 }
 
-/* void* memset(void* s, int32_t c, uint32_t n);
- * Inputs:    void* s = pointer to memory
- *          int32_t c = value to set memory to
- *         uint32_t n = number of bytes to set
- * Return Value: new string
- * Function: set n consecutive bytes of pointer s to value c */
-void *memset(void *s, int32_t c, uint32_t n) {
-    c &= 0xFF;
+#define MEM_SIMD_ALIGN    16  // alignment of destination for SIMD stores
+#define MEM_SIMD_BLOCK    64  // bytes moved per SIMD loop iteration
+#define MEM_SIMD_CHUNK    4096  // bytes moved with interrupts off at a time, a multiple of MEM_SIMD_BLOCK
+
+uint32_t mem_simd_level = MEM_SIMD_NONE;
+
+/*
+ * The kernel doesn't save SIMD state on task switches or interrupts. SIMD code saves the XMM registers it uses and
+ * restores them when done, and keeps interrupts off in between. Otherwise the PIT may switch to another task in the
+ * middle, whose own SIMD code would leave its data in the registers. Work is split into chunks of MEM_SIMD_CHUNK
+ * bytes to bound the time with interrupts off.
+ */
+#define XMM_SAVE_0_3(buf)                   \
+    asm volatile ("movups %%xmm0, (%0)\n\t"   \
+                  "movups %%xmm1, 16(%0)\n\t" \
+                  "movups %%xmm2, 32(%0)\n\t" \
+                  "movups %%xmm3, 48(%0)"     \
+                  : : "r"(buf) : "memory")
+
+#define XMM_RESTORE_0_3(buf)                \
+    asm volatile ("movups (%0), %%xmm0\n\t"   \
+                  "movups 16(%0), %%xmm1\n\t" \
+                  "movups 32(%0), %%xmm2\n\t" \
+                  "movups 48(%0), %%xmm3"     \
+                  : : "r"(buf) : "memory")
+
+/* Copy n bytes (a multiple of MEM_SIMD_BLOCK) from s to d with the given load/store instructions */
+#define SIMD_COPY_LOOP(load, store, prefetch, d, s, n)  \
+    asm volatile ("1:\n\t"                              \
+                  prefetch "\n\t"                       \
+                  load " (%1), %%xmm0\n\t"              \
+                  load " 16(%1), %%xmm1\n\t"            \
+                  load " 32(%1), %%xmm2\n\t"            \
+                  load " 48(%1), %%xmm3\n\t"            \
+                  store " %%xmm0, (%0)\n\t"             \
+                  store " %%xmm1, 16(%0)\n\t"           \
+                  store " %%xmm2, 32(%0)\n\t"           \
+                  store " %%xmm3, 48(%0)\n\t"           \
+                  "addl $64, %1\n\t"                    \
+                  "addl $64, %0\n\t"                    \
+                  "subl $64, %2\n\t"                    \
+                  "jnz 1b"                              \
+                  : "+r"(d), "+r"(s), "+r"(n)           \
+                  :                                     \
+                  : "memory", "cc")
+
+/* Fill n bytes (a multiple of MEM_SIMD_BLOCK) at d with XMM0 using the given store instruction */
+#define SIMD_FILL_LOOP(store, d, n)                     \
+    asm volatile ("1:\n\t"                              \
+                  store " %%xmm0, (%0)\n\t"             \
+                  store " %%xmm0, 16(%0)\n\t"           \
+                  store " %%xmm0, 32(%0)\n\t"           \
+                  store " %%xmm0, 48(%0)\n\t"           \
+                  "addl $64, %0\n\t"                    \
+                  "subl $64, %1\n\t"                    \
+                  "jnz 1b"                              \
+                  : "+r"(d), "+r"(n)                    \
+                  :                                     \
+                  : "memory", "cc")
+
+/**
+ * Copy with SSE
+ * @param d     Destination, aligned to MEM_SIMD_ALIGN
+ * @param s     Source, any alignment
+ * @param n     Bytes to copy, a non-zero multiple of MEM_SIMD_BLOCK
+ * @param nt    If non-zero, use non-temporal stores
+ */
+static void simd_copy_blocks(uint8_t *d, const uint8_t *s, uint32_t n, int nt) {
+    uint8_t xmm_save[64];
+    uint32_t chunk, flags;
+    while (n > 0) {
+        chunk = (n < MEM_SIMD_CHUNK ? n : MEM_SIMD_CHUNK);
+        n -= chunk;
+        cli_and_save(flags);
+        {
+            XMM_SAVE_0_3(xmm_save);
+            if (nt) {
+                if (mem_simd_level == MEM_SIMD_SSE2) {
+                    SIMD_COPY_LOOP("movdqu", "movntdq", "prefetchnta 256(%1)", d, s, chunk);
+                } else {
+                    SIMD_COPY_LOOP("movups", "movntps", "prefetchnta 256(%1)", d, s, chunk);
+                }
+            } else {
+                if (mem_simd_level == MEM_SIMD_SSE2) {
+                    SIMD_COPY_LOOP("movdqu", "movdqa", "", d, s, chunk);
+                } else {
+                    SIMD_COPY_LOOP("movups", "movaps", "", d, s, chunk);
+                }
+            }
+            XMM_RESTORE_0_3(xmm_save);
+        }
+        restore_flags(flags);
+    }
+    if (nt) asm volatile ("sfence" : : : "memory");  // non-temporal stores are weakly ordered
+}
+
+/**
+ * Fill with SSE
+ * @param d          Destination, aligned to MEM_SIMD_ALIGN
+ * @param pattern    32-bit pattern to repeat
+ * @param n          Bytes to fill, a non-zero multiple of MEM_SIMD_BLOCK
+ * @param nt         If non-zero, use non-temporal stores
+ */
+static void simd_fill_blocks(uint8_t *d, uint32_t pattern, uint32_t n, int nt) {
+    uint8_t xmm_save[16];
+    uint32_t chunk, flags;
+    while (n > 0) {
+        chunk = (n < MEM_SIMD_CHUNK ? n : MEM_SIMD_CHUNK);
+        n -= chunk;
+        cli_and_save(flags);
+        {
+            asm volatile ("movups %%xmm0, (%1)\n\t"
+                          "movss (%0), %%xmm0\n\t"
+                          "shufps $0, %%xmm0, %%xmm0"  // broadcast to all 4 dwords
+                          : : "r"(&pattern), "r"(xmm_save) : "memory");
+            if (nt) {
+                if (mem_simd_level == MEM_SIMD_SSE2) {
+                    SIMD_FILL_LOOP("movntdq", d, chunk);
+                } else {
+                    SIMD_FILL_LOOP("movntps", d, chunk);
+                }
+            } else {
+                if (mem_simd_level == MEM_SIMD_SSE2) {
+                    SIMD_FILL_LOOP("movdqa", d, chunk);
+                } else {
+                    SIMD_FILL_LOOP("movaps", d, chunk);
+                }
+            }
+            asm volatile ("movups (%0), %%xmm0" : : "r"(xmm_save) : "memory");
+        }
+        restore_flags(flags);
+    }
+    if (nt) asm volatile ("sfence" : : : "memory");
+}
+
+/**
+ * Set n bytes with rep stosl, with byte head and tail
+ * @param s          Destination
+ * @param pattern    Byte value repeated 4 times
+ * @param n          Bytes to set
+ */
+static void rep_memset(void *s, uint32_t pattern, uint32_t n) {
     asm volatile ("                 \n\
             .memset_top:            \n\
             testl   %%ecx, %%ecx    \n\
@@ -360,61 +585,42 @@ void *memset(void *s, int32_t c, uint32_t n) {
             jmp     .memset_bottom  \n\
             .memset_done:           \n\
             "
-    :
-    : "a"(c << 24 | c << 16 | c << 8 | c), "D"(s), "c"(n)
+    : "+D"(s), "+c"(n)
+    : "a"(pattern)
     : "edx", "memory", "cc"
     );
-    return s;
 }
 
-/* void* memset_word(void* s, int32_t c, uint32_t n);
- * Description: Optimized memset_word
- * Inputs:    void* s = pointer to memory
- *          int32_t c = value to set memory to
- *         uint32_t n = number of bytes to set
- * Return Value: new string
- * Function: set lower 16 bits of n consecutive memory locations of pointer s to value c */
-void *memset_word(void *s, int32_t c, uint32_t n) {
+/* Set n 16-bit words with rep stosw */
+static void rep_stosw(void *s, uint32_t c, uint32_t n) {
     asm volatile ("                 \n\
             movw    %%ds, %%dx      \n\
             movw    %%dx, %%es      \n\
             cld                     \n\
             rep     stosw           \n\
             "
-    :
-    : "a"(c), "D"(s), "c"(n)
+    : "+D"(s), "+c"(n)
+    : "a"(c)
     : "edx", "memory", "cc"
     );
-    return s;
 }
 
-/* void* memset_dword(void* s, int32_t c, uint32_t n);
- * Inputs:    void* s = pointer to memory
- *          int32_t c = value to set memory to
- *         uint32_t n = number of bytes to set
- * Return Value: new string
- * Function: set n consecutive memory locations of pointer s to value c */
-void *memset_dword(void *s, int32_t c, uint32_t n) {
+/* Set n 32-bit dwords with rep stosl */
+static void rep_stosl(void *s, uint32_t c, uint32_t n) {
     asm volatile ("                 \n\
             movw    %%ds, %%dx      \n\
             movw    %%dx, %%es      \n\
             cld                     \n\
             rep     stosl           \n\
             "
-    :
-    : "a"(c), "D"(s), "c"(n)
+    : "+D"(s), "+c"(n)
+    : "a"(c)
     : "edx", "memory", "cc"
     );
-    return s;
 }
 
-/* void* memcpy(void* dest, const void* src, uint32_t n);
- * Inputs:      void* dest = destination of copy
- *         const void* src = source of copy
- *              uint32_t n = number of byets to copy
- * Return Value: pointer to dest
- * Function: copy n bytes of src to dest */
-void *memcpy(void *dest, const void *src, uint32_t n) {
+/* Copy n bytes with rep movsl, with byte head and tail */
+static void rep_memcpy(void *dest, const void *src, uint32_t n) {
     asm volatile ("                 \n\
             .memcpy_top:            \n\
             testl   %%ecx, %%ecx    \n\
@@ -446,10 +652,121 @@ void *memcpy(void *dest, const void *src, uint32_t n) {
             jmp     .memcpy_bottom  \n\
             .memcpy_done:           \n\
             "
+    : "+S"(src), "+D"(dest), "+c"(n)
     :
-    : "S"(src), "D"(dest), "c"(n)
     : "eax", "edx", "memory", "cc"
     );
+}
+
+/**
+ * Split a SIMD operation of n bytes at s into an unaligned head, SIMD blocks and a tail
+ * @param s        Destination
+ * @param n        Total bytes
+ * @param head     Output, bytes before the first MEM_SIMD_ALIGN boundary
+ * @param body     Output, bytes of whole MEM_SIMD_BLOCK blocks after head
+ * @note n must be at least MEM_SIMD_MIN_BYTES, so body is never 0
+ */
+static inline void simd_split(const void *s, uint32_t n, uint32_t *head, uint32_t *body) {
+    *head = (-(uint32_t) s) & (MEM_SIMD_ALIGN - 1);
+    *body = (n - *head) & ~(MEM_SIMD_BLOCK - 1);
+}
+
+/**
+ * Decide whether a copy or fill of n bytes should use SIMD
+ * @param n    Bytes to move
+ * @return 1 to use SIMD, 0 to use rep movsl/stosl
+ * @note With CR0.TS set, the running task doesn't own the FPU, and the first SSE instruction raises #NM, which saves
+ *       the state of the owner and loads that of the running task. That costs more than SIMD saves on a small copy,
+ *       and the owner then traps again to get its state back. So SIMD is only used for such tasks when the copy is
+ *       at least MEM_SIMD_HANDOFF_BYTES
+ */
+static inline int mem_use_simd(uint32_t n) {
+    uint32_t cr0;
+    if (mem_simd_level == MEM_SIMD_NONE || n < MEM_SIMD_MIN_BYTES) return 0;
+    if (n >= MEM_SIMD_HANDOFF_BYTES) return 1;
+    asm volatile ("movl %%cr0, %0" : "=r"(cr0));
+    return !(cr0 & CR0_TS);
+}
+
+/* void* memset(void* s, int32_t c, uint32_t n);
+ * Inputs:    void* s = pointer to memory
+ *          int32_t c = value to set memory to
+ *         uint32_t n = number of bytes to set
+ * Return Value: new string
+ * Function: set n consecutive bytes of pointer s to value c */
+void *memset(void *s, int32_t c, uint32_t n) {
+    uint32_t pattern, head, body;
+    c &= 0xFF;
+    pattern = c << 24 | c << 16 | c << 8 | c;
+    if (mem_use_simd(n)) {
+        simd_split(s, n, &head, &body);
+        rep_memset(s, pattern, head);
+        simd_fill_blocks((uint8_t *) s + head, pattern, body, n >= MEM_SIMD_NT_BYTES);
+        rep_memset((uint8_t *) s + head + body, pattern, n - head - body);
+    } else {
+        rep_memset(s, pattern, n);
+    }
+    return s;
+}
+
+/* void* memset_word(void* s, int32_t c, uint32_t n);
+ * Description: Optimized memset_word
+ * Inputs:    void* s = pointer to memory
+ *          int32_t c = value to set memory to
+ *         uint32_t n = number of words to set
+ * Return Value: new string
+ * Function: set lower 16 bits of n consecutive memory locations of pointer s to value c */
+void *memset_word(void *s, int32_t c, uint32_t n) {
+    uint32_t head, body;
+    c &= 0xFFFF;
+    // SIMD only keeps the pattern in phase if s is aligned to words
+    if (mem_use_simd(n * 2) && ((uint32_t) s & 0x1) == 0) {
+        simd_split(s, n * 2, &head, &body);
+        rep_stosw(s, c, head / 2);
+        simd_fill_blocks((uint8_t *) s + head, c << 16 | c, body, n * 2 >= MEM_SIMD_NT_BYTES);
+        rep_stosw((uint8_t *) s + head + body, c, n - (head + body) / 2);
+    } else {
+        rep_stosw(s, c, n);
+    }
+    return s;
+}
+
+/* void* memset_dword(void* s, int32_t c, uint32_t n);
+ * Inputs:    void* s = pointer to memory
+ *          int32_t c = value to set memory to
+ *         uint32_t n = number of dwords to set
+ * Return Value: new string
+ * Function: set n consecutive memory locations of pointer s to value c */
+void *memset_dword(void *s, int32_t c, uint32_t n) {
+    uint32_t head, body;
+    // SIMD only keeps the pattern in phase if s is aligned to dwords
+    if (mem_use_simd(n * 4) && ((uint32_t) s & 0x3) == 0) {
+        simd_split(s, n * 4, &head, &body);
+        rep_stosl(s, c, head / 4);
+        simd_fill_blocks((uint8_t *) s + head, c, body, n * 4 >= MEM_SIMD_NT_BYTES);
+        rep_stosl((uint8_t *) s + head + body, c, n - (head + body) / 4);
+    } else {
+        rep_stosl(s, c, n);
+    }
+    return s;
+}
+
+/* void* memcpy(void* dest, const void* src, uint32_t n);
+ * Inputs:      void* dest = destination of copy
+ *         const void* src = source of copy
+ *              uint32_t n = number of byets to copy
+ * Return Value: pointer to dest
+ * Function: copy n bytes of src to dest */
+void *memcpy(void *dest, const void *src, uint32_t n) {
+    uint32_t head, body;
+    if (mem_use_simd(n)) {
+        simd_split(dest, n, &head, &body);
+        rep_memcpy(dest, src, head);
+        simd_copy_blocks((uint8_t *) dest + head, (const uint8_t *) src + head, body, n >= MEM_SIMD_NT_BYTES);
+        rep_memcpy((uint8_t *) dest + head + body, (const uint8_t *) src + head + body, n - head - body);
+    } else {
+        rep_memcpy(dest, src, n);
+    }
     return dest;
 }
 
@@ -461,20 +778,23 @@ void *memcpy(void *dest, const void *src, uint32_t n) {
  * Return Value: pointer to dest
  * Function: move n bytes of src to dest */
 void *memmove(void *dest, const void *src, uint32_t n) {
+    void *d = dest;
+    // A forward copy is safe if dest is below src or the areas don't overlap. Every step of memcpy() reads a block
+    // of src before writing the same amount to dest
+    if ((uint32_t) dest <= (uint32_t) src || (uint32_t) dest >= (uint32_t) src + n) {
+        return memcpy(dest, src, n);
+    }
     asm volatile ("                             \n\
             movw    %%ds, %%dx                  \n\
             movw    %%dx, %%es                  \n\
-            cld                                 \n\
-            cmp     %%edi, %%esi                \n\
-            jae     .memmove_go                 \n\
             leal    -1(%%esi, %%ecx), %%esi     \n\
             leal    -1(%%edi, %%ecx), %%edi     \n\
             std                                 \n\
-            .memmove_go:                        \n\
             rep     movsb                       \n\
+            cld                                 \n\
             "
+    : "+D"(d), "+S"(src), "+c"(n)
     :
-    : "D"(dest), "S"(src), "c"(n)
     : "edx", "memory", "cc"
     );
     return dest;
@@ -10,6 +10,10 @@
 // External variables that will be changed when switching terminals
 extern int screen_x;
 extern int screen_y;
+extern uint32_t screen_dirty_rows;  // bitmap of text rows changed since they are last drawn
+
+#define SCREEN_ROW(y)      (1U << (y))
+#define SCREEN_ALL_ROWS    ((1U << TERMINAL_TEXT_ROWS) - 1)
 
 #define VIDEO       0xA0000
 
@@ -77,6 +81,23 @@ uint32_t strlen(const int8_t* s);
 void clear(void);
 void reset_cursor();
 void scroll_up();
+void scroll_up_lines(int n);
+void putbuf(const uint8_t *buf, uint32_t n);
+
+/**
+ * SIMD level used by the memcpy() family, set by fpu_init() after the CPU is set up for it. Copies and fills of at
+ * least MEM_SIMD_MIN_BYTES use 16-byte SSE moves, and those of at least MEM_SIMD_NT_BYTES use non-temporal stores,
+ * which bypass the cache since the data is unlikely to be read again soon (e.g. image loading, VRAM upload). If the
+ * running task doesn't own the FPU, SIMD is only used from MEM_SIMD_HANDOFF_BYTES, since it takes an #NM hand-off
+ */
+#define MEM_SIMD_NONE         0  // rep movsl/stosl only
+#define MEM_SIMD_SSE          1  // movups/movntps
+#define MEM_SIMD_SSE2         2  // movdqu/movntdq
+#define MEM_SIMD_MIN_BYTES    256
+#define MEM_SIMD_NT_BYTES     (256 * 1024)
+#define MEM_SIMD_HANDOFF_BYTES    (16 * 1024)
+
+extern uint32_t mem_simd_level;
 
 void* memset(void* s, int32_t c, uint32_t n);
 void* memset_word(void* s, int32_t c, uint32_t n);
@@ -135,6 +156,44 @@ static inline uint32_t inl(port) {
     return val;
 }
 
+/* Read the full 64-bit time-stamp counter (EDX:EAX). Use it for intervals that may exceed 2^32 cycles. */
+static inline uint64_t rdtsc64() {
+    uint32_t low, high;
+    asm volatile ("rdtsc"
+            : "=a"(low), "=d"(high)
+            :
+            : "memory"
+    );
+    return ((uint64_t) high << 32) | low;
+}
+
+/* Read the time-stamp counter. Only the low 32 bits are returned, which is enough for intervals shorter than about
+ * one second. Use unsigned subtraction to get elapsed cycles. */
+static inline uint32_t rdtsc() {
+    return (uint32_t) rdtsc64();
+}
+
+/* Divide a 64-bit value by a 32-bit one. The kernel isn't linked with libgcc, so 64-bit "/" can't be used.
+ * Two divl are chained: the remainder of the high half becomes the high half of the second dividend. */
+static inline uint64_t div64_32(uint64_t n, uint32_t d) {
+    uint32_t high = (uint32_t) (n >> 32), low = (uint32_t) n;
+    uint32_t q_high = high / d, q_low, r = high % d;
+    asm ("divl %4"
+            : "=a"(q_low), "=d"(r)
+            : "a"(low), "d"(r), "rm"(d)
+    );
+    return ((uint64_t) q_high << 32) | q_low;
+}
+
+/* Write a 32-bit value to a model-specific register, with the high 32 bits cleared */
+static inline void wrmsr(uint32_t msr, uint32_t value) {
+    asm volatile ("wrmsr"
+            :
+            : "c"(msr), "a"(value), "d"(0)
+            : "memory"
+    );
+}
+
 /* Writes a byte to a port */
 #define outb(data, port)                \
 do {                                    \
@@ -158,7 +217,7 @@ do {                                    \
 /* Writes four bytes to four consecutive ports */
 #define outl(data, port)                \
 do {                                    \
-    asm volatile ("outl %l1, (%w0)"     \
+    asm volatile ("outl %k1, (%w0)"     \
             :                           \
             : "d"(port), "a"(data)      \
             : "memory", "cc"            \
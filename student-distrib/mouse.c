@@ -168,6 +168,8 @@ asmlinkage void mouse_interrupt_handler(hw_context_t hw_context) {
         // TODO: For y_movement, should negate the result, don't know why.
         y_movement = -y_movement;
 
+        if ((flags | last_flags) & LEFT_BUTTON) gui_render_request();  // press, release or drag
+
         if (gui_handle_mouse_move(x_movement, y_movement) != 0) {  // movement that can drag window out of screen
             x_movement = y_movement = 0;  // cancel the movement
         }
@@ -0,0 +1,172 @@
+/* page_frame.c - Allocator of 4kB physical page frames
+*/
+
+#include "page_frame.h"
+
+#include "lib.h"
+
+#define BITMAP_WORD_BITS    32
+#define BITMAP_WORD_FULL    0xFFFFFFFF
+#define BITMAP_WORD_COUNT   (PAGE_FRAME_COUNT / BITMAP_WORD_BITS)
+
+#define MMAP_TYPE_USABLE    1
+#define MEM_UPPER_START     0x100000  // mem_upper counts from 1MB
+
+// Bitmap of frames in the pool, 1 for used or unusable, 0 for free
+static uint32_t frame_bitmap[BITMAP_WORD_COUNT];
+static uint32_t next_word = 0;  // where to start next search
+static uint32_t free_count = 0;
+static uint32_t total_count = 0;
+
+/**
+ * Mark frames in a physical range as free or used. Range is clipped to the pool and shrunk to whole frames.
+ * @param start    Start physical address
+ * @param end      End physical address (exclusive)
+ * @param used     1 to mark used, 0 to mark free
+ */
+static void page_frame_mark_range(uint32_t start, uint32_t end, int used) {
+    uint32_t idx;
+
+    if (start < PAGE_FRAME_POOL_START) start = PAGE_FRAME_POOL_START;
+    if (end > PAGE_FRAME_POOL_END) end = PAGE_FRAME_POOL_END;
+    if (used) {
+        start &= ~(PAGE_FRAME_SIZE - 1);  // any frame touched by the range
+        end = (end + PAGE_FRAME_SIZE - 1) & ~(PAGE_FRAME_SIZE - 1);
+    } else {
+        start = (start + PAGE_FRAME_SIZE - 1) & ~(PAGE_FRAME_SIZE - 1);  // only frames fully in the range
+        end &= ~(PAGE_FRAME_SIZE - 1);
+    }
+
+    for (; start < end; start += PAGE_FRAME_SIZE) {
+        idx = (start - PAGE_FRAME_POOL_START) / PAGE_FRAME_SIZE;
+        if (used && !(frame_bitmap[idx / BITMAP_WORD_BITS] & (1U << (idx % BITMAP_WORD_BITS)))) {
+            frame_bitmap[idx / BITMAP_WORD_BITS] |= (1U << (idx % BITMAP_WORD_BITS));
+            free_count--;
+        } else if (!used && (frame_bitmap[idx / BITMAP_WORD_BITS] & (1U << (idx % BITMAP_WORD_BITS)))) {
+            frame_bitmap[idx / BITMAP_WORD_BITS] &= ~(1U << (idx % BITMAP_WORD_BITS));
+            free_count++;
+        }
+    }
+}
+
+/**
+ * Initialize the frame allocator with usable memory reported by the boot loader
+ * @param mbi    Multiboot info. Memory map is used if present, otherwise mem_upper
+ * @return 0 for success, -1 for no usable frame
+ * @note Multiboot modules (the file system image) are excluded from the pool
+ */
+int page_frame_init(multiboot_info_t *mbi) {
+    memory_map_t *mmap;
+    module_t *mod;
+    uint32_t i;
+
+    // All frames are unusable until reported usable
+    memset(frame_bitmap, 0xFF, sizeof(frame_bitmap));
+    free_count = 0;
+    next_word = 0;
+
+    if (mbi->flags & (1 << 6)) {  // mmap_* are valid
+        for (mmap = (memory_map_t *) mbi->mmap_addr;
+             (unsigned long) mmap < mbi->mmap_addr + mbi->mmap_length;
+             mmap = (memory_map_t *) ((unsigned long) mmap + mmap->size + sizeof(mmap->size))) {
+            if (mmap->type != MMAP_TYPE_USABLE || mmap->base_addr_high != 0) continue;
+            // Region crossing 4GB is cut at 4GB
+            if (mmap->length_high != 0 || mmap->length_low > 0xFFFFFFFF - mmap->base_addr_low) {
+                page_frame_mark_range(mmap->base_addr_low, 0xFFFFFFFF, 0);
+            } else {
+                page_frame_mark_range(mmap->base_addr_low, mmap->base_addr_low + mmap->length_low, 0);
+            }
+        }
+    } else if (mbi->flags & (1 << 0)) {  // mem_* are valid
+        page_frame_mark_range(MEM_UPPER_START, MEM_UPPER_START + mbi->mem_upper * 1024, 0);
+    }
+
+    // Exclude modules
+    if (mbi->flags & (1 << 3)) {
+        for (i = 0, mod = (module_t *) mbi->mods_addr; i < mbi->mods_count; i++, mod++) {
+            page_frame_mark_range(mod->mod_start, mod->mod_end, 1);
+        }
+    }
+
+    total_count = free_count;
+    if (free_count == 0) {
+        DEBUG_ERR("page_frame_init(): no usable memory above %uMB", PAGE_FRAME_POOL_START >> 20);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Allocate a physical frame
+ * @return Physical address of the frame, or PAGE_FRAME_NULL if out of memory
+ * @note Content of the frame is undefined
+ */
+uint32_t page_frame_alloc() {
+    uint32_t flags;
+    uint32_t i, w, bit;
+    uint32_t ret = PAGE_FRAME_NULL;
+
+    cli_and_save(flags);
+    {
+        // Next fit: start from the word where last allocation happens
+        for (i = 0; i < BITMAP_WORD_COUNT; i++) {
+            w = (next_word + i) % BITMAP_WORD_COUNT;
+            if (frame_bitmap[w] == BITMAP_WORD_FULL) continue;
+            for (bit = 0; frame_bitmap[w] & (1U << bit); bit++) {}
+            frame_bitmap[w] |= (1U << bit);
+            free_count--;
+            next_word = w;
+            ret = PAGE_FRAME_POOL_START + (w * BITMAP_WORD_BITS + bit) * PAGE_FRAME_SIZE;
+            break;
+        }
+    }
+    restore_flags(flags);
+
+    return ret;
+}
+
+/**
+ * Free a physical frame
+ * @param addr    Physical address of the frame
+ * @return 0 for success, -1 for bad address or frame not allocated
+ */
+int page_frame_free(uint32_t addr) {
+    uint32_t flags;
+    uint32_t idx;
+
+    if (addr < PAGE_FRAME_POOL_START || addr >= PAGE_FRAME_POOL_END || (addr & (PAGE_FRAME_SIZE - 1))) {
+        DEBUG_ERR("page_frame_free(): bad frame address 0x%x", addr);
+        return -1;
+    }
+    idx = (addr - PAGE_FRAME_POOL_START) / PAGE_FRAME_SIZE;
+
+    cli_and_save(flags);
+    {
+        if (!(frame_bitmap[idx / BITMAP_WORD_BITS] & (1U << (idx % BITMAP_WORD_BITS)))) {
+            restore_flags(flags);
+            DEBUG_ERR("page_frame_free(): frame 0x%x is not allocated", addr);
+            return -1;
+        }
+        frame_bitmap[idx / BITMAP_WORD_BITS] &= ~(1U << (idx % BITMAP_WORD_BITS));
+        free_count++;
+    }
+    restore_flags(flags);
+
+    return 0;
+}
+
+/**
+ * Get the count of free frames
+ * @return Count of free frames
+ */
+uint32_t page_frame_free_count() {
+    return free_count;
+}
+
+/**
+ * Get the count of frames usable after init
+ * @return Count of usable frames
+ */
+uint32_t page_frame_total_count() {
+    return total_count;
+}
@@ -0,0 +1,28 @@
+/* page_frame.h - Allocator of 4kB physical page frames
+*/
+
+#ifndef _PAGE_FRAME_H
+#define _PAGE_FRAME_H
+
+#include "types.h"
+#include "multiboot.h"
+
+/**
+ * Physical memory below PAGE_FRAME_POOL_START is used by the kernel (kernel image, PKMs and buffers mapped in
+ * x86_desc.S). Usable memory reported by the multiboot memory map between the two bounds is managed as 4kB frames.
+ * Frames are not mapped in kernel. Map them to a virtual address before access.
+ */
+#define PAGE_FRAME_POOL_START    0x02000000  // 32MB
+#define PAGE_FRAME_POOL_END      0x40000000  // 1GB, memory above is not used
+#define PAGE_FRAME_SIZE          4096
+#define PAGE_FRAME_COUNT         ((PAGE_FRAME_POOL_END - PAGE_FRAME_POOL_START) / PAGE_FRAME_SIZE)
+
+#define PAGE_FRAME_NULL          0  // returned when out of memory, never a valid frame in the pool
+
+int page_frame_init(multiboot_info_t *mbi);
+uint32_t page_frame_alloc();
+int page_frame_free(uint32_t addr);
+uint32_t page_frame_free_count();
+uint32_t page_frame_total_count();
+
+#endif // _PAGE_FRAME_H
@@ -0,0 +1,38 @@
+/* pci.h - PCI configuration space access (mechanism #1)
+ */
+
+#ifndef _PCI_H
+#define _PCI_H
+
+#include "types.h"
+#include "lib.h"
+
+#define PCI_CONFIG_ADDRESS    0xCF8
+#define PCI_CONFIG_DATA       0xCFC
+#define PCI_CONFIG_ADDR(bus, dev, func, reg) \
+    (0x80000000 | ((bus) << 16) | ((dev) << 11) | ((func) << 8) | ((reg) & 0xFC))
+
+#define PCI_REG_VENDOR        0x00  // vendor ID (low 16 bits) and device ID
+#define PCI_REG_COMMAND       0x04  // command (low 16 bits) and status
+#define PCI_REG_CLASS         0x08  // revision, prog IF, subclass, class (high byte)
+#define PCI_REG_BAR0          0x10
+#define PCI_REG_BAR4          0x20
+
+#define PCI_COMMAND_IO            0x1  // respond to I/O space accesses
+#define PCI_COMMAND_BUS_MASTER    0x4  // allow the device to initiate DMA
+
+#define PCI_VENDOR_NONE       0xFFFF  // no device at the address
+
+/* Read a dword from the configuration space of a device */
+static inline uint32_t pci_config_read(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg) {
+    outl(PCI_CONFIG_ADDR(bus, dev, func, reg), PCI_CONFIG_ADDRESS);
+    return inl(PCI_CONFIG_DATA);
+}
+
+/* Write a dword to the configuration space of a device */
+static inline void pci_config_write(uint32_t bus, uint32_t dev, uint32_t func, uint32_t reg, uint32_t value) {
+    outl(PCI_CONFIG_ADDR(bus, dev, func, reg), PCI_CONFIG_ADDRESS);
+    outl(value, PCI_CONFIG_DATA);
+}
+
+#endif // _PCI_H
@@ -26,8 +26,22 @@
 #define RTC_REGISTER_PORT       0x70
 #define RTC_RW_DATA_PORT        0x71
 
-// Wait list for RTC
-task_list_node_t rtc_wait_list = TASK_LIST_SENTINEL(rtc_wait_list);
+/**
+ * Timer wheel of RTC waiters. A task waiting for RTC is put into the slot of its deadline (absolute tick count), so an
+ * interrupt only visits the slot of current tick. Since the interval of any waiter is no more than RTC_WHEEL_SIZE
+ * ticks, all tasks in the slot are due, but the deadline is still checked in case the interval limit is changed.
+ */
+#define RTC_WHEEL_SIZE           128  // must be power of 2 and larger than the maximal interval
+#define RTC_WHEEL_MASK           (RTC_WHEEL_SIZE - 1)
+static task_list_node_t rtc_wheel[RTC_WHEEL_SIZE];
+static uint32_t rtc_ticks = 0;  // ticks since rtc_init(), only counts when periodic interrupt is on
+static uint32_t rtc_waiter_count = 0;
+
+static void rtc_set_periodic_interrupt(int enable);
+
+// Statistics of interrupt handler
+static uint32_t rtc_handler_count = 0;
+static uint32_t rtc_handler_cycles = 0;
 
 /**
  * Initialize RTC control block
@@ -37,28 +51,70 @@ void rtc_control_init(rtc_control_t *rtc_control) {
     rtc_control->target_freq = -1;  // not initialized
 }
 
+/**
+ * Turn on or off periodic interrupt of RTC
+ * @param enable    1 to turn on, 0 to turn off
+ * @note Use this function in a lock
+ */
+static void rtc_set_periodic_interrupt(int enable) {
+    uint8_t prev;
+    outb(RTC_STATUS_REGISTER_B, RTC_REGISTER_PORT);  // select register B and disable NMI
+    prev = inb(RTC_RW_DATA_PORT);  // read the current value of register B
+    outb(RTC_STATUS_REGISTER_B, RTC_REGISTER_PORT);  // set the index again (a read will reset the index to register D)
+    outb(enable ? (prev | 0x40) : (prev & ~0x40), RTC_RW_DATA_PORT);  // bit 6 of register B
+}
+
+/**
+ * Remove a task that is waiting for RTC, when it's torn down before waking up
+ * @param task    The task, which should have TASK_WAITING_RTC and have been removed from the wait list
+ * @note Use this function in a lock
+ */
+void rtc_cancel_wait_unsafe(struct task_t *task) {
+    task->flags &= ~TASK_WAITING_RTC;
+    if (--rtc_waiter_count == 0 && SCHED_TICKLESS) rtc_set_periodic_interrupt(0);
+}
+
+/**
+ * Get statistics of RTC interrupt handler, and reset them
+ * @param count     Number of interrupts handled since last call
+ * @param cycles    Total TSC cycles spent in the handler since last call
+ */
+void rtc_get_handler_stat(uint32_t *count, uint32_t *cycles) {
+    uint32_t flags;
+    cli_and_save(flags);
+    {
+        *count = rtc_handler_count;
+        *cycles = rtc_handler_cycles;
+        rtc_handler_count = rtc_handler_cycles = 0;
+    }
+    restore_flags(flags);
+}
+
 // Helper function to check whether the input is power of two
 int is_power_of_two(int32_t input);
 
 /**
  * Initialize the real time clock
  * @reference https://wiki.osdev.org/RTC
- * @effect    Frequency is set to be default 2 Hz
+ * @effect    Frequency is set to RTC_HARDWARE_FREQUENCY
  */
 void rtc_init() {
 
     uint32_t flags;
     uint8_t prev;
+    int i;
 
     cli_and_save(flags);
     {
-        // Turn on IRQ 8
-        outb(RTC_STATUS_REGISTER_B, RTC_REGISTER_PORT);  // select register B and disable NMI
-        prev = inb(RTC_RW_DATA_PORT);  // read the current value of register B
-        outb(RTC_STATUS_REGISTER_B,
-             RTC_REGISTER_PORT);  // set the index again (a read will reset the index to register D)
-        outb (prev | 0x40,
-              RTC_RW_DATA_PORT);  // write the previous value ORed with 0x40. This turns on bit 6 of register B
+        // Initialize timer wheel
+        for (i = 0; i < RTC_WHEEL_SIZE; i++) {
+            rtc_wheel[i].prev = rtc_wheel[i].next = &rtc_wheel[i];
+        }
+        rtc_ticks = 0;
+        rtc_waiter_count = 0;
+
+        // Turn on IRQ 8, unless tickless, in which case it's turned on when the first task waits for RTC
+        rtc_set_periodic_interrupt(!SCHED_TICKLESS);
 
         // Set frequency to 1024 Hz
         outb(RTC_STATUS_REGISTER_A, RTC_REGISTER_PORT);  // set index to register A, disable NMI
@@ -79,28 +135,32 @@ asmlinkage void rtc_interrupt_handler(hw_context_t hw_context) {
     // We are using interrupt gate now, so we don't need a lock
 
     int32_t wake_count = 0;
+    uint32_t start = rdtsc();
 
     task_list_node_t *node;
     task_list_node_t *temp;
     task_t *task;
 
-    update_system_time();
+    rtc_ticks++;
 
-    task_list_for_each_safe(node, &rtc_wait_list, temp) {
+    task_list_for_each_safe(node, &rtc_wheel[rtc_ticks & RTC_WHEEL_MASK], temp) {
         task = task_from_node(node);
-        task->rtc.counter--;
-        if (task->rtc.counter == 0) {
-            task->parent->flags &= ~TASK_WAITING_RTC;
-            sched_refill_time(task);
+        if (task->rtc.deadline == rtc_ticks) {
+            task->flags &= ~TASK_WAITING_RTC;
             // Already in lock
             sched_insert_to_head_unsafe(task);
             wake_count++;
         }
     }
+    rtc_waiter_count -= wake_count;
+    if (rtc_waiter_count == 0 && SCHED_TICKLESS) rtc_set_periodic_interrupt(0);
 
     rtc_restart_interrupt();  // to get another interrupt
     idt_send_eoi(hw_context.irq_exp_num);
 
+    rtc_handler_count++;
+    rtc_handler_cycles += rdtsc() - start;
+
     if (wake_count > 0) {
         sched_launch_to_current_head();  // insert multiple task to scheduler list head, but launch only once.
     }
@@ -152,12 +212,15 @@ int32_t system_rtc_read(int32_t fd, void *buf, int32_t nbytes) {
         // Put running task to sleep and refill wait counter
         running_task()->flags |= TASK_WAITING_RTC;
 
-        // Refill the counter
+        // Set the deadline, at least one tick later
         running_task()->rtc.counter = RTC_HARDWARE_FREQUENCY / running_task()->rtc.target_freq / 4;
+        if (running_task()->rtc.counter < 1) running_task()->rtc.counter = 1;
+        running_task()->rtc.deadline = rtc_ticks + running_task()->rtc.counter;
+        if (rtc_waiter_count++ == 0 && SCHED_TICKLESS) rtc_set_periodic_interrupt(1);
 
-        // Move running task out to wait list
+        // Move running task out to the slot of its deadline
         // Already in lock
-        sched_move_running_after_node_unsafe(&rtc_wait_list);
+        sched_move_running_after_node_unsafe(&rtc_wheel[running_task()->rtc.deadline & RTC_WHEEL_MASK]);
 
         // Yield processor to other task
         sched_launch_to_current_head();
@@ -183,7 +246,7 @@ int32_t system_rtc_write(int32_t fd, const void *buf, int32_t nbytes) {
     int32_t frequency = *((int32_t *) buf);
 
     int power = is_power_of_two(frequency);
-    if (power == -1) return -1;  // fail if frequency is not power of two
+    if (power == -1 || frequency <= 0) return -1;  // fail if frequency is not power of two
 
     uint32_t flags;
 
@@ -259,6 +322,7 @@ unsigned char get_RTC_register(int reg) {
 void update_system_time() {
 
     unsigned char registerB;
+    unsigned char prev_second = rtc_second;
 
     // Note: This uses the "read registers until you get the same values twice in a row" technique
     //       to avoid getting dodgy/inconsistent values due to RTC updates
@@ -288,6 +352,8 @@ void update_system_time() {
         rtc_hour = ((rtc_hour & 0x7F) + 12) % 24;
     }
 
+    if (rtc_second != prev_second) gui_render_request();  // clock on status bar changes
+
 }
 
 // source: https://wiki.osdev.org/CMOS#Getting_Current_Date_and_Time_from_RTC
@@ -11,10 +11,15 @@
 typedef struct rtc_control_t rtc_control_t;
 struct rtc_control_t {
     int32_t target_freq;
-    int32_t counter;
+    int32_t counter;    // interval in hardware ticks
+    uint32_t deadline;  // tick to wake up when waiting
 };
 
 void rtc_control_init(rtc_control_t* rtc_control);
+void rtc_get_handler_stat(uint32_t* count, uint32_t* cycles);
+
+struct task_t;
+void rtc_cancel_wait_unsafe(struct task_t* task);
 
 /* Initialize the real time clock */
 void rtc_init();
@@ -9,20 +9,35 @@
 #include "task_sched.h"
 #include "../vidmem.h"
 #include "../signal.h"
+#include "../fpu.h"
+#include "../gui/gui_render.h"
+#include "../tests.h"  // checkpoints and the benchmarks that can be launched from init_task_main()
 
 #define TASK_ENABLE_CHECKPOINT    0
-#if TASK_ENABLE_CHECKPOINT
-#include "tests.h"
-#endif
 
-#define task_slot(idx) ((task_t *) (PKM_STARTING_ADDR - (idx + 1) * PKM_SIZE_IN_BYTES))  // address of idx-th PCB
 volatile uint32_t task_count = 0;  // count of tasks that has started
+uint32_t task_max_count = TASK_MAX_COUNT;  // runtime limit of task count, see task_set_max_count()
+
+/**
+ * PKM allocator. PKMs are carved from the arena below PKM_STARTING_ADDR in slabs of TASK_SLAB_PKM_COUNT on demand,
+ * and freed PKMs are kept in a stack for reuse, so allocation and deallocation are O(1). The PKM with the highest
+ * address is always handed out first, which is the one the init task gets (overlapping the boot stack, as before).
+ */
+#define TASK_SLAB_PKM_COUNT    8
+extern char _end[];  // end of kernel image (including BSS), defined by the linker
+static task_t *pkm_free_stack[TASK_MAX_COUNT];
+static uint32_t pkm_free_top = 0;
+static uint32_t pkm_arena_bottom = PKM_STARTING_ADDR;  // lowest address of PKMs carved so far
+static uint32_t pkm_arena_limit = PKM_STARTING_ADDR;   // lowest address PKMs can use
 
 #define USER_STACK_STARTING_ADDR  (0x8400000 - 1)  // User stack starts at 132MB - 1 (with paging enabled)
 
 // Wait list of tasks that are waiting for child to halt
 task_list_node_t wait4child_list = TASK_LIST_SENTINEL(wait4child_list);
 
+// Wait list of init task, which has nothing to do after starting other tasks
+static task_list_node_t init_wait_list = TASK_LIST_SENTINEL(init_wait_list);
+
 task_t *terminal_fg_task[TERMINAL_MAX_COUNT];  // terminal foreground task
 task_t *focus_task_ = NULL;
 
@@ -134,13 +149,24 @@ task_t *running_task() {
 
 /**
  * Initialize task management
+ * @param mods_end    End of multiboot modules below PKM_STARTING_ADDR, such as the file system image, or 0 for none
  */
-void task_init() {
+void task_init(uint32_t mods_end) {
     int i;
+    uint32_t used_end = (uint32_t) _end;  // end of memory that PKMs must not overlap
 
-    // Initialize task slots
-    for (i = 0; i < TASK_MAX_COUNT; i++) {
-        task_slot(i)->valid = 0;
+    // Initialize PKM arena, which must not overlap with kernel image or modules placed after it by the boot loader
+    if (mods_end > used_end) used_end = mods_end;
+    pkm_free_top = 0;
+    pkm_arena_bottom = PKM_STARTING_ADDR;
+    pkm_arena_limit = PKM_STARTING_ADDR - TASK_MAX_COUNT * PKM_SIZE_IN_BYTES;
+    if (pkm_arena_limit < used_end) {
+        pkm_arena_limit = (used_end + PKM_SIZE_IN_BYTES - 1) & PKM_ALIGN_MASK;
+        DEBUG_WARN("task_init(): PKM arena overlaps with kernel image or modules, only %u tasks can run",
+                   (PKM_STARTING_ADDR - pkm_arena_limit) / PKM_SIZE_IN_BYTES);
+    }
+    if (task_max_count > (PKM_STARTING_ADDR - pkm_arena_limit) / PKM_SIZE_IN_BYTES) {
+        task_max_count = (PKM_STARTING_ADDR - pkm_arena_limit) / PKM_SIZE_IN_BYTES;
     }
     task_count = 0;
 
@@ -174,38 +200,86 @@ void task_run_initial_task() {
 }
 
 /**
- * Find an available slot in task list, mark as valid and return. If no available, return NULL
+ * Carve a new slab of PKMs from the arena and push them to the free stack
+ * @return 0 for success, -1 if the arena is used up
+ */
+static int task_pkm_grow() {
+    uint32_t count = (pkm_arena_bottom - pkm_arena_limit) / PKM_SIZE_IN_BYTES;
+    uint32_t i;
+
+    if (count == 0) return -1;
+    if (count > TASK_SLAB_PKM_COUNT) count = TASK_SLAB_PKM_COUNT;
+
+    pkm_arena_bottom -= count * PKM_SIZE_IN_BYTES;
+    // Push from low address, so that the highest one is on the top
+    for (i = 0; i < count; i++) {
+        pkm_free_stack[pkm_free_top] = (task_t *) (pkm_arena_bottom + i * PKM_SIZE_IN_BYTES);
+        pkm_free_stack[pkm_free_top]->valid = 0;
+        pkm_free_top++;
+    }
+    return 0;
+}
+
+/**
+ * Allocate a PKM, mark as valid and return. If no available, return NULL
  * @return Pointer to newly allocated task_t, or NULL is no available
+ * @note Use this function in a lock
  */
 static task_t *task_allocate_new_slot() {
-    int i;
-
-    if (task_count >= TASK_MAX_COUNT) return NULL;
+    task_t *task;
 
-    task_count++;
-    for (i = 0; i < TASK_MAX_COUNT; i++) {
-        if (!task_slot(i)->valid) {
-            task_slot(i)->valid = 1;
-            return task_slot(i);
-        }
+    if (task_count >= task_max_count) return NULL;
+    if (pkm_free_top == 0 && task_pkm_grow() != 0) {
+        DEBUG_ERR("task_allocate_new_slot(): PKM arena is used up");
+        return NULL;
     }
 
-    DEBUG_ERR("task_count is inconsistent");
-    return NULL;
+    task = pkm_free_stack[--pkm_free_top];
+    task->valid = 1;
+    task->fpu_used = 0;
+    task_count++;
+    return task;
 }
 
 /**
- * Deallocate a task from task slot
+ * Deallocate a task and return its PKM to the free stack
  * @param task    Pointer to task_t of the task to be removed
  * @return Pointer to its parent task
+ * @note Only the valid flag is changed, so it's safe to deallocate the running task before switching away from it
+ * @note Use this function in a lock
  */
 static task_t *task_deallocate(task_t *task) {
     task_t *ret = task->parent;
+    fpu_release_unsafe(task);
     task->valid = 0;
+    pkm_free_stack[pkm_free_top++] = task;
     task_count--;
     return ret;
 }
 
+/**
+ * Set the maximum number of tasks that can run at the same time
+ * @param count    New limit
+ * @return 0 for success, -1 for bad count (0, less than running task count, or more than the PKM arena can hold)
+ */
+int32_t task_set_max_count(uint32_t count) {
+    uint32_t flags;
+    int32_t ret = 0;
+
+    cli_and_save(flags);
+    {
+        if (count == 0 || count < task_count || count > (PKM_STARTING_ADDR - pkm_arena_limit) / PKM_SIZE_IN_BYTES) {
+            DEBUG_ERR("task_set_max_count(): invalid count %u", count);
+            ret = -1;
+        } else {
+            task_max_count = count;
+        }
+    }
+    restore_flags(flags);
+
+    return ret;
+}
+
 /**
  * Helper function to parse command into executable name and argument string
  * @param command    [In] string to be parse. [Out] executable name
@@ -282,6 +356,7 @@ int32_t system_execute(uint8_t *command, int8_t wait_for_return, uint8_t new_ter
         if (wait_for_return == 0 && new_terminal == 0 && running_task()->terminal->terminal_id != NULL_TERMINAL_ID) {
             DEBUG_ERR(
                     "system_execute(): new task will inherit non-NULL terminal from running task, so parent must wait.");
+            task_deallocate(task);
             return -1;
         }
     }
@@ -425,14 +500,8 @@ int32_t system_execute(uint8_t *command, int8_t wait_for_return, uint8_t new_ter
 
     /** --------------- Phase 3. Ready to go. Setup scheduler --------------- */
 
-    // Put child task into run queue
-    if (task->flags & TASK_IDLE_TASK) {
-        task->sched_ctrl.remain_time = 0;
-    } else {
-        sched_refill_time(task);
-    }
-
-
+    // Put child task into run queue. Inherit nice value from its caller.
+    sched_init_task(task, (task->flags & TASK_INIT_TASK) ? 0 : running_task()->sched_ctrl.nice);
     sched_insert_to_head_unsafe(task);
     // Don't use launch() function of sched, perform context switch manually as follows
 
@@ -451,6 +520,12 @@ int32_t system_execute(uint8_t *command, int8_t wait_for_return, uint8_t new_ter
     // Whenever switch from user to kernel stack, kernel stack should be clean, so tss.esp0 should always be kesp_base
     tss.esp0 = task->kesp_base;
 
+    // Charge caller and program PIT for new task
+    if ((task->flags & TASK_INIT_TASK) == 0) sched_timer_switch_unsafe(task);
+
+    // New task never owns the FPU
+    fpu_switch_unsafe(task);
+
     // Jump to user program entry
     if (task->flags & TASK_KERNEL_TASK) {
         if (task->flags & TASK_INIT_TASK) {
@@ -505,13 +580,13 @@ static void tear_down_task(task_t *task) {
     /** --------------- Phase 1. Remove current task from scheduler or wait list --------------- */
 
     move_task_after_node_unsafe(task, &temp_list);
+    if (task->flags & TASK_WAITING_RTC) rtc_cancel_wait_unsafe(task);
 
     /** --------------- Phase 2. Restore parent task to scheduler --------------- */
 
     if (parent) {
         // Re-activate parent
         parent->flags &= ~TASK_WAITING_CHILD;
-        sched_refill_time(parent);
         // Already in lock
         sched_insert_to_head_unsafe(parent);
     }
@@ -612,6 +687,10 @@ int32_t system_halt(int32_t status) {
 
         tss.esp0 = parent->kesp_base;  // set tss to parent's kernel stack to make sure system calls use correct stack
 
+        sched_timer_switch_unsafe(parent);  // charge halting task and program PIT for parent
+
+        fpu_switch_unsafe(parent);  // trap if parent uses FPU while it's owned by another task
+
         // It's OK to leave the lock there. After returning to parent, parent's flags will be recover
         halt_backtrack(parent->kesp, status);
 
@@ -639,6 +718,7 @@ int32_t system_getargs(uint8_t *buf, int32_t nbytes) {
     uint8_t *args = running_task()->args;
     if (args == NULL) return -1;  // no args
     if (strlen((int8_t *) args) >= nbytes) return -1;  // can not fit into buf (including ending NULL char)
+    if (task_paging_touch_user_output(buf, nbytes) == -1) return -1;
     strncpy((int8_t *) buf, (int8_t *) args, nbytes);
     return 0;
 }
@@ -656,18 +736,36 @@ static void init_task_main() {
     {
         // It's OK to lock the whole function. New program will have flags with IF = 1.
         system_execute((uint8_t *) "idle", -1, 0, idle_task_main);
+        system_execute((uint8_t *) "compositor", 0, 0, gui_compositor_main);  // idle if switched off, see GUI_COMPOSITOR_TASK
+#if FS_READAHEAD_TASK
+        system_execute((uint8_t *) "readahead", 0, 0, file_readahead_main);
+#endif
 
 //        system_execute((uint8_t *) "shell", 0, 1, NULL);
 //        system_execute((uint8_t *) "shell", 0, 1, NULL);
 //        system_execute((uint8_t *) "shell", 0, 1, NULL);
 
+//        system_execute((uint8_t *) "stress", 0, 0, task_stress_bench);
+//        system_execute((uint8_t *) "latency", 0, 0, task_latency_bench);
+//        system_execute((uint8_t *) "rtc_bench", 0, 0, rtc_handler_bench);
+//        system_execute((uint8_t *) "irq_bench", 0, 0, timer_irq_bench);
+//        system_execute((uint8_t *) "gui_bench", 0, 0, gui_render_bench);
+//        system_execute((uint8_t *) "input_bench", 0, 0, gui_input_bench);
+//        system_execute((uint8_t *) "blit_bench", 0, 0, gui_blit_bench);
+//        system_execute((uint8_t *) "win_bench", 0, 0, gui_window_bench);
+//        system_execute((uint8_t *) "mem_bench", 0, 0, mem_throughput_bench);
+//        system_execute((uint8_t *) "ra_bench", 0, 0, readahead_bench);
+//        system_execute((uint8_t *) "fpu_test", 0, 0, fpu_switch_test);
+
     }
     restore_flags(flags);
 
+    // Nothing more to do. Block forever rather than yield in a loop, so that the processor can be idle.
     while (1) {
         cli_and_save(flags);
         {
-            sched_yield_unsafe();
+            sched_move_running_after_node_unsafe(&init_wait_list);
+            sched_launch_to_current_head();
         }
         restore_flags(flags);
     }
@@ -687,7 +785,9 @@ static void init_task_main() {
  *       to other task
  */
 static void idle_task_main() {
-    while (1) {}
+    while (1) {
+        asm volatile ("hlt");  // wait for next interrupt
+    }
 
     uint32_t flags;
     cli_and_save(flags);
@@ -738,7 +838,10 @@ void task_halt_terminal(int32_t terminal_id) {
         return;
     }
 
-    if (terminal_fg_task[terminal_id] == running_task()) {
+    if (terminal_fg_task[terminal_id]->flags & TASK_IN_FILE_SYSTEM) {
+        // It may be sleeping for disk I/O, and the file system would be left locked. Let it halt in fs_unlock()
+        terminal_fg_task[terminal_id]->flags |= TASK_HALT_PENDING;
+    } else if (terminal_fg_task[terminal_id] == running_task()) {
         system_halt(255);
     } else {
         tear_down_task(terminal_fg_task[terminal_id]);
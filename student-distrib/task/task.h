@@ -26,7 +26,11 @@ struct task_list_node_t {
 typedef struct task_list_node_t task_list_node_t;
 
 struct sched_control_t {
-    int32_t remain_time;
+    int32_t remain_time;  // remaining time of current time slice [ms]
+    int32_t level;        // current level in multilevel feedback queue, 0 is the highest
+    int32_t nice;         // highest level this task can get
+    uint32_t wake_time;   // time to wake up when sleeping, see sched_sleep_unsafe() [ms]
+    uint32_t wake_tsc;    // low 32 bits of TSC when last put into the run queue, for latency measurement
 };
 typedef struct sched_control_t sched_control_t;
 
@@ -38,6 +42,10 @@ typedef struct sched_control_t sched_control_t;
 #define TASK_WAITING_TERMINAL    16U // in waiting list of terminal
 #define TASK_TERMINAL_OWNER      32U // own terminal
 #define TASK_IDLE_TASK           64U // idle task (must be kernel task, only run when no other runnable task)
+#define TASK_IN_FILE_SYSTEM      128U  // holding the lock of file system, see fs_lock()
+#define TASK_HALT_PENDING        256U  // killed while TASK_IN_FILE_SYSTEM, halt when releasing the lock
+
+#define TASK_FPU_STATE_SIZE    512  // size of FXSAVE area (FNSAVE uses the first 108 bytes)
 
 typedef struct task_t task_t;
 struct task_t {
@@ -64,6 +72,10 @@ struct task_t {
 
     file_array_t file_array;
     signal_struct_t signals;
+
+    // x87/SSE state, saved lazily only when another task uses the FPU, see fpu_handle_nm()
+    uint8_t fpu_used;  // the task has used the FPU since it started, so fpu_state is meaningful
+    uint8_t fpu_state[TASK_FPU_STATE_SIZE] __attribute__((aligned(16)));
 };
 
 
@@ -83,8 +95,11 @@ union process_kernel_memory_t {
 
 /** ============== Task Managements ============== */
 
-#define TASK_MAX_COUNT    10  // maximum number of processes running at the same time
+#define TASK_MAX_COUNT    256  // upper bound of task_max_count, which decides the size of PKM arena
 extern volatile uint32_t task_count;
+extern uint32_t task_max_count;  // maximum number of processes running at the same time
+
+int32_t task_set_max_count(uint32_t count);
 
 task_t* running_task();
 task_t* focus_task();
@@ -95,7 +110,7 @@ void task_apply_user_vidmap(task_t* task);
 
 /** ============== Interface for Pure Kernel State ============== */
 
-void task_init();
+void task_init(uint32_t mods_end);
 void task_run_initial_task();
 
 /** ============== System Calls Implementations ============== */
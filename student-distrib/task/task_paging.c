@@ -1,4 +1,3 @@
-
 #include "task_paging.h"
 
 #include "../lib.h"
@@ -7,27 +6,110 @@
 
 #include "task.h"
 #include "../file_system.h"
+#include "../page_frame.h"
 
 #define     PAGE_ID_USED          666
 #define     PAGE_ID_FREE          0
 
-#define     TASK_IMG_LOAD_ADDR    0x08048000
+#define     TASK_IMG_START        0x08000000  // 128MB
+#define     TASK_IMG_END          0x08400000  // 132MB
 
 #define     TASK_IMG_PAGE_ENTRY   32          // 128MB / 4MB
-#define     TASK_IMG_PAGE_FLAG    0x00000087  // flags for a user level task
 
-#define     ELF_MAGIC_SIZE_IN_BYTE  4
+#define     TASK_MMAP_START       0x08800000  // 136MB, after user vidmap at 132MB
+#define     TASK_MMAP_END         0x08C00000  // 140MB
+#define     TASK_MMAP_PAGE_ENTRY  34          // 136MB / 4MB
+#define     TASK_MMAP_MAX_REGION  8           // max count of mappings of a task
+#define     TASK_MMAP_ANONYMOUS   (-1)        // fd and inode of a zero-filled mapping
+
+#define     ELF_PT_LOAD             1           // type of loadable segment
+#define     ELF_PF_W                0x2         // segment flag of writable
+
+#define     PF_ERR_PRESENT          0x1         // page fault error code: caused by protection violation
+
+#define     TASK_IMG_CACHE_SIZE         4        // number of cached executable images
+
+// ELF header, only the fields used by the loader
+typedef struct __attribute__((packed)) elf_header_t {
+    uint8_t  ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;       // the EIP to start
+    uint32_t phoff;       // offset of program header table in the file
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;   // size of a program header
+    uint16_t phnum;       // number of program headers
+} elf_header_t;
+
+// ELF program header
+typedef struct __attribute__((packed)) elf_program_header_t {
+    uint32_t type;
+    uint32_t offset;      // offset of the segment in the file
+    uint32_t vaddr;       // virtual address of the segment
+    uint32_t paddr;
+    uint32_t filesz;      // bytes in the file, the rest to memsz is zero-filled
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} elf_program_header_t;
+
+/**
+ * Cache of prepared executable images, keyed by inode. An entry records the result of ELF check and the loadable
+ * segments. An entry is dropped by task_paging_invalidate_img() when its file is written.
+ */
+typedef struct task_img_cache_entry_t {
+    uint32_t valid;
+    uint32_t executable;    // 1 for ELF file with valid PT_LOAD segments, 0 for not
+    uint32_t last_use;      // for LRU replacement
+    task_img_t img;
+} task_img_cache_entry_t;
 
 // Global variables
 static int page_id_count = 0;  // the ID for new task, also the count of running tasks
-static int page_id_running[TASK_MAX_COUNT] = {0};
+static int page_id_running[TASK_PAGE_ID_COUNT] = {0};
+
+/**
+ * Each task has its own page table for 128MB-132MB. Pages are not present until the first touch, which is handled by
+ * task_paging_handle_fault(). Physical frames are allocated from page_frame.c, and freed when the task halts.
+ */
+static page_table_t task_img_pt[TASK_PAGE_ID_COUNT];
+static task_img_t task_img[TASK_PAGE_ID_COUNT];  // image info of each page id, to fault in pages
+static uint32_t task_img_fault_count = 0;
+
+/**
+ * Each task also has its own page table for 136MB-140MB, where mmap() places its mappings. Like the image, pages are
+ * filled on the first touch by task_mmap_fill_page(), into frames from page_frame.c that only the task maps. Blocks
+ * of the module are never mapped in place: the kernel writes to read-only user pages without a fault (CR0.WP is
+ * clear), and a block freed by truncate() may be given to another file.
+ */
+typedef struct task_mmap_region_t {
+    uint32_t start;     // virtual address, 0 for unused region
+    uint32_t end;       // after the last page
+    int32_t inode;      // the file, or TASK_MMAP_ANONYMOUS
+    uint32_t length;    // bytes of the file mapped
+} task_mmap_region_t;
+
+static page_table_t task_mmap_pt[TASK_PAGE_ID_COUNT];
+static task_mmap_region_t task_mmap[TASK_PAGE_ID_COUNT][TASK_MMAP_MAX_REGION];
+static uint32_t task_mmap_fill_count = 0;    // pages filled by copy or zeroing
+
+static task_img_cache_entry_t img_cache[TASK_IMG_CACHE_SIZE];
+static uint32_t img_cache_clock = 0;  // increase on each lookup, for LRU
+static uint32_t img_cache_hit = 0;
+static uint32_t img_cache_miss = 0;
 
 // Helper functions
 static int task_set_img_paging(const int page_id);
 static int task_get_free_page_id();
-static int task_load(dentry_t *task);
-static int task_is_executable(dentry_t *task);
-static uint32_t task_get_eip(dentry_t *task);
+static int task_img_parse(dentry_t *task, task_img_t *img);
+static task_img_cache_entry_t *task_img_cache_get(dentry_t *task);
+static int task_img_fill_page(const task_img_t *img, uint32_t page_addr);
+static void task_paging_free_frames(const int page_id);
+static int task_mmap_fill_page(uint32_t page_addr);
+static void task_mmap_unmap(const int page_id, task_mmap_region_t *region);
 
 
 /**
@@ -37,23 +119,35 @@ void task_paging_init() {
     int i;
 
     // Init task queues
-    for (i = 0; i < TASK_MAX_COUNT; i++) {
+    for (i = 0; i < TASK_PAGE_ID_COUNT; i++) {
         // init the global var
         page_id_running[i] = PAGE_ID_FREE;
+        memset(&task_img_pt[i], 0, sizeof(page_table_t));
+        memset(&task_mmap_pt[i], 0, sizeof(page_table_t));
+        memset(task_mmap[i], 0, sizeof(task_mmap[i]));
+    }
+
+    // Init image cache
+    for (i = 0; i < TASK_IMG_CACHE_SIZE; i++) {
+        img_cache[i].valid = 0;
     }
+    img_cache_clock = img_cache_hit = img_cache_miss = 0;
+    task_img_fault_count = 0;
+    task_mmap_fill_count = 0;
 }
 
 /**
- * Set up paging for a task that is going to run, load program image, and return EIP and page if
+ * Set up paging for a task that is going to run, prepare program image, and return EIP and page if
  * @param task_name    The name of the task
  * @param eip          The pointer to store eip of the task
  * @return Page ID for success, -1 for no such task, -2 for fail to get eip
  * @effect The paging setting will be changed, arg eip may be set
+ * @note No page of the image is loaded here. Segments are faulted in on the first touch.
  */
 int task_paging_allocate_and_set(const uint8_t *task_name, uint32_t *eip) {
 
-    int i;  // loop counter and temp use 
     dentry_t task;  // the dentry of the tasks in the file system
+    task_img_cache_entry_t *entry;  // cached image info
 
     // Check the input
     if (eip == NULL) {
@@ -61,14 +155,14 @@ int task_paging_allocate_and_set(const uint8_t *task_name, uint32_t *eip) {
         return -1;
     }
 
-    // Get the task in file system 
+    // Get the task in file system
     if (-1 == read_dentry_by_name(task_name, &task)) {
         DEBUG_ERR("task_paging_allocate_and_set(): no such task: %s", task_name);
         return -1;
     }
 
-    // Check whether the file is executable 
-    if (!task_is_executable(&task)) {
+    // Check whether the file is executable
+    if ((entry = task_img_cache_get(&task)) == NULL || !entry->executable) {
         DEBUG_ERR("task_paging_allocate_and_set(): not a executable task: %s", task_name);
         return -1;
     }
@@ -81,18 +175,13 @@ int task_paging_allocate_and_set(const uint8_t *task_name, uint32_t *eip) {
     }
 
     // Get the eip of the task
-    if (-1 == (i = task_get_eip(&task))) {
-        DEBUG_ERR("task_paging_allocate_and_set(): fail to get eip of task: %s", task_name);
-        return -2;
-    } else {
-        *eip = i;
-    }
+    *eip = entry->img.eip;
 
-    // Turn on the paging space for the file 
-    task_set_img_paging(page_id);
+    // Record the image. The page table is all clear (at init or freed in deallocation), so all pages get faulted in
+    task_img[page_id] = entry->img;
 
-    // Load the file
-    task_load(&task);
+    // Turn on the paging space for the file
+    task_set_img_paging(page_id);
 
     // Update the page_id
     page_id_running[page_id] = PAGE_ID_USED;
@@ -101,15 +190,47 @@ int task_paging_allocate_and_set(const uint8_t *task_name, uint32_t *eip) {
     return page_id;
 }
 
+/**
+ * Get hit and miss count of the executable image cache
+ * @param hit     Output hit count, can be NULL
+ * @param miss    Output miss count, can be NULL
+ */
+void task_paging_get_cache_stat(uint32_t *hit, uint32_t *miss) {
+    if (hit != NULL) *hit = img_cache_hit;
+    if (miss != NULL) *miss = img_cache_miss;
+}
+
+/**
+ * Drop the cached image of a file, since the file is changed
+ * @param inode    The inode of the file
+ * @note Tasks already running the image keep their segment info, and pages not faulted in yet come from the new
+ *       content of the file
+ */
+void task_paging_invalidate_img(uint32_t inode) {
+    int i;
+    for (i = 0; i < TASK_IMG_CACHE_SIZE; i++) {
+        if (img_cache[i].valid && img_cache[i].img.inode == inode) img_cache[i].valid = 0;
+    }
+}
+
+/**
+ * Get the count of pages faulted in for task images since boot
+ * @return The count
+ */
+uint32_t task_paging_get_fault_count() {
+    return task_img_fault_count;
+}
+
 /**
  * Reset the paging setting when halt a task
  * @param page_id   The page id of the task to halt
  * @return 0 for success , -1 for fail
  */
 int task_paging_deallocate(const int page_id) {
+    int i;
 
-    // Check whether the id is valid 
-    if (page_id >= TASK_MAX_COUNT) {
+    // Check whether the id is valid
+    if (page_id >= TASK_PAGE_ID_COUNT) {
         DEBUG_ERR("task_reset_paging(): invalid page id: %d", page_id);
         return -1;
     }
@@ -118,7 +239,11 @@ int task_paging_deallocate(const int page_id) {
         return -1;
     }
 
-    // Does not close user img page
+    // Release the frames of the image and the mappings
+    task_paging_free_frames(page_id);
+    for (i = 0; i < TASK_MMAP_MAX_REGION; i++) {
+        if (task_mmap[page_id][i].start != 0) task_mmap_unmap(page_id, &task_mmap[page_id][i]);
+    }
 
     // Release the page id
     page_id_running[page_id] = PAGE_ID_FREE;
@@ -134,7 +259,7 @@ int task_paging_deallocate(const int page_id) {
  * @effect      the PDE will be changed
  */
 int task_paging_set(const int page_id) {
-    if (page_id < 0 || page_id > TASK_MAX_COUNT) {
+    if (page_id < 0 || page_id >= TASK_PAGE_ID_COUNT) {
         DEBUG_ERR("task_paging_set(): bad page id : %d\n", page_id);
         return -1;
     }
@@ -148,28 +273,215 @@ int task_paging_set(const int page_id) {
     return 0;
 }
 
+/**
+ * Handle a page fault in the image area or the mmap area of running task by loading the page in
+ * @param addr        The faulting address (CR2)
+ * @param err_code    Error code of the page fault
+ * @return 0 if the page is loaded and the faulting instruction can be restarted, -1 for a real fault
+ * @note Called in the page fault handler, with interrupts enabled if the faulting code had them enabled, since
+ *       loading may sleep on the disk. Faults from kernel state (such as system calls writing to user buffer) are
+ *       handled as well.
+ */
+int task_paging_handle_fault(uint32_t addr, uint32_t err_code) {
+    int page_id;
+    uint32_t page_addr = addr & ~PAGE_4KB_ALIGN_TEST;
+
+    // Only not-present pages in the image area or the mmap area can be faulted in
+    if ((err_code & PF_ERR_PRESENT) ||
+        !((addr >= TASK_IMG_START && addr < TASK_IMG_END) || (addr >= TASK_MMAP_START && addr < TASK_MMAP_END))) {
+        return -1;
+    }
+    if (task_count == 0 || (page_id = running_task()->page_id) < 0 || page_id >= TASK_PAGE_ID_COUNT ||
+        page_id_running[page_id] == PAGE_ID_FREE) {
+        return -1;
+    }
+
+    if (addr >= TASK_MMAP_START) return task_mmap_fill_page(page_addr);
+
+    if (task_img_fill_page(&task_img[page_id], page_addr) != 0) return -1;
+
+    task_img_fault_count++;
+    return 0;
+}
+
+/**
+ * Access each page of a user buffer, so that pages loaded on demand are faulted in before a system call takes a lock
+ * @param buf       The buffer
+ * @param length    Length of the buffer
+ * @note A page fault inside the lock may read the file system and sleep, see task_paging_handle_fault()
+ */
+void task_paging_touch_user_buffer(const void *buf, uint32_t length) {
+    const volatile uint8_t *p = buf;
+    uint32_t i;
+
+    if (length == 0) return;
+    (void) p[0];
+    for (i = SIZE_4K - ((uint32_t) buf % SIZE_4K); i < length; i += SIZE_4K) (void) p[i];
+}
+
+/**
+ * Fault in each page of a user buffer that a system call writes to, and check that the user may write all of it
+ * @param buf       The buffer
+ * @param length    Length of the buffer
+ * @return 0 if the buffer is writable, -1 if it covers a read-only page of the image (text) or of a file mapping
+ * @note The kernel runs with CR0.WP clear, so writing such a page from a system call wouldn't fault. Other addresses
+ *       and tasks without user space are not checked here
+ */
+int task_paging_touch_user_output(void *buf, uint32_t length) {
+    int page_id;
+    uint32_t addr, last;
+    const PTE_t *pte;
+
+    if (length == 0) return 0;
+    task_paging_touch_user_buffer(buf, length);
+
+    if (task_count == 0 || (page_id = running_task()->page_id) < 0 || page_id >= TASK_PAGE_ID_COUNT ||
+        page_id_running[page_id] == PAGE_ID_FREE) {
+        return 0;
+    }
+
+    last = ((uint32_t) buf + length - 1) & ~PAGE_4KB_ALIGN_TEST;
+    for (addr = (uint32_t) buf & ~PAGE_4KB_ALIGN_TEST; ; addr += SIZE_4K) {
+        pte = NULL;
+        if (addr >= TASK_IMG_START && addr < TASK_IMG_END) {
+            pte = (const PTE_t *) &task_img_pt[page_id].entry[(addr - TASK_IMG_START) / SIZE_4K];
+        } else if (addr >= TASK_MMAP_START && addr < TASK_MMAP_END) {
+            pte = (const PTE_t *) &task_mmap_pt[page_id].entry[(addr - TASK_MMAP_START) / SIZE_4K];
+        }
+        if (pte != NULL && pte->present && !pte->can_write) {
+            DEBUG_WARN("task_paging_touch_user_output(): read-only page 0x%x", addr);
+            return -1;
+        }
+        if (addr == last) break;
+    }
+    return 0;
+}
+
+/**
+ * Support system call: mmap(). Map a regular file read-only, or zero-filled memory read-write, to the mmap area of
+ * running task
+ * @param fd        An opened regular file, or -1 for zero-filled memory
+ * @param length    Bytes to map. For a file, 0 maps the whole file, and it's cut at the end of the file
+ * @param start     Output address of the mapping, in the image area like vidmap()
+ * @return Bytes mapped, 0 for an empty file (nothing is mapped), or -1 for fail
+ * @note The file is mapped from its beginning, regardless of the file position. Pages are copied on the first touch.
+ *       The rest of the last page after the file is zero. A page of a file that is written or truncated later keeps
+ *       the content it's copied with, and pages not touched yet see the change
+ */
+int32_t system_mmap(int32_t fd, int32_t length, uint8_t **start) {
+    int page_id = running_task()->page_id;
+    int32_t inode = TASK_MMAP_ANONYMOUS;
+    uint32_t size, addr;
+    task_mmap_region_t *region = NULL;
+    int i;
+
+    // Check whether to dest to write is valid
+    if ((uint32_t) start < TASK_IMG_START || (uint32_t) start > TASK_IMG_END - sizeof(*start) ||
+        task_paging_touch_user_output(start, sizeof(*start)) == -1) {
+        DEBUG_ERR("system_mmap(): start out of range: %x", (uint32_t) start);
+        return -1;
+    }
+    if (page_id < 0 || page_id >= TASK_PAGE_ID_COUNT || page_id_running[page_id] == PAGE_ID_FREE) {
+        DEBUG_ERR("system_mmap(): current task has no user space");
+        return -1;
+    }
+    if (length < 0 || (fd == TASK_MMAP_ANONYMOUS && length == 0)) {
+        DEBUG_ERR("system_mmap(): bad length %d", length);
+        return -1;
+    }
+
+    if (fd == TASK_MMAP_ANONYMOUS) {
+        size = length;
+    } else {
+        // Not an error message, since callers such as cat fall back to read() for devices and directories
+        if ((inode = file_get_inode(fd)) == -1) return -1;
+        size = get_file_size(inode);
+        if (length != 0 && size > (uint32_t) length) size = length;
+        if (size == 0) return 0;
+    }
+    if (size > TASK_MMAP_END - TASK_MMAP_START) {
+        DEBUG_WARN("system_mmap(): %u bytes don't fit in the mmap area\n", size);
+        return -1;
+    }
+
+    // First fit. Restart the scan whenever the candidate overlaps a mapping
+    addr = TASK_MMAP_START;
+    for (i = 0; i < TASK_MMAP_MAX_REGION; i++) {
+        if (task_mmap[page_id][i].start == 0) {
+            if (region == NULL) region = &task_mmap[page_id][i];
+        } else if (task_mmap[page_id][i].start < addr + size && task_mmap[page_id][i].end > addr) {
+            addr = task_mmap[page_id][i].end;
+            if (addr + size > TASK_MMAP_END) break;
+            region = NULL;
+            i = -1;
+        }
+    }
+    if (region == NULL || addr + size > TASK_MMAP_END) {
+        DEBUG_WARN("system_mmap(): no space for %u bytes\n", size);
+        return -1;
+    }
+
+    region->start = addr;
+    region->end = addr + ((size + PAGE_4KB_ALIGN_TEST) & ~PAGE_4KB_ALIGN_TEST);
+    region->inode = inode;
+    region->length = (inode == TASK_MMAP_ANONYMOUS ? 0 : size);
+
+    *start = (uint8_t *) addr;
+    return size;
+}
+
+/**
+ * Support system call: munmap(). Remove a mapping of running task
+ * @param start    Address returned by mmap()
+ * @return 0 for success, -1 if no mapping starts at it
+ */
+int32_t system_munmap(uint8_t *start) {
+    int page_id = running_task()->page_id;
+    int i;
+
+    if (page_id < 0 || page_id >= TASK_PAGE_ID_COUNT || page_id_running[page_id] == PAGE_ID_FREE) {
+        DEBUG_ERR("system_munmap(): current task has no user space");
+        return -1;
+    }
+    for (i = 0; i < TASK_MMAP_MAX_REGION; i++) {
+        if (task_mmap[page_id][i].start != 0 && task_mmap[page_id][i].start == (uint32_t) start) {
+            task_mmap_unmap(page_id, &task_mmap[page_id][i]);
+            FLUSH_TLB();
+            return 0;
+        }
+    }
+
+    DEBUG_ERR("system_munmap(): no mapping at %x", (uint32_t) start);
+    return -1;
+}
+
+/**
+ * Get the count of pages of mmap() filled by copying or zeroing since boot
+ * @return The count
+ */
+uint32_t task_paging_get_mmap_fill_count() {
+    return task_mmap_fill_count;
+}
+
 
 /***************************** Helper Functions *******************************/
 
 /**
  * Turn on the paging for specific task (privilege = 3)
- * Specifically, map 128MB-132MB to start at 8MB + page id * 4MB
+ * Specifically, map 128MB-132MB to the page table of the page id, whose pages lie in 32MB + page id * 4MB
  * @param page_id    The page id of the task
  * @return 0
  * @effect The PD will be changed
  */
 static int task_set_img_paging(const int page_id) {
-    // The PDE to be set 
-    uint32_t pde = 0;
-
-    // Calculate the physical memory address, set at bit 22 
-    pde |= (((uint32_t) page_id + 2 + KERNEL_PAGE_OFFSET + 1) << 22U);  // +2 for 8MB
+    PDE_4kB_t *pde = (PDE_4kB_t *) &kernel_page_directory.entry[TASK_IMG_PAGE_ENTRY];
+    PDE_4kB_t *mmap_pde = (PDE_4kB_t *) &kernel_page_directory.entry[TASK_MMAP_PAGE_ENTRY];
 
-    // Set the flags of PDE 
-    pde |= TASK_IMG_PAGE_FLAG;
-
-    // Set the PDE 
-    kernel_page_directory.entry[TASK_IMG_PAGE_ENTRY] = pde;
+    // Set the PDEs to the page tables of the task. Read-only pages are marked in PTEs
+    clear_PDE_4kB(pde);
+    set_PDE_4kB(pde, (uint32_t) &task_img_pt[page_id], 1, 1, 1);
+    clear_PDE_4kB(mmap_pde);
+    set_PDE_4kB(mmap_pde, (uint32_t) &task_mmap_pt[page_id], 1, 1, 1);
 
     FLUSH_TLB();
 
@@ -182,7 +494,7 @@ static int task_set_img_paging(const int page_id) {
  */
 static int task_get_free_page_id() {
     int page_id = 0;
-    for (page_id = 0; page_id < TASK_MAX_COUNT; page_id++) {
+    for (page_id = 0; page_id < TASK_PAGE_ID_COUNT; page_id++) {
         if (page_id_running[page_id] == PAGE_ID_FREE) return page_id;
     }
     return -1;
@@ -191,59 +503,225 @@ static int task_get_free_page_id() {
 /**************** Executable File Operations ************/
 
 /**
- * Load the whole module at virtual memory TASK_START_MEM (128MB)
- * @param task    the task to be test 
- * @return        0 for not a ELF file, 1 for yes
- * @note          for a ELF file, the first 4 bytes: 0x7F, ELF (in ASCII)
+ * Map a page of the image area for running task and fill it with data of the segments it covers
+ * @param img          The image of the task
+ * @param page_addr    4KB-aligned virtual address in the image area
+ * @return 0 for success, -1 for fail
+ * @note The page is zero-filled first. Pages not covered by any segment (such as the stack) are kept zero.
  */
-static int task_load(dentry_t *task) {
-    uint8_t *task_page_p = (uint8_t *) TASK_IMG_LOAD_ADDR;   // the pointer for loading task
-    int i = 0;      // loop counter
-    int file_size = get_file_size(task->inode_num);
-    int cur_file_inode = task->inode_num;
+static int task_img_fill_page(const task_img_t *img, uint32_t page_addr) {
+    int page_id = running_task()->page_id;
+    uint32_t phys_addr;
+    uint32_t i;
+    uint32_t start, end;  // part of the segment in the file that lies in the page, as virtual address
+    uint8_t covered = 0, writable = 0;  // whether the page is covered by any segment, or by a writable one
+    PTE_t *pte = (PTE_t *) &task_img_pt[page_id].entry[(page_addr - TASK_IMG_START) / SIZE_4K];
+
+    // Pages of read-only segments (text) are read-only. Pages shared with a writable segment are writable
+    for (i = 0; i < img->seg_count; i++) {
+        if (img->segs[i].vaddr < page_addr + SIZE_4K && img->segs[i].vaddr + img->segs[i].memsz > page_addr) {
+            covered = 1;
+            if (img->segs[i].writable) writable = 1;
+        }
+    }
+
+    if ((phys_addr = page_frame_alloc()) == PAGE_FRAME_NULL) {
+        DEBUG_ERR("task_img_fill_page(): out of memory");
+        return -1;
+    }
 
-    read_data(cur_file_inode, i, task_page_p, file_size);
+    // Map the page first, then fill it through the virtual address (kernel ignores R/W in supervisor mode)
+    clear_PTE(pte);
+    set_PTE(pte, phys_addr, (!covered || writable), 1, 1);
+    memset((void *) page_addr, 0, SIZE_4K);
+
+    // Copy file data of each segment that overlaps with the page
+    for (i = 0; i < img->seg_count; i++) {
+        start = img->segs[i].vaddr;
+        end = img->segs[i].vaddr + img->segs[i].filesz;
+        if (start < page_addr) start = page_addr;
+        if (end > page_addr + SIZE_4K) end = page_addr + SIZE_4K;
+        if (start >= end) continue;
+
+        if (end - start != read_data(img->inode, img->segs[i].offset + (start - img->segs[i].vaddr),
+                                     (uint8_t *) start, end - start)) {
+            DEBUG_ERR("task_img_fill_page(): fail to read segment %u of inode %u", i, img->inode);
+            return -1;
+        }
+    }
 
     return 0;
 }
 
 /**
- * Test whether the file is a ELF file 
- * @param task    The task to be test
- * @return 0 for not a ELF file, 1 for yes
- * @note For a ELF file, the first 4 bytes: 0x7F, ELF (in ASCII)
+ * Map a page of the mmap area for running task and fill it with its mapping
+ * @param page_addr    4KB-aligned virtual address in the mmap area
+ * @return 0 for success, -1 if it's not in a mapping or out of memory
+ * @note The page is zero-filled, and data of the file is copied in. A short read (the file is truncated) leaves the
+ *       rest zero
  */
-static int task_is_executable(dentry_t *task) {
+static int task_mmap_fill_page(uint32_t page_addr) {
+    int page_id = running_task()->page_id;
+    task_mmap_region_t *region = NULL;
+    PTE_t *pte = (PTE_t *) &task_mmap_pt[page_id].entry[(page_addr - TASK_MMAP_START) / SIZE_4K];
+    uint32_t phys_addr, offset;
+    int i;
 
-    uint8_t buf[ELF_MAGIC_SIZE_IN_BYTE + 1];  // buffer for storing read
-    read_data(task->inode_num, 0, buf, ELF_MAGIC_SIZE_IN_BYTE);
+    for (i = 0; i < TASK_MMAP_MAX_REGION; i++) {
+        if (task_mmap[page_id][i].start != 0 && task_mmap[page_id][i].start <= page_addr &&
+            task_mmap[page_id][i].end > page_addr) {
+            region = &task_mmap[page_id][i];
+            break;
+        }
+    }
+    if (region == NULL) return -1;
+    offset = page_addr - region->start;
 
-    // Check the magic numbers 
-    int ret = 1;
-    ret &= (buf[0] == 0x7F);
-    ret &= (buf[1] == 'E');
-    ret &= (buf[2] == 'L');
-    ret &= (buf[3] == 'F');
+    if ((phys_addr = page_frame_alloc()) == PAGE_FRAME_NULL) {
+        DEBUG_ERR("task_mmap_fill_page(): out of memory");
+        return -1;
+    }
+
+    // Map the page first, then fill it through the virtual address (kernel ignores R/W in supervisor mode)
+    clear_PTE(pte);
+    set_PTE(pte, phys_addr, (region->inode == TASK_MMAP_ANONYMOUS), 1, 1);
+    memset((void *) page_addr, 0, SIZE_4K);
+
+    if (region->inode != TASK_MMAP_ANONYMOUS && offset < region->length) {
+        read_data(region->inode, offset, (uint8_t *) page_addr,
+                  (region->length - offset < SIZE_4K ? region->length - offset : SIZE_4K));
+    }
+
+    task_mmap_fill_count++;
+    return 0;
+}
+
+/**
+ * Clear the pages of a mapping and free its frames
+ * @param page_id    The page id
+ * @param region     The mapping, marked unused after this
+ * @note TLB is not flushed
+ */
+static void task_mmap_unmap(const int page_id, task_mmap_region_t *region) {
+    uint32_t addr;
+    PTE_t *pte;
+
+    for (addr = region->start; addr < region->end; addr += SIZE_4K) {
+        pte = (PTE_t *) &task_mmap_pt[page_id].entry[(addr - TASK_MMAP_START) / SIZE_4K];
+        if (pte->present) {
+            page_frame_free(pte->base_address << 12);  // 12: the offset of 4kB address
+        }
+        task_mmap_pt[page_id].entry[(addr - TASK_MMAP_START) / SIZE_4K] = 0;
+    }
+    region->start = region->end = 0;
+}
 
-    return ret;
+/**
+ * Free all frames mapped in the image page table of a page id, and clear the page table
+ * @param page_id    The page id
+ */
+static void task_paging_free_frames(const int page_id) {
+    int i;
+    PTE_t *pte;
+
+    for (i = 0; i < KERNEL_PAGE_TABLE_SIZE; i++) {
+        pte = (PTE_t *) &task_img_pt[page_id].entry[i];
+        if (pte->present) {
+            page_frame_free(pte->base_address << 12);  // 12: the offset of 4kB address
+        }
+        task_img_pt[page_id].entry[i] = 0;
+    }
 }
 
 /**
- * Get the EIP of the task in the elf file
- * @param task    The dentry of the elf file
- * @return Its EIP for success, -1 for fail
- * @note The eip is at byte 24~27
+ * Parse ELF header and program headers of a file
+ * @param task    The dentry of the file
+ * @param img     Output image info
+ * @return 0 for a valid executable, -1 for not
+ * @note For a ELF file, the first 4 bytes: 0x7F, ELF (in ASCII). All PT_LOAD segments must lie in 128MB-132MB.
  */
-static uint32_t task_get_eip(dentry_t *task) {
+static int task_img_parse(dentry_t *task, task_img_t *img) {
+    elf_header_t header;
+    elf_program_header_t ph;
+    uint32_t i;
+    int32_t file_size = get_file_size(task->inode_num);
 
-    uint32_t eip = 0;  // the return value
+    if (sizeof(header) != read_data(task->inode_num, 0, (uint8_t *) &header, sizeof(header))) return -1;
 
-    // Check if task is NULL
-    if (task == NULL) return -1;
+    // Check the magic numbers
+    if (header.ident[0] != 0x7F || header.ident[1] != 'E' || header.ident[2] != 'L' || header.ident[3] != 'F') {
+        return -1;
+    }
+
+    img->inode = task->inode_num;
+    img->eip = header.entry;
+    img->seg_count = 0;
+
+    // Collect PT_LOAD segments
+    for (i = 0; i < header.phnum; i++) {
+        if (sizeof(ph) != read_data(task->inode_num, header.phoff + i * header.phentsize, (uint8_t *) &ph,
+                                    sizeof(ph))) {
+            return -1;
+        }
+        if (ph.type != ELF_PT_LOAD || ph.memsz == 0) continue;
+
+        if (img->seg_count >= TASK_IMG_MAX_SEGMENT) {
+            DEBUG_ERR("task_img_parse(): too many segments in inode %u", task->inode_num);
+            return -1;
+        }
+        if (ph.vaddr < TASK_IMG_START || ph.memsz > TASK_IMG_END - ph.vaddr || ph.filesz > ph.memsz ||
+            ph.offset > file_size || ph.filesz > file_size - ph.offset) {
+            DEBUG_ERR("task_img_parse(): bad segment in inode %u", task->inode_num);
+            return -1;
+        }
+
+        img->segs[img->seg_count].offset = ph.offset;
+        img->segs[img->seg_count].vaddr = ph.vaddr;
+        img->segs[img->seg_count].filesz = ph.filesz;
+        img->segs[img->seg_count].memsz = ph.memsz;
+        img->segs[img->seg_count].writable = ((ph.flags & ELF_PF_W) != 0);
+        img->seg_count++;
+    }
 
-    /* Read EIP */
-    if (4 != read_data(task->inode_num, 24, (uint8_t *) &eip, 4)) return -1;
+    // Entry point must be in the image area
+    if (img->seg_count == 0 || img->eip < TASK_IMG_START || img->eip >= TASK_IMG_END) return -1;
 
-    return eip;
+    return 0;
 }
 
+/**
+ * Look up the image cache for a task, and parse the image into cache on miss
+ * @param task    The dentry of the file
+ * @return The cache entry, or NULL if the file size can't be read
+ * @note Cache is only accessed in execute, which runs with interrupts disabled
+ */
+static task_img_cache_entry_t *task_img_cache_get(dentry_t *task) {
+    int i;
+    task_img_cache_entry_t *entry = &img_cache[0];  // entry to replace on miss
+
+    img_cache_clock++;
+
+    // Look up the cache
+    for (i = 0; i < TASK_IMG_CACHE_SIZE; i++) {
+        if (img_cache[i].valid && img_cache[i].img.inode == task->inode_num) {
+            img_cache_hit++;
+            img_cache[i].last_use = img_cache_clock;
+            return &img_cache[i];
+        }
+        // Prefer invalid entry, otherwise the least recently used one
+        if (entry->valid && (!img_cache[i].valid || img_cache[i].last_use < entry->last_use)) {
+            entry = &img_cache[i];
+        }
+    }
+
+    img_cache_miss++;
+
+    // The victim is only replaced by a parsed image, so a bad file doesn't throw away a cached one
+    if (get_file_size(task->inode_num) < 0) return NULL;
+
+    entry->executable = (task_img_parse(task, &entry->img) == 0);
+    entry->img.inode = task->inode_num;  // also for non-executable file, so that it hits next time
+    entry->last_use = img_cache_clock;
+    entry->valid = 1;
+    return entry;
+}
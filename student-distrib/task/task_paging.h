@@ -5,8 +5,8 @@
  *  init_paging is done in boot.S 
  */
 
-#ifndef _VIDMEM_H
-#define _TERMINAL_VIDMEM_H
+#ifndef _TASK_PAGING_H
+#define _TASK_PAGING_H
 
 #include "../types.h"
 
@@ -22,12 +22,54 @@
  * 
  * Version 6.0 Tingkai Liu 2019.12.4
  * Support sVGA by moving the place for the tasks downwards 
+ *
+ * Version 6.1
+ * Cache of executable images keyed by inode
+ *
+ * Version 6.2
+ * Load PT_LOAD segments on demand with 4kB pages
+ *
+ * Version 6.3
+ * Support system call: mmap, munmap
  */
 
+#define TASK_IMG_MAX_SEGMENT    4  // max count of PT_LOAD segments of an executable
+
+// Max count of user programs at the same time. Each has a page table for the image and one for mmap(), so this is
+// kept well below TASK_MAX_COUNT, which mostly counts kernel tasks that don't need them
+#define TASK_PAGE_ID_COUNT      32
+
+// A loadable segment of an executable
+typedef struct task_img_seg_t {
+    uint32_t offset;    // offset in the file
+    uint32_t vaddr;     // virtual address to load
+    uint32_t filesz;    // bytes from the file
+    uint32_t memsz;     // bytes in memory, the part beyond filesz is zero
+    uint32_t writable;
+} task_img_seg_t;
+
+// Executable image to be loaded on demand
+typedef struct task_img_t {
+    uint32_t inode;
+    uint32_t eip;
+    uint32_t seg_count;
+    task_img_seg_t segs[TASK_IMG_MAX_SEGMENT];
+} task_img_t;
+
 void task_paging_init();
 int task_paging_allocate_and_set(const uint8_t *task_name, uint32_t *eip);  // called by system call execute
 int task_paging_deallocate(const int page_id);  // called by system call halt
 int task_paging_set(const int page_id); // call by running task for its page
+void task_paging_get_cache_stat(uint32_t *hit, uint32_t *miss);  // hit/miss of executable image cache
+void task_paging_invalidate_img(uint32_t inode);  // called when a file is written
+uint32_t task_paging_get_fault_count();  // count of image pages faulted in
+int task_paging_handle_fault(uint32_t addr, uint32_t err_code);  // called by page fault handler
+void task_paging_touch_user_buffer(const void *buf, uint32_t length);  // fault in pages before a lock
+int task_paging_touch_user_output(void *buf, uint32_t length);  // same, and check that the user may write them
+
+int32_t system_mmap(int32_t fd, int32_t length, uint8_t **start);
+int32_t system_munmap(uint8_t *start);
+uint32_t task_paging_get_mmap_fill_count();  // pages of mmap() loaded
 
-#endif /*_VIDMEM_H*/
+#endif /*_TASK_PAGING_H*/
 
@@ -10,11 +10,45 @@
 #include "task_paging.h"
 #include "../signal.h"
 #include "../gui/gui_render.h"
+#include "../rtc.h"
+#include "../fpu.h"
 
-task_list_node_t run_queue = TASK_LIST_SENTINEL(run_queue);
+/**
+ * Multilevel feedback queue. Each level has a run queue, level 0 is the highest. A bit in sched_ready_bitmap is set
+ * when a task is put into the queue of that level, and is cleared lazily when the queue is found empty, since tasks
+ * may leave a run queue through general task list functions (to a wait list, or at halt).
+ */
+static task_list_node_t sched_queue[SCHED_LEVEL_COUNT];
+static uint32_t sched_ready_bitmap = 0;
+static task_list_node_t idle_queue = TASK_LIST_SENTINEL(idle_queue);  // idle task, only run when nothing else to run
+static int32_t sched_age_time = 0;  // time since last aging [ms]
+
+static task_list_node_t sleep_list = TASK_LIST_SENTINEL(sleep_list);  // sleeping tasks, in order of wake_time
 
-#define GUI_RENDER_INTERVAL    3
-int gui_render_counter = 0;
+#define PIT_INPUT_FREQUENCY    1193182  // [Hz]
+#define PIT_COUNT_PER_MS       (PIT_INPUT_FREQUENCY / 1000)
+#define PIT_MAX_MS             (0xFFFF / PIT_COUNT_PER_MS)  // longest one-shot interval, about 54 ms
+#define PIT_CHANNEL0_PORT      0x40
+#define PIT_COMMAND_PORT       0x43
+
+#define GUI_RENDER_INTERVAL_MS      (3 * SCHED_PIT_INTERVAL)  // minimal interval between two frames
+#define CLOCK_UPDATE_INTERVAL_MS    250  // interval to read wall clock from CMOS
+
+/**
+ * Time keeping. sched_time advances by PIT interval in periodic mode, or by PIT counts consumed in tickless mode.
+ * Time slice of running task is charged at PIT interrupt and context switch, by time since sched_run_start.
+ */
+static uint32_t sched_time = 0;           // time since sched_init() [ms]
+static uint32_t sched_last_handled = 0;   // sched_time at last PIT interrupt
+static uint32_t sched_run_start = 0;      // sched_time when running task is charged last time
+static uint32_t gui_render_time = 0;      // sched_time of last GUI frame
+static uint32_t clock_update_time = 0;    // sched_time of last wall clock update
+static uint32_t sched_interrupt_count = 0;  // number of PIT interrupts
+
+#if SCHED_TICKLESS
+static uint32_t pit_armed_count = 0;       // count loaded into PIT channel 0, 0 if already accounted
+static uint32_t pit_count_remainder = 0;   // PIT counts less than 1 ms not yet added to sched_time
+#endif
 
 #if SCHED_ENABLE_KESP_CHECK
 
@@ -69,9 +103,77 @@ static void setup_pit(uint16_t hz);
  * Initialize scheduler
  */
 void sched_init() {
+    int i;
+    for (i = 0; i < SCHED_LEVEL_COUNT; i++) {
+        sched_queue[i].prev = sched_queue[i].next = &sched_queue[i];
+    }
+    sched_ready_bitmap = 0;
     setup_pit(SCHED_PIT_FREQUENCY);
 }
 
+/**
+ * Get the index of the lowest set bit
+ * @param x    Must not be 0
+ * @return Index of the lowest set bit
+ */
+static inline uint32_t sched_lowest_bit(uint32_t x) {
+    uint32_t ret;
+    asm volatile ("bsfl %1, %0" : "=r" (ret) : "rm" (x) : "cc");
+    return ret;
+}
+
+/**
+ * Put a task to the tail of the run queue of its level
+ * @param task    The task to be moved
+ * @note Use this function in a lock
+ */
+static void sched_move_to_level_tail_unsafe(task_t *task) {
+    task_list_node_t *queue;
+
+    if (task->flags & TASK_IDLE_TASK) {
+        queue = &idle_queue;
+    } else {
+        queue = &sched_queue[task->sched_ctrl.level];
+        sched_ready_bitmap |= (1U << task->sched_ctrl.level);
+    }
+
+    /*
+     * Be very careful since it may move task in the same list. Without this if, when the queue has only this task,
+     * queue->prev will be the task itself, and it will be completely detached from the queue.
+     */
+    if (queue->prev != &task->list_node) {
+        move_task_after_node_unsafe(task, queue->prev);
+    }
+}
+
+/**
+ * Pick the next task to run, which is the head of the highest non-empty level
+ * @param skip    If not NULL, this task won't be picked. Used for yield
+ * @return The task to run. Idle task if no other task is runnable. NULL if nothing can run (should never happen)
+ * @note Use this function in a lock
+ */
+static task_t *sched_pick_next_unsafe(task_t *skip) {
+    uint32_t bitmap = sched_ready_bitmap;
+    uint32_t level;
+    task_list_node_t *node;
+
+    while (bitmap) {
+        level = sched_lowest_bit(bitmap);
+        bitmap &= ~(1U << level);
+
+        node = sched_queue[level].next;
+        if (node == &sched_queue[level]) {  // empty queue, clear its bit
+            sched_ready_bitmap &= ~(1U << level);
+            continue;
+        }
+        if (skip != NULL && node == &skip->list_node) node = node->next;
+        if (node != &sched_queue[level]) return task_from_node(node);
+    }
+
+    if (idle_queue.next != &idle_queue) return task_from_node(idle_queue.next);
+    return NULL;
+}
+
 /**
  * Move current running task to an external list, mostly a wait list (lock needed)
  * @param new_prev    Pointer to new prev node
@@ -102,50 +204,208 @@ void sched_move_running_after_node_unsafe(task_list_node_t *node) {
 
 
 /**
- * Refill remain time of a task
- * @param task   The task to be refilled
+ * Advance sched_time by PIT counts consumed since it's armed
+ * @note In periodic mode, time only advances at PIT interrupts
+ * @note Use this function in a lock
  */
-void sched_refill_time(task_t *task) {
-    task->sched_ctrl.remain_time = SCHED_TASK_TIME;
+static void sched_timer_account_unsafe() {
+#if SCHED_TICKLESS
+    uint32_t count;
+
+    if (pit_armed_count == 0) return;  // already accounted
+
+    outb(0xE2, PIT_COMMAND_PORT);  // read-back status of channel 0
+    if (inb(PIT_CHANNEL0_PORT) & 0x80) {  // OUT is high, terminal count reached
+        count = pit_armed_count;
+    } else {
+        outb(0x00, PIT_COMMAND_PORT);  // latch count of channel 0
+        count = inb(PIT_CHANNEL0_PORT);
+        count |= inb(PIT_CHANNEL0_PORT) << 8;
+        count = (count <= pit_armed_count) ? pit_armed_count - count : 0;
+    }
+    pit_armed_count = 0;
+
+    count += pit_count_remainder;
+    sched_time += count / PIT_COUNT_PER_MS;
+    pit_count_remainder = count % PIT_COUNT_PER_MS;
+#endif
 }
 
 /**
- * Insert a task to the head of running queue
- * @param task    The task to be insert
- * @note Not includes refilling the time of the task
- * @note Not includes performing low-level context switch
+ * Charge time since last charging to running task
  * @note Use this function in a lock
  */
-void sched_insert_to_head_unsafe(task_t *task) {
-    move_task_after_node_unsafe(task, &run_queue);  // move the task from whatever list to run queue head
+static void sched_charge_running_unsafe() {
+    sched_timer_account_unsafe();
+    if ((running_task()->flags & TASK_IDLE_TASK) == 0) {
+        running_task()->sched_ctrl.remain_time -= sched_time - sched_run_start;
+    }
+    sched_run_start = sched_time;
 }
 
 /**
- * Perform low-level context switch to current head. Return after caller to this function is active again.
+ * Helper function to update the nearest deadline
+ * @param deadline    Pointer to current nearest deadline
+ * @param ms          Time to the new deadline, can be negative if it's already passed
+ */
+static inline void sched_deadline_min(int32_t *deadline, int32_t ms) {
+    if (ms < 1) ms = 1;
+    if (ms < *deadline) *deadline = ms;
+}
+
+/**
+ * Program PIT one-shot to the nearest deadline: end of time slice of to_run, GUI frame, wall clock update, signal
+ * alarm, aging or sleeping task. No-op in periodic mode.
+ * @param to_run    The task that is going to run
+ * @note Time must be accounted before calling this function
  * @note Use this function in a lock
  */
-void sched_launch_to_current_head() {
+static void sched_timer_arm_unsafe(task_t *to_run) {
+#if SCHED_TICKLESS
+    int32_t deadline = PIT_MAX_MS;
+    int32_t since_handled = sched_time - sched_last_handled;
 
-    task_t *to_run;
+    if ((to_run->flags & TASK_IDLE_TASK) == 0) {
+        sched_deadline_min(&deadline, to_run->sched_ctrl.remain_time);
+    }
+    if (gui_render_pending()) {
+        sched_deadline_min(&deadline, GUI_RENDER_INTERVAL_MS - (int32_t) (sched_time - gui_render_time));
+    }
+    sched_deadline_min(&deadline, CLOCK_UPDATE_INTERVAL_MS - (int32_t) (sched_time - clock_update_time));
+    if (focus_task()) {
+        sched_deadline_min(&deadline, SIGNAL_ALARM_INTERVAL_MS + 1 - focus_task()->signals.alarm_time - since_handled);
+    }
+    if (sched_ready_bitmap & ~1U) {  // only tasks not at level 0 need aging
+        sched_deadline_min(&deadline, SCHED_AGING_INTERVAL - sched_age_time - since_handled);
+    }
+    if (sleep_list.next != &sleep_list) {
+        sched_deadline_min(&deadline, (int32_t) (task_from_node(sleep_list.next)->sched_ctrl.wake_time - sched_time));
+    }
 
-    if (run_queue.next == &run_queue) {  // nothing to run
-        DEBUG_ERR("sched_launch_to_current_head(): run queue should never be empty!");
-        return;
+    pit_armed_count = deadline * PIT_COUNT_PER_MS;
+    outb(0x30, PIT_COMMAND_PORT);  // channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    outb(pit_armed_count & 0xFF, PIT_CHANNEL0_PORT);
+    outb(pit_armed_count >> 8, PIT_CHANNEL0_PORT);
+#else
+    (void) to_run;
+#endif
+}
+
+/**
+ * Update time keeping before switching to a task, including charging the running task and re-programming PIT
+ * @param to_run    The task that is going to run
+ * @note Context switches outside scheduler (execute and halt) should also call this function
+ * @note Use this function in a lock
+ */
+void sched_timer_switch_unsafe(task_t *to_run) {
+    sched_charge_running_unsafe();
+    sched_timer_arm_unsafe(to_run);
+    if (to_run->vidmap_enabled) terminal_mark_dirty(to_run->terminal);  // it may draw to its video memory
+}
+
+/**
+ * Re-program PIT since a deadline may come earlier, such as a GUI frame is requested
+ */
+void sched_timer_update() {
+#if SCHED_TICKLESS
+    uint32_t flags;
+    if (task_count == 0) return;  // scheduler is not running yet
+    cli_and_save(flags);
+    {
+        sched_timer_account_unsafe();
+        sched_timer_arm_unsafe(running_task());
     }
+    restore_flags(flags);
+#endif
+}
+
+/**
+ * Put running task to sleep
+ * @param ms    Time to sleep [ms]
+ * @note Use this function in a lock
+ */
+void sched_sleep_unsafe(uint32_t ms) {
+    task_list_node_t *node;
+    task_t *task = running_task();
+
+    sched_timer_account_unsafe();
+    task->sched_ctrl.wake_time = sched_time + ms;
+
+    // Keep sleep list in order of wake time
+    task_list_for_each(node, &sleep_list) {
+        if ((int32_t) (task_from_node(node)->sched_ctrl.wake_time - task->sched_ctrl.wake_time) > 0) break;
+    }
+    sched_move_running_to_list_unsafe(node->prev, node);
+    sched_launch_to_current_head();
+}
+
+/**
+ * Get time since scheduler starts
+ * @return Time [ms]
+ */
+uint32_t sched_get_time() {
+    return sched_time;
+}
+
+/**
+ * Get number of PIT interrupts since scheduler starts
+ * @return Interrupt count
+ */
+uint32_t sched_get_interrupt_count() {
+    return sched_interrupt_count;
+}
+
+/**
+ * Refill remain time of a task with the time slice of its level
+ * @param task   The task to be refilled
+ */
+void sched_refill_time(task_t *task) {
+    task->sched_ctrl.remain_time = SCHED_LEVEL_TIME(task->sched_ctrl.level);
+}
 
-    // Get next task to run
-    to_run = task_from_node(run_queue.next);
+/**
+ * Initialize scheduling info of a new task. Start at the highest level allowed by its nice value.
+ * @param task    The new task
+ * @param nice    Nice value, inherited from its parent
+ */
+void sched_init_task(task_t *task, int32_t nice) {
+    task->sched_ctrl.nice = nice;
+    task->sched_ctrl.level = nice;
+    sched_refill_time(task);
+}
 
-    if (to_run->flags & TASK_IDLE_TASK) {  // the head is idle task
-        if (to_run->list_node.next != &run_queue) {  // there are still other task to run
-            move_task_after_node_unsafe(to_run, run_queue.prev);  // move idle task to last
-            to_run = task_from_node(run_queue.next);  // reload
-        }  // if no other task is runnable, run idle task
+/**
+ * Insert a task to the head of the run queue of the highest level allowed by its nice value, and refill its time
+ * @param task    The task to be insert, which is a new task or is waked up from a wait list
+ * @note Tasks that block on terminal, RTC or child get boosted here, so interactive tasks stay responsive
+ * @note Not includes performing low-level context switch
+ * @note Use this function in a lock
+ */
+void sched_insert_to_head_unsafe(task_t *task) {
+    if (task->flags & TASK_IDLE_TASK) {
+        move_task_after_node_unsafe(task, &idle_queue);
+        return;
     }
+    task->sched_ctrl.level = task->sched_ctrl.nice;
+    task->sched_ctrl.wake_tsc = rdtsc();
+    sched_refill_time(task);
+    move_task_after_node_unsafe(task, &sched_queue[task->sched_ctrl.level]);  // move from whatever list to the head
+    sched_ready_bitmap |= (1U << task->sched_ctrl.level);
+}
+
+/**
+ * Perform low-level context switch to a task. Return after caller to this function is active again.
+ * @param to_run    The task to run
+ * @note Use this function in a lock
+ */
+static void sched_switch_to_unsafe(task_t *to_run) {
 
     // If they are the same, do nothing
     if (running_task() == to_run) return;
 
+    // Charge running task and re-program PIT for to_run
+    sched_timer_switch_unsafe(to_run);
+
     // Switch terminal
     terminal_set_running(to_run->terminal);
 
@@ -158,6 +418,9 @@ void sched_launch_to_current_head() {
     // FIXME: even to_run is a kernel task, we still need to call this function, or EXCEPTION 14. Not sure why yet...
     task_apply_user_vidmap(to_run);
 
+    // Let the first x87/SSE instruction of to_run trap if it doesn't own the FPU
+    fpu_switch_unsafe(to_run);
+
     // Set tss to to_run's kernel stack to make sure system calls use correct stack
     // Whenever switch from user to kernel stack, kernel stack should be clean, so tss.esp0 should always be kesp_base
     tss.esp0 = to_run->kesp_base;
@@ -167,21 +430,92 @@ void sched_launch_to_current_head() {
 }
 
 /**
- * Move running task to the end of the run queue
+ * Perform low-level context switch to the head of the highest non-empty level. Return after caller to this function
+ * is active again.
+ * @note Use this function in a lock
+ */
+void sched_launch_to_current_head() {
+
+    task_t *to_run = sched_pick_next_unsafe(NULL);
+
+    if (to_run == NULL) {  // nothing to run
+        DEBUG_ERR("sched_launch_to_current_head(): run queue should never be empty!");
+        return;
+    }
+
+    sched_switch_to_unsafe(to_run);
+}
+
+/**
+ * Move running task to the end of the run queue of its level
  * @note Always use running_task() instead of first element in run queue
  * @note Use this function in a lock
  */
 void sched_move_running_to_last() {
+    sched_move_to_level_tail_unsafe(running_task());
+}
 
-    /*
-     * Be very careful since it moves task in the same list. Without this if, when run_queue has only current running
-     * task, run_queue.prev will be running_task itself, and it will be completely detached from run queue.
-     */
-    if (run_queue.prev != &running_task()->list_node) {
-        move_task_after_node_unsafe(running_task(), run_queue.prev);
+/**
+ * Move every task one level up (but not above its nice value), so that tasks at low levels won't starve
+ * @note Use this function in a lock
+ */
+static void sched_age_unsafe() {
+    int level;
+    task_list_node_t *node;
+    task_list_node_t *temp;
+    task_t *task;
+
+    // From high to low, so that a task is moved at most once
+    for (level = 1; level < SCHED_LEVEL_COUNT; level++) {
+        task_list_for_each_safe(node, &sched_queue[level], temp) {
+            task = task_from_node(node);
+            if (task->sched_ctrl.level > task->sched_ctrl.nice) {
+                task->sched_ctrl.level--;
+                sched_move_to_level_tail_unsafe(task);
+            }
+        }
     }
 }
 
+/**
+ * Set nice value of running task, which is the highest level it can get
+ * @param inc    Increment of nice value. Positive to lower priority
+ * @return New nice value, clamped to [0, SCHED_LEVEL_COUNT - 1], or -1 if a user task tries to raise its priority
+ * @note Only kernel tasks may decrease nice value. Otherwise a user program could nice itself above the shell and
+ *       the GUI, and the value it inherits from its parent would mean nothing
+ */
+int32_t system_nice(int32_t inc) {
+    uint32_t flags;
+    int32_t nice;
+    task_t *task;
+
+    cli_and_save(flags);
+    {
+        task = running_task();
+        if (inc < 0 && !(task->flags & TASK_KERNEL_TASK)) {
+            restore_flags(flags);
+            return -1;
+        }
+
+        // Clamp the increment first, so that a huge one doesn't overflow and wrap to the other end
+        if (inc > SCHED_LEVEL_COUNT - 1) inc = SCHED_LEVEL_COUNT - 1;
+        if (inc < -(SCHED_LEVEL_COUNT - 1)) inc = -(SCHED_LEVEL_COUNT - 1);
+        nice = task->sched_ctrl.nice + inc;
+        if (nice < 0) nice = 0;
+        if (nice > SCHED_LEVEL_COUNT - 1) nice = SCHED_LEVEL_COUNT - 1;
+        task->sched_ctrl.nice = nice;
+
+        if (task->sched_ctrl.level < nice) {  // lower than allowed now
+            task->sched_ctrl.level = nice;
+            sched_move_running_to_last();
+            // No need to switch now. Higher task will preempt at next PIT interrupt
+        }
+    }
+    restore_flags(flags);
+
+    return nice;
+}
+
 /**
  * Interrupt handler for PIT
  * @usage Used in idt_asm.S
@@ -191,22 +525,41 @@ asmlinkage void sched_pit_interrupt_handler(hw_context_t hw_context) {
 
     // We are using interrupt gate now, so we don't need a lock
 
-    if (run_queue.next == &run_queue) {  // no runnable task
-        DEBUG_ERR("sched_launch_to_current_head(): run queue should never be empty!");
-        idt_send_eoi(hw_context.irq_exp_num);
-        return;
-    }
+    task_t *to_run;
+    task_t *running = running_task();
+    int expired = 0;  // whether running task runs out of its time and is moved to the tail
+    uint32_t elapsed;
+
+    sched_interrupt_count++;
+
+    // Update time and charge running task
+#if !SCHED_TICKLESS
+    sched_time += SCHED_PIT_INTERVAL;
+#endif
+    sched_charge_running_unsafe();
+    elapsed = sched_time - sched_last_handled;
+    sched_last_handled = sched_time;
 
     // Render GUI
-    gui_render_counter++;
-    if (gui_render_counter >= GUI_RENDER_INTERVAL) {
-        gui_render();
-        gui_render_counter = 0;
+    if (running->vidmap_enabled) terminal_mark_dirty(running->terminal);  // it may draw to its video memory
+#if SCHED_TICKLESS
+    if (gui_render_pending() && sched_time - gui_render_time >= GUI_RENDER_INTERVAL_MS) {
+#else
+    if (sched_time - gui_render_time >= GUI_RENDER_INTERVAL_MS) {
+#endif
+        if (gui_compositor_wake_unsafe() != 0) gui_render();  // render in the handler if no compositor task
+        gui_render_time = sched_time;
+    }
+
+    // Update wall clock
+    if (sched_time - clock_update_time >= CLOCK_UPDATE_INTERVAL_MS) {
+        update_system_time();
+        clock_update_time = sched_time;
     }
 
     // Handle signal ALARM
     if (focus_task()) {
-        focus_task()->signals.alarm_time += SCHED_PIT_INTERVAL;
+        focus_task()->signals.alarm_time += elapsed;
         if (focus_task()->signals.alarm_time > SIGNAL_ALARM_INTERVAL_MS) {
             signal_send(SIGNAL_ALARM);
             focus_task()->signals.alarm_time = 0;
@@ -216,43 +569,56 @@ asmlinkage void sched_pit_interrupt_handler(hw_context_t hw_context) {
 
     // Handle scheduling
 
-    task_t *running = running_task();
-
     _sched_check_kesp();
 
-    if (running->flags & TASK_IDLE_TASK) {
-
-        sched_move_running_to_last();
-
-        idt_send_eoi(hw_context.irq_exp_num); // must send EOI before context switch, or PIT won't work in new task
-        sched_launch_to_current_head();  // return after this thread get running again
-
-    } else {
+    sched_age_time += elapsed;
+    if (sched_age_time >= SCHED_AGING_INTERVAL) {
+        sched_age_unsafe();
+        sched_age_time = 0;
+    }
 
-        // Decrease available time of current running task
-        running->sched_ctrl.remain_time -= SCHED_PIT_INTERVAL;
+    // Wake up sleeping tasks
+    while (sleep_list.next != &sleep_list &&
+           (int32_t) (task_from_node(sleep_list.next)->sched_ctrl.wake_time - sched_time) <= 0) {
+        sched_insert_to_head_unsafe(task_from_node(sleep_list.next));
+    }
 
+    if ((running->flags & TASK_IDLE_TASK) == 0) {
         if (running->sched_ctrl.remain_time <= 0) {  // running_task runs out of its time
             /*
-             *  Re-fill remain time when putting a task to the end, instead of when getting it to running.
+             *  Demote and re-fill remain time when putting a task to the end, instead of when getting it to running.
              *  For example, task A have 30 ms left, but task B was inserted to the head of run queue because of
-             *  rtc read() complete, etc. After B runs out of its time, A should have 30ms, rather than re-filling
-             *  it with 50 ms.
+             *  rtc read() complete, etc. After B runs out of its time, A should have 30ms, rather than re-filling it.
              */
+            if (running->sched_ctrl.level < SCHED_LEVEL_COUNT - 1) running->sched_ctrl.level++;
             sched_refill_time(running);
             sched_move_running_to_last();
-
-            idt_send_eoi(hw_context.irq_exp_num); // must send EOI before context switch, or PIT won't work then
-            sched_launch_to_current_head();  // return after this thread get running again
-        } else {
-            idt_send_eoi(hw_context.irq_exp_num);
+            expired = 1;
         }
     }
 
+    to_run = sched_pick_next_unsafe(NULL);
+    if (to_run == NULL) {  // no runnable task
+        DEBUG_ERR("sched_pit_interrupt_handler(): run queue should never be empty!");
+    }
+
+    idt_send_eoi(hw_context.irq_exp_num); // must send EOI before context switch, or PIT won't work in new task
+
+    /*
+     * Switch if running task is moved to the tail, or a task at a higher level becomes runnable (woken up or aged).
+     * Otherwise the running task is at the head of its level, or is preempted by a task at the same level that is
+     * inserted to the head, which has already run.
+     */
+    if (to_run != NULL && to_run != running &&
+        (expired || (running->flags & TASK_IDLE_TASK) || to_run->sched_ctrl.level < running->sched_ctrl.level)) {
+        sched_switch_to_unsafe(to_run);  // return after this thread get running again
+    } else {
+        sched_timer_arm_unsafe(running);
+    }
 }
 
 /**
- * Give up remaining available time of current task and yield CPU to other task
+ * Give up remaining available time of current task and yield CPU to other task, including those at lower levels
  * @note Use this function in a lock
  * @note Do not use in interrupt context etc. Only use it in process body.
  * @note If there is no more task in the run queue (only idle task), this function will return immediately. In this
@@ -260,30 +626,48 @@ asmlinkage void sched_pit_interrupt_handler(hw_context_t hw_context) {
  *       still happen in this case (limited lock range, for example)
  */
 void sched_yield_unsafe() {
-    if ((running_task()->flags & TASK_IDLE_TASK) == NULL) {
-        sched_refill_time(running_task());
+    task_t *to_run;
+
+    if (running_task()->flags & TASK_IDLE_TASK) {
+        sched_launch_to_current_head();
+        return;
     }
+
+    sched_charge_running_unsafe();  // before refilling
+    sched_refill_time(running_task());
     sched_move_running_to_last();
-    sched_launch_to_current_head();  // return after this thread get running again
+
+    to_run = sched_pick_next_unsafe(running_task());
+    if (to_run == NULL || (to_run->flags & TASK_IDLE_TASK)) return;  // nothing else to run
+    sched_switch_to_unsafe(to_run);  // return after this thread get running again
 }
 
 /**
  * Start PIT interrupt
  * @param hz    PIT clock frequency
  * @note Reference: http://www.osdever.net/bkerndev/Docs/pit.htm
+ * @note In tickless mode, the first interrupt comes after one period, then PIT is re-programmed at each interrupt
  */
 static void setup_pit(uint16_t hz) {
-    uint16_t divisor = 1193180 / hz;
-    outb(0x36, 0x34);  // set command byte 0x36
-    outb(divisor & 0xFF, 0x40);   // Set low byte of divisor
-    outb(divisor >> 8, 0x40);     // Set high byte of divisor
+    uint16_t divisor = PIT_INPUT_FREQUENCY / hz;
+#if SCHED_TICKLESS
+    pit_armed_count = divisor;
+    outb(0x30, PIT_COMMAND_PORT);  // channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count)
+#else
+    outb(0x36, PIT_COMMAND_PORT);  // channel 0, lobyte/hibyte, mode 3 (square wave)
+#endif
+    outb(divisor & 0xFF, PIT_CHANNEL0_PORT);   // Set low byte of divisor
+    outb(divisor >> 8, PIT_CHANNEL0_PORT);     // Set high byte of divisor
 }
 
 int sched_print_run_queue() {
     int count = 0;
+    int level;
     task_list_node_t *node;
-    task_list_for_each(node, &run_queue) {
-        printf("[%d] %s\n", count++, task_from_node(node)->executable_name);
+    for (level = 0; level < SCHED_LEVEL_COUNT; level++) {
+        task_list_for_each(node, &sched_queue[level]) {
+            printf("[%d] L%d %s\n", count++, level, task_from_node(node)->executable_name);
+        }
     }
     return count;
 }
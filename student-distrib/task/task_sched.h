@@ -16,13 +16,18 @@
 
 #define SCHED_ENABLE_KESP_CHECK    1
 
-#define SCHED_PIT_FREQUENCY    100  // frequency of PIT [Hz]
-#define SCHED_PIT_INTERVAL     (1000 / SCHED_PIT_FREQUENCY)  // time quantum of scheduler [ms]
-#define SCHED_TASK_TIME        50  // full available time for each task [ms]
+// If enabled, PIT is programmed one-shot to the next deadline instead of ticking at SCHED_PIT_FREQUENCY, and RTC
+// interrupt is turned off when no task is waiting for it
+#define SCHED_TICKLESS         1
 
-extern task_list_node_t run_queue;
+#define SCHED_PIT_FREQUENCY    100  // frequency of PIT when not tickless [Hz]
+#define SCHED_PIT_INTERVAL     (1000 / SCHED_PIT_FREQUENCY)  // time quantum of scheduler [ms]
+#define SCHED_LEVEL_COUNT      8   // number of levels of multilevel feedback queue, no more than 32
+#define SCHED_LEVEL_TIME(level)    (SCHED_PIT_INTERVAL * 2 * ((level) + 1))  // time slice of each level [ms]
+#define SCHED_AGING_INTERVAL   1000  // interval to move every task one level up [ms]
 
 void sched_init();
+void sched_init_task(task_t* task, int32_t nice);
 void sched_refill_time(task_t* task);
 void sched_insert_to_head_unsafe(task_t* task);
 void sched_move_running_to_list_unsafe(task_list_node_t* new_prev, task_list_node_t* new_next);
@@ -30,6 +35,13 @@ void sched_move_running_after_node_unsafe(task_list_node_t* node);
 void sched_yield_unsafe();
 
 void sched_launch_to_current_head();
+void sched_timer_switch_unsafe(task_t* to_run);
+void sched_timer_update();
+void sched_sleep_unsafe(uint32_t ms);
+uint32_t sched_get_time();
+uint32_t sched_get_interrupt_count();
+
+int32_t system_nice(int32_t inc);
 
 #endif // ASM
 #endif // _TASK_SCHED_H
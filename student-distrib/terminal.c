@@ -10,6 +10,7 @@
 #include "vidmem.h"
 #include "signal.h"
 #include "beep.h"
+#include "gui/gui_render.h"
 
 #define KEYBOARD_PORT   0x60    /* keyboard scancode port */
 #define KEYBOARD_FLAG_SIZE 128
@@ -27,6 +28,8 @@
 
 #define SCANCODE_PRESSED 0x80
 
+#define TERMINAL_WRITE_CHUNK    4096  // max bytes written to screen buffer in one lock
+
 // Temporary height and width for text mode
 #define TEXT_MODE_WIDTH 80
 #define TEXT_MODE_HEIGHT 25
@@ -84,12 +87,15 @@ static const char caps_scan_code_table[128] = {
 static uint8_t key_flags[KEYBOARD_FLAG_SIZE];
 // Bit vector used to check whether the CapsLock is on
 static uint8_t capslock_status = 0;
+// TSC at the start of the keyboard interrupt being handled
+static uint32_t keyboard_irq_tsc;
 
 // Local wait list for the terminals
 task_list_node_t terminal_wait_list = TASK_LIST_SENTINEL(terminal_wait_list);
 terminal_t terminal_slot[TERMINAL_MAX_COUNT];
 
 void handle_scan_code(uint8_t scan_code);
+static void terminal_wake_reader_unsafe();
 
 terminal_t *running_term_ = &null_terminal;
 
@@ -100,11 +106,16 @@ terminal_t *running_term() {
 terminal_t null_terminal = {
         .valid = 1,
         .terminal_id = NULL_TERMINAL_ID,
-        .key_buf_cnt = 0,
+        .key_buf_head = 0,
+        .key_buf_tail = 0,
+        .key_buf_line_start = 0,
+        .key_buf_line_head = 0,
+        .key_buf_line_cnt = 0,
         .screen_width = TEXT_MODE_WIDTH,
         .screen_height = TEXT_MODE_HEIGHT,
         .screen_x = 0,
-        .screen_y = 0
+        .screen_y = 0,
+        .screen_dirty_rows = SCREEN_ALL_ROWS
 };
 
 /**
@@ -117,6 +128,8 @@ asmlinkage void keyboard_interrupt_handler(hw_context_t hw_context) {
 
     // We are using interrupt gate now, so we don't need a lock
 
+    keyboard_irq_tsc = rdtsc();  // keypress-to-screen latency is measured from here, see gui_render_input()
+
     // Get scan code from port 0x60
     uint8_t scancode = inb(KEYBOARD_PORT);
 
@@ -162,26 +175,20 @@ void handle_scan_code(uint8_t scan_code) {
         // If Enter and someone is reading from the keyboard
         terminal_t *focus_term = focus_task()->terminal;
 
-        if ((0 != focus_term->user_ask_len) && (ENTER_PRESS == scan_code)) {
-
-            focus_term->key_buf[focus_term->key_buf_cnt] = '\n';
-            putc('\n');
-            focus_term->key_buf_cnt++;
-
-            // Wake up the sleep task
-            focus_task()->flags &= ~TASK_WAITING_TERMINAL;
-            sched_refill_time(focus_task());
-            // Don't worry. This whole function is already placed in a lock
-            sched_insert_to_head_unsafe(focus_task());
-            sched_launch_to_current_head();
-            // Return after this task is active again...
-            return;
-        }
-
-        // If Enter and no one is reading from the keyboard, clear the keyboard buffer
-        if ((0 == focus_term->user_ask_len) && (ENTER_PRESS == scan_code)) {
-            focus_term->key_buf_cnt = 0;
-            putc('\n');
+        // If Enter, commit the line. If no one is reading now, the line is kept for the next read (type-ahead)
+        if (ENTER_PRESS == scan_code) {
+            if (focus_term->key_buf_tail - focus_term->key_buf_head < KEYBOARD_BUF_SIZE &&
+                focus_term->key_buf_line_cnt < KEYBOARD_MAX_LINES) {
+                focus_term->key_buf_newline[(focus_term->key_buf_line_head + focus_term->key_buf_line_cnt) &
+                                            KEYBOARD_LINE_MASK] = focus_term->key_buf_tail;
+                focus_term->key_buf_line_cnt++;
+                focus_term->key_buf[focus_term->key_buf_tail & KEYBOARD_BUF_MASK] = '\n';
+                focus_term->key_buf_tail++;
+                focus_term->key_buf_line_start = focus_term->key_buf_tail;
+                putc('\n');
+                gui_render_input(keyboard_irq_tsc);
+            }
+            if (0 != focus_term->user_ask_len) terminal_wake_reader_unsafe();
             return;
         }
 
@@ -204,9 +211,9 @@ void handle_scan_code(uint8_t scan_code) {
 
             // Keep the last typed line
             printf("391OS> ");
-            int i;
-            for (i = 0; i < focus_term->key_buf_cnt; i++) {
-                putc(focus_term->key_buf[i]);
+            uint32_t i;
+            for (i = focus_term->key_buf_line_start; i != focus_term->key_buf_tail; i++) {
+                putc(focus_term->key_buf[i & KEYBOARD_BUF_MASK]);
             }
             return;
         }
@@ -224,11 +231,13 @@ void handle_scan_code(uint8_t scan_code) {
         }
 
         // If backspace
-        // Just putc then delete the char in the key_buf
+        // Just putc then delete the char in the key_buf. Committed lines and characters already read can't be erased.
         if (1 == key_flags[BACKSPACE_PRESS]) {
-            if (0 < focus_term->key_buf_cnt) {
+            if (focus_term->key_buf_tail != focus_term->key_buf_line_start &&
+                focus_term->key_buf_tail != focus_term->key_buf_head) {
                 putc('\b');
-                focus_term->key_buf_cnt--;
+                focus_term->key_buf_tail--;
+                gui_render_input(keyboard_irq_tsc);
             }
         } else {
 
@@ -248,29 +257,36 @@ void handle_scan_code(uint8_t scan_code) {
                 character = caps_scan_code_table[scan_code];
             }
 
+            // Keep one slot so that the line can always be committed by Enter
             if (0 != character) {
-                if (focus_term->key_buf_cnt < KEYBOARD_BUF_SIZE - 1) {
-                    focus_term->key_buf[focus_term->key_buf_cnt] = character;
+                if (focus_term->key_buf_tail - focus_term->key_buf_head < KEYBOARD_BUF_SIZE - 1) {
+                    focus_term->key_buf[focus_term->key_buf_tail & KEYBOARD_BUF_MASK] = character;
                     putc(character);
-                    focus_term->key_buf_cnt++;
+                    focus_term->key_buf_tail++;
+                    gui_render_input(keyboard_irq_tsc);
                 }
             }
 
         }
         // If we reached the length user wants, return
-        if (focus_term->user_ask_len > 0 && focus_term->key_buf_cnt >= focus_term->user_ask_len) {
-            // Wake up the sleep task
-            // No lock is needed, since this function is already placed in a lock
-            focus_task()->flags &= ~TASK_WAITING_TERMINAL;
-            sched_refill_time(focus_task());
-            // Don't worry. This whole function is already placed in a lock
-            sched_insert_to_head_unsafe(focus_task());
-            sched_launch_to_current_head();
-            // Return after this task is active again...
+        if (focus_term->user_ask_len > 0 &&
+            focus_term->key_buf_tail - focus_term->key_buf_head >= (uint32_t) focus_term->user_ask_len) {
+            terminal_wake_reader_unsafe();
         }
     }
 }
 
+/**
+ * Wake up the focus task, which is waiting on its terminal for input
+ * @note Only called in keyboard interrupt, which is already placed in a lock
+ */
+static void terminal_wake_reader_unsafe() {
+    focus_task()->flags &= ~TASK_WAITING_TERMINAL;
+    sched_insert_to_head_unsafe(focus_task());
+    sched_launch_to_current_head();
+    // Return after this task is active again...
+}
+
 /**
  * System call implementation for terminal open
  * @param filename    No use
@@ -296,69 +312,70 @@ int32_t system_terminal_close(int32_t fd) {
  * @param fd        File descriptor, must be 0
  * @param buf       Buffer to store output
  * @param nbytes    Maximal number of bytes to write
- * @return When enter is pressed or nbytes (< 128) is reached
+ * @return When enter is pressed or nbytes (< KEYBOARD_BUF_SIZE) is reached, number of bytes read excluding '\n'
+ * @note Positions of '\n' are queued by the keyboard handler, so a read is at most two memcpy and never scans
  */
 int32_t system_terminal_read(int32_t fd, void *buf, int32_t nbytes) {
-    int32_t i = 0;  // record how many characters are read from the buffer before we reach nbytes, key_buf_size or '\n'
-    int32_t j;  // counter
-    int32_t to_delete = 0;
-    int32_t to_continue = 1;
+    uint32_t cnt;  // number of characters to copy before we reach nbytes or '\n'
+    uint32_t start;  // masked index of key_buf_head
+    uint32_t first_part;  // number of characters before wrapping around the ring buffer
+    terminal_t *term;
     uint32_t flags;
 
     if (fd != 0) {
         DEBUG_ERR("system_terminal_read(): invalid fd %d for terminal read", fd);
         return -1;
     }
+    if (nbytes <= 0) return 0;
 
     cli_and_save(flags);
     {
-        // If user asks more than 128 bytes of data, then just return 128 bytes.
-        if (nbytes > KEYBOARD_BUF_SIZE) {
-            nbytes = KEYBOARD_BUF_SIZE;
-        }
-
-        running_task()->terminal->user_ask_len = nbytes;
+        term = running_task()->terminal;
 
-        // Perform full scan, in case key buffer changes in an unexpected way.
-        // For example, an backspace and an enter are pressed during two loops, we need to identify that enter.
-        for (i = 0; (i < running_task()->terminal->key_buf_cnt) && (i < nbytes); i++) {
-            if (running_task()->terminal->key_buf[i] == '\n') {
-                to_continue = 0;
-                break;  // exit for
-            }
-        }
-        if (i == nbytes) {  // already fulfill buffer given by user, return immediately
-            to_continue = 0;
+        // The buffer holds at most KEYBOARD_BUF_SIZE - 1 characters without '\n'
+        if (nbytes > KEYBOARD_BUF_SIZE - 1) {
+            nbytes = KEYBOARD_BUF_SIZE - 1;
         }
 
-        if (1 == to_continue) {
+        if (0 == term->key_buf_line_cnt && term->key_buf_tail - term->key_buf_head < (uint32_t) nbytes) {
+            term->user_ask_len = nbytes;
             // Set the task to sleep
             running_task()->flags |= TASK_WAITING_TERMINAL;
             // Already in lock
             sched_move_running_after_node_unsafe(&terminal_wait_list);
             sched_launch_to_current_head();
             // Return after this task is active again...
-
-            // Re-count i. Now must not continue
-            for (i = 0; (i < running_task()->terminal->key_buf_cnt) && (i < nbytes); i++) {
-                if (running_task()->terminal->key_buf[i] == '\n') {
-                    break;  // exit for
-                }
-            }
+            term->user_ask_len = 0;  // serves the same function as whether_read
         }
 
-        running_task()->terminal->user_ask_len = 0;  // serves the same function as whether_read
+        if (term->key_buf_line_cnt > 0) {
+            cnt = term->key_buf_newline[term->key_buf_line_head & KEYBOARD_LINE_MASK] - term->key_buf_head;
+        } else {
+            cnt = term->key_buf_tail - term->key_buf_head;
+        }
+        if (cnt > (uint32_t) nbytes) cnt = nbytes;
 
-        memcpy(buf, running_task()->terminal->key_buf, i);
-        to_delete = i + (running_task()->terminal->key_buf[i] == '\n');
-        for (j = to_delete; j < running_task()->terminal->key_buf_cnt; j++) {
-            running_task()->terminal->key_buf[j - to_delete] = running_task()->terminal->key_buf[j];
+        start = term->key_buf_head & KEYBOARD_BUF_MASK;
+        first_part = KEYBOARD_BUF_SIZE - start;
+        if (first_part >= cnt) {
+            memcpy(buf, &term->key_buf[start], cnt);
+        } else {
+            memcpy(buf, &term->key_buf[start], first_part);
+            memcpy((uint8_t *) buf + first_part, term->key_buf, cnt - first_part);
+        }
+        term->key_buf_head += cnt;
+
+        // Consume the '\n' if the whole line is read. The next one, if typed ahead, is the next slot of the ring
+        if (term->key_buf_line_cnt > 0 &&
+            term->key_buf_head == term->key_buf_newline[term->key_buf_line_head & KEYBOARD_LINE_MASK]) {
+            term->key_buf_head++;
+            term->key_buf_line_head++;
+            term->key_buf_line_cnt--;
         }
-        running_task()->terminal->key_buf_cnt -= to_delete;
     }
     restore_flags(flags);
 
-    return i;
+    return cnt;
 }
 
 /**
@@ -366,27 +383,34 @@ int32_t system_terminal_read(int32_t fd, void *buf, int32_t nbytes) {
  * @param fd        File descriptor, must be 1
  * @param buf       Buffer of content to write
  * @param nbytes    Number of bytes to write
- * @return 0 on success, -1 on failure
+ * @return Number of bytes written on success, -1 on failure
+ * @note Buffer is written by chunks of TERMINAL_WRITE_CHUNK bytes with putbuf(). Each chunk is placed in a lock so
+ *       that keyboard echo can't move the cursor in the middle, while the task can still be switched between chunks
  */
 int32_t system_terminal_write(int32_t fd, const void *buf, int32_t nbytes) {
-    int i;
+    int32_t i;
+    int32_t chunk;
+    uint32_t flags;
 
     if (fd != 1) {
         DEBUG_ERR("system_terminal_write(): invalid fd %d for terminal write", fd);
         return -1;
     }
 
-    // NOTE: don't place lock here, otherwise looping print program such as counter won't be able to switch
-    for (i = 0; i < nbytes; i++) {
-        // TODO: decide whether to terminate write when seeing a NUL
-        /*if (0 == ((uint8_t *) buf)[i]) {
-            // If current character is '\0', stop
-            break;
-        }*/
-        putc(((uint8_t *) buf)[i]);
+    // NOTE: don't place lock around the whole buffer, otherwise looping print program such as counter won't be
+    //       able to switch
+    for (i = 0; i < nbytes; i += chunk) {
+        chunk = nbytes - i;
+        if (chunk > TERMINAL_WRITE_CHUNK) chunk = TERMINAL_WRITE_CHUNK;
+        task_paging_touch_user_buffer((const uint8_t *) buf + i, chunk);  // a page fault may sleep, not in the lock
+        cli_and_save(flags);
+        {
+            putbuf((const uint8_t *) buf + i, chunk);
+        }
+        restore_flags(flags);
     }
 
-    return i;
+    return (nbytes > 0 ? nbytes : 0);
 }
 
 /**
@@ -421,16 +445,51 @@ terminal_t *terminal_allocate() {
     terminal->terminal_id = i;
 
     memset(terminal->key_buf, 0, sizeof(terminal->key_buf));
-    terminal->key_buf_cnt = 0;
+    terminal->key_buf_head = terminal->key_buf_tail = terminal->key_buf_line_start = 0;
+    terminal->key_buf_line_head = terminal->key_buf_line_cnt = 0;
+    terminal->user_ask_len = 0;
 
     terminal->screen_width = TEXT_MODE_WIDTH;
     terminal->screen_height = TEXT_MODE_HEIGHT;
     terminal->screen_x = 0;
     terminal->screen_y = 0;
+    terminal->screen_dirty_rows = SCREEN_ALL_ROWS;
 
     return terminal;
 }
 
+/**
+ * Get and clear changed text rows of a terminal
+ * @param terminal_id    ID of the terminal
+ * @return Bitmap of changed rows, see SCREEN_ROW()
+ */
+uint32_t terminal_fetch_dirty_rows(int terminal_id) {
+    uint32_t ret;
+    terminal_t *term = (terminal_id == NULL_TERMINAL_ID ? &null_terminal : &terminal_slot[terminal_id]);
+    if (term == running_term_) {  // lib.c works on the global copy
+        ret = screen_dirty_rows;
+        screen_dirty_rows = 0;
+    } else {
+        ret = term->screen_dirty_rows;
+        term->screen_dirty_rows = 0;
+    }
+    return ret;
+}
+
+/**
+ * Mark all text rows of a terminal as changed and request a frame, for changes not made through lib.c, such as
+ * writes to vidmap
+ * @param term    The terminal
+ */
+void terminal_mark_dirty(terminal_t *term) {
+    if (term == running_term_) {
+        screen_dirty_rows = SCREEN_ALL_ROWS;
+    } else {
+        term->screen_dirty_rows = SCREEN_ALL_ROWS;
+    }
+    gui_render_request();
+}
+
 /**
  * Deallocate a terminal control block. No action on video memory is included.
  * @param terminal    Pointer to the terminal control
@@ -462,10 +521,12 @@ void terminal_set_running(terminal_t *term) {
 
     running_term_->screen_x = screen_x;
     running_term_->screen_y = screen_y;
+    running_term_->screen_dirty_rows = screen_dirty_rows;
 
     terminal_vidmem_set(term->terminal_id);
     screen_x = term->screen_x;
     screen_y = term->screen_y;
+    screen_dirty_rows = term->screen_dirty_rows;
 
     running_term_ = term;
 }
@@ -15,7 +15,10 @@ int32_t system_terminal_open(const uint8_t* filename);
 int32_t system_terminal_close(int32_t fd);
 
 #define KEYBOARD_IRQ_NUM   1
-#define KEYBOARD_BUF_SIZE  128
+#define KEYBOARD_BUF_SIZE  4096  // must be a power of 2, since ring buffer indices are masked with it
+#define KEYBOARD_BUF_MASK  (KEYBOARD_BUF_SIZE - 1)
+#define KEYBOARD_MAX_LINES 64    // lines typed ahead before Enter is ignored, must be a power of 2
+#define KEYBOARD_LINE_MASK (KEYBOARD_MAX_LINES - 1)
 
 
 typedef struct terminal_t terminal_t;
@@ -23,14 +26,22 @@ struct terminal_t {
     uint8_t valid;
     int terminal_id;  // equal to slot index
 
+    // Ring buffer of typed characters. Indices are free-running and masked with KEYBOARD_BUF_MASK on access
     char key_buf[KEYBOARD_BUF_SIZE];
-    uint8_t key_buf_cnt;
-    uint8_t user_ask_len;
+    uint32_t key_buf_head;        // first unread character
+    uint32_t key_buf_tail;        // one past the last typed character
+    uint32_t key_buf_line_start;  // start of the line being edited, backspace can't erase beyond it
+    // Ring of key_buf indices of committed '\n', so that read() never searches for them
+    uint32_t key_buf_newline[KEYBOARD_MAX_LINES];
+    uint32_t key_buf_line_head;   // the slot of the first '\n' at or after key_buf_head, free-running
+    uint32_t key_buf_line_cnt;    // number of complete lines ('\n') in the buffer
+    int32_t user_ask_len;
 
     int32_t screen_width;
     int32_t screen_height;
     int32_t screen_x;  // not valid for focus_task. Update when switching focus_task
     int32_t screen_y;  // not valid for focus_task. Update when switching focus_task
+    uint32_t screen_dirty_rows;  // not valid for running terminal. Update when switching running terminal
     char* screen_char;
 
     gui_window_t win;
@@ -46,6 +57,8 @@ void terminal_deallocate(terminal_t* terminal);
 
 terminal_t* running_term();
 void terminal_set_running(terminal_t *term);
+uint32_t terminal_fetch_dirty_rows(int terminal_id);
+void terminal_mark_dirty(terminal_t *term);
 extern terminal_t null_terminal;
 
 /**
@@ -3,8 +3,17 @@
 #include "lib.h"
 #include "file_system.h"
 #include "task/task.h"
+#include "task/task_paging.h"
+#include "task/task_sched.h"
+#include "rtc.h"
+#include "paging.h"
+#include "page_frame.h"
+#include "fpu.h"
+#include "fs_cache.h"
+#include "ata.h"
 #include "vga/vga.h"
 #include "gui/gui.h"
+#include "gui/gui_objs.h"
 #include "gui/upng.h"
 
 #define FD_STDIN     0
@@ -753,6 +762,1377 @@ void svga_test() {
 //}
 //
 
+/* Benchmarks */
+
+#define BENCH_PIT_FREQ          1193182  // input clock of PIT
+#define BENCH_CALIBRATE_MS      10       // time to run TSC calibration
+#define BENCH_MIN_BYTES         (8 * 1024 * 1024)  // total bytes to move for each throughput item
+
+/**
+ * Calibrate TSC with PIT channel 2 (the speaker channel, gated by port 0x61 without sound)
+ * @return TSC cycles per millisecond
+ */
+static uint32_t bench_tsc_per_ms() {
+    uint32_t flags;
+    uint32_t start, end;
+    uint32_t latch = BENCH_PIT_FREQ * BENCH_CALIBRATE_MS / 1000;
+
+    cli_and_save(flags);
+    {
+        outb((inb(0x61) & ~0x02) | 0x01, 0x61);  // gate high, speaker off
+        outb(0xB0, 0x43);  // channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+        outb(latch & 0xFF, 0x42);
+        outb(latch >> 8, 0x42);
+
+        start = rdtsc();
+        while ((inb(0x61) & 0x20) == 0) {}  // wait for OUT2 to go high
+        end = rdtsc();
+    }
+    restore_flags(flags);
+
+    return (end - start) / BENCH_CALIBRATE_MS;
+}
+
+/**
+ * Print throughput in MB/s
+ * @param name          Name of the item
+ * @param bytes         Total bytes moved
+ * @param cycles        TSC cycles used
+ * @param tsc_per_ms    TSC cycles per millisecond
+ */
+static void bench_print_throughput(const char *name, uint32_t bytes, uint64_t cycles, uint32_t tsc_per_ms) {
+    uint32_t us = (uint32_t) div64_32(cycles, tsc_per_ms / 1000);  // cycles per microsecond is never 0 on a MHz CPU
+    if (us == 0) us = 1;
+    // Bytes per microsecond is MB/s (1 MB = 10^6 B)
+    printf("  %s: %u B in %u us, %u.%u MB/s\n", name, bytes, us, bytes / us, (bytes % us) * 10 / us);
+}
+
+// Scratch buffer for benchmarks, large enough for any file in fsdir. Aligned for DMA of ATA benchmarks
+static uint8_t bench_buf[512 * 1024] __attribute__((aligned(ATA_BUF_SIZE)));
+
+/**
+ * Measure read throughput of the file system for the paths used by cat (read() in 1KB chunks), execute (read_data()
+ * of the whole image) and PNG loading (read_data() of the whole file, and zero-copy read_data_direct())
+ * @note Run it before and after a change to read_data() to compare
+ */
+void fs_throughput_bench() {
+    TEST_HEADER;
+
+    const char *cat_file = "fish";  // the largest executable
+    const char *exec_file = "fish";
+    const char *png_file = "background_a.png";
+
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t bytes;
+    uint64_t start;
+    int32_t ret, span;
+    int32_t fd;
+    dentry_t dentry;
+    const uint8_t *ptr;
+
+    printf("TSC: %u cycles/ms\n", tsc_per_ms);
+
+    // cat: read() through file descriptor with the buffer size of ece391cat
+    if (-1 == (fd = open((const uint8_t *) cat_file))) {
+        printf("Failed to open %s\n", cat_file);
+    } else {
+        bytes = 0;
+        ret = 0;
+        start = rdtsc64();
+        while (bytes < BENCH_MIN_BYTES) {
+            running_task()->file_array.opened_files[fd].file_position = 0;
+            while (0 < (ret = read(fd, bench_buf, 1024))) bytes += ret;
+            if (ret == -1 || bytes == 0) break;  // an empty file would never reach BENCH_MIN_BYTES
+        }
+        if (ret == -1 || bytes == 0) {
+            printf("Failed to read %s\n", cat_file);
+        } else {
+            bench_print_throughput("cat", bytes, rdtsc64() - start, tsc_per_ms);
+        }
+        close(fd);
+    }
+
+    // exec: whole image with read_data() as task_load() does
+    if (-1 == read_dentry_by_name((const uint8_t *) exec_file, &dentry)) {
+        printf("Failed to find %s\n", exec_file);
+    } else {
+        bytes = 0;
+        start = rdtsc64();
+        while (bytes < BENCH_MIN_BYTES) {
+            if (0 >= (ret = read_data(dentry.inode_num, 0, bench_buf, get_file_size(dentry.inode_num)))) break;
+            bytes += ret;
+        }
+        if (ret <= 0) {
+            printf("Failed to read %s\n", exec_file);
+        } else {
+            bench_print_throughput("exec", bytes, rdtsc64() - start, tsc_per_ms);
+        }
+    }
+
+    // PNG: whole file with read_data() as fallback of load_png(), and zero-copy access
+    if (-1 == read_dentry_by_name((const uint8_t *) png_file, &dentry)) {
+        printf("Failed to find %s\n", png_file);
+    } else {
+        bytes = 0;
+        start = rdtsc64();
+        while (bytes < BENCH_MIN_BYTES) {
+            if (0 >= (ret = read_data(dentry.inode_num, 0, bench_buf, sizeof(bench_buf)))) break;
+            bytes += ret;
+        }
+        if (ret <= 0) {
+            printf("Failed to read %s\n", png_file);
+            return;
+        }
+        bench_print_throughput("png (copy)", bytes, rdtsc64() - start, tsc_per_ms);
+
+        bytes = 0;
+        start = rdtsc64();
+        while (0 < (span = read_data_direct(dentry.inode_num, bytes, &ptr))) bytes += span;
+        start = rdtsc64() - start;
+        printf("  png (direct): %u B, first span %d B, %u cycles\n", bytes,
+               read_data_direct(dentry.inode_num, 0, &ptr), (uint32_t) start);
+    }
+}
+
+#define BENCH_WRITE_FILE_SIZE    (64 * 1024)  // fits in free blocks of the image
+#define BENCH_SMALL_WRITE_SIZE   64
+#define BENCH_SMALL_WRITE_COUNT  20000
+
+/**
+ * Print write-back cache statistics since the last call
+ * @param last    Statistics of the last call, updated
+ */
+static void bench_print_cache_stat(fs_cache_stat_t *last) {
+    fs_cache_stat_t stat;
+    fs_cache_get_stat(&stat);
+    printf("    cache: %u hit, %u miss, %u sync, %u blocks in %u batches written back\n",
+           stat.write_hit - last->write_hit, stat.write_miss - last->write_miss, stat.sync_count - last->sync_count,
+           stat.block_written - last->block_written, stat.batch_written - last->batch_written);
+    *last = stat;
+}
+
+/**
+ * Measure write throughput of the file system: sequential writes in 4KB chunks to a file that is truncated and
+ * rewritten, and small writes at random offsets of a file. Time to write back dirty blocks is included
+ * @note Creates a file "write_bench" if it doesn't exist, which is left empty at the end
+ */
+void fs_write_bench() {
+    TEST_HEADER;
+
+    const char *file = "write_bench";
+
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t bytes, start, offset, i;
+    uint32_t seed = 391;
+    int32_t ret;
+    dentry_t dentry;
+    fs_cache_stat_t stat;
+
+    printf("TSC: %u cycles/ms, %u free blocks\n", tsc_per_ms, get_free_block_count());
+
+    if (-1 == read_dentry_by_name((const uint8_t *) file, &dentry) &&
+        -1 == create_file((const uint8_t *) file, &dentry)) {
+        printf("Failed to create %s\n", file);
+        return;
+    }
+    for (i = 0; i < BENCH_WRITE_FILE_SIZE; i++) bench_buf[i] = (uint8_t) i;
+    file_system_sync();
+    fs_cache_get_stat(&stat);
+
+    // Sequential: rewrite the whole file, allocating blocks each round
+    bytes = 0;
+    start = rdtsc();
+    while (bytes < BENCH_MIN_BYTES) {
+        truncate_data(dentry.inode_num, 0);
+        for (offset = 0; offset < BENCH_WRITE_FILE_SIZE; offset += FILE_BLOCK_SIZE_IN_BYTES) {
+            if (FILE_BLOCK_SIZE_IN_BYTES != (ret = append_data(dentry.inode_num, &bench_buf[offset],
+                                                                   FILE_BLOCK_SIZE_IN_BYTES))) {
+                printf("Failed to write %s at %u, file system full?\n", file, offset);
+                truncate_data(dentry.inode_num, 0);
+                return;
+            }
+            bytes += ret;
+        }
+    }
+    file_system_sync();
+    bench_print_throughput("sequential 4KB", bytes, rdtsc() - start, tsc_per_ms);
+    bench_print_cache_stat(&stat);
+
+    // Small random: overwrite small pieces of the file
+    bytes = 0;
+    start = rdtsc();
+    for (i = 0; i < BENCH_SMALL_WRITE_COUNT; i++) {
+        seed = seed * 1103515245 + 12345;  // LCG
+        offset = (seed >> 8) % (BENCH_WRITE_FILE_SIZE - BENCH_SMALL_WRITE_SIZE);
+        bytes += write_data(dentry.inode_num, offset, &bench_buf[offset], BENCH_SMALL_WRITE_SIZE);
+    }
+    file_system_sync();
+    bench_print_throughput("random 64B", bytes, rdtsc() - start, tsc_per_ms);
+    bench_print_cache_stat(&stat);
+
+    // Check the content, which is the same as what is written
+    if (BENCH_WRITE_FILE_SIZE != read_data(dentry.inode_num, 0, &bench_buf[BENCH_WRITE_FILE_SIZE],
+                                           BENCH_WRITE_FILE_SIZE)) {
+        printf("FAIL: fail to read back %s\n", file);
+    } else {
+        for (i = 0; i < BENCH_WRITE_FILE_SIZE && bench_buf[i] == bench_buf[BENCH_WRITE_FILE_SIZE + i]; i++) {}
+        if (i != BENCH_WRITE_FILE_SIZE) printf("FAIL: content of %s is wrong at %u\n", file, i);
+    }
+
+    truncate_data(dentry.inode_num, 0);
+    file_system_sync();
+    printf("  %u free blocks after truncate\n", get_free_block_count());
+}
+
+#define BENCH_ATA_BLOCKS        64    // 4KB requests in each round
+#define BENCH_ATA_ROUNDS        8
+#define BENCH_ATA_SPAN_BLOCKS   8192  // random blocks are picked in the first 32MB of the drive
+
+/**
+ * Print I/O scheduler statistics since the last call
+ * @param last          Statistics of the last call, updated
+ * @param tsc_per_ms    TSC cycles per millisecond
+ */
+static void bench_print_ata_stat(ata_stat_t *last, uint32_t tsc_per_ms) {
+    ata_stat_t stat;
+    uint32_t requests;
+
+    ata_get_stat(&stat);
+    if ((requests = stat.request_count - last->request_count) == 0) requests = 1;
+    printf("    %u requests in %u transfers, %u merged, %u by deadline, depth avg %u max %u, latency avg %u us\n",
+           stat.request_count - last->request_count, stat.transfer_count - last->transfer_count,
+           stat.merge_count - last->merge_count, stat.deadline_count - last->deadline_count,
+           (stat.depth_sum - last->depth_sum) / requests, stat.depth_max,
+           (stat.latency_sum - last->latency_sum) / requests * 1000 / (tsc_per_ms / 1000));
+    *last = stat;
+}
+
+/**
+ * Read blocks from a drive with 4KB requests, and measure the time
+ * @param drive     The drive
+ * @param blocks    Block numbers (4KB)
+ * @param batch     1 to submit all requests together, 0 to submit and wait one by one
+ * @return TSC cycles used, or 0 for fail
+ */
+static uint32_t bench_ata_read(int32_t drive, const uint32_t *blocks, int batch) {
+    static ata_request_t reqs[BENCH_ATA_BLOCKS];
+    uint32_t start = rdtsc();
+    uint32_t i;
+
+    for (i = 0; i < BENCH_ATA_BLOCKS; i++) {
+        reqs[i].drive = drive;
+        reqs[i].lba = blocks[i] * ATA_BUF_SECTORS;
+        reqs[i].buf_count = 1;
+        reqs[i].bufs[0] = &bench_buf[i * ATA_BUF_SIZE];
+        reqs[i].write = 0;
+        if (!batch && (ata_submit(&reqs[i]) == -1 || ata_wait(&reqs[i]) == -1)) return 0;
+    }
+    if (batch) {
+        if (ata_submit_batch(reqs, BENCH_ATA_BLOCKS) == -1) return 0;
+        for (i = 0; i < BENCH_ATA_BLOCKS; i++) {
+            if (ata_wait(&reqs[i]) == -1) return 0;
+        }
+    }
+
+    return rdtsc() - start;
+}
+
+/**
+ * Measure the I/O scheduler with 4KB reads of sequential and random blocks, submitted one by one (each is a
+ * transfer) or as a batch (sorted by the elevator and merged). Read only
+ * @note Needs an ATA drive, e.g. QEMU -hdb filesys_img
+ */
+void ata_sched_bench() {
+    TEST_HEADER;
+
+    const char *names[2][2] = {{"sequential, one by one", "sequential, batch"}, {"random, one by one", "random, batch"}};
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t blocks[BENCH_ATA_BLOCKS];
+    uint32_t span, cycles, round, i, cost;
+    uint32_t seed = 391;
+    int32_t drive;
+    int random, batch;
+    ata_stat_t stat;
+
+    for (drive = 0; drive < ATA_DRIVE_COUNT && ata_drive_sectors(drive) < BENCH_ATA_BLOCKS * ATA_BUF_SECTORS; drive++) {}
+    if (drive == ATA_DRIVE_COUNT) {
+        printf("No ATA drive\n");
+        return;
+    }
+    span = ata_drive_sectors(drive) / ATA_BUF_SECTORS;
+    if (span > BENCH_ATA_SPAN_BLOCKS) span = BENCH_ATA_SPAN_BLOCKS;
+    printf("TSC: %u cycles/ms, drive %d\n", tsc_per_ms, drive);
+    ata_get_stat(&stat);
+
+    for (random = 0; random < 2; random++) {
+        for (batch = 0; batch < 2; batch++) {
+            cycles = 0;
+            seed = 391;  // same blocks for both ways
+            for (round = 0; round < BENCH_ATA_ROUNDS; round++) {
+                for (i = 0; i < BENCH_ATA_BLOCKS; i++) {
+                    seed = seed * 1103515245 + 12345;  // LCG
+                    blocks[i] = (random ? (seed >> 8) % span : (round * BENCH_ATA_BLOCKS + i) % span);
+                }
+                if ((cost = bench_ata_read(drive, blocks, batch)) == 0) {
+                    printf("Failed to read drive %d\n", drive);
+                    return;
+                }
+                cycles += cost;
+            }
+            bench_print_throughput(names[random][batch], BENCH_ATA_ROUNDS * BENCH_ATA_BLOCKS * ATA_BUF_SIZE, cycles,
+                                   tsc_per_ms);
+            bench_print_ata_stat(&stat, tsc_per_ms);
+        }
+    }
+}
+
+#define BENCH_READAHEAD_CHUNK    1024  // buffer size of ece391cat
+#define BENCH_READAHEAD_WORK     16    // passes over each chunk, as a reader that processes what it reads
+
+/**
+ * Simulate processing of a chunk that has been read
+ * @param buf       The chunk
+ * @param length    Length of the chunk
+ * @return Checksum, so that the work is not optimized out
+ */
+static uint32_t bench_readahead_process(const uint8_t *buf, uint32_t length) {
+    uint32_t sum = 0;
+    uint32_t pass, i;
+    for (pass = 0; pass < BENCH_READAHEAD_WORK; pass++) {
+        for (i = 0; i < length; i++) sum = sum * 31 + buf[i];
+    }
+    return sum;
+}
+
+/**
+ * Measure sequential read-ahead with streaming readers of large files on a cold cache: read() in 1KB chunks (with
+ * read-ahead), and read_data() in 1KB chunks (without read-ahead, each block is loaded when the reader gets to it).
+ * Each chunk is processed before the next read, so read-ahead can overlap the disk with it
+ * @usage Kernel task EIP, see the commented line in init_task_main(). Needs the file system on an ATA drive and the
+ *        read-ahead task, see FS_READAHEAD_TASK
+ */
+void readahead_bench() {
+    TEST_HEADER;
+
+    const char *files[] = {"background_a.png", "snow.png", "fish"};
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t bytes, start, cycles, sum = 0;
+    uint32_t flags;
+    int32_t fd, ret;
+    uint32_t i;
+    dentry_t dentry;
+    file_readahead_t ra;
+
+    printf("TSC: %u cycles/ms%s\n", tsc_per_ms, fs_cache_in_memory() ? ", file system in memory" : "");
+
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        if (-1 == read_dentry_by_name((const uint8_t *) files[i], &dentry)) {
+            printf("Failed to find %s\n", files[i]);
+            continue;
+        }
+        printf("%s:\n", files[i]);
+
+        // Without read-ahead
+        file_system_drop_cache();
+        bytes = 0;
+        start = rdtsc();
+        while (0 < (ret = read_data(dentry.inode_num, bytes, bench_buf, BENCH_READAHEAD_CHUNK))) {
+            sum += bench_readahead_process(bench_buf, ret);
+            bytes += ret;
+        }
+        bench_print_throughput("read_data()", bytes, rdtsc() - start, tsc_per_ms);
+
+        // With read-ahead
+        if (-1 == (fd = open((const uint8_t *) files[i]))) {
+            printf("Failed to open %s\n", files[i]);
+            continue;
+        }
+        file_system_drop_cache();
+        bytes = 0;
+        start = rdtsc();
+        while (0 < (ret = read(fd, bench_buf, BENCH_READAHEAD_CHUNK))) {
+            sum += bench_readahead_process(bench_buf, ret);
+            bytes += ret;
+        }
+        cycles = rdtsc() - start;
+        bench_print_throughput("read()", bytes, cycles, tsc_per_ms);
+        file_get_readahead_stat(fd, &ra);
+        printf("    read-ahead: %u hit, %u stall, %u blocks, window %u\n", ra.hit_count, ra.stall_count,
+               ra.block_count, ra.window);
+        close(fd);
+    }
+    printf("  checksum %x\n", sum);
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_SPAWN_COUNT    100
+
+/**
+ * Measure the cost of setting up paging and image for execute, with hit/miss of executable image cache
+ * @note Only paging part of execute is measured. Pages of the image are faulted in when the program runs, see
+ *       task_paging_get_fault_count(). Must run before any user program runs, since it remaps 128MB
+ */
+void exec_load_bench() {
+    TEST_HEADER;
+
+    const char *programs[] = {"shell", "ls", "fish"};
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t i, j, start, cycles, eip;
+    uint32_t hit, miss;
+    int page_id;
+
+    for (i = 0; i < sizeof(programs) / sizeof(const char *); i++) {
+        cycles = 0;
+        for (j = 0; j < BENCH_SPAWN_COUNT; j++) {
+            start = rdtsc();
+            page_id = task_paging_allocate_and_set((const uint8_t *) programs[i], &eip);
+            cycles += rdtsc() - start;
+            if (page_id < 0) {
+                printf("Failed to load %s\n", programs[i]);
+                break;
+            }
+            task_paging_deallocate(page_id);
+        }
+        printf("  %s: %u cycles (%u us) per load\n", programs[i], cycles / BENCH_SPAWN_COUNT,
+               cycles / BENCH_SPAWN_COUNT / (tsc_per_ms / 1000));
+    }
+
+    task_paging_get_cache_stat(&hit, &miss);
+    printf("Image cache: %u hit, %u miss, %u pages faulted in\n", hit, miss, task_paging_get_fault_count());
+}
+
+#define BENCH_STRESS_WINDOW_MS    100  // time to count context switches for each N
+
+static volatile uint32_t stress_switch_count = 0;  // total yields of counter tasks
+static volatile uint8_t stress_stop = 0;           // set to make counter tasks halt
+
+/**
+ * Main function of counter tasks of task_stress_bench(). Count and yield until asked to stop.
+ */
+static void stress_counter_main() {
+    uint32_t flags;
+
+    while (!stress_stop) {
+        cli_and_save(flags);
+        {
+            stress_switch_count++;
+            sched_yield_unsafe();
+        }
+        restore_flags(flags);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * Spawn N counter tasks and report spawn cost and context switch throughput as N grows
+ * @usage Kernel task EIP, see the commented line in init_task_main(). Counter tasks are kernel tasks, since only a
+ *        kernel task (which has no terminal) can spawn tasks without waiting for them
+ * @note Boot with "max_tasks=N" to raise the limit, otherwise spawning stops at the default limit
+ */
+void task_stress_bench() {
+    TEST_HEADER;
+
+    const uint32_t counts[] = {8, 32, 128, 250};
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t base_count, i, n, spawned, start, spawn_cycles, window, switches;
+    uint32_t flags;
+
+    for (i = 0; i < sizeof(counts) / sizeof(uint32_t); i++) {
+        n = counts[i];
+        base_count = task_count;
+        stress_stop = 0;
+
+        // Spawn. Each new task runs immediately, so this includes its first round
+        start = rdtsc();
+        for (spawned = 0; spawned < n; spawned++) {
+            cli_and_save(flags);
+            {
+                if (task_count >= task_max_count) {
+                    restore_flags(flags);
+                    break;
+                }
+                system_execute((uint8_t *) "counter", 0, 0, stress_counter_main);
+            }
+            restore_flags(flags);
+        }
+        spawn_cycles = rdtsc() - start;
+
+        // Count context switches in a fixed time window
+        stress_switch_count = 0;
+        window = tsc_per_ms * BENCH_STRESS_WINDOW_MS;
+        start = rdtsc();
+        while (rdtsc() - start < window) {
+            cli_and_save(flags);
+            {
+                sched_yield_unsafe();
+            }
+            restore_flags(flags);
+        }
+        switches = stress_switch_count;
+
+        // Stop and wait for all counter tasks to halt
+        stress_stop = 1;
+        while (task_count > base_count) {
+            cli_and_save(flags);
+            {
+                sched_yield_unsafe();
+            }
+            restore_flags(flags);
+        }
+
+        printf("  N = %u (spawned %u): %u cycles per spawn, %u switches/s\n", n, spawned,
+               spawned ? spawn_cycles / spawned : 0, switches * (1000 / BENCH_STRESS_WINDOW_MS));
+        if (spawned < n) break;  // limit reached
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_LATENCY_SAMPLES     16   // number of simulated keypresses for each hog count
+#define BENCH_LATENCY_BURST_MS    60   // CPU time to handle a keypress, longer than a time slice
+#define BENCH_LATENCY_RTC_FREQ    4    // frequency of simulated keypresses [Hz]
+#define BENCH_LATENCY_WARMUP      4    // keypresses to skip, letting hogs sink to low levels
+
+/**
+ * Main function of hog tasks of task_latency_bench(). Busy loop until asked to stop.
+ */
+static void latency_hog_main() {
+    uint32_t flags;
+
+    while (!stress_stop) {}
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * Busy loop for a fixed amount of work
+ * @param loops    Number of iterations
+ */
+static void latency_burst(uint32_t loops) {
+    volatile uint32_t i;
+    for (i = 0; i < loops; i++) {}
+}
+
+/**
+ * Measure keypress-to-echo latency under CPU load. A keypress is simulated by waking up from RTC read(), after which
+ * the task handles the key with a fixed amount of CPU work (BENCH_LATENCY_BURST_MS when not loaded) and then "echoes".
+ * Latency is the time from wake-up (the RTC handler putting the task into the run queue, see wake_tsc) to echo, with
+ * 0, 2 and 4 busy-looping hog tasks. Time from wake-up until the task runs is reported as dispatch delay.
+ * @usage Kernel task EIP, see the commented line in init_task_main()
+ */
+void task_latency_bench() {
+    TEST_HEADER;
+
+    const uint32_t hog_counts[] = {0, 2, 4};
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t loops, start, latency, total, max, dispatch_total;
+    uint32_t base_count, i, j, k;
+    uint32_t flags;
+    int32_t freq = BENCH_LATENCY_RTC_FREQ;
+
+    // Calibrate work loop without interruption
+    cli_and_save(flags);
+    {
+        start = rdtsc();
+        latency_burst(1000000);
+        latency = rdtsc() - start;
+    }
+    restore_flags(flags);
+    loops = tsc_per_ms * BENCH_LATENCY_BURST_MS / (latency / 1000) * 1000;  // latency / 1000 is cycles per 1000 loops
+
+    system_rtc_open(NULL);
+    system_rtc_write(0, &freq, sizeof(freq));
+
+    for (i = 0; i < sizeof(hog_counts) / sizeof(uint32_t); i++) {
+        base_count = task_count;
+        stress_stop = 0;
+
+        for (j = 0; j < hog_counts[i]; j++) {
+            cli_and_save(flags);
+            {
+                system_execute((uint8_t *) "hog", 0, 0, latency_hog_main);
+            }
+            restore_flags(flags);
+        }
+
+        total = max = dispatch_total = 0;
+        for (k = 0; k < BENCH_LATENCY_WARMUP + BENCH_LATENCY_SAMPLES; k++) {
+            system_rtc_read(0, NULL, 0);  // "keypress", woken up by the RTC handler
+            start = running_task()->sched_ctrl.wake_tsc;
+            if (k >= BENCH_LATENCY_WARMUP) dispatch_total += (rdtsc() - start) / (tsc_per_ms / 1000);
+            latency_burst(loops);
+            latency = rdtsc() - start;  // "echo"
+            if (k < BENCH_LATENCY_WARMUP) continue;
+            total += latency / (tsc_per_ms / 1000);
+            if (latency / (tsc_per_ms / 1000) > max) max = latency / (tsc_per_ms / 1000);
+        }
+
+        // Stop and wait for all hog tasks to halt
+        stress_stop = 1;
+        while (task_count > base_count) {
+            cli_and_save(flags);
+            {
+                sched_yield_unsafe();
+            }
+            restore_flags(flags);
+        }
+
+        printf("  %u hogs: latency avg %u us, max %u us, dispatch avg %u us\n", hog_counts[i],
+               total / BENCH_LATENCY_SAMPLES, max, dispatch_total / BENCH_LATENCY_SAMPLES);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_RTC_WINDOW    8  // number of 2 Hz RTC reads to measure for each waiter count
+
+/**
+ * Main function of waiter tasks of rtc_handler_bench(). Sleep on RTC until asked to stop.
+ */
+static void rtc_waiter_main() {
+    uint32_t flags;
+    int32_t freq = 2;
+
+    system_rtc_open(NULL);
+    system_rtc_write(0, &freq, sizeof(freq));
+    while (!stress_stop) {
+        system_rtc_read(0, NULL, 0);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * Measure cycles of RTC interrupt handler with 1, 10 and 100 tasks sleeping on RTC
+ * @usage Kernel task EIP, see the commented line in init_task_main(). The bench task itself is one of the waiters.
+ */
+void rtc_handler_bench() {
+    TEST_HEADER;
+
+    const uint32_t waiter_counts[] = {1, 10, 100};
+    uint32_t base_count, i, j;
+    uint32_t count, cycles;
+    uint32_t flags;
+    int32_t freq = 2;
+
+    system_rtc_open(NULL);
+    system_rtc_write(0, &freq, sizeof(freq));
+
+    for (i = 0; i < sizeof(waiter_counts) / sizeof(uint32_t); i++) {
+        base_count = task_count;
+        stress_stop = 0;
+
+        for (j = 1; j < waiter_counts[i]; j++) {  // the bench task itself is a waiter
+            cli_and_save(flags);
+            {
+                system_execute((uint8_t *) "waiter", 0, 0, rtc_waiter_main);
+            }
+            restore_flags(flags);
+        }
+
+        system_rtc_read(0, NULL, 0);  // let all waiters sleep
+        rtc_get_handler_stat(&count, &cycles);  // reset
+        for (j = 0; j < BENCH_RTC_WINDOW; j++) {
+            system_rtc_read(0, NULL, 0);
+        }
+        rtc_get_handler_stat(&count, &cycles);
+
+        // Stop and wait for all waiter tasks to halt
+        stress_stop = 1;
+        while (task_count > base_count) {
+            cli_and_save(flags);
+            {
+                sched_yield_unsafe();
+            }
+            restore_flags(flags);
+        }
+
+        printf("  %u waiters: %u interrupts, %u cycles per interrupt\n", waiter_counts[i], count,
+               count ? cycles / count : 0);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_IRQ_WINDOW_MS    2000  // time to count interrupts for each case
+
+/**
+ * Count PIT and RTC interrupts while the bench task sleeps
+ * @param name    Name of the case
+ */
+static void timer_irq_count(const char *name) {
+    uint32_t flags;
+    uint32_t pit_start, rtc_count, rtc_cycles;
+
+    pit_start = sched_get_interrupt_count();
+    rtc_get_handler_stat(&rtc_count, &rtc_cycles);  // reset
+    cli_and_save(flags);
+    {
+        sched_sleep_unsafe(BENCH_IRQ_WINDOW_MS);
+    }
+    restore_flags(flags);
+    rtc_get_handler_stat(&rtc_count, &rtc_cycles);
+
+    printf("  %s: PIT %u/s, RTC %u/s\n", name, (sched_get_interrupt_count() - pit_start) * 1000 / BENCH_IRQ_WINDOW_MS,
+           rtc_count * 1000 / BENCH_IRQ_WINDOW_MS);
+}
+
+/**
+ * Measure timer interrupts per second while idle and while running one busy task
+ * @usage Kernel task EIP, see the commented line in init_task_main(). Run with SCHED_TICKLESS set to 0 and 1 to compare
+ */
+void timer_irq_bench() {
+    TEST_HEADER;
+
+    uint32_t base_count;
+    uint32_t flags;
+
+    printf("Tickless: %d\n", SCHED_TICKLESS);
+
+    timer_irq_count("idle");
+
+    base_count = task_count;
+    stress_stop = 0;
+    cli_and_save(flags);
+    {
+        system_execute((uint8_t *) "hog", 0, 0, latency_hog_main);
+    }
+    restore_flags(flags);
+
+    timer_irq_count("one task");
+
+    // Stop and wait for the hog task to halt
+    stress_stop = 1;
+    while (task_count > base_count) {
+        cli_and_save(flags);
+        {
+            sched_yield_unsafe();
+        }
+        restore_flags(flags);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_RENDER_WINDOW_MS    2000  // time to measure for each case
+#define BENCH_RENDER_PERIOD_MS    30    // period to report damage in busy cases
+
+/**
+ * Report damage of given size periodically (or never if width is 0), and print rendering statistics
+ * @param name      Name of the case
+ * @param width     Width of the damaged area
+ * @param height    Height of the damaged area
+ * @param tsc_per_ms    TSC cycles per millisecond
+ */
+static void gui_render_measure(const char *name, int width, int height, uint32_t tsc_per_ms) {
+    uint32_t flags;
+    uint32_t elapsed;
+    gui_render_stat_t stat;
+
+    gui_render_get_stat(&stat);  // reset
+    for (elapsed = 0; elapsed < BENCH_RENDER_WINDOW_MS; elapsed += BENCH_RENDER_PERIOD_MS) {
+        if (width) gui_render_damage(0, STATUS_BAR_HEIGHT, width, height);
+        cli_and_save(flags);
+        {
+            sched_sleep_unsafe(BENCH_RENDER_PERIOD_MS);
+        }
+        restore_flags(flags);
+    }
+    gui_render_get_stat(&stat);
+
+    printf("  %s: %u frames, %u skipped, %u rects, %u cycles/frame (max %u)\n", name,
+           stat.frames, stat.skipped, stat.rects, stat.frames ? stat.cycles / stat.frames : 0, stat.max_cycles);
+    // Interrupts-off time of rendering, not measured input latency. It bounds how long rendering can delay an
+    // interrupt (keyboard, mouse, RTC), but not the delay until a task handles the input
+    printf("    max interrupts-off %u cycles (%u us)\n", stat.max_cli_cycles,
+           stat.max_cli_cycles / (tsc_per_ms / 1000));
+}
+
+/**
+ * Measure GUI frame cost with no change, a changed text row, and a full-screen change in every frame, as well as the
+ * longest period rendering runs with interrupts off (an upper bound of the delay rendering adds to an interrupt such
+ * as keyboard, not a measured input latency)
+ * @usage Kernel task EIP, see the commented line in init_task_main(). Rendering in the compositor task and in PIT
+ *        handler are both measured, see gui_compositor_set_enabled()
+ */
+void gui_render_bench() {
+    TEST_HEADER;
+
+    uint32_t flags;
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    int compositor;
+
+    for (compositor = 1; compositor >= 0; compositor--) {
+        gui_compositor_set_enabled(compositor);
+        printf("Compositor task: %d\n", compositor);
+
+        gui_render_measure("idle", 0, 0, tsc_per_ms);
+        gui_render_measure("one row", TERMINAL_WIDTH_PIXEL, FONT_HEIGHT, tsc_per_ms);
+        gui_render_measure("full screen", VGA_WIDTH, VGA_HEIGHT - STATUS_BAR_HEIGHT, tsc_per_ms);
+    }
+    gui_compositor_set_enabled(GUI_COMPOSITOR_TASK);
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_INPUT_KEYS         32    // keypresses for each case, half of them a letter and half backspace
+#define BENCH_INPUT_PERIOD_MS    60    // time between keypresses, longer than a frame interval
+#define BENCH_INPUT_HOGS         2     // busy-looping tasks in the loaded cases
+#define BENCH_KBC_DATA           0x60  // data port of the keyboard controller
+#define BENCH_KBC_CMD            0x64  // command/status port of the keyboard controller
+#define BENCH_KBC_WRITE_KBD_OUT  0xD2  // command to put a byte in the output buffer as if it came from the keyboard
+
+/**
+ * Make the keyboard controller raise IRQ 1 with a scan code, as if the key was pressed on the keyboard
+ * @param scan_code    The scan code
+ */
+static void bench_inject_scan_code(uint8_t scan_code) {
+    while (inb(BENCH_KBC_CMD) & 0x02) {}  // wait for the input buffer of the controller to be empty
+    outb(BENCH_KBC_WRITE_KBD_OUT, BENCH_KBC_CMD);
+    while (inb(BENCH_KBC_CMD) & 0x02) {}
+    outb(scan_code, BENCH_KBC_DATA);
+}
+
+/**
+ * Sort samples in ascending order
+ * @param a    Samples
+ * @param n    Number of samples
+ */
+static void bench_sort(uint32_t *a, int n) {
+    int i, j;
+    uint32_t v;
+    for (i = 1; i < n; i++) {
+        v = a[i];
+        for (j = i; j > 0 && a[j - 1] > v; j--) a[j] = a[j - 1];
+        a[j] = v;
+    }
+}
+
+/**
+ * Print the distribution of latency samples
+ * @param name          Name of the samples
+ * @param a             Samples in TSC cycles, sorted in place
+ * @param n             Number of samples, more than 0
+ * @param tsc_per_ms    TSC cycles per millisecond
+ */
+static void bench_print_distribution(const char *name, uint32_t *a, int n, uint32_t tsc_per_ms) {
+    uint32_t tsc_per_us = tsc_per_ms / 1000;
+    bench_sort(a, n);
+    printf("    %s: min %u, p50 %u, p90 %u, max %u us\n", name, a[0] / tsc_per_us, a[n / 2] / tsc_per_us,
+           a[n * 9 / 10] / tsc_per_us, a[n - 1] / tsc_per_us);
+}
+
+/**
+ * Inject keypresses and measure their latency for one case
+ * @param compositor    1 to render in the compositor task, 0 in PIT handler
+ * @param hogs          Number of busy-looping tasks to start
+ * @param tsc_per_ms    TSC cycles per millisecond
+ */
+static void gui_input_measure(int compositor, uint32_t hogs, uint32_t tsc_per_ms) {
+    static uint32_t consumed[GUI_INPUT_LATENCY_SAMPLES];
+    static uint32_t shown[GUI_INPUT_LATENCY_SAMPLES];
+    uint32_t flags;
+    uint32_t base_count = task_count;
+    uint32_t i;
+    int n;
+
+    gui_compositor_set_enabled(compositor);
+    stress_stop = 0;
+    for (i = 0; i < hogs; i++) {
+        cli_and_save(flags);
+        {
+            system_execute((uint8_t *) "hog", 0, 0, latency_hog_main);
+        }
+        restore_flags(flags);
+    }
+
+    gui_render_get_input_latency(consumed, shown, GUI_INPUT_LATENCY_SAMPLES);  // reset
+    for (i = 0; i < BENCH_INPUT_KEYS; i++) {
+        // A letter, then erase it, so the line being edited in the focused terminal is left as it was
+        bench_inject_scan_code((i % 2 == 0) ? 0x1E /* 'a' */ : 0x0E /* backspace */);
+        bench_inject_scan_code((i % 2 == 0) ? 0x9E : 0x8E);  // release
+        cli_and_save(flags);
+        {
+            sched_sleep_unsafe(BENCH_INPUT_PERIOD_MS);
+        }
+        restore_flags(flags);
+    }
+    n = gui_render_get_input_latency(consumed, shown, GUI_INPUT_LATENCY_SAMPLES);
+
+    stress_stop = 1;
+    while (task_count > base_count) {
+        cli_and_save(flags);
+        {
+            sched_yield_unsafe();
+        }
+        restore_flags(flags);
+    }
+
+    printf("  %s, %u hogs: %d of %d keypresses shown\n", compositor ? "compositor task" : "PIT handler", hogs, n,
+           BENCH_INPUT_KEYS);
+    if (n == 0) return;
+    bench_print_distribution("IRQ to snapshot", consumed, n, tsc_per_ms);
+    bench_print_distribution("IRQ to screen", shown, n, tsc_per_ms);
+}
+
+/**
+ * Measure latency from keyboard interrupt to the frame that shows the echo, rendering in the compositor task and in
+ * the PIT handler, without and with CPU hogs. Keypresses are real IRQ 1, made by the keyboard controller
+ * @usage Kernel task EIP, see the commented line in init_task_main(). A shell must be started and focused, since
+ *        keys go to the focus task. It types a letter and erases it, repeatedly
+ */
+void gui_input_bench() {
+    TEST_HEADER;
+
+    uint32_t flags;
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+
+    if (focus_task() == NULL) {
+        printf("No focus task to receive keys\n");
+    } else {
+        gui_input_measure(1, 0, tsc_per_ms);
+        gui_input_measure(0, 0, tsc_per_ms);
+        gui_input_measure(1, BENCH_INPUT_HOGS, tsc_per_ms);
+        gui_input_measure(0, BENCH_INPUT_HOGS, tsc_per_ms);
+        gui_compositor_set_enabled(GUI_COMPOSITOR_TASK);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_WINDOW_MOVES    200  // number of window movements to measure
+
+static gui_window_t bench_windows[GUI_MAX_WINDOW_NUM];
+static char bench_window_text[GUI_MAX_WINDOW_NUM][TERMINAL_TEXT_ROWS * TERMINAL_TEXT_COLS];
+
+/**
+ * Fill the window stack with windows of no terminal, then measure the cost of moving a window (which updates the
+ * occlusion map) and full-screen frames
+ * @usage Kernel task EIP, see the commented line in init_task_main(). The stack is filled up to GUI_MAX_WINDOW_NUM
+ *        (32), including the windows of terminals
+ */
+void gui_window_bench() {
+    TEST_HEADER;
+
+    uint32_t flags;
+    uint32_t start;
+    uint32_t cycles = 0;
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    int i, n;
+    gui_window_t *win;
+
+    // Windows are packed at the beginning of the stack
+    for (n = 0; n < GUI_MAX_WINDOW_NUM && window_stack[GUI_MAX_WINDOW_NUM - 1] == NULL; n++) {
+        memset(bench_window_text[n], 'a' + n % 26, sizeof(bench_window_text[n]));
+        gui_new_window(&bench_windows[n], bench_window_text[n], NULL_TERMINAL_ID);
+    }
+
+    // Scatter windows over the screen, since initial positions cascade out of the screen
+    for (i = 0; i < n; i++) {
+        win = &bench_windows[i];
+        gui_move_window(win, GUI_WIN_LEFT_RIGHT_MARGIN + (i * 53) % 372 - win->term_x,
+                        GUI_WIN_TITLE_BAR_HEIGHT + (i * 29) % 263 - win->term_y);
+    }
+
+    printf("%d windows, %d rectangles visible\n", GUI_MAX_WINDOW_NUM, window_visible_end[GUI_MAX_WINDOW_NUM - 1]);
+
+    if (n > 0) {
+        for (i = 0; i < BENCH_WINDOW_MOVES; i++) {
+            start = rdtsc();
+            gui_move_window(&bench_windows[0], (i & 1) ? 1 : -1, 0);
+            cycles += rdtsc() - start;
+        }
+        printf("  move: %u cycles\n", cycles / BENCH_WINDOW_MOVES);
+    }
+
+    gui_render_measure("full screen", VGA_WIDTH, VGA_HEIGHT - STATUS_BAR_HEIGHT, tsc_per_ms);
+
+    for (i = 0; i < n; i++) {
+        gui_destroy_window(&bench_windows[i]);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_BLIT_WIDTH     640  // size of the blitted area, as large as a terminal window
+#define BENCH_BLIT_HEIGHT    480
+#define BENCH_BLIT_ROUNDS    16
+
+/**
+ * Copy an area of the desktop canvas to the top-left corner of video memory with CPU
+ */
+static void gui_blit_cpu_copy() {
+    int y;
+    for (y = 0; y < BENCH_BLIT_HEIGHT; y++) {
+        // A line never crosses 64K pages, in case there is no linear framebuffer
+        memcpy(vga_vram(y * VGA_BYTES_PER_LINE), gui_obj_desktop.canvas + y * VGA_BYTES_PER_LINE,
+               BENCH_BLIT_WIDTH * VGA_BYTES_PER_PIXEL);
+    }
+}
+
+/**
+ * Measure throughput of copying a terminal-sized area to video memory with CPU, with system-to-screen BitBLT (with
+ * and without transparency), and with screen-to-screen BitBLT as a reference
+ * @usage Kernel task EIP, see the commented line in init_task_main()
+ * @note The top-left corner of the screen is overwritten, and the whole screen is redrawn when finished
+ */
+void gui_blit_bench() {
+    TEST_HEADER;
+
+    uint32_t flags;
+    uint64_t start;
+    uint64_t cycles[4] = {0, 0, 0, 0};  // a round of CPU copy alone may take tens of millions of cycles
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    int i;
+
+    for (i = 0; i < BENCH_BLIT_ROUNDS; i++) {
+        // Keep the compositor from drawing in between
+        cli_and_save(flags);
+        {
+            start = rdtsc64();
+            gui_blit_cpu_copy();
+            cycles[0] += rdtsc64() - start;
+
+            vga_set_transparent(DISABLE_TRANSPARENCY_COLOR, 0);
+            start = rdtsc64();
+            vga_buf_copy(gui_obj_desktop.canvas, VGA_BYTES_PER_LINE, 0, 0, BENCH_BLIT_WIDTH, BENCH_BLIT_HEIGHT);
+            cycles[1] += rdtsc64() - start;
+
+            vga_set_transparent(ENABLE_TRANSPARENCY_COLOR, color_convert(GUI_TRANSPARENT_COLOR));
+            start = rdtsc64();
+            vga_buf_copy(gui_obj_desktop.canvas, VGA_BYTES_PER_LINE, 0, 0, BENCH_BLIT_WIDTH, BENCH_BLIT_HEIGHT);
+            cycles[2] += rdtsc64() - start;
+
+            vga_set_transparent(DISABLE_TRANSPARENCY_COLOR, 0);
+            start = rdtsc64();
+            vga_screen_copy(0, 0, 0, BENCH_BLIT_HEIGHT, BENCH_BLIT_WIDTH, BENCH_BLIT_HEIGHT);
+            cycles[3] += rdtsc64() - start;
+        }
+        restore_flags(flags);
+    }
+
+    bench_print_throughput("cpu copy", BENCH_BLIT_ROUNDS * BENCH_BLIT_WIDTH * BENCH_BLIT_HEIGHT * VGA_BYTES_PER_PIXEL,
+                           cycles[0], tsc_per_ms);
+    bench_print_throughput("sys-to-screen blt",
+                           BENCH_BLIT_ROUNDS * BENCH_BLIT_WIDTH * BENCH_BLIT_HEIGHT * VGA_BYTES_PER_PIXEL,
+                           cycles[1], tsc_per_ms);
+    bench_print_throughput("sys-to-screen blt (transparent)",
+                           BENCH_BLIT_ROUNDS * BENCH_BLIT_WIDTH * BENCH_BLIT_HEIGHT * VGA_BYTES_PER_PIXEL,
+                           cycles[2], tsc_per_ms);
+    bench_print_throughput("screen-to-screen blt",
+                           BENCH_BLIT_ROUNDS * BENCH_BLIT_WIDTH * BENCH_BLIT_HEIGHT * VGA_BYTES_PER_PIXEL,
+                           cycles[3], tsc_per_ms);
+
+    gui_render_damage(0, 0, VGA_WIDTH, VGA_HEIGHT);
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define BENCH_MEM_PD_ENTRY     (VGA_LFB_PD_ENTRY - 2)  // two unused 4MB areas below the linear framebuffer
+#define BENCH_MEM_AREA_SIZE    (4 * 1024 * 1024)
+#define BENCH_MEM_MAX_SIZE     BENCH_MEM_AREA_SIZE
+#define BENCH_MEM_MIN_SIZE     16
+
+static page_table_t bench_mem_pt[2];
+
+/**
+ * Map two 4MB areas of page frames at BENCH_MEM_PD_ENTRY, or unmap and free them
+ * @param map    1 to map, 0 to unmap
+ * @return 0 for success, -1 if out of memory (frames allocated so far are freed)
+ */
+static int bench_mem_map(int map) {
+    PTE_t *pte;
+    uint32_t phys_addr;
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < KERNEL_PAGE_TABLE_SIZE; j++) {
+            pte = (PTE_t *) &bench_mem_pt[i].entry[j];
+            if (map) {
+                if ((phys_addr = page_frame_alloc()) == PAGE_FRAME_NULL) {
+                    bench_mem_map(0);
+                    return -1;
+                }
+                set_PTE(pte, phys_addr, 1, 0, 1);
+            } else if (pte->present) {
+                page_frame_free(pte->base_address << 12);
+                clear_PTE(pte);
+            }
+        }
+        clear_PDE_4kB((PDE_4kB_t *) &kernel_page_directory.entry[BENCH_MEM_PD_ENTRY + i]);
+        if (map) {
+            set_PDE_4kB((PDE_4kB_t *) &kernel_page_directory.entry[BENCH_MEM_PD_ENTRY + i],
+                        (uint32_t) &bench_mem_pt[i], 1, 0, 1);
+        }
+    }
+    FLUSH_TLB();
+    return 0;
+}
+
+/**
+ * Time memcpy() or memset() of the given size with the given SIMD level, repeated until BENCH_MIN_BYTES are moved
+ * @param op             0 for memcpy(), 1 for memset()
+ * @param size           Bytes per call
+ * @param level          Value of mem_simd_level to use
+ * @param tsc_per_ms     TSC cycles per millisecond
+ * @return Throughput in MB/s
+ */
+static uint32_t bench_mem_mbps(int op, uint32_t size, uint32_t level, uint32_t tsc_per_ms) {
+    uint8_t *src = (uint8_t *) (BENCH_MEM_PD_ENTRY * 0x400000U);
+    uint8_t *dest = src + BENCH_MEM_AREA_SIZE;
+    uint32_t saved_level = mem_simd_level;
+    uint32_t flags;
+    uint32_t count = BENCH_MIN_BYTES / size;
+    uint32_t start, cycles, us;
+    uint32_t i;
+
+    if (count == 0) count = 1;
+
+    cli_and_save(flags);
+    {
+        mem_simd_level = level;
+        if (op == 0) memcpy(dest, src, size);  // warm up TLB and cache
+        else memset(dest, 0x5A, size);
+        start = rdtsc();
+        for (i = 0; i < count; i++) {
+            if (op == 0) memcpy(dest, src, size);
+            else memset(dest, 0x5A, size);
+        }
+        cycles = rdtsc() - start;
+        mem_simd_level = saved_level;
+    }
+    restore_flags(flags);
+
+    us = cycles / (tsc_per_ms / 1000);
+    if (us == 0) us = 1;
+    return count * size / us;
+}
+
+/**
+ * Measure throughput of memcpy() and memset() from BENCH_MEM_MIN_SIZE to BENCH_MEM_MAX_SIZE, with rep movsl/stosl
+ * only and with the SIMD level selected by fpu_init()
+ * @usage Kernel task EIP, see the commented line in init_task_main()
+ * @note Small sizes are dominated by call overhead, and sizes beyond MEM_SIMD_NT_BYTES use non-temporal stores
+ */
+void mem_throughput_bench() {
+    TEST_HEADER;
+
+    uint32_t flags;
+    uint32_t tsc_per_ms = bench_tsc_per_ms();
+    uint32_t size;
+    uint32_t mbps[4];
+
+    printf("TSC: %u cycles/ms, SIMD level %u\n", tsc_per_ms, mem_simd_level);
+
+    if (bench_mem_map(1) == -1) {
+        printf("Out of memory for buffers\n");
+    } else {
+        memset((void *) (BENCH_MEM_PD_ENTRY * 0x400000U), 0xA5, BENCH_MEM_AREA_SIZE);
+        printf("  size      memcpy rep/simd    memset rep/simd (GB/s)\n");
+        for (size = BENCH_MEM_MIN_SIZE; size <= BENCH_MEM_MAX_SIZE; size *= 4) {
+            mbps[0] = bench_mem_mbps(0, size, MEM_SIMD_NONE, tsc_per_ms);
+            mbps[1] = bench_mem_mbps(0, size, mem_simd_level, tsc_per_ms);
+            mbps[2] = bench_mem_mbps(1, size, MEM_SIMD_NONE, tsc_per_ms);
+            mbps[3] = bench_mem_mbps(1, size, mem_simd_level, tsc_per_ms);
+            // 1 GB/s = 1000 MB/s, print 2 decimal places
+            printf("  %u B: %u.%u%u / %u.%u%u    %u.%u%u / %u.%u%u\n", size,
+                   mbps[0] / 1000, mbps[0] / 100 % 10, mbps[0] / 10 % 10,
+                   mbps[1] / 1000, mbps[1] / 100 % 10, mbps[1] / 10 % 10,
+                   mbps[2] / 1000, mbps[2] / 100 % 10, mbps[2] / 10 % 10,
+                   mbps[3] / 1000, mbps[3] / 100 % 10, mbps[3] / 10 % 10);
+        }
+        bench_mem_map(0);
+    }
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+#define FPU_TEST_WORKERS    8
+#define FPU_TEST_STEPS      (1 << 20)  // additions per worker, long enough to span many time slices
+#define FPU_TEST_DELAY      64         // busy loops between additions, so that preemption hits live registers
+#define FPU_TEST_TERMS      20000      // terms of the series computed in C
+
+static volatile uint32_t fpu_worker_next = 0;  // id of the next worker to start
+static volatile uint32_t fpu_worker_done = 0;  // number of workers finished
+static int32_t fpu_worker_x87[FPU_TEST_WORKERS];
+static int32_t fpu_worker_sse[FPU_TEST_WORKERS];
+static double fpu_worker_series[FPU_TEST_WORKERS];
+
+/**
+ * Sum of 1 / (k * k + offset) for k = 1 .. FPU_TEST_TERMS, with x87 code generated by the compiler
+ * @param offset    Makes results differ among workers
+ * @return The sum
+ */
+static double fpu_test_series(int32_t offset) {
+    double sum = 0.0;
+    int32_t k;
+    for (k = 1; k <= FPU_TEST_TERMS; k++) {
+        sum += 1.0 / ((double) k * k + offset);
+    }
+    return sum;
+}
+
+/**
+ * Main function of worker tasks of fpu_switch_test(). Count up from a seed in ST0 and XMM0 at the same time, keeping
+ * both in registers across preemption, then compute a series in C
+ */
+static void fpu_worker_main() {
+    uint32_t flags;
+    uint32_t id;
+    int32_t seed;
+
+    cli_and_save(flags);
+    {
+        id = fpu_worker_next++;
+    }
+    restore_flags(flags);
+
+    seed = id * 1000;
+    asm volatile ("                         \n\
+            fildl       %2                  \n\
+            cvtsi2ssl   %2, %%xmm0          \n\
+            movl        $1, %%eax           \n\
+            cvtsi2ssl   %%eax, %%xmm1       \n\
+            movl        %3, %%ecx           \n\
+            1:                              \n\
+            fld1                            \n\
+            faddp                           \n\
+            addss       %%xmm1, %%xmm0      \n\
+            movl        %4, %%eax           \n\
+            2:                              \n\
+            decl        %%eax               \n\
+            jnz         2b                  \n\
+            decl        %%ecx               \n\
+            jnz         1b                  \n\
+            fistpl      %0                  \n\
+            cvtss2si    %%xmm0, %%eax       \n\
+            movl        %%eax, %1           \n\
+            "
+    : "=m"(fpu_worker_x87[id]), "=m"(fpu_worker_sse[id])
+    : "m"(seed), "i"(FPU_TEST_STEPS), "i"(FPU_TEST_DELAY)
+    : "eax", "ecx", "cc", "memory"
+    );
+
+    fpu_worker_series[id] = fpu_test_series(id);
+
+    cli_and_save(flags);
+    {
+        fpu_worker_done++;
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
+/**
+ * Run several FP-heavy kernel tasks concurrently and check that none of them sees FPU state of another
+ * @usage Kernel task EIP, see the commented line in init_task_main(). Workers are kernel tasks, but they take the same
+ *        #NM path as user programs. fptest is the user program counterpart
+ * @note Requires SSE
+ */
+void fpu_switch_test() {
+    TEST_HEADER;
+
+    double expected[FPU_TEST_WORKERS];
+    uint32_t flags;
+    uint32_t switches;
+    int i, fail = 0;
+
+    // Reference results, computed by this task alone
+    for (i = 0; i < FPU_TEST_WORKERS; i++) {
+        expected[i] = fpu_test_series(i);
+    }
+
+    switches = fpu_get_switch_count();
+    fpu_worker_next = fpu_worker_done = 0;
+    for (i = 0; i < FPU_TEST_WORKERS; i++) {
+        cli_and_save(flags);
+        {
+            system_execute((uint8_t *) "fpu_worker", 0, 0, fpu_worker_main);
+        }
+        restore_flags(flags);
+    }
+
+    while (fpu_worker_done < fpu_worker_next) {
+        cli_and_save(flags);
+        {
+            sched_yield_unsafe();
+        }
+        restore_flags(flags);
+    }
+    switches = fpu_get_switch_count() - switches;
+
+    for (i = 0; i < fpu_worker_next; i++) {
+        if (fpu_worker_x87[i] != i * 1000 + FPU_TEST_STEPS || fpu_worker_sse[i] != i * 1000 + FPU_TEST_STEPS ||
+            fpu_worker_series[i] != expected[i]) {
+            printf("  worker %d: x87 %d, sse %d, series %s\n", i, fpu_worker_x87[i], fpu_worker_sse[i],
+                   (fpu_worker_series[i] == expected[i]) ? "ok" : "WRONG");
+            fail = 1;
+        }
+    }
+    printf("  %u workers, %u FPU switches: %s\n", fpu_worker_next, switches,
+           (fail || fpu_worker_next < FPU_TEST_WORKERS) ? "FAIL" : "PASS");
+
+    cli_and_save(flags);
+    {
+        system_halt(0);
+    }
+    restore_flags(flags);
+}
+
 /* Test suite entry point */
 void launch_tests() {
 
@@ -774,5 +2154,9 @@ void launch_tests() {
 //    png_test();
 //    png_alpha_test();
 //    png_full_screen_test();
+//    fs_throughput_bench();
+//    fs_write_bench();
+//    ata_sched_bench();
+//    exec_load_bench();
     printf("\nTests complete.\n");
 }
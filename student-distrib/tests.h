@@ -14,6 +14,22 @@ long dereference_null_test();
 void checkpoint_task_closed_all_files();
 void checkpoint_task_paging_consistent();
 
+void fs_throughput_bench();
+void fs_write_bench();
+void ata_sched_bench();
+void readahead_bench();
+void exec_load_bench();
+void task_stress_bench();
+void task_latency_bench();
+void rtc_handler_bench();
+void timer_irq_bench();
+void gui_render_bench();
+void gui_input_bench();
+void gui_blit_bench();
+void gui_window_bench();
+void mem_throughput_bench();
+void fpu_switch_test();
+
 // test launcher
 void launch_tests();
 
@@ -7,6 +7,7 @@
 #include "vga.h"
 
 #include "../lib.h"
+#include "../paging.h"
 
 #include "vga_port.h"
 #include "vga_regs.h"
@@ -21,6 +22,7 @@ vga_info_t vga_info;            /* current video parameters */
 static const vga_info_t CI_G1024_768_32K = {1024, 768, 1 << 15, 1024 * 2, 2};
 
 static int curr_page = -1;
+unsigned char *vga_lfb = NULL;
 
 
 static void set_color_emulation(void);
@@ -77,8 +79,7 @@ int vga_clear(void) {
         int pages = (vga_info.ydim * vga_info.xbytes + 65535) >> 16;
 
         for (i = 0; i < pages; ++i) {
-            vga_set_page(i);
-            memset(GM, 0, 65536);
+            memset(vga_vram(i * VGA_PAGE_SIZE), 0, VGA_PAGE_SIZE);
         }
 
     }
@@ -132,6 +133,28 @@ void vga_screen_on() {
     outb(0x20, ATT_IW);
 }
 
+/**
+ * Map the linear framebuffer, so that CPU can access video memory without switching 64K pages
+ * @note The same 4MB page is mapped for all tasks, since the page directory is shared
+ */
+static void vga_lfb_init() {
+    unsigned long base = cirrus_pci_linear_base();
+    if (base == 0) {
+        DEBUG_WARN("vga_lfb_init(): no linear framebuffer, fall back to 64K pages");
+        return;
+    }
+
+    PDE_4MB_t *pde = (PDE_4MB_t *) &kernel_page_directory.entry[VGA_LFB_PD_ENTRY];
+    clear_PDE_4MB(pde);
+    pde->base_address = base >> 22;
+    pde->can_write = 1;
+    pde->cache_disabled = 1;
+    pde->present = 1;
+    FLUSH_TLB();
+
+    vga_lfb = (unsigned char *) VGA_LFB_ADDR + (base & 0x3FFFFF);
+}
+
 /**
  * Initialize VGA driver
  */
@@ -140,6 +163,7 @@ void vga_init() {
     cli_and_save(interrupt_flags);
     {
         cirrus_test_and_init();
+        vga_lfb_init();
     }
 }
 
@@ -152,17 +176,20 @@ void vga_screen_copy(int x1, int y1, int x2, int y2, int width, int height) {
     cirrus_accel_mmio_screen_copy(x1, y1, x2, y2, width, height);
 }
 
-// FIXME: This function is still broken
-/*void vga_buf_copy(unsigned int* srcaddr, int x2, int y2, int width, int height) {
-    cirrus_accel_mmio_buf_copy(srcaddr, x2, y2, width, height);
-}*/
+void vga_buf_copy(const unsigned char *src, int src_pitch, int x2, int y2, int width, int height) {
+    cirrus_accel_mmio_buf_copy(src, src_pitch, x2, y2, width, height);
+}
+
+void vga_mono_expand(int srcaddr, int skip, int x2, int y2, int width, int height, int fg, int bg) {
+    cirrus_accel_mmio_mono_expand(srcaddr, skip, x2, y2, width, height, fg, bg);
+}
 
 void vga_set_start_addr(int address) {
     cirrus_setdisplaystart(address);
 }
 
 void vga_set_transparent(int mode, int color) {
-    cirrus_accel_set_transparency(mode, color);
+    cirrus_accel_mmio_set_transparency(mode, color);
 }
 
 void vga_accel_sync() {
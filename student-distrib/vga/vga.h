@@ -41,11 +41,29 @@ int vga_clear(void);
 void vga_set_page(int page);
 void vga_set_start_addr(int address);
 
+#define VGA_LFB_PD_ENTRY    1023  // linear framebuffer is mapped at the last 4MB of virtual memory
+#define VGA_LFB_ADDR        (VGA_LFB_PD_ENTRY * 0x400000U)
+
+extern unsigned char *vga_lfb;  // mapped linear framebuffer, NULL if not available
+
+/**
+ * Get the address for CPU to access video memory
+ * @param offset    Offset in video memory
+ * @return Address of the offset in the linear framebuffer. Without linear framebuffer, the page of the offset is
+ *         switched in, and only the rest of the 64K page can be accessed from the returned address.
+ */
+static inline unsigned char *vga_vram(unsigned long offset) {
+    if (vga_lfb != NULL) return vga_lfb + offset;
+    vga_set_page(offset >> 16);
+    return (unsigned char *) GM + (offset & 0xFFFF);
+}
+
 void vga_screen_off();
 void vga_screen_on();
 
 void vga_screen_copy(int x1, int y1, int x2, int y2, int width, int height);
-//void vga_buf_copy(unsigned int* srcaddr, int x2, int y2, int width, int height);
+void vga_buf_copy(const unsigned char *src, int src_pitch, int x2, int y2, int width, int height);
+void vga_mono_expand(int srcaddr, int skip, int x2, int y2, int width, int height, int fg, int bg);
 
 #define DISABLE_TRANSPARENCY_COLOR	0
 #define ENABLE_TRANSPARENCY_COLOR	1
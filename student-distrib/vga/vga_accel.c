@@ -142,6 +142,7 @@
 #define MMIOBLTMODE        0x18
 #define MMIOROP            0x1A
 #define MMIOTRANSPARENTCOLOR  0x1C
+#define MMIOTRANSPARENTCOLORMASK  0x20
 #define MMIOBLTSTATUS        0x40
 
 #define MMIOSETDESTADDR(addr) \
@@ -220,8 +221,12 @@
 #define MMIOSETRANSPARENT(color) \
   *(unsigned short *)(MMIO_POINTER + MMIOTRANSPARENTCOLOR) = color;
 
+#define MMIOSETRANSPARENTMASK(mask) \
+  *(unsigned short *)(MMIO_POINTER + MMIOTRANSPARENTCOLORMASK) = mask;
+
 static int cirrus_pattern_address;    /* Pattern with 1's (8 bytes) */
 static int cirrus_bitblt_pixelwidth;
+static int cirrus_transparent_color = -1;  /* color in the transparency registers, -1 for not loaded */
 /* Foreground color is not preserved on 5420/2/4/6/8. */
 
 int __svgalib_accel_screenpitch;
@@ -314,7 +319,7 @@ void cirrus_accel_mmio_screen_copy(int x1, int y1, int x2, int y2, int width, in
     MMIOSETWIDTH(width);
     MMIOSETHEIGHT(height);
     if (__svgalib_accel_bitmaptransparency == 1) {
-        MMIOSETBLTMODE(dir | TRANSPARENCYCOMPARE | PIXELWIDTH16);
+        MMIOSETBLTMODE(dir | TRANSPARENCYCOMPARE | cirrus_bitblt_pixelwidth);
     } else {
         MMIOSETBLTMODE(dir);
     }
@@ -363,56 +368,91 @@ void cirrus_accel_mmio_set_raster_op(int rop) {
     MMIOSETROP(cirrus_rop_map[rop]);
 }
 
-// FIXME: This function is still broken
-void cirrus_accel_mmio_mono_expand(int srcaddr, int x2, int y2, int width, int height, int fg, int bg) {
+/**
+ * Color-expand BitBLT from a 1bpp bitmap in video memory. Each 1 bit becomes a foreground pixel and each 0 bit a
+ * background pixel.
+ * @param srcaddr    Byte address of the bitmap in video memory
+ * @param skip       Number of pixels (0 - 7) to skip at the beginning of each line
+ * @param x2         Destination x of the first (skipped or not) pixel
+ * @param y2         Destination y
+ * @param width      Width in pixels, including skipped pixels
+ * @param height     Height in pixels
+ * @param fg         Foreground color
+ * @param bg         Background color
+ * @note Bitmap lines are packed one after another, each starting at a byte boundary (MSB is the leftmost pixel).
+ *       Source address register overlaps with the skip register in MMIO, so the skip is set after it.
+ */
+void cirrus_accel_mmio_mono_expand(int srcaddr, int skip, int x2, int y2, int width, int height, int fg, int bg) {
 
     cirrus_accel_set_foreground_color(fg);
     cirrus_accel_set_background_color(bg);
     cirrus_accel_mmio_set_raster_op(ROP_COPY);
 
     int destaddr;
+    width *= __svgalib_accel_bytesperpixel;
     destaddr = BLTBYTEADDRESS(x2, y2);
     MMIOFINISHBACKGROUNDBLITS();
     MMIOSETSRCADDR(srcaddr);
+    MMIOSETBLTWRITEMASK(skip & 0x07);
     MMIOSETDESTADDR(destaddr);
     MMIOSETWIDTH(width);
     MMIOSETHEIGHT(height);
-    MMIOSETBLTMODE(COLOREXPAND | PIXELWIDTH16 | SYSTEMSRC);
+    MMIOSETBLTMODE(COLOREXPAND | cirrus_bitblt_pixelwidth);
     MMIOSTARTBLT();
     if (!(__svgalib_accel_mode & BLITS_IN_BACKGROUND))
         MMIOWAITUNTILFINISHED();
 }
 
-// FIXME: This function is still broken
-#define BUF_COPY_MID_ADDR ((unsigned int*) 0x000BC000)
-
-void cirrus_accel_mmio_buf_copy(unsigned int *srcaddr, int x2, int y2, int width, int height) {
-    int destaddr;
+/**
+ * System-to-screen BitBLT. The blitter is started with system memory as source, then the CPU streams source lines
+ * into the BitBLT data window, and the blitter writes them to video memory with the current transparency setting.
+ * @param src          Address of the first source pixel in system memory
+ * @param src_pitch    Bytes between two source lines
+ * @param x2           Destination x
+ * @param y2           Destination y
+ * @param width        Width in pixels
+ * @param height       Height in pixels
+ * @note The GD5446 takes source data written anywhere in the first 64K of the VGA aperture while a system-source BLT
+ *       is pending, and expects each source line padded to a dword. The source address register is not used, but
+ *       its low bits must be 0 so that the first pixel is taken from the first byte of each dword.
+ */
+void cirrus_accel_mmio_buf_copy(const unsigned char *src, int src_pitch, int x2, int y2, int width, int height) {
+    int destaddr, dwords, tail, n;
+    const unsigned char *s;
+    char *d;
+    unsigned int last;
     width *= __svgalib_accel_bytesperpixel;
+    dwords = width >> 2;
+    tail = width & 3;
     destaddr = BLTBYTEADDRESS(x2, y2);
-    MMIOFINISHBACKGROUNDBLITS();
     cirrus_accel_mmio_set_raster_op(ROP_COPY);
-    MMIOSETSRCADDR((unsigned int) BUF_COPY_MID_ADDR);
+    MMIOFINISHBACKGROUNDBLITS();
+    MMIOSETSRCADDR(0);
     MMIOSETDESTADDR(destaddr);
     MMIOSETWIDTH(width);
     MMIOSETHEIGHT(height);
-    MMIOSETBLTMODE(SYSTEMSRC | PIXELWIDTH16);
-    asm volatile ("              \
-        movw $0x3CE, %%dx      \n\
-        movb $0x31, %%al       \n\
-        outb %%al, %%dx        \n\
-        movw $0x3CF, %%dx      \n\
-        inb %%dx, %%al         \n\
-        orb $0x02, %%al        \n\
-        outb %%al, %%dx        \n\
-    1:  movl (%%ebx), %%eax    \n\
-        movl %%eax, 0xBC000    \n\
-        addl $4, %%ebx         \n\
-        dec %%ecx              \n\
-        jg 1b"                    \
-        :                         \
-        : "b" (srcaddr), "c" (width * height * __svgalib_accel_bytesperpixel / sizeof(unsigned int))
-    : "memory", "cc");
+    if (__svgalib_accel_bitmaptransparency == 1) {
+        MMIOSETBLTMODE(SYSTEMSRC | TRANSPARENCYCOMPARE | cirrus_bitblt_pixelwidth);
+    } else {
+        MMIOSETBLTMODE(SYSTEMSRC | cirrus_bitblt_pixelwidth);
+    }
+    MMIOSTARTBLT();
+    for (; height > 0; height--, src += src_pitch) {
+        // A line is at most one screen pitch, so restarting from GM for each line stays inside the data window
+        s = src;
+        d = GM;
+        n = dwords;
+        asm volatile ("cld; rep movsl"
+        : "+S" (s), "+D" (d), "+c" (n)
+        :
+        : "memory", "cc");
+        if (tail) {
+            // Pad the line to a dword without reading past the end of the source line
+            last = 0;
+            memcpy(&last, src + (dwords << 2), tail);
+            *(volatile unsigned int *) GM = last;
+        }
+    }
     if (!(__svgalib_accel_mode & BLITS_IN_BACKGROUND))
         MMIOWAITUNTILFINISHED();
 }
@@ -433,13 +473,19 @@ void cirrus_accel_set_transparency(int mode, int color) {
     }
 }
 
-// FIXME: this function is still broken
 void cirrus_accel_mmio_set_transparency(int mode, int color) {
-    FINISHBACKGROUNDBLITS();
+    MMIOFINISHBACKGROUNDBLITS();
     if (mode == DISABLE_TRANSPARENCY_COLOR) {
         __svgalib_accel_bitmaptransparency = 0;
     } else if (mode == ENABLE_TRANSPARENCY_COLOR) {
-        MMIOSETRANSPARENT(color);
+        if (__svgalib_accel_bytesperpixel == 1)
+            color += color << 8;
+        // Called before every object blit, so skip the register writes if the color is already loaded
+        if (color != cirrus_transparent_color) {
+            MMIOSETRANSPARENTMASK(0x0000);  // compare all bits
+            MMIOSETRANSPARENT(color);
+            cirrus_transparent_color = color;
+        }
         __svgalib_accel_bitmaptransparency = 1;
     }
 }
@@ -7,6 +7,7 @@
 #include "vga_cirrus.h"
 
 #include "../lib.h"
+#include "../pci.h"
 
 #include "vga.h"
 #include "vga_regs.h"
@@ -50,7 +51,8 @@ enum {
 int cirrus_memory;
 static int cirrus_chiptype;
 static int cirrus_chiprev;
-//static int cirrus_pci_linear = 0;
+
+#define CIRRUS_PCI_VENDOR_ID  0x1013
 static unsigned char actualMCLK, programmedMCLK;
 static int DRAMbandwidth, DRAMbandwidthLimit;
 
@@ -179,6 +181,24 @@ void cirrus_setlinear(int addr) {
     outb((val & 0x0f) | (addr << 4), SEQ_D);
 }
 
+/**
+ * Find the linear framebuffer of the Cirrus card on PCI bus 0
+ * @return Physical address of the linear framebuffer (BAR0), or 0 if there is no Cirrus PCI card
+ * @note On PCI cards the linear framebuffer is always decoded at BAR0, and the ISA linear address set by
+ *       cirrus_setlinear() is ignored
+ */
+unsigned long cirrus_pci_linear_base() {
+    int dev;
+    unsigned long bar;
+    for (dev = 0; dev < 32; dev++) {
+        if ((pci_config_read(0, dev, 0, PCI_REG_VENDOR) & 0xFFFF) != CIRRUS_PCI_VENDOR_ID) continue;
+        bar = pci_config_read(0, dev, 0, PCI_REG_BAR0);
+        if (bar & 0x1) continue;  // I/O space
+        return bar & 0xFFFFFFF0;
+    }
+    return 0;
+}
+
 int cirrus_test_and_init() {
 
     int oldlockreg;
@@ -17,6 +17,7 @@ int cirrus_setmode(vga_info_t* infotable);
 void cirrus_setdisplaystart(int address);
 void cirrus_setlogicalwidth(int width);
 void cirrus_setlinear(int addr);
+unsigned long cirrus_pci_linear_base();
 
 void cirrus_setpage_64k(int page);
 void cirrus_setpage_4k(int page);
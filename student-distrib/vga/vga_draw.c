@@ -17,20 +17,16 @@ void vga_set_color_argb(vga_argb color) {
  * @param y    Y coordinate of pixel
  */
 void vga_draw_pixel(int x, int y) {
-    unsigned long offset = y * vga_info.xbytes + x * VGA_BYTES_PER_PIXEL;
-    vga_set_page(offset >> 16);
-    offset &= 0xFFFF;
+    volatile unsigned short *p = (unsigned short *) vga_vram(y * vga_info.xbytes + x * VGA_BYTES_PER_PIXEL);
 #if VGA_DRAW_ALPHA_BLEND
-    gr_writew(color_convert(rgb_blend(color_revert(gr_readw(offset)), curr_color, alpha(curr_color))), offset);
+    *p = color_convert(rgb_blend(color_revert(*p), curr_color, alpha(curr_color)));
 #else
-    gr_writew(color_convert(curr_color), offset);
+    *p = color_convert(curr_color);
 #endif
 }
 
 void vga_set_byte(unsigned long offset, unsigned char b) {
-    vga_set_page(offset >> 16);
-    offset &= 0xFFFF;
-    gr_writeb(b, offset);
+    *(volatile unsigned char *) vga_vram(offset) = b;
 }
 
 /**
@@ -40,13 +36,11 @@ void vga_set_byte(unsigned long offset, unsigned char b) {
  * @return RGB color of the pixel
  */
 vga_rgb vga_get_pixel(int x, int y) {
-    unsigned long offset = y * vga_info.xbytes + x * VGA_BYTES_PER_PIXEL;
-    vga_set_page(offset >> 16);
-    return color_revert(gr_readw(offset & 0xFFFF));
+    return color_revert(*(volatile unsigned short *) vga_vram(y * vga_info.xbytes + x * VGA_BYTES_PER_PIXEL));
 }
 
 void vga_draw_img(const vga_argb *img_data, unsigned width, unsigned height, int start_x, int start_y) {
-    unsigned long offset;
+    volatile unsigned short *p;
     vga_argb c;
     int x, y;
     for (y = 0; y < height; y++) {
@@ -54,14 +48,12 @@ void vga_draw_img(const vga_argb *img_data, unsigned width, unsigned height, int
 
             c = img_data[y * width + x];
 
-            offset = (start_y + y) * vga_info.xbytes + (start_x + x) * VGA_BYTES_PER_PIXEL;
-            vga_set_page(offset >> 16);
-            offset &= 0xFFFF;
+            p = (unsigned short *) vga_vram((start_y + y) * vga_info.xbytes + (start_x + x) * VGA_BYTES_PER_PIXEL);
 
 #if VGA_DRAW_ALPHA_BLEND
-            gr_writew(color_convert(rgb_blend(color_revert(gr_readw(offset)), c, alpha(c))), offset);
+            *p = color_convert(rgb_blend(color_revert(*p), c, alpha(c)));
 #else
-            gr_writew(color_convert(c), offset);
+            *p = color_convert(c);
 #endif
         }
     }
@@ -9,6 +9,7 @@
 #include "x86_desc.h"
 
 #include "task/task.h"
+#include "task/task_paging.h"
 #include "terminal.h"
 #include "file_system.h"
 
@@ -191,7 +192,8 @@ int terminal_vidmem_set(const int term_id) {
 int system_vidmap(uint8_t **screen_start) {
 
     // Check whether to dest to write is valid
-    if ((int) screen_start < TASK_IMG_START || (int) screen_start >= TASK_IMG_END) {
+    if ((int) screen_start < TASK_IMG_START || (int) screen_start > TASK_IMG_END - (int) sizeof(*screen_start) ||
+        task_paging_touch_user_output(screen_start, sizeof(*screen_start)) == -1) {
         DEBUG_ERR("system_vidmap(): screen_start out of range: %x", (int) screen_start);
         return -1;
     }
@@ -203,6 +205,7 @@ int system_vidmap(uint8_t **screen_start) {
     }
 
     running_task()->vidmap_enabled = 1;
+    terminal_mark_dirty(running_task()->terminal);
 
     task_set_user_vidmap(running_task()->terminal->terminal_id);
 
@@ -7,6 +7,7 @@ int main ()
 {
     int32_t fd, cnt;
     uint8_t buf[1024];
+    uint8_t* data;
 
     if (0 != ece391_getargs (buf, 1024)) {
         ece391_fdputs (1, (uint8_t*)"could not read arguments\n");
@@ -18,6 +19,16 @@ int main ()
 	return 2;
     }
 
+    /* A regular file is mapped and written out without copying, others (such as rtc) are read */
+    if (-1 != (cnt = ece391_mmap (fd, 0, &data))) {
+	if (0 == cnt)
+	    return 0;
+	if (-1 == ece391_write (1, data, cnt))
+	    return 3;
+	ece391_munmap (data);
+	return 0;
+    }
+
     while (0 != (cnt = ece391_read (fd, buf, 1024))) {
         if (-1 == cnt) {
 	    ece391_fdputs (1, (uint8_t*)"file read failed\n");
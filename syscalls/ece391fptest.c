@@ -0,0 +1,82 @@
+#include <stdint.h>
+
+#include "ece391support.h"
+#include "ece391syscall.h"
+
+#define RTC_FREQ    1024
+#define ROUNDS      2048  // 2 seconds at RTC_FREQ
+#define MAX_STEP    64    // ROUNDS * MAX_STEP must stay below 2^24, so single precision is exact
+
+/*
+ * Lazy FPU switching test. Each round adds step to an x87 accumulator (st(0)) and to an SSE one (xmm0), then blocks
+ * on the RTC so that other tasks run. Both accumulators stay in registers for the whole loop, so they are only right
+ * at the end if the kernel gave this task back its own FPU state every time. xmm0 is also one of the registers the
+ * kernel memcpy() uses. Run it on several terminals at once, or next to another program using the FPU.
+ */
+static void fp_loop(int32_t fd, uint32_t step, int32_t *x87, int32_t *sse) {
+    uint32_t buf, rounds = ROUNDS;
+    int32_t x87_sum, sse_sum;
+
+    // Only registers are used between push and pop, as memory operands may be relative to ESP. EBX, ESI and EDI are
+    // preserved by ece391_read(). XMM registers can't be listed as clobbered without -msse, but programs are built
+    // without it, so the compiler never keeps anything there. The x87 stack is left as it was found
+    asm volatile ("fildl %4\n\t"
+                  "fldz\n\t"
+                  "cvtsi2ss %4, %%xmm1\n\t"
+                  "xorps %%xmm0, %%xmm0\n"
+                  "1:\n\t"
+                  "fadd %%st(1), %%st\n\t"
+                  "addss %%xmm1, %%xmm0\n\t"
+                  "pushl $4\n\t"
+                  "pushl %%ebx\n\t"
+                  "pushl %%edi\n\t"
+                  "call ece391_read\n\t"
+                  "addl $12, %%esp\n\t"
+                  "decl %%esi\n\t"
+                  "jnz 1b\n\t"
+                  "fistpl %0\n\t"
+                  "fstp %%st(0)\n\t"
+                  "cvttss2si %%xmm0, %%eax\n\t"
+                  "movl %%eax, %1"
+                  : "=m"(x87_sum), "=m"(sse_sum), "+S"(rounds)
+                  : "D"(fd), "m"(step), "b"(&buf)
+                  : "eax", "ecx", "edx", "memory", "cc");
+
+    *x87 = x87_sum;
+    *sse = sse_sum;
+}
+
+static void put_num(const char *name, int32_t value) {
+    uint8_t num[16];
+    ece391_fdputs(1, (uint8_t *) name);
+    ece391_itoa(value, num, 10);
+    ece391_fdputs(1, num);
+}
+
+int main() {
+    int32_t fd, freq = RTC_FREQ;
+    int32_t x87, sse, expected;
+    uint32_t lo, hi, step;
+
+    // Different step in each instance, so state leaked from another one is noticed
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    step = lo % MAX_STEP + 1;
+
+    if (-1 == (fd = ece391_open((uint8_t *) "rtc"))) {
+        ece391_fdputs(1, (uint8_t *) "Can't open rtc\n");
+        return 2;
+    }
+    ece391_write(fd, &freq, 4);
+
+    fp_loop(fd, step, &x87, &sse);
+    ece391_close(fd);
+
+    expected = ROUNDS * step;
+    put_num("fptest: step ", step);
+    put_num(", x87 ", x87);
+    put_num(", sse ", sse);
+    put_num(", expected ", expected);
+    ece391_fdputs(1, (x87 == expected && sse == expected) ? (uint8_t *) ": PASS\n" : (uint8_t *) ": FAIL\n");
+
+    return (x87 == expected && sse == expected) ? 0 : 1;
+}
@@ -6,17 +6,59 @@
 #define BUFSIZE 1024
 #define SBUFSIZE 33
 
+/* Search a file mapped by mmap () in place, line by line */
+void
+search_mapped (const char* s, const char* fname, const uint8_t* data, int32_t size)
+{
+    int32_t line_start, line_end, line_len, check, s_len;
+
+    s_len = ece391_strlen ((uint8_t*)s);
+    for (line_start = 0; line_start < size; line_start = line_end + 1) {
+	line_end = line_start;
+	while (line_end < size && '\n' != data[line_end])
+	    line_end++;
+	for (check = line_start; check + s_len <= line_end; check++) {
+	    if (s[0] == data[check] && 
+		0 == ece391_strncmp ((uint8_t*)(data + check), (uint8_t*)s, s_len)) {
+		/* print up to a NUL, as ece391_fdputs () does */
+		for (line_len = 0; line_start + line_len < line_end &&
+		     '\0' != data[line_start + line_len]; line_len++);
+		ece391_fdputs (1, (uint8_t*)fname);
+		ece391_fdputs (1, (uint8_t*)":");
+		ece391_write (1, data + line_start, line_len);
+		ece391_fdputs (1, (uint8_t*)"\n");
+		break;
+	    }
+	}
+    }
+}
+
 int32_t
 do_one_file (const char* s, const char* fname) 
 {
     int32_t fd, cnt, last, line_start, line_end, check, s_len;
     uint8_t data[BUFSIZE+1];
+    uint8_t* map;
 
     s_len = ece391_strlen ((uint8_t*)s);
     if (-1 == (fd = ece391_open ((uint8_t*)fname))) {
         ece391_fdputs (1, (uint8_t*)"file open failed\n");
         return -1;
     }
+
+    /* Search the file in place if it can be mapped, otherwise read it through a buffer */
+    if (-1 != (cnt = ece391_mmap (fd, 0, &map))) {
+	if (0 != cnt) {
+	    search_mapped (s, fname, map, cnt);
+	    ece391_munmap (map);
+	}
+	if (-1 == ece391_close (fd)) {
+	    ece391_fdputs (1, (uint8_t*)"file close failed\n");
+	    return -1;
+	}
+	return 0;
+    }
+
     last = 0;
     while (1) {
         cnt = ece391_read (fd, data + last, BUFSIZE - last);
@@ -0,0 +1,78 @@
+#include <stdint.h>
+
+#include "ece391support.h"
+#include "ece391syscall.h"
+
+#define ROUNDS       10000  // calls per item
+#define READ_FILE    "frame0.txt"
+
+static uint8_t buf[16];
+
+/* Read the low 32 bits of time stamp counter, enough for ROUNDS calls */
+static uint32_t rdtsc_low() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+/*
+ * Time ROUNDS calls of the item
+ * @param item    0 for null call (nice(0)), 1 for read() of 1 byte, 2 for write() of 0 bytes to stdout
+ * @param fd      File to read from
+ * @return Cycles per call
+ */
+static uint32_t measure(int item, int32_t fd) {
+    uint32_t i, start;
+    start = rdtsc_low();
+    for (i = 0; i < ROUNDS; i++) {
+        switch (item) {
+            case 0:
+                ece391_nice(0);
+                break;
+            case 1:
+                ece391_read(fd, buf, 1);
+                break;
+            default:
+                ece391_write(1, buf, 0);
+                break;
+        }
+    }
+    return (rdtsc_low() - start) / ROUNDS;
+}
+
+int main() {
+    static const char *names[] = {"null (nice(0)): ", "read 1 byte:    ", "write 0 bytes:  "};
+    uint8_t num[16];
+    uint32_t cycles[2];
+    int32_t sysenter = ece391_use_sysenter;
+    int32_t fd;
+    int item, path;
+
+    if (-1 == (fd = ece391_open((uint8_t *) READ_FILE))) {
+        ece391_fdputs(1, (uint8_t *) "Failed to open " READ_FILE "\n");
+        return 1;
+    }
+    if (!sysenter) {
+        ece391_fdputs(1, (uint8_t *) "SYSENTER is not supported, only int $0x80 is measured\n");
+    }
+
+    // The file is short, so most reads hit the end of file. They still take the full path into the file system
+    for (item = 0; item < 3; item++) {
+        for (path = 0; path < 2; path++) {
+            ece391_use_sysenter = path;
+            cycles[path] = (path && !sysenter) ? 0 : measure(item, fd);
+        }
+        ece391_use_sysenter = sysenter;
+
+        ece391_fdputs(1, (uint8_t *) names[item]);
+        ece391_itoa(cycles[0], num, 10);
+        ece391_fdputs(1, num);
+        ece391_fdputs(1, (uint8_t *) " cycles (int $0x80), ");
+        ece391_itoa(cycles[1], num, 10);
+        ece391_fdputs(1, num);
+        ece391_fdputs(1, (uint8_t *) " cycles (sysenter)\n");
+    }
+
+    ece391_close(fd);
+    return 0;
+}
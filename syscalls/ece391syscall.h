@@ -23,6 +23,19 @@ extern int32_t ece391_set_handler (int32_t signum, void* handler);
 extern int32_t ece391_sigreturn (void);
 extern int32_t ece391_playsound(uint32_t nFrequence);
 extern int32_t ece391_nosound();
+extern int32_t ece391_nice(int32_t inc);
+/* Create an empty file. write() writes at the file position, so reading to the end of file then writing appends */
+extern int32_t ece391_create(const uint8_t* filename);
+extern int32_t ece391_truncate(int32_t fd, int32_t length);
+/*
+ * Map a file read-only from its beginning (length 0 for the whole file), or fd -1 for zero-filled memory. Returns
+ * bytes mapped and sets *start, or 0 for an empty file
+ */
+extern int32_t ece391_mmap(int32_t fd, int32_t length, uint8_t** start);
+extern int32_t ece391_munmap(uint8_t* start);
+
+/* Non-zero if system calls use SYSENTER instead of int $0x80 */
+extern int32_t ece391_use_sysenter;
 
 enum signums {
 	DIV_ZERO = 0,
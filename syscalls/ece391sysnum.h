@@ -13,5 +13,10 @@
 #define SYS_SIGRETURN  10
 #define SYS_PLAYSOUND   11
 #define SYS_NOSOUND     12 
+#define SYS_NICE        13
+#define SYS_CREATE      14
+#define SYS_TRUNCATE    15
+#define SYS_MMAP        16
+#define SYS_MUNMAP      17
 
 #endif /* ECE391SYSNUM_H */
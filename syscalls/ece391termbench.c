@@ -0,0 +1,65 @@
+#include <stdint.h>
+
+#include "ece391support.h"
+#include "ece391syscall.h"
+
+#define LINE_LEN     80   // including '\n'
+#define LINE_COUNT   50
+#define BUFSIZE      (LINE_LEN * LINE_COUNT)
+#define ROUNDS       16   // each mode writes ROUNDS * BUFSIZE bytes
+
+static uint8_t text[BUFSIZE];
+
+/* Read time stamp counter, in units of 1024 cycles so that it fits in 32 bits */
+static uint32_t rdtsc_kcycles() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return (hi << 22) | (lo >> 10);
+}
+
+static void report(const char *name, uint32_t kcycles) {
+    uint8_t num[16];
+    ece391_fdputs(1, (uint8_t *) name);
+    ece391_itoa(kcycles, num, 10);
+    ece391_fdputs(1, num);
+    ece391_fdputs(1, (uint8_t *) " Kcycles, ");
+    ece391_itoa(kcycles ? (ROUNDS * BUFSIZE) / kcycles : 0, num, 10);
+    ece391_fdputs(1, num);
+    ece391_fdputs(1, (uint8_t *) " bytes/Kcycle\n");
+}
+
+int main() {
+    uint32_t i, r, start;
+    uint32_t byte_time, line_time, bulk_time;
+
+    for (i = 0; i < BUFSIZE; i++) {
+        text[i] = ((i % LINE_LEN) == LINE_LEN - 1) ? '\n' : ('a' + (i / LINE_LEN + i) % 26);
+    }
+
+    // One byte per write
+    start = rdtsc_kcycles();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < BUFSIZE; i++) ece391_write(1, &text[i], 1);
+    }
+    byte_time = rdtsc_kcycles() - start;
+
+    // One line per write, like counter or cat
+    start = rdtsc_kcycles();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < BUFSIZE; i += LINE_LEN) ece391_write(1, &text[i], LINE_LEN);
+    }
+    line_time = rdtsc_kcycles() - start;
+
+    // Whole buffer per write
+    start = rdtsc_kcycles();
+    for (r = 0; r < ROUNDS; r++) {
+        ece391_write(1, text, BUFSIZE);
+    }
+    bulk_time = rdtsc_kcycles() - start;
+
+    report("byte write: ", byte_time);
+    report("line write: ", line_time);
+    report("bulk write: ", bulk_time);
+
+    return 0;
+}